@@ -0,0 +1,384 @@
+//
+// Implementation of the backup progress checkpoints
+//
+
+#include "checkpoint.hh"
+#include "common/trace.hh"
+#include "common/error.hh"
+#include "common/scopeguard.hh"
+
+#include <algorithm>
+
+namespace {
+  trace::Path t_ckpt("/upload/checkpoint");
+
+  //! We write out buffered records at least this often...
+  const DiffTime g_flush_period(DiffTime::iso("PT30S"));
+
+  //! ...and when this many are buffered
+  const size_t g_flush_batch = 1024;
+
+  const int g_busy_timeout_ms = 10000;
+
+  std::pair<uint64_t,uint64_t> idKey(const fsobjid_t &id)
+  {
+    return std::make_pair(uint64_t(id.device), uint64_t(id.fileid));
+  }
+
+  /// The times of an object id as we store them
+  void idTimes(const fsobjid_t &id, uint64_t t[4])
+  {
+#if defined(__unix__) || defined(__APPLE__)
+    t[0] = id.ctime_s;
+    t[1] = id.ctime_ns;
+    t[2] = id.mtime_s;
+    t[3] = id.mtime_ns;
+#endif
+#if defined(_WIN32)
+    t[0] = id.creation_time.dwHighDateTime;
+    t[1] = id.creation_time.dwLowDateTime;
+    t[2] = id.write_time.dwHighDateTime;
+    t[3] = id.write_time.dwLowDateTime;
+#endif
+  }
+
+  bool sameTimes(const fsobjid_t &a, const fsobjid_t &b)
+  {
+    uint64_t ta[4], tb[4];
+    idTimes(a, ta);
+    idTimes(b, tb);
+    return std::equal(ta, ta + 4, tb);
+  }
+
+  sqlite3_stmt *prepare(sqlite3 *db, const char *sql)
+  {
+    sqlite3_stmt *pstmt = 0;
+    if (SQLITE_OK != sqlite3_prepare_v2(db, sql, -1, &pstmt, 0))
+      throw error(std::string("PREP ") + sql + ": " + sqlite3_errmsg(db));
+    return pstmt;
+  }
+
+  /// Bind id and times as the first six parameters
+  void bindId(sqlite3_stmt *pstmt, const fsobjid_t &id)
+  {
+    uint64_t t[4];
+    idTimes(id, t);
+    sqlite3_bind_int64(pstmt, 1, id.device);
+    sqlite3_bind_int64(pstmt, 2, id.fileid);
+    for (int i = 0; i != 4; ++i)
+      sqlite3_bind_int64(pstmt, 3 + i, t[i]);
+  }
+
+  std::vector<uint8_t> hashBlob(const objseq_t &hash)
+  {
+    std::vector<uint8_t> blob;
+    blob.reserve(hash.size() * sha256::size);
+    for (objseq_t::const_iterator h = hash.begin(); h != hash.end(); ++h)
+      blob.insert(blob.end(), h->m_raw, h->m_raw + sha256::size);
+    return blob;
+  }
+}
+
+Checkpoint::Checkpoint(const std::string &fname)
+  : m_fname(fname)
+  , m_db(0)
+  , m_put_dir(0)
+  , m_get_dir(0)
+  , m_put_file(0)
+  , m_get_file(0)
+  , m_del_file(0)
+  , m_resuming(false)
+  , m_last_flush(Time::now())
+{
+  if (SQLITE_OK != sqlite3_open(m_fname.c_str(), &m_db)) {
+    sqlite3_close(m_db);
+    throw error("Unable to open checkpoint database: " + m_fname);
+  }
+
+  try {
+    if (SQLITE_OK != sqlite3_busy_timeout(m_db, g_busy_timeout_ms))
+      throw error("Unable to set busy timeout on checkpoint database");
+    execute("PRAGMA journal_mode = WAL;");
+    execute("PRAGMA synchronous = NORMAL;");
+    execute("CREATE TABLE IF NOT EXISTS run "
+            "( root TEXT NOT NULL,"
+            "  started INT8 NOT NULL"
+            ");");
+    const char *objs = " ( dev INT8 NOT NULL,"
+      "  ino INT8 NOT NULL,"
+      "  ctime_s INT8 NOT NULL,"
+      "  ctime_ns INT8 NOT NULL,"
+      "  mtime_s INT8 NOT NULL,"
+      "  mtime_ns INT8 NOT NULL,"
+      "  hash BLOB,"
+      "  treesize INT8 NOT NULL,"
+      "  PRIMARY KEY (dev, ino)"
+      ");";
+    execute(std::string("CREATE TABLE IF NOT EXISTS dirs") + objs);
+    execute(std::string("CREATE TABLE IF NOT EXISTS files") + objs);
+
+    m_put_dir = prepare(m_db, "INSERT OR REPLACE INTO dirs "
+                        "(dev, ino, ctime_s, ctime_ns, mtime_s, mtime_ns,"
+                        " hash, treesize) VALUES (?,?,?,?,?,?,?,?);");
+    m_get_dir = prepare(m_db, "SELECT ctime_s, ctime_ns, mtime_s, mtime_ns,"
+                        " hash, treesize FROM dirs WHERE dev = ? AND ino = ?;");
+    m_put_file = prepare(m_db, "INSERT OR REPLACE INTO files "
+                         "(dev, ino, ctime_s, ctime_ns, mtime_s, mtime_ns,"
+                         " hash, treesize) VALUES (?,?,?,?,?,?,?,?);");
+    m_get_file = prepare(m_db, "SELECT ctime_s, ctime_ns, mtime_s, mtime_ns,"
+                         " hash, treesize FROM files"
+                         " WHERE dev = ? AND ino = ?;");
+    m_del_file = prepare(m_db, "DELETE FROM files WHERE dev = ? AND ino = ?;");
+  } catch (error &) {
+    close();
+    throw;
+  }
+}
+
+Checkpoint::~Checkpoint()
+{
+  try {
+    MutexLock l(m_lock);
+    flushLocked();
+  } catch (error &e) {
+    MTrace(t_ckpt, trace::Warn, "Losing checkpoints: " << e.toString());
+  }
+  close();
+}
+
+void Checkpoint::close()
+{
+  sqlite3_finalize(m_put_dir);
+  sqlite3_finalize(m_get_dir);
+  sqlite3_finalize(m_put_file);
+  sqlite3_finalize(m_get_file);
+  sqlite3_finalize(m_del_file);
+  sqlite3_close(m_db);
+}
+
+void Checkpoint::execute(const std::string &stmt)
+{
+  sqlite3_stmt *pstmt = prepare(m_db, stmt.c_str());
+  ON_BLOCK_EXIT(sqlite3_finalize, pstmt);
+  int res;
+  while ((res = sqlite3_step(pstmt)) == SQLITE_ROW)
+    ;
+  if (res != SQLITE_DONE)
+    throw error("STEP " + stmt + ": " + sqlite3_errmsg(m_db));
+}
+
+bool Checkpoint::begin(const std::string &root, const DiffTime &maxage)
+{
+  MutexLock l(m_lock);
+  m_dirs.clear();
+  m_files.clear();
+
+  // Is there a backup to resume
+  m_resuming = false;
+  { sqlite3_stmt *pstmt = prepare(m_db, "SELECT root, started FROM run;");
+    ON_BLOCK_EXIT(sqlite3_finalize, pstmt);
+    if (sqlite3_step(pstmt) == SQLITE_ROW) {
+      const char *r
+        = reinterpret_cast<const char*>(sqlite3_column_text(pstmt, 0));
+      const Time started(time_t(sqlite3_column_int64(pstmt, 1)));
+      m_resuming = r && root == r && Time::now() < started + maxage;
+      MTrace(t_ckpt, trace::Info, "Backup of " << (r ? r : "") << " started "
+             << started << " did not complete - "
+             << (m_resuming ? "resuming it" : "not resuming it"));
+    }
+  }
+  if (m_resuming)
+    return true;
+
+  execute("BEGIN TRANSACTION");
+  try {
+    execute("DELETE FROM run;");
+    execute("DELETE FROM dirs;");
+    execute("DELETE FROM files;");
+    sqlite3_stmt *pstmt
+      = prepare(m_db, "INSERT INTO run (root, started) VALUES (?,?);");
+    ON_BLOCK_EXIT(sqlite3_finalize, pstmt);
+    sqlite3_bind_text(pstmt, 1, root.c_str(), int(root.size()),
+                      SQLITE_TRANSIENT);
+    sqlite3_bind_int64(pstmt, 2, Time::now().to_timet());
+    if (sqlite3_step(pstmt) != SQLITE_DONE)
+      throw error(std::string("STEP run: ") + sqlite3_errmsg(m_db));
+    execute("COMMIT TRANSACTION");
+  } catch (error &) {
+    try { execute("ROLLBACK TRANSACTION"); }
+    catch (error &) { }
+    throw;
+  }
+  m_last_flush = Time::now();
+  return false;
+}
+
+void Checkpoint::complete()
+{
+  MutexLock l(m_lock);
+  m_dirs.clear();
+  m_files.clear();
+  m_resuming = false;
+  execute("BEGIN TRANSACTION");
+  try {
+    execute("DELETE FROM run;");
+    execute("DELETE FROM dirs;");
+    execute("DELETE FROM files;");
+    execute("COMMIT TRANSACTION");
+  } catch (error &) {
+    try { execute("ROLLBACK TRANSACTION"); }
+    catch (error &) { }
+    throw;
+  }
+}
+
+void Checkpoint::dirDone(const CObject &obj)
+{
+  MutexLock l(m_lock);
+  rec_t &r = m_dirs[idKey(obj.m_id)];
+  r.obj = obj;
+  r.erase = false;
+  didUpdate();
+}
+
+bool Checkpoint::findDir(const fsobjid_t &id, CObject &obj)
+{
+  if (!m_resuming)
+    return false;
+  MutexLock l(m_lock);
+  return find(m_dirs, m_get_dir, id, obj);
+}
+
+void Checkpoint::fileProgress(const fsobjid_t &id, const objseq_t &hash,
+                              uint64_t treesize)
+{
+  MutexLock l(m_lock);
+  rec_t &r = m_files[idKey(id)];
+  r.obj.m_id = id;
+  r.obj.m_hash = hash;
+  r.obj.m_treesize = treesize;
+  r.erase = false;
+  didUpdate();
+}
+
+void Checkpoint::fileDone(const fsobjid_t &id)
+{
+  MutexLock l(m_lock);
+  rec_t &r = m_files[idKey(id)];
+  r.obj = CObject();
+  r.obj.m_id = id;
+  r.erase = true;
+  didUpdate();
+}
+
+bool Checkpoint::findFile(const fsobjid_t &id, objseq_t &hash,
+                          uint64_t &treesize)
+{
+  if (!m_resuming)
+    return false;
+  MutexLock l(m_lock);
+  CObject obj;
+  if (!find(m_files, m_get_file, id, obj) || obj.m_hash.empty())
+    return false;
+  hash = obj.m_hash;
+  treesize = obj.m_treesize;
+  return true;
+}
+
+bool Checkpoint::find(pending_t &pending, sqlite3_stmt *pstmt,
+                      const fsobjid_t &id, CObject &obj)
+{
+  pending_t::const_iterator i = pending.find(idKey(id));
+  if (i != pending.end()) {
+    if (i->second.erase || !sameTimes(i->second.obj.m_id, id))
+      return false;
+    obj.m_hash = i->second.obj.m_hash;
+    obj.m_treesize = i->second.obj.m_treesize;
+    return true;
+  }
+
+  ON_BLOCK_EXIT(sqlite3_reset, pstmt);
+  sqlite3_bind_int64(pstmt, 1, id.device);
+  sqlite3_bind_int64(pstmt, 2, id.fileid);
+  const int res = sqlite3_step(pstmt);
+  if (res == SQLITE_DONE)
+    return false;
+  if (res != SQLITE_ROW)
+    throw error(std::string("STEP checkpoint lookup: ")
+                + sqlite3_errmsg(m_db));
+
+  // The object must not have changed since it was recorded
+  uint64_t t[4];
+  idTimes(id, t);
+  for (int c = 0; c != 4; ++c)
+    if (uint64_t(sqlite3_column_int64(pstmt, c)) != t[c])
+      return false;
+
+  const size_t blobsize = sqlite3_column_bytes(pstmt, 4);
+  if (blobsize % sha256::size)
+    throw error("Checkpoint hash of non-256 bit multiple");
+  const uint8_t *rawp
+    = reinterpret_cast<const uint8_t*>(sqlite3_column_blob(pstmt, 4));
+  obj.m_hash.resize(blobsize / sha256::size);
+  for (size_t h = 0; h != obj.m_hash.size(); ++h)
+    obj.m_hash[h] = sha256::parseRaw(rawp + h * sha256::size);
+  obj.m_treesize = sqlite3_column_int64(pstmt, 5);
+  return true;
+}
+
+void Checkpoint::flush()
+{
+  MutexLock l(m_lock);
+  flushLocked();
+}
+
+void Checkpoint::didUpdate()
+{
+  if (m_dirs.size() + m_files.size() >= g_flush_batch
+      || m_last_flush + g_flush_period < Time::now())
+    flushLocked();
+}
+
+void Checkpoint::flushLocked()
+{
+  m_last_flush = Time::now();
+  if (m_dirs.empty() && m_files.empty())
+    return;
+
+  execute("BEGIN TRANSACTION");
+  try {
+    for (int table = 0; table != 2; ++table) {
+      const pending_t &pending = table ? m_files : m_dirs;
+      for (pending_t::const_iterator i = pending.begin();
+           i != pending.end(); ++i) {
+        sqlite3_stmt *pstmt;
+        if (i->second.erase) {
+          pstmt = m_del_file;
+          sqlite3_bind_int64(pstmt, 1, i->second.obj.m_id.device);
+          sqlite3_bind_int64(pstmt, 2, i->second.obj.m_id.fileid);
+        } else {
+          pstmt = table ? m_put_file : m_put_dir;
+          const std::vector<uint8_t> blob(hashBlob(i->second.obj.m_hash));
+          bindId(pstmt, i->second.obj.m_id);
+          sqlite3_bind_blob(pstmt, 7, blob.empty() ? 0 : &blob[0],
+                            int(blob.size()), SQLITE_TRANSIENT);
+          sqlite3_bind_int64(pstmt, 8, i->second.obj.m_treesize);
+        }
+        const int res = sqlite3_step(pstmt);
+        sqlite3_reset(pstmt);
+        if (res != SQLITE_DONE)
+          throw error(std::string("STEP checkpoint: ") + sqlite3_errmsg(m_db));
+      }
+    }
+    execute("COMMIT TRANSACTION");
+  } catch (error &) {
+    try { execute("ROLLBACK TRANSACTION"); }
+    catch (error &) { }
+    throw;
+  }
+
+  MTrace(t_ckpt, trace::Debug, "Checkpointed " << m_dirs.size()
+         << " directories and " << m_files.size() << " files");
+  m_dirs.clear();
+  m_files.clear();
+}
@@ -0,0 +1,120 @@
+//
+// Progress checkpoints for resumable backups
+//
+// A backup that is stopped before it completes leaves nothing behind
+// but the cache entries of what it uploaded, and those do not tell a
+// new backup which subtrees need no traversal - only the change
+// notification of a running session does that. So while a backup
+// runs, we record in a side database the directories it completed
+// (with their hashes and tree sizes) and how far it got with large
+// files. If the backup does not complete, the next one of the same
+// root resumes: completed directories that are unchanged are taken
+// as they are, and large files continue from the last chunk
+// recorded.
+//
+// Everything recorded is on the server when it is recorded. Writes
+// are batched; losing the last batch only means redoing a little.
+//
+
+#ifndef BACKUP_CHECKPOINT_HH
+#define BACKUP_CHECKPOINT_HH
+
+#include "metatree.hh"
+#include "common/mutex.hh"
+#include "common/time.hh"
+#include "sqlite/sqlite3.h"
+
+#include <string>
+#include <map>
+#include <stdint.h>
+
+class Checkpoint {
+public:
+  /// Open (or create) the checkpoint database
+  Checkpoint(const std::string &fname);
+
+  /// Writes out what is buffered
+  ~Checkpoint();
+
+  /// A backup of the given root starts. If the last backup recorded
+  /// was of the same root, did not complete, and started no longer
+  /// than maxage ago, we resume it and return true. Otherwise what
+  /// was recorded is dropped and we return false.
+  bool begin(const std::string &root, const DiffTime &maxage);
+
+  /// The backup completed; drop what was recorded
+  void complete();
+
+  /// Are we resuming a backup
+  bool resuming() const { return m_resuming; }
+
+  /// Record a directory as completed. The object must carry the id
+  /// the directory was scanned with, and its hashes and tree size.
+  void dirDone(const CObject &);
+
+  /// If we are resuming and the directory with the given id was
+  /// completed by the backup we resume, fill in its hashes and tree
+  /// size and return true
+  bool findDir(const fsobjid_t &, CObject &);
+
+  /// Record the chunks of a file uploaded so far
+  void fileProgress(const fsobjid_t &, const objseq_t &, uint64_t treesize);
+
+  /// The file is done; forget its progress
+  void fileDone(const fsobjid_t &);
+
+  /// If we are resuming and have progress recorded for the file with
+  /// the given id, fill in the chunk hashes and their size, and
+  /// return true
+  bool findFile(const fsobjid_t &, objseq_t &, uint64_t &treesize);
+
+  /// Write out buffered records
+  void flush();
+
+private:
+  Checkpoint(const Checkpoint&);
+  Checkpoint &operator=(const Checkpoint&);
+
+  const std::string m_fname;
+
+  /// Protects everything below
+  Mutex m_lock;
+
+  sqlite3 *m_db;
+  sqlite3_stmt *m_put_dir;
+  sqlite3_stmt *m_get_dir;
+  sqlite3_stmt *m_put_file;
+  sqlite3_stmt *m_get_file;
+  sqlite3_stmt *m_del_file;
+
+  bool m_resuming;
+
+  /// A buffered record, keyed by device and file id
+  struct rec_t {
+    rec_t() : erase(false) { }
+    CObject obj;
+    /// Delete the stored record instead
+    bool erase;
+  };
+  typedef std::map<std::pair<uint64_t,uint64_t>,rec_t> pending_t;
+  pending_t m_dirs;
+  pending_t m_files;
+  Time m_last_flush;
+
+  /// Look up a record, buffered or stored
+  bool find(pending_t &, sqlite3_stmt *, const fsobjid_t &, CObject &);
+
+  /// Flush if enough is buffered or enough time has passed. Must
+  /// hold m_lock.
+  void didUpdate();
+
+  /// Write out buffered records. Must hold m_lock.
+  void flushLocked();
+
+  /// Run a statement. Must hold m_lock.
+  void execute(const std::string &);
+
+  void close();
+};
+
+#endif
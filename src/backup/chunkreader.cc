@@ -0,0 +1,935 @@
+//
+// Implementation of the chunked file data readers
+//
+
+#include "chunkreader.hh"
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include "common/error.hh"
+#include "common/trace.hh"
+
+#include <list>
+#include <deque>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(__linux__)
+# include <sys/mman.h>
+# define CHUNKREADER_CACHECTL 1
+#endif
+
+//
+// We talk to io_uring through the raw system calls so that we do not
+// depend on liburing; all we need is the kernel interface header.
+//
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define CHUNKREADER_URING 1
+# endif
+#endif
+
+#if defined(CHUNKREADER_URING)
+# include <linux/io_uring.h>
+# include <sys/syscall.h>
+# include <sys/mman.h>
+# include <sys/uio.h>
+// The io_uring system calls have the same numbers on all
+// architectures, but older C libraries do not know them
+# ifndef __NR_io_uring_setup
+#  define __NR_io_uring_setup 425
+# endif
+# ifndef __NR_io_uring_enter
+#  define __NR_io_uring_enter 426
+# endif
+# ifndef __NR_io_uring_register
+#  define __NR_io_uring_register 427
+# endif
+#endif
+
+namespace {
+  //! Tracer for the readers
+  trace::Path t_rd("/upload/reader");
+
+  /// A file queued for reading
+  struct file_t {
+    file_t(int f, uint64_t s, const std::string &n, bool sp, uint64_t from)
+      : fd(f), size(s), name(n), next_off(from), ended(false), done(false)
+      , sparse(sp), region_from(0), region_to(0), region_hole(false)
+      , direct(false), ahead_off(0) { }
+    int fd;
+    /// Bytes we plan to read (grows if the file turns out longer)
+    uint64_t size;
+    std::string name;
+    /// Offset of the next read to submit
+    uint64_t next_off;
+    /// A read has hit end of file
+    bool ended;
+    /// We returned the last chunk of the file
+    bool done;
+    /// Whether we look for holes
+    bool sparse;
+    /// The last data or hole region we found
+    uint64_t region_from;
+    uint64_t region_to;
+    bool region_hole;
+    /// Whether we read with O_DIRECT
+    bool direct;
+    /// What of the chunk after the one last read was cached before
+    /// we read (see cachepolicy_t)
+    std::vector<unsigned char> ahead;
+    uint64_t ahead_off;
+  };
+
+  /// Does the chunk at the given offset lie entirely in a hole? Only
+  /// full chunks within the expected size can. We ask the kernel once
+  /// per data or hole region; note that this moves the file offset.
+  bool inHole(file_t &f, uint64_t off, size_t len)
+  {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    if (!f.sparse || off + len > f.size)
+      return false;
+    if (off < f.region_from || off >= f.region_to) {
+      const off_t data = lseek(f.fd, off_t(off), SEEK_DATA);
+      if (data == -1 && errno == ENXIO) {
+        // No data from here to the end of the file
+        f.region_from = off;
+        f.region_to = f.size;
+        f.region_hole = true;
+      } else if (data == -1) {
+        // The file system cannot tell us
+        MTrace(t_rd, trace::Debug, "Cannot look for holes in " << f.name
+               << ": " << strerror(errno));
+        f.sparse = false;
+        return false;
+      } else if (uint64_t(data) > off) {
+        f.region_from = off;
+        f.region_to = data;
+        f.region_hole = true;
+      } else {
+        const off_t hole = lseek(f.fd, off_t(off), SEEK_HOLE);
+        if (hole == -1) {
+          f.sparse = false;
+          return false;
+        }
+        f.region_from = off;
+        f.region_to = hole;
+        f.region_hole = false;
+      }
+    }
+    return f.region_hole && off + len <= f.region_to;
+#else
+    (void)f;
+    (void)off;
+    (void)len;
+    return false;
+#endif
+  }
+
+  /// O_DIRECT reads must be aligned - in memory, on disk and in
+  /// length - to the logical block size of the device; no device has
+  /// larger blocks than this
+  const size_t g_direct_align = 4096;
+
+#if defined(CHUNKREADER_CACHECTL)
+  size_t pageSize()
+  {
+    static const size_t ps = size_t(sysconf(_SC_PAGESIZE));
+    return ps;
+  }
+
+  /// Which pages of the range are in the page cache - one byte per
+  /// page, from the page holding off on. Leaves pages empty if we
+  /// cannot tell.
+  void residency(int fd, uint64_t off, size_t len,
+                 std::vector<unsigned char> &pages)
+  {
+    pages.clear();
+    if (!len)
+      return;
+    const uint64_t from = off & ~uint64_t(pageSize() - 1);
+    const size_t maplen = size_t(off + len - from);
+    void *m = mmap(0, maplen, PROT_READ, MAP_SHARED, fd, off_t(from));
+    if (m == MAP_FAILED)
+      return;
+    pages.resize((maplen + pageSize() - 1) / pageSize());
+    if (mincore(m, maplen, &pages[0]))
+      pages.clear();
+    munmap(m, maplen);
+  }
+#endif
+
+  ///
+  /// What the readers do about the page cache
+  ///
+  struct cachepolicy_t {
+    cachepolicy_t(ChunkReader::cache_t m, ChunkReader::cachestats_t *s)
+      : mode(m), stats(s) { }
+
+    ChunkReader::cache_t mode;
+    ChunkReader::cachestats_t *stats;
+
+    /// Do we need to know what was cached before we read
+    bool tracks() const
+    {
+#if defined(CHUNKREADER_CACHECTL)
+      return mode != ChunkReader::CacheKeep || stats;
+#else
+      return false;
+#endif
+    }
+
+    /// Set up a newly queued file
+    void open(file_t &f) const
+    {
+#if defined(CHUNKREADER_CACHECTL)
+      if (mode == ChunkReader::CacheKeep)
+        return;
+      posix_fadvise(f.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      if (mode != ChunkReader::CacheDirect)
+        return;
+      const int flags = fcntl(f.fd, F_GETFL);
+      if (flags != -1 && !fcntl(f.fd, F_SETFL, flags | O_DIRECT))
+        f.direct = true;
+      else
+        MTrace(t_rd, trace::Debug, "No O_DIRECT for " << f.name << ": "
+               << strerror(errno));
+#else
+      (void)f;
+#endif
+    }
+
+    /// The file system will not do the O_DIRECT read after all
+    void undirect(file_t &f) const
+    {
+#if defined(CHUNKREADER_CACHECTL)
+      const int flags = fcntl(f.fd, F_GETFL);
+      if (flags != -1)
+        fcntl(f.fd, F_SETFL, flags & ~O_DIRECT);
+#endif
+      f.direct = false;
+      MTrace(t_rd, trace::Debug, "O_DIRECT read refused for " << f.name
+             << " - reading through the page cache");
+    }
+
+    /// Note what of the chunk at off was cached before we read it.
+    /// Read-ahead of this chunk will pull in the start of the next,
+    /// so we look at that now too.
+    void before(file_t &f, uint64_t off, size_t len,
+                std::vector<unsigned char> &pages) const
+    {
+#if defined(CHUNKREADER_CACHECTL)
+      if (!tracks())
+        return;
+      if (f.ahead_off == off && !f.ahead.empty())
+        pages.swap(f.ahead);
+      else
+        residency(f.fd, off, len, pages);
+      f.ahead_off = off + len;
+      if (f.ahead_off < f.size)
+        residency(f.fd, f.ahead_off, len, f.ahead);
+      else
+        f.ahead.clear();
+#else
+      (void)f;
+      (void)off;
+      (void)len;
+      (void)pages;
+#endif
+    }
+
+    /// The data of the chunk at off has been read and handed on
+    void consumed(const file_t &f, uint64_t off, size_t len,
+                  const std::vector<unsigned char> &pages) const
+    {
+#if defined(CHUNKREADER_CACHECTL)
+      if (!tracks() || !len)
+        return;
+      const uint64_t ps = pageSize();
+      const uint64_t from = off & ~(ps - 1);
+      if (mode != ChunkReader::CacheKeep) {
+        // Drop the pages we brought in
+        if (pages.empty()) {
+          posix_fadvise(f.fd, off_t(off), off_t(len), POSIX_FADV_DONTNEED);
+        } else {
+          for (size_t i = 0; i != pages.size(); ) {
+            if (pages[i] & 1) {
+              ++i;
+              continue;
+            }
+            size_t j = i;
+            while (j != pages.size() && !(pages[j] & 1))
+              ++j;
+            posix_fadvise(f.fd, off_t(from + i * ps), off_t((j - i) * ps),
+                          POSIX_FADV_DONTNEED);
+            i = j;
+          }
+        }
+      }
+      if (stats) {
+        __sync_add_and_fetch(&stats->read, uint64_t(len));
+        std::vector<unsigned char> now;
+        if (!pages.empty())
+          residency(f.fd, off, len, now);
+        uint64_t added = 0;
+        for (size_t i = 0; i != std::min(pages.size(), now.size()); ++i)
+          if ((now[i] & 1) && !(pages[i] & 1))
+            added += ps;
+        if (added)
+          __sync_add_and_fetch(&stats->added, added);
+      }
+#else
+      (void)f;
+      (void)off;
+      (void)len;
+      (void)pages;
+#endif
+    }
+  };
+
+  ///
+  /// Plain blocking reads - one chunk at a time when asked for it
+  ///
+  class BlockingReader : public ChunkReader {
+  public:
+    BlockingReader(size_t chunkdata, const cachepolicy_t &policy)
+      : ChunkReader(chunkdata)
+      , m_policy(policy)
+      , m_bounce(0)
+    { }
+
+    ~BlockingReader()
+    {
+      reset();
+      free(m_bounce);
+    }
+
+    void add(int fd, uint64_t size, const std::string &name, bool sparse,
+             uint64_t from)
+    {
+      m_files.push_back(file_t(fd, size, name, sparse, from));
+      m_policy.open(m_files.back());
+    }
+
+    bool next(std::vector<uint8_t> &chunk, bool &hole)
+    {
+      hole = false;
+      if (m_files.empty())
+        return false;
+      file_t &f = m_files.front();
+
+      if (!f.done && inHole(f, f.next_off, m_chunkdata)) {
+        f.next_off += m_chunkdata;
+        hole = true;
+        return true;
+      }
+
+      size_t got = 0;
+      if (!f.done) {
+        std::vector<unsigned char> pages;
+        m_policy.before(f, f.next_off, m_chunkdata, pages);
+        if (!f.direct || !readDirect(f, chunk, got)) {
+          const size_t ofs = chunk.size();
+          chunk.resize(ofs + m_chunkdata);
+          ssize_t rrc;
+          do {
+            rrc = pread(f.fd, &chunk[ofs + got], m_chunkdata - got,
+                        off_t(f.next_off + got));
+            if (rrc == -1 && errno == EINTR)
+              continue;
+            if (rrc == -1) {
+              const syserror e("pread", "reading file data from "
+                               + f.name + " for backup");
+              chunk.resize(ofs);
+              throw e;
+            }
+            got += rrc;
+          } while (rrc && got < m_chunkdata);
+          chunk.resize(ofs + got);
+        }
+        m_policy.consumed(f, f.next_off, got, pages);
+        f.next_off += got;
+        // A short chunk is the last one
+        f.done = got < m_chunkdata;
+      }
+
+      if (!got) {
+        close(f.fd);
+        m_files.pop_front();
+        return false;
+      }
+      return true;
+    }
+
+    void reset()
+    {
+      for (std::deque<file_t>::iterator i = m_files.begin();
+           i != m_files.end(); ++i)
+        close(i->fd);
+      m_files.clear();
+    }
+
+    size_t depth() const
+    {
+      return 1;
+    }
+
+    const char *name() const
+    {
+      return "blocking";
+    }
+
+  private:
+    const cachepolicy_t m_policy;
+    std::deque<file_t> m_files;
+
+    /// Aligned buffer for O_DIRECT reads
+    uint8_t *m_bounce;
+
+    /// Read the next chunk with O_DIRECT, through our buffer since
+    /// the chunk is not aligned. Returns false if the file system
+    /// refuses, in which case the file is no longer read with
+    /// O_DIRECT.
+    bool readDirect(file_t &f, std::vector<uint8_t> &chunk, size_t &got)
+    {
+      const uint64_t aoff = f.next_off & ~uint64_t(g_direct_align - 1);
+      const size_t skip = size_t(f.next_off - aoff);
+      const size_t want = (skip + m_chunkdata + g_direct_align - 1)
+        & ~(g_direct_align - 1);
+      if (!m_bounce) {
+        void *b;
+        if (posix_memalign(&b, g_direct_align,
+                           m_chunkdata + 2 * g_direct_align))
+          throw error("Cannot allocate buffer for direct reads");
+        m_bounce = static_cast<uint8_t*>(b);
+      }
+
+      size_t have = 0;
+      while (have < want) {
+        const ssize_t rrc = pread(f.fd, m_bounce + have, want - have,
+                                  off_t(aoff + have));
+        if (rrc == -1 && errno == EINTR)
+          continue;
+        if (rrc == -1 && errno == EINVAL && !have) {
+          m_policy.undirect(f);
+          return false;
+        }
+        if (rrc == -1)
+          throw syserror("pread", "reading file data from "
+                         + f.name + " for backup");
+        if (!rrc)
+          break;
+        have += rrc;
+        // Only the end of the file ends a direct read off the
+        // alignment
+        if (have % g_direct_align)
+          break;
+      }
+
+      got = have > skip ? std::min(have - skip, m_chunkdata) : 0;
+      chunk.insert(chunk.end(), m_bounce + skip, m_bounce + skip + got);
+      return true;
+    }
+  };
+
+#if defined(CHUNKREADER_URING)
+
+  ///
+  /// io_uring reads - we keep up to depth reads in flight ahead of
+  /// the consumer
+  ///
+  class URingReader : public ChunkReader {
+  public:
+    /// \throws syserror if the kernel does not give us a ring
+    URingReader(size_t chunkdata, size_t depth, const cachepolicy_t &);
+    ~URingReader();
+
+    void add(int fd, uint64_t size, const std::string &name, bool sparse,
+             uint64_t from);
+    bool next(std::vector<uint8_t> &chunk, bool &hole);
+    void reset();
+
+    size_t depth() const
+    {
+      return m_bufs.size();
+    }
+
+    const char *name() const
+    {
+      return m_fixed ? "io_uring (fixed buffers)" : "io_uring";
+    }
+
+  private:
+    struct qfile_t;
+
+    /// The slot of a chunk in a hole, which needs no reading
+    static const size_t c_hole = ~size_t(0);
+
+    /// A read of one chunk into one of our buffers
+    struct read_t {
+      read_t(qfile_t *f, uint64_t o, size_t s, size_t chunkdata)
+        : file(f), off(o), slot(s), got(0), err(0), eof(false)
+        , inflight(false)
+      {
+        setDirect(f->direct, chunkdata);
+      }
+      qfile_t *file;
+      uint64_t off;
+      size_t slot;
+      /// What we read into the buffer; an O_DIRECT read covers the
+      /// aligned blocks around the chunk, which starts skip bytes in
+      uint64_t aoff;
+      size_t skip;
+      size_t want;
+      bool direct;
+      /// Bytes read so far; short reads are resubmitted until the
+      /// chunk is full or we hit end of file
+      size_t got;
+      int err;
+      bool eof;
+      bool inflight;
+      /// What of the chunk was cached before we read it
+      std::vector<unsigned char> pages;
+      /// For non-fixed buffer reads
+      struct iovec iov;
+
+      void setDirect(bool d, size_t chunkdata)
+      {
+        direct = d;
+        aoff = d ? off & ~uint64_t(g_direct_align - 1) : off;
+        skip = size_t(off - aoff);
+        want = d ? (skip + chunkdata + g_direct_align - 1)
+          & ~(g_direct_align - 1) : chunkdata;
+      }
+    };
+
+    /// A queued file with its reads in offset order. Pointers to
+    /// deque elements are stable when we only push and pop at the
+    /// ends, so the ring can refer to them.
+    struct qfile_t : file_t {
+      qfile_t(int f, uint64_t s, const std::string &n, bool sp,
+              uint64_t from)
+        : file_t(f, s, n, sp, from) { }
+      std::deque<read_t> reads;
+    };
+
+    const cachepolicy_t m_policy;
+
+    int m_ring;
+    void *m_sq_map;
+    size_t m_sq_len;
+    void *m_cq_map;
+    size_t m_cq_len;
+    struct io_uring_sqe *m_sqes;
+    size_t m_sqes_len;
+    volatile unsigned *m_sq_tail;
+    unsigned m_sq_mask;
+    unsigned *m_sq_array;
+    volatile unsigned *m_cq_head;
+    volatile unsigned *m_cq_tail;
+    unsigned m_cq_mask;
+    struct io_uring_cqe *m_cqes;
+
+    /// Did we manage to register our buffers
+    bool m_fixed;
+    /// Our buffer pool and the slots not in use. Buffers have room
+    /// for the alignment of O_DIRECT reads when we do those.
+    size_t m_buflen;
+    std::vector<uint8_t*> m_bufs;
+    std::vector<size_t> m_free;
+    /// Reads submitted but not completed
+    size_t m_inflight;
+    /// Entries queued in the submission ring but not yet submitted
+    unsigned m_tosubmit;
+
+    std::list<qfile_t> m_files;
+
+    /// Submit reads for as far ahead as our free buffers allow
+    void fill();
+    /// Queue a (re)submission of the given read
+    void queueRead(read_t &);
+    /// Hand queued submissions to the kernel, optionally waiting for
+    /// at least one completion, and process completions
+    void enter(bool wait);
+    /// Free a buffer for the first file by giving up the last reads
+    /// submitted for a later file
+    bool stealSlot();
+    /// Release the buffer of the last read, if any, and drop it.
+    /// Returns whether a buffer was released.
+    bool dropLast(qfile_t &);
+    /// Close the first file, waiting for its outstanding reads
+    void popFile();
+    void release();
+  };
+
+  URingReader::URingReader(size_t chunkdata, size_t depth,
+                           const cachepolicy_t &policy)
+    : ChunkReader(chunkdata)
+    , m_policy(policy)
+    , m_ring(-1)
+    , m_sq_map(MAP_FAILED)
+    , m_sq_len(0)
+    , m_cq_map(MAP_FAILED)
+    , m_cq_len(0)
+    , m_sqes(0)
+    , m_sqes_len(0)
+    , m_fixed(false)
+    , m_buflen(policy.mode == CacheDirect
+               ? chunkdata + 2 * g_direct_align : chunkdata)
+    , m_inflight(0)
+    , m_tosubmit(0)
+  {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    m_ring = syscall(__NR_io_uring_setup, unsigned(depth), &p);
+    if (m_ring == -1)
+      throw syserror("io_uring_setup", "setting up read ring");
+
+    try {
+      m_sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      m_sq_map = mmap(0, m_sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQ_RING);
+      if (m_sq_map == MAP_FAILED)
+        throw syserror("mmap", "mapping submission ring");
+      m_cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+      m_cq_map = mmap(0, m_cq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_CQ_RING);
+      if (m_cq_map == MAP_FAILED)
+        throw syserror("mmap", "mapping completion ring");
+      m_sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+      void *sqes = mmap(0, m_sqes_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQES);
+      if (sqes == MAP_FAILED)
+        throw syserror("mmap", "mapping submission entries");
+      m_sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+      uint8_t *sq = static_cast<uint8_t*>(m_sq_map);
+      m_sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+      m_sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+      m_sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+      uint8_t *cq = static_cast<uint8_t*>(m_cq_map);
+      m_cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+      m_cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+      m_cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+      m_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+      // Our buffer pool - page aligned so that the kernel can pin it
+      std::vector<struct iovec> iov;
+      for (size_t i = 0; i != depth; ++i) {
+        void *b = mmap(0, m_buflen, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b == MAP_FAILED)
+          throw syserror("mmap", "allocating read buffers");
+        m_bufs.push_back(static_cast<uint8_t*>(b));
+        m_free.push_back(i);
+        struct iovec v;
+        v.iov_base = b;
+        v.iov_len = m_buflen;
+        iov.push_back(v);
+      }
+
+      // Registering may fail if we are not allowed to lock that much
+      // memory - we can do without
+      m_fixed = !syscall(__NR_io_uring_register, m_ring,
+                         IORING_REGISTER_BUFFERS, &iov[0], unsigned(depth));
+      if (!m_fixed)
+        MTrace(t_rd, trace::Info, "Cannot register read buffers ("
+               << strerror(errno) << ") - using plain reads");
+    } catch (...) {
+      release();
+      throw;
+    }
+  }
+
+  URingReader::~URingReader()
+  {
+    reset();
+    release();
+  }
+
+  void URingReader::release()
+  {
+    for (size_t i = 0; i != m_bufs.size(); ++i)
+      munmap(m_bufs[i], m_buflen);
+    m_bufs.clear();
+    if (m_sqes)
+      munmap(m_sqes, m_sqes_len);
+    if (m_cq_map != MAP_FAILED)
+      munmap(m_cq_map, m_cq_len);
+    if (m_sq_map != MAP_FAILED)
+      munmap(m_sq_map, m_sq_len);
+    if (m_ring != -1)
+      close(m_ring);
+  }
+
+  void URingReader::add(int fd, uint64_t size, const std::string &name,
+                        bool sparse, uint64_t from)
+  {
+    m_files.push_back(qfile_t(fd, size, name, sparse, from));
+    m_policy.open(m_files.back());
+    fill();
+    enter(false);
+  }
+
+  void URingReader::queueRead(read_t &r)
+  {
+    const unsigned tail = *m_sq_tail;
+    const unsigned idx = tail & m_sq_mask;
+    struct io_uring_sqe &sqe = m_sqes[idx];
+    memset(&sqe, 0, sizeof sqe);
+    sqe.fd = r.file->fd;
+    sqe.off = r.aoff + r.got;
+    if (m_fixed) {
+      sqe.opcode = IORING_OP_READ_FIXED;
+      sqe.addr = reinterpret_cast<uintptr_t>(m_bufs[r.slot] + r.got);
+      sqe.len = unsigned(r.want - r.got);
+      sqe.buf_index = uint16_t(r.slot);
+    } else {
+      r.iov.iov_base = m_bufs[r.slot] + r.got;
+      r.iov.iov_len = r.want - r.got;
+      sqe.opcode = IORING_OP_READV;
+      sqe.addr = reinterpret_cast<uintptr_t>(&r.iov);
+      sqe.len = 1;
+    }
+    sqe.user_data = reinterpret_cast<uintptr_t>(&r);
+    m_sq_array[idx] = idx;
+
+    // The entry must be visible before the tail moves
+    __sync_synchronize();
+    *m_sq_tail = tail + 1;
+    __sync_synchronize();
+
+    r.inflight = true;
+    ++m_inflight;
+    ++m_tosubmit;
+  }
+
+  void URingReader::fill()
+  {
+    for (std::list<qfile_t>::iterator f = m_files.begin();
+         f != m_files.end() && !m_free.empty(); ++f) {
+      // We read up to and including the offset of the expected end
+      // of file so that we see the end of file as the blocking read
+      // loop would. Chunks in holes take no buffer, but we look no
+      // further ahead in a file than we could read.
+      while (!m_free.empty() && !f->ended && f->next_off <= f->size
+             && f->reads.size() < m_bufs.size()) {
+        if (inHole(*f, f->next_off, m_chunkdata)) {
+          f->reads.push_back(read_t(&*f, f->next_off, c_hole, m_chunkdata));
+          f->next_off += m_chunkdata;
+          continue;
+        }
+        f->reads.push_back(read_t(&*f, f->next_off, m_free.back(),
+                                  m_chunkdata));
+        m_free.pop_back();
+        m_policy.before(*f, f->next_off, m_chunkdata, f->reads.back().pages);
+        f->next_off += m_chunkdata;
+        queueRead(f->reads.back());
+      }
+    }
+  }
+
+  void URingReader::enter(bool wait)
+  {
+    // Never wait for completions that cannot come
+    wait = wait && m_inflight;
+    while (m_tosubmit || wait) {
+      const int rc = syscall(__NR_io_uring_enter, m_ring, m_tosubmit,
+                             wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                             0, 0);
+      if (rc == -1) {
+        if (errno == EINTR || errno == EAGAIN)
+          continue;
+        throw syserror("io_uring_enter", "submitting file reads");
+      }
+      m_tosubmit -= std::min(unsigned(rc), m_tosubmit);
+      break;
+    }
+
+    // Process completions
+    unsigned head = *m_cq_head;
+    __sync_synchronize();
+    for (; head != *m_cq_tail; ++head) {
+      const struct io_uring_cqe &cqe = m_cqes[head & m_cq_mask];
+      read_t &r = *reinterpret_cast<read_t*>(uintptr_t(cqe.user_data));
+      r.inflight = false;
+      --m_inflight;
+      if (cqe.res == -EINVAL && r.direct && !r.got) {
+        // The file system will not do O_DIRECT after all
+        if (r.file->direct)
+          m_policy.undirect(*r.file);
+        r.setDirect(false, m_chunkdata);
+        queueRead(r);
+      } else if (cqe.res < 0) {
+        r.err = -cqe.res;
+      } else if (!cqe.res) {
+        r.eof = true;
+        r.file->ended = true;
+      } else {
+        r.got += cqe.res;
+        if (r.direct && r.got % g_direct_align) {
+          // Only the end of the file ends a direct read off the
+          // alignment
+          r.eof = true;
+          r.file->ended = true;
+        } else if (r.got < r.want) {
+          // Resubmit the rest of a short read
+          queueRead(r);
+        }
+      }
+    }
+    __sync_synchronize();
+    *m_cq_head = head;
+  }
+
+  bool URingReader::dropLast(qfile_t &f)
+  {
+    read_t &r = f.reads.back();
+    while (r.inflight)
+      enter(true);
+    const bool freed = r.slot != c_hole;
+    if (freed) {
+      m_free.push_back(r.slot);
+      // What was cached before holds when we read this again
+      f.ahead.swap(r.pages);
+      f.ahead_off = r.off;
+    }
+    f.next_off = r.off;
+    if (r.eof)
+      f.ended = false;
+    f.reads.pop_back();
+    return freed;
+  }
+
+  bool URingReader::stealSlot()
+  {
+    for (std::list<qfile_t>::reverse_iterator f = m_files.rbegin();
+         f != m_files.rend() && &*f != &m_files.front(); ++f) {
+      while (!f->reads.empty())
+        if (dropLast(*f))
+          return true;
+    }
+    return false;
+  }
+
+  void URingReader::popFile()
+  {
+    qfile_t &f = m_files.front();
+    while (!f.reads.empty()) {
+      while (f.reads.front().inflight)
+        enter(true);
+      if (f.reads.front().slot != c_hole)
+        m_free.push_back(f.reads.front().slot);
+      f.reads.pop_front();
+    }
+    close(f.fd);
+    m_files.pop_front();
+  }
+
+  bool URingReader::next(std::vector<uint8_t> &chunk, bool &hole)
+  {
+    hole = false;
+    if (m_files.empty())
+      return false;
+    qfile_t &f = m_files.front();
+
+    while (!f.done) {
+      if (f.reads.empty()) {
+        if (f.ended)
+          break;
+        // Every chunk was full and we have read as much as the file
+        // held when queued - it grew, read on
+        f.size = f.next_off;
+        if (m_free.empty() && !stealSlot())
+          throw error("Read pool exhausted reading " + f.name);
+        fill();
+      }
+
+      read_t &r = f.reads.front();
+      if (r.slot == c_hole) {
+        f.reads.pop_front();
+        fill();
+        enter(false);
+        hole = true;
+        return true;
+      }
+
+      // Wait for the chunk to be complete - full, or at end of file
+      while (!r.err && !r.eof && r.got < r.want)
+        enter(true);
+      if (r.err) {
+        errno = r.err;
+        throw syserror(m_fixed ? "io_uring read_fixed" : "io_uring readv",
+                       "reading file data from " + f.name + " for backup");
+      }
+
+      const size_t got = r.got > r.skip
+        ? std::min(r.got - r.skip, m_chunkdata) : 0;
+      const uint8_t *data = m_bufs[r.slot] + r.skip;
+      chunk.insert(chunk.end(), data, data + got);
+      m_policy.consumed(f, r.off, got, r.pages);
+      m_free.push_back(r.slot);
+      f.reads.pop_front();
+      // A short chunk is the last one
+      f.done = got < m_chunkdata;
+
+      // Keep the pipeline full
+      fill();
+      enter(false);
+
+      if (got)
+        return true;
+    }
+
+    popFile();
+    fill();
+    enter(false);
+    return false;
+  }
+
+  void URingReader::reset()
+  {
+    while (!m_files.empty())
+      popFile();
+  }
+
+#endif
+
+}
+
+ChunkReader::ChunkReader(size_t chunkdata)
+  : m_chunkdata(chunkdata)
+{
+}
+
+ChunkReader::~ChunkReader()
+{
+}
+
+ChunkReader *ChunkReader::create(size_t chunkdata, size_t depth,
+                                 cache_t cache, cachestats_t *stats)
+{
+  const cachepolicy_t policy(cache, stats);
+#if defined(CHUNKREADER_URING)
+  if (depth > 1) {
+    try {
+      ChunkReader *r = new URingReader(chunkdata, depth, policy);
+      MTrace(t_rd, trace::Debug, "Using " << r->name() << " reader, depth "
+             << depth);
+      return r;
+    } catch (error &e) {
+      MTrace(t_rd, trace::Info, "No io_uring - using blocking reads: "
+             << e.toString());
+    }
+  }
+#else
+  (void)depth;
+#endif
+  return new BlockingReader(chunkdata, policy);
+}
+
+#endif
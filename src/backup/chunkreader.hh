@@ -0,0 +1,114 @@
+//
+// Chunked file data reader for the backup client
+//
+// The uploader reads files a chunk at a time. A ChunkReader is given
+// a sequence of open files and hands back their data chunk by chunk,
+// in order. The plain implementation simply read()s each chunk when
+// asked for it; the io_uring implementation (Linux) keeps a number of
+// reads in flight ahead of the consumer, across chunks and across
+// the queued files, into a fixed pool of registered buffers.
+//
+// Both skip the holes of sparse files: a chunk that lies entirely in
+// a hole is not read at all (see next()).
+//
+// Reading terabytes for a backup would push the working set of
+// whatever else runs on the machine out of the page cache, so the
+// readers can drop what they read from the cache again, or bypass it
+// with O_DIRECT (Linux), and can measure how much of the page cache
+// the data read took up.
+//
+
+#ifndef BACKUP_CHUNKREADER_HH
+#define BACKUP_CHUNKREADER_HH
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+class ChunkReader {
+public:
+  /// How reads treat the page cache
+  enum cache_t {
+    /// Plain reads - what we read stays cached
+    CacheKeep,
+    /// Sequential read-ahead, and what we read is dropped from the
+    /// page cache once handed on - unless it was cached before we
+    /// read it
+    CacheDrop,
+    /// O_DIRECT reads, bypassing the page cache, where the file
+    /// system allows it; otherwise as CacheDrop
+    CacheDirect
+  };
+
+  /// Page cache statistics. Readers sharing one update it atomically.
+  struct cachestats_t {
+    cachestats_t() : read(0), added(0) { }
+    /// Bytes of file data read
+    volatile uint64_t read;
+    /// Bytes of what we read that were left in the page cache and
+    /// were not there before - what we displaced from the cache
+    volatile uint64_t added;
+  };
+
+  /// Create the best reader available. With a depth above one we use
+  /// io_uring if the kernel supports it, otherwise (or with a depth
+  /// of one) we fall back to plain blocking reads.
+  //
+  /// Every chunk read holds up to chunkdata bytes of file data. If
+  /// stats are given, the reader measures its use of the page cache
+  /// there; this costs a mincore() call or two per chunk.
+  static ChunkReader *create(size_t chunkdata, size_t depth,
+                             cache_t cache = CacheKeep,
+                             cachestats_t *stats = 0);
+
+  /// Closes all files still queued
+  virtual ~ChunkReader();
+
+  /// Queue a file for reading. We take ownership of the descriptor
+  /// and close it when the file has been read. The size is what the
+  /// file is expected to hold; we read until end of file regardless.
+  /// The name is used for error messages. If the file may be sparse
+  /// (it uses less space than its size) we look for its holes.
+  /// Reading starts at the given offset, which should be a multiple
+  /// of chunkdata.
+  virtual void add(int fd, uint64_t size, const std::string &name,
+                   bool sparse, uint64_t from) = 0;
+
+  /// Append the next chunk of the first queued file to the given
+  /// buffer. Returns false when the file holds no more data, in
+  /// which case it is closed and the next call continues with the
+  /// next file. A chunk shorter than chunkdata is always the last one
+  /// of its file.
+  //
+  /// If the chunk is a full chunk within a hole, nothing is appended
+  /// and hole is set; the chunk holds chunkdata zero bytes.
+  //
+  /// \throws syserror on read errors
+  virtual bool next(std::vector<uint8_t> &chunk, bool &hole) = 0;
+
+  /// Drop all queued files (after an error, for example)
+  virtual void reset() = 0;
+
+  /// How many reads we may keep in flight
+  virtual size_t depth() const = 0;
+
+  /// Name of the implementation, for tracing
+  virtual const char *name() const = 0;
+
+protected:
+  ChunkReader(size_t chunkdata);
+
+  /// Bytes of file data per chunk
+  const size_t m_chunkdata;
+
+private:
+  ChunkReader(const ChunkReader&);
+  ChunkReader &operator=(const ChunkReader&);
+};
+
+#endif
+
+#endif
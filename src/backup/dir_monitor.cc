@@ -38,8 +38,7 @@ bool DirMonitor::popFileChangeEvent(FileChangeEvent_t &event)
     return false;
   }
 
-  event.root = m_fileChangeEvents.front().root;
-  event.fileName = m_fileChangeEvents.front().fileName;
+  event = m_fileChangeEvents.front();
 
   m_fileChangeEvents.pop();
   return true;
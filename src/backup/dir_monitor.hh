@@ -15,6 +15,7 @@
 #include <stdint.h>
 #include <string>
 #include <set>
+#include <map>
 #include <queue>
 #include <utility>
 
@@ -31,15 +32,28 @@
 class DirMonitor : public Thread {
 public:
   /// Create instance and start working thread
-  DirMonitor();
+  //
+  /// On Linux, if fileSystemWide is set, we attempt to monitor whole
+  /// file systems with a single fanotify mark each rather than
+  /// watching every directory with inotify. Where that is not
+  /// possible (missing privileges, old kernel, file systems that
+  /// cannot report file handles) we fall back to inotify.
+  DirMonitor(bool fileSystemWide = false);
 
   /// We must destroy allocated structures
   ~DirMonitor();
 
   /// Include new directory into monitoring
-  /// Note. For linux it returns inotify watch descriptor (0 for other platforms)
+  /// Note. For linux it returns inotify watch descriptor (0 for other
+  /// platforms, and 0 on linux if the directory is covered by a file
+  /// system wide fanotify mark)
   int addDir(const std::string &fullPath);
 
+#if defined(__linux__)
+  /// Are we monitoring with fanotify
+  bool fileSystemWide() const { return m_fanotify_fd != -1; }
+#endif
+
   struct FileChangeEvent_t {
     FileChangeEvent_t() {}
 
@@ -57,8 +71,18 @@ public:
 
 #if defined(__linux__)
     FileChangeEvent_t(int aRoot, const std::string& aFileName)
-      : root(aRoot), fileName(aFileName) {}
+      : root(aRoot), dev(0), ino(0), fileName(aFileName) {}
+    /// A fanotify event in the directory with the given device and
+    /// inode numbers and path. If neither are known, events were
+    /// lost and anything may have changed.
+    FileChangeEvent_t(uint64_t aDev, uint64_t aIno, const std::string &aPath,
+                      const std::string& aFileName)
+      : root(-1), dev(aDev), ino(aIno), path(aPath), fileName(aFileName) {}
+    /// The inotify watch descriptor, or -1 for fanotify events
     int root;
+    uint64_t dev;
+    uint64_t ino;
+    std::string path;
 #endif
 
     std::string fileName;
@@ -88,6 +112,10 @@ protected:
 #endif
 #if defined(__linux__)
   void runLinux();
+  void readInotify();
+  void readFanotify();
+  /// Mark the file system holding the path with fanotify
+  bool markFileSystem(const std::string &path);
 #endif
 
 private:
@@ -110,6 +138,16 @@ private:
   int m_inotify_fd;
   /// On Linux we use a wake pipe to be woken for exit
   int m_wakepipe[2];
+  /// Our fanotify descriptor if we monitor whole file systems
+  int m_fanotify_fd;
+  /// Protects the two maps below
+  Mutex m_marks_lock;
+  /// For each device we have seen in addDir, whether its file system
+  /// is covered by a fanotify mark
+  std::map<uint64_t,bool> m_marked;
+  /// For each marked file system (by fsid), a descriptor we can
+  /// resolve the file handles of its events with
+  std::map<uint64_t,int> m_mountfds;
 #endif
 
 #if defined(__APPLE__) || defined(_WIN32)
@@ -7,16 +7,45 @@
 #if defined(__linux__)
 #include <sys/inotify.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <stdio.h>
+
+#if defined(__has_include)
+# if __has_include(<sys/fanotify.h>)
+#  include <sys/fanotify.h>
+# endif
+#endif
+
+// We need file system marks and directory file handles with names
+// in the events (Linux 5.9)
+#if defined(FAN_MARK_FILESYSTEM) && defined(FAN_REPORT_DFID_NAME)
+# define DIRMONITOR_FANOTIFY
 #endif
 
-DirMonitor::DirMonitor()
+namespace {
+#if defined(DIRMONITOR_FANOTIFY)
+  /// The events we want - the same as for inotify below
+  const uint64_t g_fanotify_mask = FAN_ATTRIB | FAN_CREATE | FAN_MOVED_TO
+    | FAN_MODIFY | FAN_DELETE | FAN_MOVED_FROM | FAN_ONDIR;
+
+  uint64_t fsidKey(const int32_t *val)
+  {
+    return uint64_t(uint32_t(val[0])) << 32 | uint32_t(val[1]);
+  }
+#endif
+}
+#endif
+
+DirMonitor::DirMonitor(bool fileSystemWide)
   : m_changeNotify(0)
 #if defined(__linux__)
   , m_inotify_fd(-1)
+  , m_fanotify_fd(-1)
 #endif
 {
 #if defined(__linux__)
@@ -36,6 +65,22 @@ DirMonitor::DirMonitor()
     }
   }
   MTrace(t_dm, trace::Info, "inotify initialized and ready");
+
+  // We keep inotify for the file systems we cannot mark
+  if (fileSystemWide) {
+#if defined(DIRMONITOR_FANOTIFY)
+    m_fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME
+                                  | FAN_CLOEXEC | FAN_NONBLOCK,
+                                  O_RDONLY | O_LARGEFILE);
+    if (m_fanotify_fd == -1)
+      MTrace(t_dm, trace::Info, "Cannot initialise fanotify: "
+             << strerror(errno) << ". Using inotify.");
+    else
+      MTrace(t_dm, trace::Info, "fanotify initialized and ready");
+#else
+    MTrace(t_dm, trace::Info, "Built without fanotify support. Using inotify.");
+#endif
+  }
 #endif
   // start working thread
   start();
@@ -63,6 +108,13 @@ DirMonitor::~DirMonitor()
     close(m_inotify_fd);
     m_inotify_fd = -1;
   }
+  if (m_fanotify_fd != -1) {
+    close(m_fanotify_fd);
+    m_fanotify_fd = -1;
+  }
+  for (std::map<uint64_t,int>::iterator i = m_mountfds.begin();
+       i != m_mountfds.end(); ++i)
+    close(i->second);
   // Close wake pipe ends
   close(m_wakepipe[0]);
   close(m_wakepipe[1]);
@@ -109,22 +161,26 @@ void DirMonitor::runMac()
 #if defined(__linux__)
 void DirMonitor::runLinux()
 {
-  while (m_inotify_fd != -1) {
-    struct pollfd ent[2];
+  while (m_inotify_fd != -1 || m_fanotify_fd != -1) {
+    struct pollfd ent[3];
     ent[0].fd = m_inotify_fd;
     ent[0].events = POLLIN;
     ent[0].revents = 0;
     ent[1].fd = m_wakepipe[0];
     ent[1].events = POLLIN;
     ent[1].revents = 0;
+    // A negative descriptor is ignored by poll
+    ent[2].fd = m_fanotify_fd;
+    ent[2].events = POLLIN;
+    ent[2].revents = 0;
 
     int rc;
     do {
-      rc = poll(ent, 2, -1);
+      rc = poll(ent, 3, -1);
     } while (rc == -1 && errno == EINTR);
 
     if (rc < 0) {
-      MTrace(t_dm, trace::Warn, "Error polling inotify fd: "
+      MTrace(t_dm, trace::Warn, "Error polling notification fds: "
              << strerror(errno) << " - disabling CDP");
       break;
     }
@@ -144,52 +200,186 @@ void DirMonitor::runLinux()
     }
   
     // Fine, let's treat the events then
-    if (ent[0].revents & POLLIN) {
-      // Read event
-      std::vector<uint8_t> rdbuf(1024);
-      while (true) {
-        int rc;
-        while (-1 == (rc = read(m_inotify_fd, &rdbuf[0], rdbuf.size()))
-               && errno == EINTR);
-        // If buffer too small, double
-        if (rc == 0 || (rc == -1 && errno == EINVAL)) {
-          rdbuf.resize(rdbuf.size() * 2);
-          continue;
-        }
-        // Otherwise, fail on error
-        if (rc == -1)
-          throw syserror("read", "reading inotify event");
-        // Success then
-        if (rc > 0) {
-          rdbuf.resize(rc);
-          break;
-        }
-      }
-
-      size_t numEvents = 0;
-      {
-        MutexLock l(m_fileChangeEventsLock);
-        // Parse events from buffer - buffer holds one or more events.
-        for (size_t offset = 0; offset != rdbuf.size(); ) {
-          struct inotify_event *evt
-          = reinterpret_cast<inotify_event*>(&rdbuf[offset]);
-          // Treat event
-          m_fileChangeEvents.push(FileChangeEvent_t(evt->wd, evt->name));
-          numEvents++;
-      
-          // Now increment offset to next event
-          offset += sizeof(struct inotify_event) + evt->len;
-          MTrace(t_dm, trace::Debug, "New offset is " << offset
-                 << " - buffer size is " << rdbuf.size());
-        }
-      }
-      // Notify so that someone can consume events from our queue
-      if (m_changeNotify) {
-        (*m_changeNotify)(*this);
-      }
+    if (ent[0].revents & POLLIN)
+      readInotify();
+    if (ent[2].revents & POLLIN)
+      readFanotify();
+
+    // Notify so that someone can consume events from our queue
+    if (m_changeNotify && ((ent[0].revents | ent[2].revents) & POLLIN))
+      (*m_changeNotify)(*this);
+  }
+}
+
+void DirMonitor::readInotify()
+{
+  // Read event
+  std::vector<uint8_t> rdbuf(1024);
+  while (true) {
+    int rc;
+    while (-1 == (rc = read(m_inotify_fd, &rdbuf[0], rdbuf.size()))
+           && errno == EINTR);
+    // If buffer too small, double
+    if (rc == 0 || (rc == -1 && errno == EINVAL)) {
+      rdbuf.resize(rdbuf.size() * 2);
+      continue;
+    }
+    // Otherwise, fail on error
+    if (rc == -1)
+      throw syserror("read", "reading inotify event");
+    // Success then
+    if (rc > 0) {
+      rdbuf.resize(rc);
+      break;
+    }
+  }
+
+  MutexLock l(m_fileChangeEventsLock);
+  // Parse events from buffer - buffer holds one or more events.
+  for (size_t offset = 0; offset != rdbuf.size(); ) {
+    struct inotify_event *evt
+      = reinterpret_cast<inotify_event*>(&rdbuf[offset]);
+    // Treat event
+    m_fileChangeEvents.push(FileChangeEvent_t(evt->wd, evt->name));
+
+    // Now increment offset to next event
+    offset += sizeof(struct inotify_event) + evt->len;
+    MTrace(t_dm, trace::Debug, "New offset is " << offset
+           << " - buffer size is " << rdbuf.size());
+  }
+}
+
+void DirMonitor::readFanotify()
+{
+#if defined(DIRMONITOR_FANOTIFY)
+  std::vector<uint8_t> rdbuf(65536);
+  ssize_t rc;
+  while (-1 == (rc = read(m_fanotify_fd, &rdbuf[0], rdbuf.size()))
+         && errno == EINTR);
+  if (rc == -1 && errno == EAGAIN)
+    return;
+  if (rc == -1)
+    throw syserror("read", "reading fanotify event");
+
+  // Resolve the events before we take the queue lock - resolving
+  // takes system calls
+  std::vector<FileChangeEvent_t> events;
+  size_t len = size_t(rc);
+  for (const fanotify_event_metadata *md
+         = reinterpret_cast<const fanotify_event_metadata*>(&rdbuf[0]);
+       FAN_EVENT_OK(md, len); md = FAN_EVENT_NEXT(md, len)) {
+    if (md->vers != FANOTIFY_METADATA_VERSION)
+      throw error("Unexpected fanotify metadata version");
+    if (md->fd >= 0)
+      close(md->fd);
+
+    // If the kernel dropped events we no longer know what changed
+    if (md->mask & FAN_Q_OVERFLOW) {
+      MTrace(t_dm, trace::Warn, "fanotify queue overflow - "
+             "considering everything changed");
+      events.push_back(FileChangeEvent_t(0, 0, std::string(), std::string()));
       continue;
     }
+
+    // Locate the directory file handle and entry name
+    const fanotify_event_info_fid *fid = 0;
+    for (size_t ofs = md->metadata_len; ofs < md->event_len; ) {
+      const fanotify_event_info_header *hdr
+        = reinterpret_cast<const fanotify_event_info_header*>
+        (reinterpret_cast<const uint8_t*>(md) + ofs);
+      if (!hdr->len)
+        break;
+      if (hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+        fid = reinterpret_cast<const fanotify_event_info_fid*>(hdr);
+      ofs += hdr->len;
+    }
+    if (!fid)
+      continue;
+
+    int mountfd;
+    { MutexLock l(m_marks_lock);
+      std::map<uint64_t,int>::const_iterator m
+        = m_mountfds.find(fsidKey(fid->fsid.val));
+      if (m == m_mountfds.end())
+        continue;
+      mountfd = m->second;
+    }
+
+    file_handle *fh = reinterpret_cast<file_handle*>
+      (const_cast<unsigned char*>(fid->handle));
+    const char *name = reinterpret_cast<const char*>(fh->f_handle
+                                                      + fh->handle_bytes);
+
+    // The directory may be gone by now - then its parent will have
+    // seen an event too
+    int dfd;
+    while (-1 == (dfd = open_by_handle_at(mountfd, fh, O_PATH | O_CLOEXEC))
+           && errno == EINTR);
+    if (dfd == -1) {
+      MTrace(t_dm, trace::Debug, "Cannot open directory of fanotify event on "
+             << name << ": " << strerror(errno));
+      continue;
+    }
+    struct stat st;
+    char link[64];
+    char path[4096];
+    snprintf(link, sizeof link, "/proc/self/fd/%d", dfd);
+    const ssize_t plen = readlink(link, path, sizeof path);
+    const int src = fstat(dfd, &st);
+    close(dfd);
+    if (src == -1 || plen <= 0 || size_t(plen) == sizeof path)
+      continue;
+
+    // A write often comes as several events in a row
+    if (!events.empty() && events.back().ino == st.st_ino
+        && events.back().dev == st.st_dev && events.back().fileName == name)
+      continue;
+
+    MTrace(t_dm, trace::Debug, "fanotify event on \""
+           << std::string(path, plen) << "\" entry \"" << name << "\"");
+    events.push_back(FileChangeEvent_t(st.st_dev, st.st_ino,
+                                       std::string(path, plen), name));
+  }
+
+  MutexLock l(m_fileChangeEventsLock);
+  for (size_t i = 0; i != events.size(); ++i)
+    m_fileChangeEvents.push(events[i]);
+#endif
+}
+
+bool DirMonitor::markFileSystem(const std::string &path)
+{
+#if defined(DIRMONITOR_FANOTIFY)
+  // Keep a descriptor for resolving the handles of events
+  int mfd;
+  while (-1 == (mfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+         && errno == EINTR);
+  if (mfd == -1) {
+    MTrace(t_dm, trace::Info, "Cannot open " << path << " for fanotify: "
+           << strerror(errno));
+    return false;
   }
+  struct statfs fs;
+  if (fstatfs(mfd, &fs)
+      || fanotify_mark(m_fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                       g_fanotify_mask, mfd, 0)) {
+    MTrace(t_dm, trace::Info, "Cannot watch file system of " << path
+           << " with fanotify: " << strerror(errno) << ". Using inotify.");
+    close(mfd);
+    return false;
+  }
+  const uint64_t key = fsidKey(reinterpret_cast<const int32_t*>(&fs.f_fsid));
+  if (m_mountfds.count(key))
+    close(mfd);
+  else
+    m_mountfds[key] = mfd;
+  MTrace(t_dm, trace::Info, "Watching file system of " << path
+         << " with fanotify");
+  return true;
+#else
+  (void)path;
+  return false;
+#endif
 }
 #endif
 
@@ -218,6 +408,24 @@ int DirMonitor::addDir(const std::string &path)
   return 0;
 #endif
 #if defined(__linux__)
+  // If the directory is on a file system we can watch as a whole,
+  // there is nothing to add
+  if (m_fanotify_fd != -1) {
+    struct stat st;
+    if (stat(path.c_str(), &st)) {
+      if (errno == ENOENT)
+        return -1;
+      throw syserror("stat", "examining directory to watch");
+    }
+    MutexLock l(m_marks_lock);
+    std::map<uint64_t,bool>::iterator m = m_marked.find(st.st_dev);
+    if (m == m_marked.end())
+      m = m_marked.insert(std::make_pair(uint64_t(st.st_dev),
+                                         markFileSystem(path))).first;
+    if (m->second)
+      return 0;
+  }
+
   int rc = inotify_add_watch(m_inotify_fd,
                              path.c_str(),
                              // File attribute changes
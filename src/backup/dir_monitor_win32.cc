@@ -4,7 +4,7 @@
 // $Id: $
 //
 
-DirMonitor::DirMonitor()
+DirMonitor::DirMonitor(bool)
   : m_outstandingExit(false)
   , m_outstandingReads(0)
   , m_changeNotify(0)
@@ -0,0 +1,254 @@
+//
+// Implementation of the descriptor relative directory scanner
+//
+
+#include "dirscan.hh"
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#if defined(__linux__)
+# include <sys/syscall.h>
+# include <sys/sysmacros.h>
+#endif
+
+namespace {
+
+#if defined(O_CLOEXEC)
+  const int g_cloexec = O_CLOEXEC;
+#else
+  const int g_cloexec = 0;
+#endif
+
+#if defined(O_NOFOLLOW)
+  const int g_nofollow = O_NOFOLLOW;
+#else
+  const int g_nofollow = 0;
+#endif
+
+#if defined(O_NOATIME)
+  const int g_noatime = O_NOATIME;
+#else
+  const int g_noatime = 0;
+#endif
+
+  /// Bytes of directory entries we read per getdents64 call
+  const size_t g_dentbuf = 32768;
+
+  bool isDots(const char *n)
+  {
+    return n[0] == '.' && (!n[1] || (n[1] == '.' && !n[2]));
+  }
+
+#if defined(__linux__)
+  /// The kernel getdents64 record; glibc only exposes this as of 2.30
+  struct dirent64_t {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+  };
+#endif
+
+#if defined(__linux__) && defined(STATX_TYPE)
+  /// Cleared if the kernel turns out not to have statx
+  volatile bool g_have_statx = true;
+
+  unsigned statxMask(unsigned fields)
+  {
+    unsigned mask = 0;
+    if (fields & DirScanner::F_Type) mask |= STATX_TYPE;
+    if (fields & DirScanner::F_Mode) mask |= STATX_TYPE | STATX_MODE;
+    if (fields & DirScanner::F_Owner) mask |= STATX_UID | STATX_GID;
+    if (fields & DirScanner::F_Ino) mask |= STATX_INO;
+    if (fields & DirScanner::F_Size) mask |= STATX_SIZE;
+    if (fields & DirScanner::F_Times) mask |= STATX_MTIME | STATX_CTIME;
+    if (fields & DirScanner::F_Blocks) mask |= STATX_BLOCKS;
+    return mask;
+  }
+
+  void fromStatx(const struct statx &sx, struct stat &st)
+  {
+    memset(&st, 0, sizeof st);
+    st.st_dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+    st.st_ino = sx.stx_ino;
+    st.st_mode = sx.stx_mode;
+    st.st_nlink = sx.stx_nlink;
+    st.st_uid = sx.stx_uid;
+    st.st_gid = sx.stx_gid;
+    st.st_rdev = makedev(sx.stx_rdev_major, sx.stx_rdev_minor);
+    st.st_size = sx.stx_size;
+    st.st_blksize = sx.stx_blksize;
+    st.st_blocks = sx.stx_blocks;
+    st.st_atim.tv_sec = sx.stx_atime.tv_sec;
+    st.st_atim.tv_nsec = sx.stx_atime.tv_nsec;
+    st.st_mtim.tv_sec = sx.stx_mtime.tv_sec;
+    st.st_mtim.tv_nsec = sx.stx_mtime.tv_nsec;
+    st.st_ctim.tv_sec = sx.stx_ctime.tv_sec;
+    st.st_ctim.tv_nsec = sx.stx_ctime.tv_nsec;
+  }
+#endif
+
+}
+
+DirScanner::DirScanner()
+  : m_fd(-1)
+#if defined(__linux__)
+  , m_bufpos(0)
+  , m_buflen(0)
+#else
+  , m_dir(0)
+#endif
+{
+}
+
+DirScanner::~DirScanner()
+{
+  close();
+}
+
+bool DirScanner::open(const std::string &path)
+{
+  // The path itself may well lead through symlinks (the backup root
+  // could be one). Directories are scanned by whichever worker picks
+  // them off the queue, long after their parent was closed, so we
+  // cannot open them relative to the parent descriptor.
+  close();
+  while (-1 == (m_fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY
+                              | g_cloexec))
+         && errno == EINTR);
+  if (m_fd == -1)
+    return false;
+
+#if !defined(__linux__)
+  if (!(m_dir = fdopendir(m_fd))) {
+    const int err = errno;
+    ::close(m_fd);
+    m_fd = -1;
+    errno = err;
+    return false;
+  }
+#endif
+  return true;
+}
+
+void DirScanner::close()
+{
+#if defined(__linux__)
+  if (m_fd != -1)
+    ::close(m_fd);
+  m_bufpos = m_buflen = 0;
+#else
+  // closedir closes the descriptor too
+  if (m_dir)
+    closedir(m_dir);
+  m_dir = 0;
+#endif
+  m_fd = -1;
+}
+
+bool DirScanner::next(entry_t &e)
+{
+#if defined(__linux__)
+  while (true) {
+    if (m_bufpos == m_buflen) {
+      if (m_buf.empty())
+        m_buf.resize(g_dentbuf);
+      long rc;
+      while (-1 == (rc = syscall(SYS_getdents64, m_fd, &m_buf[0],
+                                 m_buf.size()))
+             && errno == EINTR);
+      if (rc <= 0) {
+        if (!rc)
+          errno = 0;
+        return false;
+      }
+      m_bufpos = 0;
+      m_buflen = size_t(rc);
+    }
+
+    const dirent64_t *de
+      = reinterpret_cast<const dirent64_t*>(&m_buf[m_bufpos]);
+    m_bufpos += de->d_reclen;
+    if (isDots(de->d_name))
+      continue;
+
+    e.name = de->d_name;
+    e.type = de->d_type;
+    return true;
+  }
+#else
+  while (true) {
+    errno = 0;
+    const struct dirent *de = readdir(m_dir);
+    if (!de)
+      return false;
+    if (isDots(de->d_name))
+      continue;
+
+    e.name = de->d_name;
+    e.type = de->d_type;
+    return true;
+  }
+#endif
+}
+
+bool DirScanner::statAt(const char *name, struct stat &st,
+                        unsigned fields) const
+{
+#if defined(__linux__) && defined(STATX_TYPE)
+  if (g_have_statx) {
+    struct statx sx;
+    int rc;
+    while (-1 == (rc = statx(m_fd, name, AT_SYMLINK_NOFOLLOW,
+                             statxMask(fields), &sx))
+           && errno == EINTR);
+    if (!rc) {
+      fromStatx(sx, st);
+      return true;
+    }
+    if (errno != ENOSYS)
+      return false;
+    g_have_statx = false;
+  }
+#else
+  (void)fields;
+#endif
+
+  int rc;
+  while (-1 == (rc = fstatat(m_fd, name, &st, AT_SYMLINK_NOFOLLOW))
+         && errno == EINTR);
+  return !rc;
+}
+
+bool DirScanner::statfs(struct statfs &fs) const
+{
+  int rc;
+  while (-1 == (rc = fstatfs(m_fd, &fs)) && errno == EINTR);
+  return !rc;
+}
+
+int DirScanner::openFile(const char *name) const
+{
+  // Reading for backup should not change access times. We may only
+  // ask for that on files we own (unless we have CAP_FOWNER).
+  int fd;
+  int flags = O_RDONLY | g_nofollow | g_cloexec | g_noatime;
+  while (true) {
+    fd = openat(m_fd, name, flags);
+    if (fd == -1 && errno == EINTR)
+      continue;
+    if (fd == -1 && errno == EPERM && (flags & g_noatime)) {
+      flags &= ~g_noatime;
+      continue;
+    }
+    return fd;
+  }
+}
+
+#endif
@@ -0,0 +1,110 @@
+//
+// Directory scanner working relative to an open directory descriptor
+//
+// The scanner opens a directory once, reads its entries in bulk
+// (getdents64 on Linux) and stats entries relative to the directory
+// descriptor, so that no per-entry absolute path has to be built or
+// walked by the kernel. The entry type reported by the file system
+// lets callers skip the stat entirely for objects they do not care
+// about.
+//
+
+#ifndef BACKUP_DIRSCAN_HH
+#define BACKUP_DIRSCAN_HH
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#if defined(__linux__)
+# include <sys/vfs.h>
+#endif
+
+#if defined(__APPLE__)
+# include <sys/param.h>
+# include <sys/mount.h>
+#endif
+
+class DirScanner {
+public:
+  /// A directory entry. The name is valid until the next call to
+  /// next().
+  struct entry_t {
+    const char *name;
+    /// DT_* type of the entry, DT_UNKNOWN if the file system does
+    /// not tell
+    unsigned char type;
+  };
+
+  DirScanner();
+
+  /// Closes the directory if open
+  ~DirScanner();
+
+  /// Open the directory at the given path. Returns false and sets
+  /// errno on failure.
+  bool open(const std::string &path);
+
+  /// Close the directory
+  void close();
+
+  /// The directory descriptor, or -1 if not open
+  int fd() const { return m_fd; }
+
+  /// Fetch the next entry, skipping "." and "..". Returns false at
+  /// the end of the directory or on error (errno is then set,
+  /// otherwise errno is zero).
+  bool next(entry_t &);
+
+  /// Fields we need from a stat - anything not requested may be left
+  /// unset
+  enum {
+    F_Type = 1 << 0,
+    F_Mode = 1 << 1,
+    F_Owner = 1 << 2,
+    F_Ino = 1 << 3,
+    F_Size = 1 << 4,
+    F_Times = 1 << 5,
+    F_Blocks = 1 << 6,
+    F_All = (1 << 7) - 1
+  };
+
+  /// lstat() the named entry relative to the directory, fetching at
+  /// least the requested fields (the device is always filled
+  /// in). Returns false and sets errno on failure.
+  bool statAt(const char *name, struct stat &st, unsigned fields = F_All) const;
+
+  /// statfs() the directory itself
+  bool statfs(struct statfs &) const;
+
+  /// Open the named entry for reading, not following symlinks and
+  /// without updating its access time where we are allowed to.
+  /// Returns the descriptor or -1 with errno set.
+  int openFile(const char *name) const;
+
+private:
+  DirScanner(const DirScanner&);
+  DirScanner &operator=(const DirScanner&);
+
+  /// Our directory descriptor
+  int m_fd;
+
+#if defined(__linux__)
+  /// Entries read by getdents64 and not yet returned
+  std::vector<char> m_buf;
+  size_t m_bufpos;
+  size_t m_buflen;
+#else
+  /// Elsewhere we read through a DIR stream on our descriptor
+  DIR *m_dir;
+#endif
+};
+
+#endif
+
+#endif
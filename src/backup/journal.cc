@@ -0,0 +1,306 @@
+//
+// Implementation of the change journal
+//
+
+#include "journal.hh"
+#include "common/error.hh"
+#include "common/trace.hh"
+#include "common/crc32.hh"
+#include "common/scopeguard.hh"
+
+#include <string.h>
+#include <errno.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+# include <unistd.h>
+# include <fcntl.h>
+#endif
+
+#if defined(_WIN32)
+# include <windows.h>
+# include <io.h>
+#endif
+
+//
+// The journal is a sequence of records:
+//
+//   uint8_t type; uint32_t length; uint32_t crc; payload[length]
+//
+// with integers in little endian byte order. The crc covers the type
+// and the payload. Replay stops at the first short or damaged record,
+// which is what a crash may leave behind.
+//
+
+namespace {
+  trace::Path t_jnl("/upload/cdp/journal");
+
+  /// Compact when this many records more than the live ones are in
+  /// the file
+  const size_t g_compact_slack = 4096;
+
+  void put32(std::vector<uint8_t> &v, uint32_t x)
+  {
+    for (size_t i = 0; i != 4; ++i)
+      v.push_back(uint8_t(x >> (8 * i)));
+  }
+
+  uint32_t get32(const uint8_t *p)
+  {
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8
+      | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+  }
+
+  /// Flush the file all the way to disk
+  bool sync(FILE *f)
+  {
+    if (fflush(f))
+      return false;
+#if defined(_WIN32)
+    return !_commit(_fileno(f));
+#else
+    return !fsync(fileno(f));
+#endif
+  }
+
+  bool replaceFile(const std::string &from, const std::string &to)
+  {
+#if defined(_WIN32)
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING
+                       | MOVEFILE_WRITE_THROUGH);
+#else
+    if (rename(from.c_str(), to.c_str()))
+      return false;
+    // Make the rename itself durable
+    const size_t slash = to.rfind('/');
+    const std::string dir(slash == to.npos ? "." : to.substr(0, slash + 1));
+    const int dfd = open(dir.c_str(), O_RDONLY);
+    if (dfd != -1) {
+      fsync(dfd);
+      close(dfd);
+    }
+    return true;
+#endif
+  }
+}
+
+ChangeJournal::ChangeJournal(const std::string &fname)
+  : m_fname(fname)
+  , m_file(0)
+  , m_clean(false)
+  , m_live_all(false)
+  , m_since_all(false)
+  , m_records(0)
+{
+  replay();
+  MTrace(t_jnl, trace::Info, "Journal " << m_fname << " replayed: "
+         << m_live.size() << " touched paths"
+         << (m_live_all ? ", everything touched" : "")
+         << (m_clean ? ", closed cleanly" : ", not closed cleanly"));
+  compact();
+}
+
+ChangeJournal::~ChangeJournal()
+{
+  MutexLock l(m_lock);
+  if (!m_file)
+    return;
+  append(R_Close);
+  if (m_file && !sync(m_file))
+    MTrace(t_jnl, trace::Warn, "Cannot sync journal " << m_fname
+           << ": " << strerror(errno));
+  if (m_file)
+    fclose(m_file);
+}
+
+void ChangeJournal::encode(std::vector<uint8_t> &out, rec_t type,
+                           const std::string &payload)
+{
+  std::vector<uint8_t> crcd;
+  crcd.reserve(1 + payload.size());
+  crcd.push_back(uint8_t(type));
+  crcd.insert(crcd.end(), payload.begin(), payload.end());
+
+  out.push_back(uint8_t(type));
+  put32(out, uint32_t(payload.size()));
+  put32(out, crc32(crcd));
+  out.insert(out.end(), payload.begin(), payload.end());
+}
+
+void ChangeJournal::replay()
+{
+  FILE *f = fopen(m_fname.c_str(), "rb");
+  if (!f) {
+    MTrace(t_jnl, trace::Info, "No journal " << m_fname << " to replay");
+    return;
+  }
+  ON_BLOCK_EXIT(fclose, f);
+
+  std::vector<uint8_t> crcd;
+  while (true) {
+    uint8_t hdr[9];
+    const size_t got = fread(hdr, 1, sizeof hdr, f);
+    if (!got)
+      break;
+    if (got != sizeof hdr) {
+      MTrace(t_jnl, trace::Info, "Journal " << m_fname << " has a short "
+             "record header - ignoring the rest");
+      m_clean = false;
+      break;
+    }
+    const uint32_t len = get32(hdr + 1);
+    crcd.resize(1 + len);
+    crcd[0] = hdr[0];
+    if ((len && fread(&crcd[1], 1, len, f) != len)
+        || crc32(crcd) != get32(hdr + 5)) {
+      MTrace(t_jnl, trace::Info, "Journal " << m_fname << " has a damaged "
+             "record - ignoring the rest");
+      m_clean = false;
+      break;
+    }
+
+    switch (hdr[0]) {
+    case R_Open:
+      m_clean = false;
+      break;
+    case R_Close:
+      m_clean = true;
+      break;
+    case R_Touched:
+      m_since.insert(std::string(crcd.begin() + 1, crcd.end()));
+      break;
+    case R_All:
+      m_since_all = true;
+      break;
+    case R_Started:
+      m_live.insert(m_since.begin(), m_since.end());
+      m_since.clear();
+      m_live_all = m_live_all || m_since_all;
+      m_since_all = false;
+      break;
+    case R_Done:
+      m_live.clear();
+      m_live_all = false;
+      break;
+    default:
+      MTrace(t_jnl, trace::Info, "Journal " << m_fname << " has unknown "
+             "record type " << int(hdr[0]) << " - ignoring the rest");
+      m_clean = false;
+      break;
+    }
+  }
+
+  // No backup is in progress as we start, so everything is pending
+  m_live.insert(m_since.begin(), m_since.end());
+  m_since.clear();
+  m_live_all = m_live_all || m_since_all;
+  m_since_all = false;
+}
+
+void ChangeJournal::compact()
+{
+  std::vector<uint8_t> out;
+  size_t records = 0;
+  for (size_t pass = 0; pass != 2; ++pass) {
+    const std::set<std::string> &paths = pass ? m_since : m_live;
+    for (std::set<std::string>::const_iterator i = paths.begin();
+         i != paths.end(); ++i, ++records)
+      encode(out, R_Touched, *i);
+  }
+  if (m_live_all || m_since_all) {
+    encode(out, R_All, std::string());
+    ++records;
+  }
+  encode(out, R_Open, std::string());
+  ++records;
+
+  if (m_file) {
+    fclose(m_file);
+    m_file = 0;
+  }
+
+  const std::string tmpname(m_fname + ".tmp");
+  FILE *f = fopen(tmpname.c_str(), "wb");
+  if (!f) {
+    MTrace(t_jnl, trace::Warn, "Cannot create journal " << tmpname
+           << ": " << strerror(errno) << " - journaling disabled");
+    return;
+  }
+  const bool written = fwrite(&out[0], 1, out.size(), f) == out.size()
+    && sync(f);
+  fclose(f);
+  if (!written || !replaceFile(tmpname, m_fname)) {
+    MTrace(t_jnl, trace::Warn, "Cannot write journal " << m_fname
+           << ": " << strerror(errno) << " - journaling disabled");
+    remove(tmpname.c_str());
+    return;
+  }
+
+  m_file = fopen(m_fname.c_str(), "ab");
+  if (!m_file) {
+    MTrace(t_jnl, trace::Warn, "Cannot open journal " << m_fname
+           << ": " << strerror(errno) << " - journaling disabled");
+    return;
+  }
+  m_records = records;
+}
+
+void ChangeJournal::append(rec_t type, const std::string &payload)
+{
+  if (!m_file)
+    return;
+  std::vector<uint8_t> out;
+  encode(out, type, payload);
+  // Flushing hands the record to the OS, so it survives if we crash;
+  // we only sync when closing - after a system crash the journal is
+  // not trusted anyway, since it was not closed.
+  if (fwrite(&out[0], 1, out.size(), m_file) != out.size()
+      || fflush(m_file)) {
+    MTrace(t_jnl, trace::Warn, "Cannot append to journal " << m_fname
+           << ": " << strerror(errno) << " - journaling disabled");
+    fclose(m_file);
+    m_file = 0;
+    return;
+  }
+  ++m_records;
+}
+
+void ChangeJournal::touched(const std::string &path)
+{
+  MutexLock l(m_lock);
+  if (m_since_all || !m_since.insert(path).second)
+    return;
+  append(R_Touched, path);
+}
+
+void ChangeJournal::touchedAll()
+{
+  MutexLock l(m_lock);
+  if (m_since_all)
+    return;
+  m_since_all = true;
+  m_since.clear();
+  append(R_All);
+}
+
+void ChangeJournal::backupStarted()
+{
+  MutexLock l(m_lock);
+  m_live.insert(m_since.begin(), m_since.end());
+  m_since.clear();
+  m_live_all = m_live_all || m_since_all;
+  m_since_all = false;
+  append(R_Started);
+}
+
+void ChangeJournal::backupDone()
+{
+  MutexLock l(m_lock);
+  m_live.clear();
+  m_live_all = false;
+  append(R_Done);
+
+  // Drop the records of what was just backed up if they take up
+  // enough space
+  if (m_file && m_records > m_since.size() + g_compact_slack)
+    compact();
+}
@@ -0,0 +1,108 @@
+//
+// Persistent journal of change notifications (CDP)
+//
+// The watch tree only lives in memory, so after a restart we would
+// not know what changed since the last backup and would have to scan
+// everything. The journal records every directory marked as touched
+// in an append-only file, along with the start and the completion of
+// backups, so that what was touched but not yet backed up can be
+// marked again at startup.
+//
+// A journal can only be trusted if it saw every change since the last
+// backup - that is, if the previous session closed it cleanly and
+// never lost change events.
+//
+
+#ifndef BACKUP_JOURNAL_HH
+#define BACKUP_JOURNAL_HH
+
+#include "common/mutex.hh"
+
+#include <string>
+#include <set>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+
+class ChangeJournal {
+public:
+  /// Open the journal, creating it if needed, and replay it. The file
+  /// is compacted to the entries that are still live.
+  ChangeJournal(const std::string &fname);
+
+  /// Close the journal cleanly
+  ~ChangeJournal();
+
+  /// Did the previous session close the journal cleanly? If not (or
+  /// if there was no journal), changes may have gone unrecorded.
+  bool clean() const { return m_clean; }
+
+  /// The paths that were touched but not yet backed up when we
+  /// opened the journal
+  const std::set<std::string> &replayed() const { return m_live; }
+
+  /// Were change events lost, so that everything must be considered
+  /// touched
+  bool replayedAll() const { return m_live_all; }
+
+  /// Record that a path was touched
+  void touched(const std::string &path);
+
+  /// Record that everything must be considered touched
+  void touchedAll();
+
+  /// Record that a backup started. Everything touched until now is
+  /// covered by it.
+  void backupStarted();
+
+  /// Record that the last backup started completed
+  void backupDone();
+
+private:
+  ChangeJournal(const ChangeJournal&);
+  ChangeJournal &operator=(const ChangeJournal&);
+
+  /// Record types
+  enum rec_t {
+    R_Open = 'O',
+    R_Close = 'C',
+    R_Touched = 'T',
+    R_All = 'A',
+    R_Started = 'B',
+    R_Done = 'D'
+  };
+
+  /// Read the journal and set up our state from it
+  void replay();
+
+  /// Write a new journal holding just our live entries
+  void compact();
+
+  /// Append a record; on failure we stop journaling altogether, so
+  /// that the journal will not be trusted on the next start
+  void append(rec_t, const std::string & = std::string());
+
+  /// Encode a record
+  static void encode(std::vector<uint8_t> &, rec_t, const std::string &);
+
+  const std::string m_fname;
+
+  Mutex m_lock;
+  FILE *m_file;
+
+  bool m_clean;
+
+  /// Touched before the start of the backup in progress (or before
+  /// we opened, if none is running)
+  std::set<std::string> m_live;
+  bool m_live_all;
+
+  /// Touched since the start of the backup in progress
+  std::set<std::string> m_since;
+  bool m_since_all;
+
+  /// Records in the file, and how many of those are still live
+  size_t m_records;
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include "common/error.hh"
 #include "common/ntohll.hh"
 #include "metatree.hh"
+#include "mmapcache.hh"
 
 #ifdef __unix__
 # include <sys/types.h>
@@ -19,12 +20,72 @@ namespace {
   //! Tracer for meta cache
   trace::Path t_cache("/cache");
 
-  //! We commit a transaction every period
+  //! We flush buffered writes at least every period
   const DiffTime g_txn_grp_period(DiffTime::iso("PT60S"));
+
+  //! We flush buffered writes when this many are pending
+  const size_t g_flush_batch = 4096;
+
+  //! How long a connection waits for a lock held by another
+  const int g_busy_timeout_ms = 10000;
+
+  //! Let SQLite map up to 256MiB of the database file
+  const char g_mmap_pragma[] = "PRAGMA mmap_size = 268435456;";
 }
 
 namespace {
 
+  /// Buffered writes are keyed by device and file id
+  std::pair<uint64_t,uint64_t> objKey(const fsobjid_t &id)
+  {
+    return std::make_pair(uint64_t(id.device), uint64_t(id.fileid));
+  }
+
+  /// The times of an object id as we store them in the database
+  void dbTimes(const fsobjid_t &id, uint64_t &ctime_s, uint32_t &ctime_ns,
+               uint64_t &mtime_s, uint32_t &mtime_ns)
+  {
+#if defined(__unix__) || defined(__APPLE__)
+    ctime_s = id.ctime_s;
+    ctime_ns = uint32_t(id.ctime_ns);
+    mtime_s = id.mtime_s;
+    mtime_ns = uint32_t(id.mtime_ns);
+#endif
+#if defined(_WIN32)
+    ctime_s = id.creation_time.dwHighDateTime;
+    ctime_ns = id.creation_time.dwLowDateTime;
+    mtime_s = id.write_time.dwHighDateTime;
+    mtime_ns = id.write_time.dwLowDateTime;
+#endif
+  }
+
+  /// Prepare a statement that lives as long as its connection
+  sqlite3_stmt *prepare(sqlite3 *db, const char *sql)
+  {
+    sqlite3_stmt *pstmt = 0;
+    int pres = sqlite3_prepare_v2(db, sql, -1, &pstmt, 0);
+    if (pres != SQLITE_OK)
+      throw error(std::string("PREP ") + sql + ": " + sqlite3_errmsg(db));
+    return pstmt;
+  }
+
+  /// Execute a statement, discarding any rows it returns (PRAGMAs
+  /// report their new value)
+  void exec(sqlite3 *db, const std::string &stmt)
+  {
+    sqlite3_stmt *pstmt = 0;
+    int pres = sqlite3_prepare_v2(db, stmt.c_str(), -1, &pstmt, 0);
+    if (pres != SQLITE_OK)
+      throw error("PREP " + stmt + ": " + sqlite3_errmsg(db));
+    ON_BLOCK_EXIT(sqlite3_finalize, pstmt);
+
+    int res;
+    while ((res = sqlite3_step(pstmt)) == SQLITE_ROW)
+      ;
+    if (res != SQLITE_DONE)
+      throw error("STEP " + stmt + ": " + sqlite3_errmsg(db));
+  }
+
   /// We want to have an easy way for debug printing of an fsobjid_t
   std::ostream &operator<<(std::ostream &out, const fsobjid_t &id)
   {
@@ -43,8 +104,7 @@ namespace {
     const uint8_t *rawp
       = reinterpret_cast<const uint8_t*>(sqlite3_column_blob(stmt, col));
     for (size_t i = 0; i != blobsize / 32; ++i) {
-      ret[i] = sha256::parse(std::vector<uint8_t>(rawp + i * 32,
-                                                  rawp + (i+1) * 32));
+      ret[i] = sha256::parseRaw(rawp + i * 32);
     }
     return ret;
   }
@@ -53,10 +113,14 @@ namespace {
 
 
 
-FSCache::FSCache(const std::string &fname)
+FSCache::FSCache(const std::string &fname, engine_t engine)
   : m_fname(fname)
+  , m_mmap(0)
   , m_db(0)
+  , m_insert_stmt(0)
+  , m_update_stmt(0)
   , m_txn_start(Time::now())
+  , m_generation(0)
 {
   if (!sqlite3_threadsafe())
     throw error("SQLite library not thread safe");
@@ -64,9 +128,135 @@ FSCache::FSCache(const std::string &fname)
   if (SQLITE_OK != sqlite3_config(SQLITE_CONFIG_SERIALIZED))
     throw error("Unable to set SERIALIZED mode on SQLite");
 
+  if (engine == E_MMap) {
+    const bool migrate = !MMapCache::exists(m_fname + ".mmap");
+    m_mmap = new MMapCache(m_fname + ".mmap");
+    if (migrate) {
+      try {
+        migrateToMMap();
+      } catch (error &) {
+        delete m_mmap;
+        throw;
+      }
+    }
+    return;
+  }
+
+  opendb();
+
+  quiesce();
+
+}
+
+FSCache::engine_t FSCache::parseEngine(const std::string &name)
+{
+  if (name == "sqlite")
+    return E_SQLite;
+  if (name == "mmap")
+    return E_MMap;
+  throw error("Unknown cache engine: " + name);
+}
+
+void FSCache::migrateToMMap()
+{
+  // Nothing to migrate from unless the SQLite cache exists
+  sqlite3 *db = 0;
+  if (SQLITE_OK != sqlite3_open_v2(m_fname.c_str(), &db,
+                                   SQLITE_OPEN_READONLY, 0)) {
+    sqlite3_close(db);
+    MTrace(t_cache, trace::Info, "No SQLite cache to migrate from");
+    return;
+  }
+  ON_BLOCK_EXIT(sqlite3_close, db);
+
+  sqlite3_stmt *pstmt = 0;
+  if (SQLITE_OK != sqlite3_prepare_v2(db, "SELECT dev, ino, ctime_s, ctime_ns,"
+                                      " mtime_s, mtime_ns, hash, treesize"
+                                      " FROM objs2;", -1, &pstmt, 0)) {
+    MTrace(t_cache, trace::Info, "SQLite cache has no objects to migrate: "
+           << sqlite3_errmsg(db));
+    sqlite3_finalize(pstmt);
+    return;
+  }
+  ON_BLOCK_EXIT(sqlite3_finalize, pstmt);
+
+  uint64_t count = 0;
+  int res;
+  while ((res = sqlite3_step(pstmt)) == SQLITE_ROW) {
+    CObject obj;
+    obj.m_id.device = sqlite3_column_int64(pstmt, 0);
+    obj.m_id.fileid = sqlite3_column_int64(pstmt, 1);
+#if defined(__unix__) || defined(__APPLE__)
+    obj.m_id.ctime_s = sqlite3_column_int64(pstmt, 2);
+    obj.m_id.ctime_ns = uint32_t(sqlite3_column_int(pstmt, 3));
+    obj.m_id.mtime_s = sqlite3_column_int64(pstmt, 4);
+    obj.m_id.mtime_ns = uint32_t(sqlite3_column_int(pstmt, 5));
+#endif
+    obj.m_hash = parseHashes(pstmt, 6);
+    obj.m_treesize = sqlite3_column_int64(pstmt, 7);
+    m_mmap->upsert(obj);
+    ++count;
+  }
+  if (res != SQLITE_DONE)
+    throw error(std::string("STEP migration: ") + sqlite3_errmsg(db));
+
+  m_mmap->sync();
+  MTrace(t_cache, trace::Info, "Migrated " << count
+         << " objects from SQLite cache");
+}
+
+void FSCache::clearCache()
+{
+  if (m_mmap) {
+    m_mmap->clear();
+    return;
+  }
+
+  { MutexLock l(m_pending_lock);
+    m_pending.clear();
+  }
+
   opendb();
+  MutexLock l(m_db_lock);
+  execute("DELETE FROM objs2;");
+  closedb();
+}
+
+void FSCache::changeCache()
+{
+  if (m_mmap) {
+    m_mmap->sync();
+    return;
+  }
+
+  MutexLock l(m_db_lock);
+  closedb();
+}
+
+void FSCache::opendb()
+{
+  MutexLock l(m_db_lock);
+  if (m_db)
+    return;
+
+  int res = sqlite3_open(m_fname.c_str(), &m_db);
+  if (res != SQLITE_OK)
+    throw error("Unable to open cache: " + m_fname);
 
   try {
+    if (SQLITE_OK != sqlite3_extended_result_codes(m_db, 1))
+      throw error("Unable to enable extended result codes in sqlite");
+
+    if (SQLITE_OK != sqlite3_busy_timeout(m_db, g_busy_timeout_ms))
+      throw error("Unable to set busy timeout on cache");
+
+    // WAL lets the readers work while we write. Losing the last
+    // writes on power loss is fine (see m_txn_start) so we only sync
+    // at checkpoints.
+    execute("PRAGMA journal_mode = WAL;");
+    execute("PRAGMA synchronous = NORMAL;");
+    execute(g_mmap_pragma);
+
     // Clean up old schema
   //  execute("DROP INDEX IF EXISTS objs_di_ndx;");
   //  execute("DROP TABLE IF EXISTS objs;");
@@ -84,106 +274,209 @@ FSCache::FSCache(const std::string &fname)
             ");");
     execute("CREATE UNIQUE INDEX IF NOT EXISTS objs2_di_ndx ON objs2 (dev,ino);");
 
+    // Note; because of inode re-use, we actually have a race like this:
+    //
+    // Thread 1:   Open file inode 1 - not found in db
+    // System:     delete file inode 1
+    // System:     create new file - re-use inode 1
+    // Thread 2:   Open file inode 1 - not found in db
+    // Thread 1:   Complete processing - insert inode 1 in database
+    // Thread 2:   Complete processing - insert inode 1 in database  <-- fail!
+    //
+    // It is of course impossible to know whether it is the first or the
+    // second thread that has the "most recent" data.  If we simply
+    // ignore the failure, two things can happen: Either we - by chance
+    // - retained the correct record - or, we stored information which
+    // will not match the retained file and therefore we will have to
+    // re-visit the file in the next backup run.
+    //
+    // In either case, OR IGNORE (or OR REPLACE) are correct solutions
+    // to the problem.
+    //
+    m_insert_stmt = prepare(m_db,
+                            "INSERT OR IGNORE INTO objs2 "
+                            "(dev, ino, ctime_s, ctime_ns, mtime_s, mtime_ns,"
+                            " hash, treesize) "
+                            "VALUES (?,?,?,?,?,?,?,?);");
+    m_update_stmt = prepare(m_db,
+                            "UPDATE objs2"
+                            " SET ctime_s = ?, ctime_ns = ?, mtime_s = ?,"
+                            "     mtime_ns = ?, hash = ?, treesize = ?"
+                            " WHERE id = ?;");
   } catch (error &) {
+    sqlite3_finalize(m_insert_stmt);
+    sqlite3_finalize(m_update_stmt);
+    m_insert_stmt = m_update_stmt = 0;
     sqlite3_close(m_db);
+    m_db = 0;
     throw;
   }
+}
 
-  quiesce();
+void FSCache::closedb()
+{
+  if (!m_db)
+    return;
+
+  // Write out whatever is buffered
+  flushLocked();
+
+  // Idle readers go now; leased readers are closed when returned
+  { MutexLock l(m_readers_lock);
+    ++m_generation;
+    for (std::list<reader_t>::const_iterator i = m_readers.begin();
+         i != m_readers.end(); ++i)
+      closeReader(*i);
+    m_readers.clear();
+  }
 
+  sqlite3_finalize(m_insert_stmt);
+  sqlite3_finalize(m_update_stmt);
+  m_insert_stmt = m_update_stmt = 0;
+  if (SQLITE_OK != sqlite3_close(m_db))
+    throw error("Unable to close database");
+  m_db = 0;
 }
 
-void FSCache::clearCache()
+void FSCache::quiesce()
 {
-    MutexLock l(m_db_lock);
-    if (!m_db)
-        return;
-    
-        std::cout << "delete bd" << std::endl;
-        char *zErr;
-        int res = sqlite3_open(m_fname.c_str(), &m_db);
-        res = sqlite3_exec(m_db, "delete from objs2", NULL, NULL, &zErr);
-        if( res != SQLITE_OK )
-        {
-            std::cout << "delete bd all is OK" << std::endl;
-            sqlite3_free( zErr );
-        }
-           
-    m_db = 0;
+  if (m_mmap) {
+    m_mmap->sync();
+    return;
+  }
+
+  MutexLock l(m_db_lock);
+  closedb();
 }
 
-void FSCache::changeCache()
+FSCache::~FSCache()
 {
+  delete m_mmap;
+
+  // Flush and close whatever we have, ignore failure - if we fail,
+  // well, there isn't really any meaningful recovery...
+  try {
     MutexLock l(m_db_lock);
-    if (!m_db)
-        return;
-    
-    execute("COMMIT TRANSACTION");
-    if (SQLITE_OK != sqlite3_close(m_db))
-        throw error("Unable to close database");
+    closedb();
+  } catch (...) { }
+
+  sqlite3_shutdown();
 }
 
-void FSCache::opendb()
+FSCache::reader_t FSCache::leaseReader()
 {
-  MutexLock l(m_db_lock);
-  if (m_db)
-    return;
+  { MutexLock l(m_readers_lock);
+    if (!m_readers.empty()) {
+      const reader_t r = m_readers.front();
+      m_readers.pop_front();
+      return r;
+    }
+  }
 
-  int res = sqlite3_open(m_fname.c_str(), &m_db);
-  if (res != SQLITE_OK)
-    throw error("Unable to open cache: " + m_fname);
+  // Make sure the schema exists before a reader looks at it
+  opendb();
+
+  reader_t r;
+  r.select_stmt = 0;
+  { MutexLock l(m_readers_lock);
+    r.generation = m_generation;
+  }
 
-  if (SQLITE_OK != sqlite3_extended_result_codes(m_db, 1))
-    throw error("Unable to enable extended result codes in sqlite");
+  // Each reader is only used by one thread at a time
+  int res = sqlite3_open_v2(m_fname.c_str(), &r.db,
+                            SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, 0);
+  if (res != SQLITE_OK) {
+    sqlite3_close(r.db);
+    throw error("Unable to open cache reader: " + m_fname);
+  }
 
-  // Start txn
-  execute("BEGIN TRANSACTION");
+  try {
+    if (SQLITE_OK != sqlite3_busy_timeout(r.db, g_busy_timeout_ms))
+      throw error("Unable to set busy timeout on cache reader");
+    exec(r.db, g_mmap_pragma);
+    r.select_stmt = prepare(r.db,
+                            "SELECT id, ctime_s, ctime_ns, mtime_s, mtime_ns,"
+                            " hash, treesize"
+                            " FROM objs2"
+                            " WHERE dev = ? AND ino = ?;");
+  } catch (error &) {
+    closeReader(r);
+    throw;
+  }
+
+  MTrace(t_cache, trace::Debug, "Opened cache reader connection");
+  return r;
 }
 
-void FSCache::quiesce()
+FSCache::readerlease_t::readerlease_t(FSCache &c, const reader_t &r)
+  : m_cache(c)
+  , m_reader(r)
 {
-  MutexLock l(m_db_lock);
-  if (!m_db)
-    return;
+}
 
-  execute("COMMIT TRANSACTION");
-  if (SQLITE_OK != sqlite3_close(m_db))
-    throw error("Unable to close database");
-  m_db = 0;
+FSCache::readerlease_t::~readerlease_t()
+{
+  m_cache.returnReader(m_reader);
 }
 
-FSCache::~FSCache()
+void FSCache::returnReader(const reader_t &r)
 {
-  if (!m_db)
+  MutexLock l(m_readers_lock);
+  if (r.generation != m_generation) {
+    closeReader(r);
     return;
-  // Commit whatever we have, ignore failure
-  try { execute("COMMIT TRANSACTION"); }
-  catch (...) { }
+  }
+  m_readers.push_back(r);
+}
 
-  // Close - if we fail, well, there isn't really any meaningful
-  // recovery...
-  sqlite3_close(m_db);
-  sqlite3_shutdown();
+void FSCache::closeReader(const reader_t &r)
+{
+  sqlite3_finalize(r.select_stmt);
+  sqlite3_close(r.db);
 }
 
 bool FSCache::readObj(const fsobjid_t &id, CObject &obj)
 {
-  opendb();
+  if (m_mmap)
+    return m_mmap->readObj(id, obj);
+
   // If we find it or not, update the id
   obj.m_id = id;
 
+  uint64_t ctime_s, mtime_s;
+  uint32_t ctime_ns, mtime_ns;
+
+  // Buffered writes are the most recent
+  bool buffered = false;
+  { MutexLock l(m_pending_lock);
+    const pending_t *p = 0;
+    pending_map_t::const_iterator i = m_pending.find(objKey(id));
+    if (i != m_pending.end()) {
+      p = &i->second;
+    } else {
+      i = m_flushing.find(objKey(id));
+      if (i != m_flushing.end())
+        p = &i->second;
+    }
+    if (p) {
+      buffered = true;
+      obj = p->obj;
+      if (!p->update)
+        obj.m_dbid = -1;
+      dbTimes(p->obj.m_id, ctime_s, ctime_ns, mtime_s, mtime_ns);
+      MTrace(t_cache, trace::Debug, "Located buffered object " << id);
+    }
+  }
+
   // Locate object
-  { std::ostringstream prep;
-    prep << "SELECT id, ctime_s, ctime_ns, mtime_s, mtime_ns, hash, treesize"
-         << " FROM objs2"
-         << " WHERE dev = " << id.device
-         << " AND ino = " << id.fileid
-         << ";";
-    sqlite3_stmt *pstmt = 0;
-    int pres = sqlite3_prepare_v2(m_db, prep.str().c_str(), -1, &pstmt, 0);
-    if (pres != SQLITE_OK)
-      throw error("PREP " + prep.str() + ": " + sqlite3_errmsg(m_db));
-    ON_BLOCK_EXIT(sqlite3_finalize, pstmt);
+  if (!buffered) {
+    const reader_t reader = leaseReader();
+    readerlease_t lease(*this, reader);
+    sqlite3_stmt *pstmt = reader.select_stmt;
+    ON_BLOCK_EXIT(sqlite3_reset, pstmt);
+
+    sqlite3_bind_int64(pstmt, 1, id.device);
+    sqlite3_bind_int64(pstmt, 2, id.fileid);
 
     int res = sqlite3_step(pstmt);
     if (res == SQLITE_DONE) {
@@ -194,18 +487,17 @@ bool FSCache::readObj(const fsobjid_t &id, CObject &obj)
       return false;
     }
     if (res != SQLITE_ROW)
-      throw error("STEP " + prep.str() + ": " + sqlite3_errmsg(m_db));
+      throw error(std::string("STEP lookup: ") + sqlite3_errmsg(reader.db));
 
     MTrace(t_cache, trace::Debug, "Located cached object " << id);
 
     // Fine, fetch columns
-    const int64_t db_id = obj.m_dbid = sqlite3_column_int64(pstmt, 0);
-    obj.m_id = id;
+    obj.m_dbid = sqlite3_column_int64(pstmt, 0);
 
-    const uint64_t ctime_s = sqlite3_column_int64(pstmt, 1);
-    const uint32_t ctime_ns = sqlite3_column_int(pstmt, 2);
-    const uint64_t mtime_s = sqlite3_column_int64(pstmt, 3);
-    const uint32_t mtime_ns = sqlite3_column_int(pstmt, 4);
+    ctime_s = sqlite3_column_int64(pstmt, 1);
+    ctime_ns = sqlite3_column_int(pstmt, 2);
+    mtime_s = sqlite3_column_int64(pstmt, 3);
+    mtime_ns = sqlite3_column_int(pstmt, 4);
 
     obj.m_hash = parseHashes(pstmt, 5);
     obj.m_treesize = sqlite3_column_int64(pstmt, 6);
@@ -226,36 +518,38 @@ bool FSCache::readObj(const fsobjid_t &id, CObject &obj)
         throw error(err.str());
       }
     }
+  }
+  obj.m_id = id;
+  const int64_t db_id = obj.m_dbid;
 
 #if defined(__unix__) || defined(__APPLE__)
-    // See if ctime matches. If it does not, report that we don't have the object
-    if (ctime_s != id.ctime_s || ctime_ns != id.ctime_ns
-        || mtime_s != id.mtime_s || mtime_ns != id.mtime_ns) {
-      MTrace(t_cache, trace::Debug, "Located outdated object - reporting not found");
-      obj = CObject();
-      obj.m_dbid = db_id;
-      obj.m_id = id;
-      return false;
-    }
+  // See if ctime matches. If it does not, report that we don't have the object
+  if (ctime_s != id.ctime_s || ctime_ns != id.ctime_ns
+      || mtime_s != id.mtime_s || mtime_ns != id.mtime_ns) {
+    MTrace(t_cache, trace::Debug, "Located outdated object - reporting not found");
+    obj = CObject();
+    obj.m_dbid = db_id;
+    obj.m_id = id;
+    return false;
+  }
 #endif
 
 #if defined(_WIN32)
-    // See if creation time and write time matches. If it does not,
-    // report that we don't have the object
-    if (ctime_s != id.creation_time.dwHighDateTime || ctime_ns != id.creation_time.dwLowDateTime
-	|| mtime_s != id.write_time.dwHighDateTime || mtime_ns != id.write_time.dwLowDateTime) {
-      MTrace(t_cache, trace::Debug, "Located outdated object - reporting not found: cs=("
-             << ctime_s << "," << id.creation_time.dwHighDateTime << ") cn=("
-             << ctime_ns << "," << id.creation_time.dwLowDateTime << ") ms=("
-             << mtime_s << "," << id.write_time.dwHighDateTime << ") mn=("
-             << mtime_ns << "," << id.write_time.dwLowDateTime << ")");
-      obj = CObject();
-      obj.m_dbid = db_id;
-      obj.m_id = id;
-      return false;
-    }
-#endif
+  // See if creation time and write time matches. If it does not,
+  // report that we don't have the object
+  if (ctime_s != id.creation_time.dwHighDateTime || ctime_ns != id.creation_time.dwLowDateTime
+      || mtime_s != id.write_time.dwHighDateTime || mtime_ns != id.write_time.dwLowDateTime) {
+    MTrace(t_cache, trace::Debug, "Located outdated object - reporting not found: cs=("
+           << ctime_s << "," << id.creation_time.dwHighDateTime << ") cn=("
+           << ctime_ns << "," << id.creation_time.dwLowDateTime << ") ms=("
+           << mtime_s << "," << id.write_time.dwHighDateTime << ") mn=("
+           << mtime_ns << "," << id.write_time.dwLowDateTime << ")");
+    obj = CObject();
+    obj.m_dbid = db_id;
+    obj.m_id = id;
+    return false;
   }
+#endif
 
   MTrace(t_cache, trace::Debug, " Times identical for object - reporting un-changed");
   return true;
@@ -263,153 +557,180 @@ bool FSCache::readObj(const fsobjid_t &id, CObject &obj)
 
 void FSCache::insert(const CObject &obj)
 {
-  opendb();
-  // Create the object
-  //
-  // Note; because of inode re-use, we actually have a race like this:
-  //
-  // Thread 1:   Open file inode 1 - not found in db
-  // System:     delete file inode 1
-  // System:     create new file - re-use inode 1
-  // Thread 2:   Open file inode 1 - not found in db
-  // Thread 1:   Complete processing - insert inode 1 in database
-  // Thread 2:   Complete processing - insert inode 1 in database  <-- fail!
-  //
-  // It is of course impossible to know whether it is the first or the
-  // second thread that has the "most recent" data.  If we simply
-  // ignore the failure, two things can happen: Either we - by chance
-  // - retained the correct record - or, we stored information which
-  // will not match the retained file and therefore we will have to
-  // re-visit the file in the next backup run.
-  //
-  // In either case, OR IGNORE (or OR REPLACE) are correct solutions
-  // to the problem.
-  //
-  { std::ostringstream prep;
-    prep << "INSERT OR IGNORE INTO objs2 "
-         << "(dev, ino, ctime_s, ctime_ns, mtime_s, mtime_ns, hash, treesize) "
-         << "VALUES (?,?,?,?,?,?,?,?);";
-    sqlite3_stmt *pstmt = 0;
-    int pres = sqlite3_prepare_v2(m_db, prep.str().c_str(), -1, &pstmt, 0);
-    if (pres != SQLITE_OK)
-      throw error("PREP " + prep.str() + ": " + sqlite3_errmsg(m_db));
-    ON_BLOCK_EXIT(sqlite3_finalize, pstmt);
+  if (m_mmap) {
+    m_mmap->upsert(obj);
+    return;
+  }
+
+  addPending(obj, false);
+  MTrace(t_cache, trace::Debug, "Added object " << obj.m_id << " to cache");
 
-    sqlite3_bind_int64(pstmt, 1, obj.m_id.device);
-    sqlite3_bind_int64(pstmt, 2, obj.m_id.fileid);
+  // Optionally flush
+  didUpdate();
+}
 
-#if defined(__unix__) || defined(__APPLE__)
-    sqlite3_bind_int64(pstmt, 3, obj.m_id.ctime_s);
-    sqlite3_bind_int(pstmt, 4, obj.m_id.ctime_ns);
-    sqlite3_bind_int64(pstmt, 5, obj.m_id.mtime_s);
-    sqlite3_bind_int(pstmt, 6, obj.m_id.mtime_ns);
-#endif
+void FSCache::update(const CObject &obj)
+{
+  if (m_mmap) {
+    m_mmap->upsert(obj);
+    return;
+  }
 
 #if defined(_WIN32)
-    sqlite3_bind_int64(pstmt, 3, obj.m_id.creation_time.dwHighDateTime);
-    sqlite3_bind_int(pstmt, 4, obj.m_id.creation_time.dwLowDateTime);
-    sqlite3_bind_int64(pstmt, 5, obj.m_id.write_time.dwHighDateTime);
-    sqlite3_bind_int(pstmt, 6, obj.m_id.write_time.dwLowDateTime);
+  MTrace(t_cache, trace::Debug, "Updated object " << obj.m_id << " in cache: cs=("
+         << obj.m_id.creation_time.dwHighDateTime << ") cn=("
+         << obj.m_id.creation_time.dwLowDateTime << ") ms=("
+         << obj.m_id.write_time.dwHighDateTime << ") mn=("
+         << obj.m_id.write_time.dwLowDateTime << ")");
 #endif
 
-    std::vector<uint8_t> blob;
-    for (objseq_t::const_iterator i = obj.m_hash.begin();
-         i != obj.m_hash.end(); ++i)
-      blob.insert(blob.end(), i->m_raw.begin(), i->m_raw.end());
+  addPending(obj, true);
 
-    sqlite3_bind_blob(pstmt, 7, (blob.empty() ? 0 : &blob[0]), int(blob.size()), SQLITE_TRANSIENT);
-    sqlite3_bind_int64(pstmt, 8, obj.m_treesize);
+  // Optionally flush
+  didUpdate();
+}
 
-    int res = sqlite3_step(pstmt);
-    if (res != SQLITE_DONE)
-      throw error("STEP " + prep.str() + ": " + sqlite3_errmsg(m_db));
+void FSCache::addPending(const CObject &obj, bool update)
+{
+  MutexLock l(m_pending_lock);
+  std::pair<pending_map_t::iterator,bool> ins
+    = m_pending.insert(std::make_pair(objKey(obj.m_id), pending_t()));
+  pending_t &p = ins.first->second;
+
+  // A later write to the same object replaces the buffered one. If
+  // either refers to an existing row, we must update that row.
+  if (ins.second || update || !p.update) {
+    p.update = update;
+    p.obj = obj;
+  } else {
+    const int64_t dbid = p.obj.m_dbid;
+    p.obj = obj;
+    p.obj.m_dbid = dbid;
   }
-
-  MTrace(t_cache, trace::Debug, "Added object " << obj.m_id << " to cache");
-
-  // Optionally commit
-  didUpdate();
 }
 
-void FSCache::update(const CObject &obj)
+void FSCache::flush()
 {
+  if (m_mmap) {
+    m_mmap->sync();
+    return;
+  }
+
   opendb();
-  // Update this object
-  { std::ostringstream prep;
-    prep << "UPDATE objs2"
-         << " SET ctime_s = ?, ctime_ns = ?, mtime_s = ?, mtime_ns = ?, "
-         << "     hash = ?, treesize = ?"
-         << " WHERE id = ?;";
+  MutexLock l(m_db_lock);
+  flushLocked();
+}
 
-    sqlite3_stmt *pstmt = 0;
-    int pres = sqlite3_prepare_v2(m_db, prep.str().c_str(), -1, &pstmt, 0);
-    if (pres != SQLITE_OK)
-      throw error("PREP " + prep.str() + ": " + sqlite3_errmsg(m_db));
-    ON_BLOCK_EXIT(sqlite3_finalize, pstmt);
+void FSCache::flushLocked()
+{
+  pending_map_t towrite;
+  { MutexLock pl(m_pending_lock);
+    towrite.swap(m_pending);
+    m_flushing = towrite;
+  }
+  ON_BLOCK_EXIT(&FSCache::doneFlushing, this);
 
-#if defined(__unix__) || defined(__APPLE__)
-    sqlite3_bind_int64(pstmt, 1, obj.m_id.ctime_s);
-    sqlite3_bind_int(pstmt, 2, obj.m_id.ctime_ns);
-    sqlite3_bind_int64(pstmt, 3, obj.m_id.mtime_s);
-    sqlite3_bind_int(pstmt, 4, obj.m_id.mtime_ns);
-#endif
+  try {
+    writePending(towrite);
+  } catch (error &) {
+    // Put the writes back unless they were superseded meanwhile
+    MutexLock pl(m_pending_lock);
+    m_pending.insert(towrite.begin(), towrite.end());
+    throw;
+  }
+  m_txn_start = Time::now();
+}
 
-#if defined(_WIN32)
-    sqlite3_bind_int64(pstmt, 1, obj.m_id.creation_time.dwHighDateTime);
-    sqlite3_bind_int(pstmt, 2, obj.m_id.creation_time.dwLowDateTime);
-    sqlite3_bind_int64(pstmt, 3, obj.m_id.write_time.dwHighDateTime);
-    sqlite3_bind_int(pstmt, 4, obj.m_id.write_time.dwLowDateTime);
-
-    MTrace(t_cache, trace::Debug, "Updated object " << obj.m_id << " in cache: cs=("
-           << obj.m_id.creation_time.dwHighDateTime << ") cn=("
-           << obj.m_id.creation_time.dwLowDateTime << ") ms=("
-           << obj.m_id.write_time.dwHighDateTime << ") mn=("
-           << obj.m_id.write_time.dwLowDateTime << ")");
-#endif
+void FSCache::doneFlushing()
+{
+  MutexLock l(m_pending_lock);
+  m_flushing.clear();
+}
 
-    std::vector<uint8_t> blob;
-    for (objseq_t::const_iterator i = obj.m_hash.begin();
-         i != obj.m_hash.end(); ++i)
-      blob.insert(blob.end(), i->m_raw.begin(), i->m_raw.end());
+void FSCache::writePending(const pending_map_t &towrite)
+{
+  if (towrite.empty())
+    return;
 
-    sqlite3_bind_blob(pstmt, 5, (blob.empty() ? 0 : &blob[0]), int(blob.size()), SQLITE_TRANSIENT);
-    sqlite3_bind_int64(pstmt, 6, obj.m_treesize);
-    sqlite3_bind_int64(pstmt, 7, obj.m_dbid);
+  execute("BEGIN TRANSACTION");
+  try {
+    for (pending_map_t::const_iterator i = towrite.begin();
+         i != towrite.end(); ++i) {
+      const CObject &obj = i->second.obj;
+
+      uint64_t ctime_s, mtime_s;
+      uint32_t ctime_ns, mtime_ns;
+      dbTimes(obj.m_id, ctime_s, ctime_ns, mtime_s, mtime_ns);
+
+      std::vector<uint8_t> blob;
+      blob.reserve(obj.m_hash.size() * sha256::size);
+      for (objseq_t::const_iterator h = obj.m_hash.begin();
+           h != obj.m_hash.end(); ++h)
+        blob.insert(blob.end(), h->m_raw, h->m_raw + sha256::size);
+
+      sqlite3_stmt *pstmt;
+      if (i->second.update) {
+        pstmt = m_update_stmt;
+        sqlite3_bind_int64(pstmt, 1, ctime_s);
+        sqlite3_bind_int(pstmt, 2, ctime_ns);
+        sqlite3_bind_int64(pstmt, 3, mtime_s);
+        sqlite3_bind_int(pstmt, 4, mtime_ns);
+        sqlite3_bind_blob(pstmt, 5, (blob.empty() ? 0 : &blob[0]),
+                          int(blob.size()), SQLITE_TRANSIENT);
+        sqlite3_bind_int64(pstmt, 6, obj.m_treesize);
+        sqlite3_bind_int64(pstmt, 7, obj.m_dbid);
+      } else {
+        pstmt = m_insert_stmt;
+        sqlite3_bind_int64(pstmt, 1, obj.m_id.device);
+        sqlite3_bind_int64(pstmt, 2, obj.m_id.fileid);
+        sqlite3_bind_int64(pstmt, 3, ctime_s);
+        sqlite3_bind_int(pstmt, 4, ctime_ns);
+        sqlite3_bind_int64(pstmt, 5, mtime_s);
+        sqlite3_bind_int(pstmt, 6, mtime_ns);
+        sqlite3_bind_blob(pstmt, 7, (blob.empty() ? 0 : &blob[0]),
+                          int(blob.size()), SQLITE_TRANSIENT);
+        sqlite3_bind_int64(pstmt, 8, obj.m_treesize);
+      }
 
-    int res = sqlite3_step(pstmt);
-    if (res != SQLITE_DONE)
-      throw error("STEP " + prep.str() + ": " + sqlite3_errmsg(m_db));
+      int res = sqlite3_step(pstmt);
+      sqlite3_reset(pstmt);
+      if (res != SQLITE_DONE)
+        throw error(std::string(i->second.update ? "STEP update: "
+                                : "STEP insert: ")
+                    + sqlite3_errmsg(m_db));
+    }
+    execute("COMMIT TRANSACTION");
+  } catch (error &) {
+    try { execute("ROLLBACK TRANSACTION"); }
+    catch (error &) { }
+    throw;
   }
 
-  // Optionally commit the txn
-  didUpdate();
+  MTrace(t_cache, trace::Debug, "Flushed " << towrite.size()
+         << " cache writes");
 }
 
 void FSCache::execute(const std::string &stmt)
 {
-  sqlite3_stmt *pstmt = 0;
-  int pres = sqlite3_prepare_v2(m_db, stmt.c_str(), -1, &pstmt, 0);
-  if (pres != SQLITE_OK)
-    throw error("PREP " + stmt + ": " + sqlite3_errmsg(m_db));
-  ON_BLOCK_EXIT(sqlite3_finalize, pstmt);
-
-  int res = sqlite3_step(pstmt);
-  if (res != SQLITE_DONE)
-      throw error("STEP " + stmt + ": " + sqlite3_errmsg(m_db));
+  exec(m_db, stmt);
 }
 
 void FSCache::didUpdate()
 {
-  MutexLock l(m_db_lock);
-  if (m_txn_start + g_txn_grp_period < Time::now()) {
-    execute("COMMIT TRANSACTION");
-    execute("BEGIN TRANSACTION");
-    // We take 'now' again, because the commit above may have taken a
-    // long time and we really want to guarantee g_txn_grp_period of
-    // no commits to prevent excessive load on the system we are
-    // running on.
-    m_txn_start = Time::now();
+  bool doflush;
+  { MutexLock l(m_pending_lock);
+    doflush = m_pending.size() >= g_flush_batch;
+  }
+  // We take 'now' again after flushing, because the flush may have
+  // taken a long time and we really want to guarantee
+  // g_txn_grp_period of no commits to prevent excessive load on the
+  // system we are running on.
+  if (!doflush) {
+    MutexLock l(m_db_lock);
+    doflush = m_txn_start + g_txn_grp_period < Time::now();
   }
+  if (doflush)
+    flush();
 }
 
 
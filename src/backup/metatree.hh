@@ -10,6 +10,7 @@
 
 #include <vector>
 #include <list>
+#include <map>
 #include <string>
 #include <stdint.h>
 #include "sqlite/sqlite3.h"
@@ -184,16 +185,34 @@ public:
 
 
 
+class MMapCache;
+
 ///
 /// Our cache
 ///
+/// The default engine keeps the cache in SQLite. Writes are buffered
+/// in memory and flushed to the database in batched transactions.
+/// The database runs in WAL mode so that lookups can proceed on
+/// reader connections (one per concurrently reading thread) while the
+/// writer connection flushes.
+///
+/// The MMap engine keeps the cache in a memory mapped hash table
+/// instead (see mmapcache.hh); it is filled from the SQLite cache the
+/// first time it is used.
+///
 class FSCache {
 public:
+  /// Cache storage engines
+  enum engine_t { E_SQLite, E_MMap };
+
   /// Initialise
-  FSCache(const std::string &fname);
+  FSCache(const std::string &fname, engine_t engine = E_SQLite);
   /// Shutdown
   ~FSCache();
 
+  /// The file name we were given
+  const std::string &fileName() const { return m_fname; }
+
   /// Locate object in cache. If found, fill in argument object and
   /// return true. Otherwise return false. On false return, obj will
   /// be default-initialised and the m_id field of the obj will be set
@@ -206,6 +225,8 @@ public:
   /// outdated. So, the decision to use insert or update should be
   /// made based on whether m_dbid is -1, not whether readObj returns
   /// true or false.
+  //
+  /// Writes that are still buffered are visible to readObj.
   bool readObj(const fsobjid_t &id, CObject &obj);
 
   /// Insert object in cache - does not use m_dbid
@@ -215,16 +236,24 @@ public:
   /// constant and updates mtime/ctime/hash
   void update(const CObject &obj);
 
+  /// Write all buffered inserts and updates to the database
+  void flush();
+
   /// When we complete a sequence of operations on the database (for
   /// example, we complete a backup), then we can issue this call
-  /// which will commit the currently open transaction and close the
-  /// database. The database will then automatically be re-opened as
-  /// soon as it is needed by any of the read/insert/update methods.
+  /// which will flush buffered writes and close the database. The
+  /// database will then automatically be re-opened as soon as it is
+  /// needed by any of the read/insert/update methods.
   void quiesce();
     
     void changeCache();
     void clearCache();
 
+  /// Parse an engine name ("sqlite" or "mmap")
+  //
+  /// \throws error on unknown names
+  static engine_t parseEngine(const std::string &);
+
 private:
   /// Protect against copying
   FSCache(const FSCache &);
@@ -233,29 +262,107 @@ private:
   /// Our database file name
   const std::string m_fname;
 
-  /// Our db handle
+  /// The memory mapped engine, if we use it
+  MMapCache *m_mmap;
+
+  /// Fill the memory mapped engine from the SQLite cache
+  void migrateToMMap();
+
+  /// Our writer db handle
   sqlite3 *m_db;
 
-  /// We group transactions to not commit on every insert. After all,
-  /// if we lose some changes to our cache due to
+  /// Prepared statements on the writer connection; they live as long
+  /// as the connection
+  sqlite3_stmt *m_insert_stmt;
+  sqlite3_stmt *m_update_stmt;
+
+  /// We group writes to not commit on every insert. After all, if we
+  /// lose some changes to our cache due to
   /// crash/power-loss/whatever, it will only mean that we inspect a
   /// couple of extra files on our next run. No data is lost and no
   /// harm done.
   //
-  /// So, this time stamp holds the current transaction start time
+  /// So, this time stamp holds the time of the last flush
   Time m_txn_start;
 
-  /// Our mutex to protect access to the underlying db.
+  /// Our mutex to protect access to the writer connection.
   Mutex m_db_lock;
 
+  /// A buffered write
+  struct pending_t {
+    /// True if this must UPDATE the row with obj.m_dbid; false for
+    /// an INSERT
+    bool update;
+    CObject obj;
+  };
+  /// Buffered writes are keyed by device and file id
+  typedef std::map<std::pair<uint64_t,uint64_t>,pending_t> pending_map_t;
+
+  /// Protects m_pending and m_flushing
+  Mutex m_pending_lock;
+  /// Writes not yet handed to the database
+  pending_map_t m_pending;
+  /// Writes being flushed right now; readers must still see them
+  /// until the flush commits
+  pending_map_t m_flushing;
+
+  /// Buffer a write
+  void addPending(const CObject &obj, bool update);
+
+  /// A reader connection with its own prepared lookup statement
+  struct reader_t {
+    sqlite3 *db;
+    sqlite3_stmt *select_stmt;
+    /// The m_generation the connection was opened in
+    unsigned generation;
+  };
+
+  /// Protects m_readers and m_generation
+  Mutex m_readers_lock;
+  /// Idle reader connections
+  std::list<reader_t> m_readers;
+  /// Bumped whenever the database is closed, so that readers leased
+  /// before the close are not returned to the pool
+  unsigned m_generation;
+
+  /// Get an idle reader connection, or open a new one
+  reader_t leaseReader();
+  /// Hand a reader connection back to the pool
+  void returnReader(const reader_t &);
+  /// Returns a leased reader connection when going out of scope
+  class readerlease_t {
+  public:
+    readerlease_t(FSCache &, const reader_t &);
+    ~readerlease_t();
+  private:
+    FSCache &m_cache;
+    const reader_t m_reader;
+  };
+  /// Close a reader connection
+  static void closeReader(const reader_t &);
+
   /// Open database if not open already
   void opendb();
 
+  /// Flush and close the writer and all idle readers. Must hold
+  /// m_db_lock.
+  void closedb();
+
+  /// Flush buffered writes. Must hold m_db_lock.
+  void flushLocked();
+
+  /// Forget the writes of a finished (or failed) flush
+  void doneFlushing();
+
+  /// Write out the given buffered writes in one transaction. Must
+  /// hold m_db_lock.
+  void writePending(const pending_map_t &);
+
   /// Execute a statement
   void execute(const std::string &stmt);
 
-  /// Call this method to optionally (if the txn time has been
-  /// reached) commit the current transaction and start a new
+  /// Call this method to optionally (if enough writes are buffered or
+  /// the flush period has passed) flush the buffered writes
   void didUpdate();
 };
 
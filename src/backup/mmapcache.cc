@@ -0,0 +1,775 @@
+//
+// Implementation of the memory mapped file system object cache
+//
+
+#include "mmapcache.hh"
+#include "metatree.hh"
+
+#include "common/error.hh"
+#include "common/trace.hh"
+
+#include <fstream>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sched.h>
+# include <errno.h>
+#endif
+
+namespace {
+  //! Tracer for the memory mapped cache
+  trace::Path t_mcache("/cache/mmap");
+
+  const char g_magic[8] = { 'K', 'O', 'S', 'F', 'S', 'C', 'M', 'M' };
+  const uint32_t g_version = 1;
+
+  //! The index file starts with one page of header
+  const size_t g_header_size = 4096;
+
+  //! A fresh index holds this many slots
+  const uint64_t g_initial_slots = uint64_t(1) << 20;
+
+  //! We grow the index when it is three quarters full
+  inline bool overloaded(uint64_t count, uint64_t nslots)
+  {
+    return count * 4 > nslots * 3;
+  }
+
+  //! Address space reserved for the arena (in bytes); the arena file
+  //! grows within this
+  const uint64_t g_arena_reserve = uint64_t(1) << 38;
+
+  //! The arena file grows in steps of this
+  const uint64_t g_arena_step = 64 * 1024 * 1024;
+
+  //! We compact the arena on open when dead sequences exceed the
+  //! live ones by this many hashes
+  const uint64_t g_compact_slack = 1024 * 1024;
+
+  //! Number of writer lock stripes
+  const size_t g_nstripes = 256;
+
+  //! How many times we yield to a writer changing a record before we
+  //! give up on it; a record left half written by a crashed process
+  //! must not hang us
+  const unsigned g_max_waits = 10000;
+
+  //! Spread (dev, ino) over the table
+  inline uint64_t keyHash(uint64_t dev, uint64_t ino)
+  {
+    uint64_t x = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+  }
+
+  inline size_t stripeOf(uint64_t hash)
+  {
+    return size_t(hash >> 40) % g_nstripes;
+  }
+
+  //! Counts a reader in for as long as it exists, holding off while
+  //! the cache is being cleared
+  class ReaderLease {
+  public:
+    ReaderLease(volatile uint32_t &readers, volatile uint32_t &clearing)
+      : m_readers(readers) {
+      while (true) {
+        __sync_fetch_and_add(&m_readers, 1);
+        if (!clearing)
+          return;
+        __sync_fetch_and_sub(&m_readers, 1);
+        while (clearing)
+          sched_yield();
+      }
+    }
+    ~ReaderLease() { __sync_fetch_and_sub(&m_readers, 1); }
+  private:
+    volatile uint32_t &m_readers;
+  };
+
+  //! The boot id lets us tell a crashed process (page cache intact)
+  //! from a crashed system (page cache lost) on next open
+  std::string bootId()
+  {
+#if defined(__linux__)
+    std::ifstream f("/proc/sys/kernel/random/boot_id");
+    std::string id;
+    if (f >> id)
+      return id;
+#endif
+    return std::string();
+  }
+}
+
+struct MMapCache::header_t {
+  char magic[8];
+  uint32_t version;
+  /// Set when everything was synced and no writes happened since
+  volatile uint32_t clean;
+  uint64_t nslots;
+  /// Number of used slots
+  volatile uint64_t count;
+  /// Hashes allocated in the arena
+  volatile uint64_t arena_used;
+  /// Hashes referenced from records
+  volatile uint64_t arena_live;
+  /// Boot id of the system that last wrote the cache
+  char boot_id[48];
+};
+
+struct MMapCache::record_t {
+  /// Zero for an empty slot, odd while a writer changes the record
+  volatile uint32_t seq;
+  /// Number of hashes in the sequence
+  uint32_t nhash;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t ctime_s;
+  uint64_t mtime_s;
+  uint32_t ctime_ns;
+  uint32_t mtime_ns;
+  uint64_t treesize;
+  /// Offset (in hashes) of the sequence in the arena
+  uint64_t arena_off;
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+
+MMapCache::MMapCache(const std::string &fname)
+  : m_fname(fname)
+  , m_table(0)
+  , m_idx_fd(-1)
+  , m_arena_fd(-1)
+  , m_arena(0)
+  , m_arena_filesize(0)
+  , m_stripes(g_nstripes)
+  , m_readers(0)
+  , m_clearing(0)
+{
+  if (sizeof(void*) < 8)
+    throw error("Memory mapped cache requires a 64-bit build");
+  if (sizeof(record_t) != 64 || sizeof(header_t) > g_header_size)
+    throw error("Memory mapped cache record layout mismatch");
+
+  const std::string boot(bootId());
+
+  m_idx_fd = open((m_fname + ".idx").c_str(), O_RDWR | O_CREAT, 0600);
+  if (m_idx_fd == -1)
+    throw syserror("open", "opening cache index " + m_fname + ".idx");
+  m_arena_fd = open((m_fname + ".arena").c_str(), O_RDWR | O_CREAT, 0600);
+  if (m_arena_fd == -1) {
+    close(m_idx_fd);
+    throw syserror("open", "opening cache arena " + m_fname + ".arena");
+  }
+
+  try {
+    struct stat st;
+    if (fstat(m_idx_fd, &st))
+      throw syserror("fstat", "examining cache index");
+
+    // See if we can trust what is there
+    bool fresh = true;
+    bool scrubbed = false;
+    table_t *t = 0;
+    if (st.st_size >= off_t(g_header_size)) {
+      try {
+        t = mapTable(m_idx_fd);
+      } catch (error &e) {
+        MTrace(t_mcache, trace::Warn, e.toString() << " - starting over");
+      }
+    }
+    if (t) {
+      const header_t &h = *t->hdr;
+      if (memcmp(h.magic, g_magic, sizeof g_magic) || h.version != g_version) {
+        MTrace(t_mcache, trace::Warn, "Cache index has unknown format"
+               " - starting over");
+      } else if (!h.clean
+                 && (boot.empty()
+                     || strncmp(h.boot_id, boot.c_str(), sizeof h.boot_id))) {
+        MTrace(t_mcache, trace::Warn, "Cache was not closed cleanly before"
+               " a system restart - starting over");
+      } else {
+        fresh = false;
+        m_table = t;
+        if (!h.clean)
+          scrubbed = scrub();
+      }
+      if (fresh)
+        unmapTable(t);
+    }
+
+    if (fresh) {
+      if (ftruncate(m_arena_fd, 0))
+        throw syserror("ftruncate", "clearing cache arena");
+      initTable(m_idx_fd, g_initial_slots);
+      m_table = mapTable(m_idx_fd);
+    }
+
+    // Reserve the arena address space
+    if (fstat(m_arena_fd, &st))
+      throw syserror("fstat", "examining cache arena");
+    m_arena_filesize = st.st_size;
+    void *a = mmap(0, g_arena_reserve, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   m_arena_fd, 0);
+    if (a == MAP_FAILED)
+      throw syserror("mmap", "mapping cache arena");
+    m_arena = static_cast<uint8_t*>(a);
+    growArena(m_table->hdr->arena_used * sha256::size);
+
+    // We are writing from now on
+    header_t &h = *m_table->hdr;
+    h.clean = 0;
+    memset(h.boot_id, 0, sizeof h.boot_id);
+    strncpy(h.boot_id, boot.c_str(), sizeof h.boot_id - 1);
+    if (msync(m_table->map, g_header_size, MS_SYNC))
+      throw syserror("msync", "writing cache header");
+
+    // Housekeeping while nobody else uses us. Dropped records leave
+    // holes in the probe sequences, so after a scrub we must rebuild.
+    if (overloaded(h.count, h.nslots)) {
+      rebuild(h.nslots * 2, true);
+    } else if (scrubbed || h.arena_used > 2 * h.arena_live + g_compact_slack) {
+      rebuild(h.nslots, true);
+    }
+  } catch (...) {
+    if (m_table)
+      unmapTable(m_table);
+    if (m_arena)
+      munmap(m_arena, g_arena_reserve);
+    close(m_idx_fd);
+    close(m_arena_fd);
+    throw;
+  }
+
+  MTrace(t_mcache, trace::Info, "Opened cache " << m_fname << " with "
+         << m_table->hdr->count << " objects in "
+         << m_table->hdr->nslots << " slots");
+}
+
+MMapCache::~MMapCache()
+{
+  try { sync(); }
+  catch (error &e) {
+    MTrace(t_mcache, trace::Warn, "Failed to sync cache on close: "
+           << e.toString());
+  }
+  unmapTable(m_table);
+  for (std::list<table_t*>::iterator i = m_retired.begin();
+       i != m_retired.end(); ++i)
+    unmapTable(*i);
+  munmap(m_arena, g_arena_reserve);
+  close(m_idx_fd);
+  close(m_arena_fd);
+}
+
+bool MMapCache::exists(const std::string &fname)
+{
+  struct stat st;
+  return !stat((fname + ".idx").c_str(), &st);
+}
+
+MMapCache::table_t *MMapCache::mapTable(int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st))
+    throw syserror("fstat", "examining cache index");
+  void *m = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED)
+    throw syserror("mmap", "mapping cache index");
+
+  table_t *t = new table_t;
+  t->map = m;
+  t->len = st.st_size;
+  t->hdr = static_cast<header_t*>(m);
+  t->slots = reinterpret_cast<record_t*>(static_cast<uint8_t*>(m)
+                                         + g_header_size);
+  t->mask = t->hdr->nslots - 1;
+
+  // Refuse an index whose size does not match its header
+  const uint64_t n = t->hdr->nslots;
+  if (!n || (n & (n - 1))
+      || t->len != g_header_size + n * sizeof(record_t)) {
+    unmapTable(t);
+    throw error("Cache index size does not match its header");
+  }
+  return t;
+}
+
+bool MMapCache::scrub()
+{
+  // The process that wrote the cache crashed, but the system did not,
+  // so everything it wrote is there - except for records it was
+  // writing at the time, which are left with an odd sequence
+  // number. We drop those, and any that refer past the arena.
+  header_t &h = *m_table->hdr;
+  uint64_t dropped = 0;
+  for (uint64_t i = 0; i <= m_table->mask; ++i) {
+    record_t &r = m_table->slots[i];
+    if (!r.seq)
+      continue;
+    if ((r.seq & 1) || r.arena_off + r.nhash > h.arena_used) {
+      memset(&r, 0, sizeof r);
+      ++dropped;
+    }
+  }
+  if (dropped)
+    MTrace(t_mcache, trace::Warn, "Cache was not closed cleanly - dropped "
+           << dropped << " records that were being written");
+  return dropped;
+}
+
+void MMapCache::unmapTable(table_t *t)
+{
+  munmap(t->map, t->len);
+  delete t;
+}
+
+void MMapCache::initTable(int fd, uint64_t nslots)
+{
+  // Zero-filled (and sparse) - a zero seq means an empty slot
+  if (ftruncate(fd, 0)
+      || ftruncate(fd, g_header_size + nslots * sizeof(record_t)))
+    throw syserror("ftruncate", "sizing cache index");
+
+  header_t h;
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, g_magic, sizeof g_magic);
+  h.version = g_version;
+  h.nslots = nslots;
+  if (pwrite(fd, &h, sizeof h, 0) != ssize_t(sizeof h))
+    throw syserror("pwrite", "writing cache header");
+}
+
+void MMapCache::growArena(uint64_t bytes)
+{
+  if (bytes <= m_arena_filesize)
+    return;
+  MutexLock l(m_arena_lock);
+  if (bytes <= m_arena_filesize)
+    return;
+  const uint64_t newsize = (bytes + g_arena_step - 1) / g_arena_step
+    * g_arena_step;
+  if (ftruncate(m_arena_fd, newsize))
+    throw syserror("ftruncate", "growing cache arena");
+  m_arena_filesize = newsize;
+}
+
+bool MMapCache::readObj(const fsobjid_t &id, CObject &obj)
+{
+  obj = CObject();
+  obj.m_id = id;
+
+  ReaderLease lease(m_readers, m_clearing);
+  const table_t *t = m_table;
+  unsigned waits = 0;
+  const uint64_t hash = keyHash(id.device, id.fileid);
+
+  for (uint64_t probe = 0; probe <= t->mask; ++probe) {
+    const uint64_t slot = (hash + probe) & t->mask;
+    const record_t &r = t->slots[slot];
+
+    while (true) {
+      const uint32_t s1 = r.seq;
+      __sync_synchronize();
+      if (!s1) {
+        MTrace(t_mcache, trace::Debug, "Cache did not contain "
+               << id.device << "," << id.fileid);
+        return false;
+      }
+      if (s1 & 1) {
+        if (++waits > g_max_waits) {
+          MTrace(t_mcache, trace::Warn, "Cache record " << slot
+                 << " stays locked - reporting not found");
+          return false;
+        }
+        sched_yield();
+        continue;
+      }
+
+      const uint64_t dev = r.dev;
+      const uint64_t ino = r.ino;
+      if (dev != uint64_t(id.device) || ino != uint64_t(id.fileid)) {
+        __sync_synchronize();
+        if (r.seq != s1 && ++waits <= g_max_waits)
+          continue;
+        break; // next slot
+      }
+
+      const uint64_t ctime_s = r.ctime_s;
+      const uint64_t mtime_s = r.mtime_s;
+      const uint32_t ctime_ns = r.ctime_ns;
+      const uint32_t mtime_ns = r.mtime_ns;
+      const uint64_t treesize = r.treesize;
+      const uint64_t off = r.arena_off;
+      const uint32_t nhash = r.nhash;
+
+      // The arena is append-only so the sequence stays put even if
+      // the record moves on
+      objseq_t hashes;
+      if (off + nhash <= t->hdr->arena_used) {
+        hashes.resize(nhash);
+        for (uint32_t i = 0; i != nhash; ++i)
+          hashes[i] = sha256::parseRaw(m_arena + (off + i) * sha256::size);
+      }
+      __sync_synchronize();
+      if (r.seq != s1) {
+        if (++waits > g_max_waits)
+          return false;
+        continue;
+      }
+      if (hashes.size() != nhash)
+        throw error("Cache record refers outside arena");
+
+      obj.m_dbid = int64_t(slot) + 1;
+      if (ctime_s != id.ctime_s || ctime_ns != id.ctime_ns
+          || mtime_s != id.mtime_s || mtime_ns != id.mtime_ns) {
+        MTrace(t_mcache, trace::Debug, "Located outdated object"
+               " - reporting not found");
+        return false;
+      }
+      obj.m_hash.swap(hashes);
+      obj.m_treesize = treesize;
+      return true;
+    }
+  }
+  return false;
+}
+
+void MMapCache::upsert(const CObject &obj)
+{
+  const uint64_t hash = keyHash(obj.m_id.device, obj.m_id.fileid);
+  const uint32_t nhash = uint32_t(obj.m_hash.size());
+
+  { MutexLock l(m_stripes[stripeOf(hash)]);
+    table_t *t = m_table;
+    header_t &h = *t->hdr;
+
+    // Nothing may be written while the header says clean
+    if (h.clean) {
+      MutexLock al(m_arena_lock);
+      if (h.clean) {
+        h.clean = 0;
+        if (msync(t->map, g_header_size, MS_SYNC))
+          throw syserror("msync", "writing cache header");
+      }
+    }
+
+    // Store the hash sequence first; it is not visible until a
+    // record refers to it
+    const uint64_t off = __sync_fetch_and_add(&h.arena_used, uint64_t(nhash));
+    if ((off + nhash) * sha256::size > g_arena_reserve) {
+      MTrace(t_mcache, trace::Warn, "Cache arena full - not caching object");
+      return;
+    }
+    growArena((off + nhash) * sha256::size);
+    for (uint32_t i = 0; i != nhash; ++i)
+      memcpy(m_arena + (off + i) * sha256::size, obj.m_hash[i].m_raw,
+             sha256::size);
+
+    for (uint64_t probe = 0; probe <= t->mask; ++probe) {
+      record_t &r = t->slots[(hash + probe) & t->mask];
+
+      uint32_t s = r.seq;
+      // Claim an empty slot; another key may race us for it
+      while (!s && !__sync_bool_compare_and_swap(&r.seq, 0, 1))
+        s = r.seq;
+
+      if (!s) {
+        s = 1;
+        r.dev = obj.m_id.device;
+        r.ino = obj.m_id.fileid;
+        __sync_fetch_and_add(&h.count, uint64_t(1));
+      } else {
+        for (unsigned waits = 0; s & 1; ++waits) {
+          // A new key is being written into this slot
+          if (waits == g_max_waits) {
+            MTrace(t_mcache, trace::Warn, "Cache record stays locked"
+                   " - not caching object");
+            return;
+          }
+          sched_yield();
+          s = r.seq;
+        }
+        if (r.dev != uint64_t(obj.m_id.device)
+            || r.ino != uint64_t(obj.m_id.fileid))
+          continue;
+        // Only holders of our stripe write records of our key
+        r.seq = ++s;
+        __sync_synchronize();
+        __sync_fetch_and_sub(&h.arena_live, uint64_t(r.nhash));
+      }
+
+      r.ctime_s = obj.m_id.ctime_s;
+      r.ctime_ns = uint32_t(obj.m_id.ctime_ns);
+      r.mtime_s = obj.m_id.mtime_s;
+      r.mtime_ns = uint32_t(obj.m_id.mtime_ns);
+      r.treesize = obj.m_treesize;
+      r.arena_off = off;
+      r.nhash = nhash;
+      __sync_fetch_and_add(&h.arena_live, uint64_t(nhash));
+      __sync_synchronize();
+      r.seq = s + 1;
+      break;
+    }
+  }
+
+  maybeGrow();
+}
+
+void MMapCache::lockAll()
+{
+  for (size_t i = 0; i != m_stripes.size(); ++i)
+    m_stripes[i].ll_lock();
+}
+
+void MMapCache::unlockAll()
+{
+  for (size_t i = m_stripes.size(); i; --i)
+    m_stripes[i - 1].ll_unlock();
+}
+
+void MMapCache::maybeGrow()
+{
+  { const header_t &h = *m_table->hdr;
+    if (!overloaded(h.count, h.nslots))
+      return;
+  }
+  lockAll();
+  try {
+    const header_t &h = *m_table->hdr;
+    if (overloaded(h.count, h.nslots))
+      rebuild(h.nslots * 2, false);
+  } catch (...) {
+    unlockAll();
+    throw;
+  }
+  unlockAll();
+}
+
+void MMapCache::rebuild(uint64_t nslots, bool compact_arena)
+{
+  const table_t *old = m_table;
+  const header_t &oh = *old->hdr;
+
+  MTrace(t_mcache, trace::Info, "Rebuilding cache index with " << nslots
+         << " slots" << (compact_arena ? ", compacting arena" : ""));
+
+  const std::string idxname(m_fname + ".idx");
+  const std::string arenaname(m_fname + ".arena");
+
+  int fd = open((idxname + ".new").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1)
+    throw syserror("open", "creating new cache index");
+  int afd = -1;
+  table_t *t = 0;
+  try {
+    initTable(fd, nslots);
+    t = mapTable(fd);
+    header_t &h = *t->hdr;
+    memcpy(h.boot_id, oh.boot_id, sizeof h.boot_id);
+
+    if (compact_arena) {
+      afd = open((arenaname + ".new").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+      if (afd == -1)
+        throw syserror("open", "creating new cache arena");
+    }
+
+    uint64_t used = 0;
+    std::vector<uint8_t> buf;
+    for (uint64_t i = 0; i <= old->mask; ++i) {
+      const record_t &r = old->slots[i];
+      if (!r.seq)
+        continue;
+
+      const uint64_t hash = keyHash(r.dev, r.ino);
+      uint64_t probe = 0;
+      while (t->slots[(hash + probe) & t->mask].seq)
+        ++probe;
+      record_t &n = t->slots[(hash + probe) & t->mask];
+      n = r;
+      n.seq = 2;
+
+      if (compact_arena) {
+        if (r.arena_off + r.nhash > oh.arena_used)
+          throw error("Cache record refers outside arena");
+        const size_t bytes = size_t(r.nhash) * sha256::size;
+        buf.assign(m_arena + r.arena_off * sha256::size,
+                   m_arena + r.arena_off * sha256::size + bytes);
+        if (bytes && pwrite(afd, &buf[0], bytes, used * sha256::size)
+            != ssize_t(bytes))
+          throw syserror("pwrite", "writing new cache arena");
+        n.arena_off = used;
+        used += r.nhash;
+      }
+      ++h.count;
+      h.arena_live += r.nhash;
+    }
+    h.arena_used = compact_arena ? used : uint64_t(oh.arena_used);
+
+    if (msync(t->map, t->len, MS_SYNC))
+      throw syserror("msync", "writing new cache index");
+    if (compact_arena) {
+      if (fsync(afd))
+        throw syserror("fsync", "writing new cache arena");
+      if (rename((arenaname + ".new").c_str(), arenaname.c_str()))
+        throw syserror("rename", "replacing cache arena");
+    }
+    if (rename((idxname + ".new").c_str(), idxname.c_str()))
+      throw syserror("rename", "replacing cache index");
+  } catch (...) {
+    if (t)
+      unmapTable(t);
+    close(fd);
+    if (afd != -1)
+      close(afd);
+    throw;
+  }
+
+  // Switch over. Readers may still be looking at the old index (and
+  // arena, when compacting during open there are no readers).
+  if (compact_arena) {
+    close(m_arena_fd);
+    m_arena_fd = afd;
+    munmap(m_arena, g_arena_reserve);
+    m_arena_filesize = 0;
+    void *a = mmap(0, g_arena_reserve, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   m_arena_fd, 0);
+    if (a == MAP_FAILED)
+      throw syserror("mmap", "mapping cache arena");
+    m_arena = static_cast<uint8_t*>(a);
+    struct stat st;
+    if (fstat(m_arena_fd, &st))
+      throw syserror("fstat", "examining cache arena");
+    m_arena_filesize = st.st_size;
+    growArena(t->hdr->arena_used * sha256::size);
+  }
+  close(m_idx_fd);
+  m_idx_fd = fd;
+  table_t *cur = m_table;
+  m_retired.push_back(cur);
+  __sync_synchronize();
+  m_table = t;
+}
+
+void MMapCache::sync()
+{
+  lockAll();
+  try {
+    table_t *t = m_table;
+    if (m_arena_filesize
+        && msync(m_arena, m_arena_filesize, MS_SYNC))
+      throw syserror("msync", "writing cache arena");
+    if (msync(t->map, t->len, MS_SYNC))
+      throw syserror("msync", "writing cache index");
+    t->hdr->clean = 1;
+    if (msync(t->map, g_header_size, MS_SYNC))
+      throw syserror("msync", "writing cache header");
+  } catch (...) {
+    unlockAll();
+    throw;
+  }
+  unlockAll();
+}
+
+void MMapCache::clear()
+{
+  lockAll();
+  // Readers take no locks; wait for those under way to finish and
+  // hold off new ones until we are done
+  m_clearing = 1;
+  __sync_synchronize();
+  while (m_readers)
+    sched_yield();
+
+  const std::string idxname(m_fname + ".idx");
+  int fd = -1;
+  try {
+    if (ftruncate(m_arena_fd, 0))
+      throw syserror("ftruncate", "clearing cache arena");
+    m_arena_filesize = 0;
+
+    // The old index stays mapped, as for a grow, since size() and
+    // maybeGrow() look at its header without locking
+    fd = open((idxname + ".new").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+      throw syserror("open", "creating new cache index");
+    initTable(fd, g_initial_slots);
+    table_t *t = mapTable(fd);
+    memcpy(t->hdr->boot_id, m_table->hdr->boot_id, sizeof t->hdr->boot_id);
+    if (rename((idxname + ".new").c_str(), idxname.c_str())) {
+      unmapTable(t);
+      throw syserror("rename", "replacing cache index");
+    }
+    close(m_idx_fd);
+    m_idx_fd = fd;
+    table_t *cur = m_table;
+    m_retired.push_back(cur);
+    __sync_synchronize();
+    m_table = t;
+  } catch (...) {
+    if (fd != -1 && fd != m_idx_fd)
+      close(fd);
+    m_clearing = 0;
+    unlockAll();
+    throw;
+  }
+  m_clearing = 0;
+  unlockAll();
+}
+
+uint64_t MMapCache::size() const
+{
+  return m_table->hdr->count;
+}
+
+#endif
+
+#if defined(_WIN32)
+
+MMapCache::MMapCache(const std::string &fname)
+  : m_fname(fname)
+{
+  throw error("Memory mapped cache is not available on this platform");
+}
+
+MMapCache::~MMapCache()
+{
+}
+
+bool MMapCache::exists(const std::string &)
+{
+  return false;
+}
+
+bool MMapCache::readObj(const fsobjid_t &, CObject &)
+{
+  return false;
+}
+
+void MMapCache::upsert(const CObject &)
+{
+}
+
+void MMapCache::sync()
+{
+}
+
+void MMapCache::clear()
+{
+}
+
+uint64_t MMapCache::size() const
+{
+  return 0;
+}
+
+#endif
@@ -0,0 +1,141 @@
+//
+// Memory mapped file system object cache
+//
+// An alternative FSCache engine for scan-heavy incremental backups:
+// an open-addressing hash table keyed by (dev, ino) with fixed-size
+// records, plus an append-only arena holding the hash sequences. Both
+// live in memory mapped files next to the SQLite cache file.
+//
+// Lookups take no locks; every record carries a sequence counter
+// which writers make odd while they change the record (a seqlock).
+// Writers serialise per key on a striped set of mutexes and claim
+// empty slots with compare-and-swap.
+//
+
+#ifndef BACKUP_MMAPCACHE_HH
+#define BACKUP_MMAPCACHE_HH
+
+#include "common/mutex.hh"
+
+#include <string>
+#include <vector>
+#include <list>
+#include <stdint.h>
+#include <stddef.h>
+
+class CObject;
+struct fsobjid_t;
+
+class MMapCache {
+public:
+  /// Open the cache stored in fname.idx and fname.arena, creating
+  /// an empty cache if there is none or if it cannot be trusted
+  /// after an unclean shutdown.
+  //
+  /// \throws error if memory mapped caches are not supported here
+  MMapCache(const std::string &fname);
+
+  /// Syncs and unmaps the cache
+  ~MMapCache();
+
+  /// Returns true if a cache exists under the given name
+  static bool exists(const std::string &fname);
+
+  /// Same semantics as FSCache::readObj. The m_dbid we report is the
+  /// slot number plus one.
+  bool readObj(const fsobjid_t &id, CObject &obj);
+
+  /// Insert or update the object. Objects that do not fit (full
+  /// table or arena) are simply not cached.
+  void upsert(const CObject &obj);
+
+  /// Write everything to disk and mark the cache clean
+  void sync();
+
+  /// Remove all entries. Concurrent readers are held off meanwhile.
+  void clear();
+
+  /// Number of cached objects
+  uint64_t size() const;
+
+private:
+  MMapCache(const MMapCache&);
+  MMapCache &operator=(const MMapCache&);
+
+  /// On-disk header of the index file
+  struct header_t;
+  /// On-disk record in the index file
+  struct record_t;
+
+  /// A mapped index file
+  struct table_t {
+    void *map;
+    size_t len;
+    header_t *hdr;
+    record_t *slots;
+    uint64_t mask;
+  };
+
+  /// Base name of our files
+  const std::string m_fname;
+
+  /// The current index. Readers pick this up without locking; it
+  /// is replaced only while all stripes are locked.
+  table_t * volatile m_table;
+
+  /// Tables replaced by a grow; readers may still be looking at
+  /// them so we unmap them when we close
+  std::list<table_t*> m_retired;
+
+  /// Index file descriptor
+  int m_idx_fd;
+
+  /// Arena file descriptor
+  int m_arena_fd;
+  /// Arena mapping - we reserve address space for the largest arena
+  /// we support and extend the file as it fills
+  uint8_t *m_arena;
+  /// Current arena file size in bytes
+  uint64_t m_arena_filesize;
+  /// Protects arena file growth
+  Mutex m_arena_lock;
+
+  /// Writers lock the stripe of the key they write
+  std::vector<Mutex> m_stripes;
+
+  /// Readers under way, and set while clear() replaces the index
+  /// and empties the arena under them
+  volatile uint32_t m_readers;
+  volatile uint32_t m_clearing;
+
+  /// Lock the stripes in order (grow, sync, clear)
+  void lockAll();
+  void unlockAll();
+
+  /// Map an index file
+  table_t *mapTable(int fd);
+  /// Unmap an index
+  static void unmapTable(table_t *);
+
+  /// Drop the records a crashed writer left half written from the
+  /// index we opened. Returns true if any were dropped; the index
+  /// must then be rebuilt.
+  bool scrub();
+
+  /// Create an empty index with the given number of slots in the
+  /// given file
+  void initTable(int fd, uint64_t nslots);
+
+  /// Rebuild the index with the given number of slots. With
+  /// compact_arena the arena is rewritten to hold only live hash
+  /// sequences. Must hold all stripes (or be opening).
+  void rebuild(uint64_t nslots, bool compact_arena);
+
+  /// Make sure the arena file covers the given number of bytes
+  void growArena(uint64_t bytes);
+
+  /// Double the index if it is getting full
+  void maybeGrow();
+};
+
+#endif
@@ -0,0 +1,194 @@
+//
+// Implementation of the user and group name cache
+//
+
+#include "ownercache.hh"
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include "common/trace.hh"
+
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <pwd.h>
+#include <grp.h>
+
+namespace {
+  trace::Path t_own("/upload/owners");
+
+  /// getpwent() and getgrent() are not reentrant
+  Mutex g_ent_lock;
+
+  /// Entries with many group members need large buffers
+  const size_t g_max_buffer = 1 << 20;
+
+  /// How long we stay with the numeric id after the name service
+  /// failed, rather than told us there is no such name
+  const DiffTime g_error_ttl(DiffTime::iso("PT5S"));
+
+  std::string numeric(uint32_t id)
+  {
+    std::ostringstream s;
+    s << id;
+    return s.str();
+  }
+
+  OwnerCache::lookup_t lookupUser(uint32_t uid, std::string &name)
+  {
+    std::vector<char> buf(1024);
+    while (true) {
+      struct passwd pw;
+      struct passwd *res = 0;
+      const int rc = getpwuid_r(uid_t(uid), &pw, &buf[0], buf.size(), &res);
+      if (rc == ERANGE && buf.size() < g_max_buffer) {
+        buf.resize(buf.size() * 2);
+        continue;
+      }
+      if (rc) {
+        errno = rc;
+        return OwnerCache::L_Error;
+      }
+      if (!res)
+        return OwnerCache::L_NotFound;
+      name = res->pw_name;
+      return OwnerCache::L_Found;
+    }
+  }
+
+  OwnerCache::lookup_t lookupGroup(uint32_t gid, std::string &name)
+  {
+    std::vector<char> buf(1024);
+    while (true) {
+      struct group gr;
+      struct group *res = 0;
+      const int rc = getgrgid_r(gid_t(gid), &gr, &buf[0], buf.size(), &res);
+      if (rc == ERANGE && buf.size() < g_max_buffer) {
+        buf.resize(buf.size() * 2);
+        continue;
+      }
+      if (rc) {
+        errno = rc;
+        return OwnerCache::L_Error;
+      }
+      if (!res)
+        return OwnerCache::L_NotFound;
+      name = res->gr_name;
+      return OwnerCache::L_Found;
+    }
+  }
+}
+
+OwnerCache::OwnerCache(const DiffTime &ttl)
+  : m_ttl(ttl)
+  , m_hits(0)
+  , m_misses(0)
+{
+}
+
+void OwnerCache::setTTL(const DiffTime &ttl)
+{
+  MutexLock l(m_lock);
+  m_ttl = ttl;
+}
+
+std::string OwnerCache::username(uid_t uid, Time *expires)
+{
+  return lookup(m_users, uint32_t(uid), lookupUser, expires);
+}
+
+std::string OwnerCache::groupname(gid_t gid, Time *expires)
+{
+  return lookup(m_groups, uint32_t(gid), lookupGroup, expires);
+}
+
+std::string OwnerCache::lookup(names_t &names, uint32_t id,
+                               lookup_t (*fn)(uint32_t, std::string&),
+                               Time *expires)
+{
+  const Time now(Time::now());
+  { MutexLock l(m_lock);
+    names_t::const_iterator i = names.find(id);
+    if (i != names.end() && now < i->second.expires) {
+      ++m_hits;
+      if (expires)
+        *expires = i->second.expires;
+      return i->second.name;
+    }
+    ++m_misses;
+  }
+
+  // Look up without holding our lock, so that a slow name service
+  // only holds up the workers that need this name. An id without a
+  // name is cached like any other; if the name service failed we
+  // only hold on to the numeric id for a moment.
+  entry_t e;
+  const lookup_t res = fn(id, e.name);
+  if (res != L_Found)
+    e.name = numeric(id);
+  if (res == L_Error)
+    MTrace(t_own, trace::Warn, "Name service lookup of " << id
+           << " failed: " << strerror(errno));
+
+  MutexLock l(m_lock);
+  e.expires = now + (res == L_Error ? std::min(m_ttl, g_error_ttl) : m_ttl);
+  names[id] = e;
+  if (expires)
+    *expires = e.expires;
+  return e.name;
+}
+
+void OwnerCache::prefill()
+{
+  const Time now(Time::now());
+  { MutexLock l(m_lock);
+    if (now < m_prefill_expires)
+      return;
+    m_prefill_expires = now + m_ttl;
+  }
+
+  // The first entry for an id is the one that getpwuid() would find
+  names_t users;
+  names_t groups;
+  { MutexLock l(g_ent_lock);
+    setpwent();
+    while (struct passwd *pw = getpwent())
+      if (!users.count(pw->pw_uid))
+        users[pw->pw_uid].name = pw->pw_name;
+    endpwent();
+
+    setgrent();
+    while (struct group *gr = getgrent())
+      if (!groups.count(gr->gr_gid))
+        groups[gr->gr_gid].name = gr->gr_name;
+    endgrent();
+  }
+
+  MutexLock l(m_lock);
+  const Time expires(now + m_ttl);
+  for (names_t::iterator i = users.begin(); i != users.end(); ++i) {
+    i->second.expires = expires;
+    m_users[i->first] = i->second;
+  }
+  for (names_t::iterator i = groups.begin(); i != groups.end(); ++i) {
+    i->second.expires = expires;
+    m_groups[i->first] = i->second;
+  }
+  MTrace(t_own, trace::Info, "Prefilled " << users.size() << " users and "
+         << groups.size() << " groups");
+}
+
+OwnerCache::stats_t OwnerCache::stats()
+{
+  MutexLock l(m_lock);
+  stats_t s;
+  s.users = m_users.size();
+  s.groups = m_groups.size();
+  s.hits = m_hits;
+  s.misses = m_misses;
+  return s;
+}
+
+#endif
@@ -0,0 +1,85 @@
+//
+// Cache of user and group names
+//
+// Every file we back up carries the names of its owner user and
+// group. Looking a name up goes through NSS, which on a file server
+// with many users may mean a round trip to LDAP or similar, so names
+// are cached for all upload workers - and so are ids without a name,
+// since files owned by users that no longer exist are common.
+//
+
+#ifndef BACKUP_OWNERCACHE_HH
+#define BACKUP_OWNERCACHE_HH
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include "common/mutex.hh"
+#include "common/time.hh"
+
+#include <string>
+#include <map>
+#include <sys/types.h>
+#include <stdint.h>
+
+class OwnerCache {
+public:
+  /// Names are looked up again once they have been cached for the
+  /// given time
+  OwnerCache(const DiffTime &ttl);
+
+  /// Change the time names are cached for
+  void setTTL(const DiffTime &);
+
+  /// The name of a user - or the uid in decimal if there is none. If
+  /// expires is given, it is set to the time the answer should be
+  /// looked up again.
+  std::string username(uid_t, Time *expires = 0);
+
+  /// The name of a group - or the gid in decimal if there is none
+  std::string groupname(gid_t, Time *expires = 0);
+
+  /// Enumerate the user and group databases into the cache. This is
+  /// skipped if the last enumeration has not yet expired.
+  void prefill();
+
+  /// Cache statistics
+  struct stats_t {
+    stats_t() : users(0), groups(0), hits(0), misses(0) { }
+    size_t users;
+    size_t groups;
+    uint64_t hits;
+    uint64_t misses;
+  };
+  stats_t stats();
+
+  /// Outcome of a name service lookup
+  enum lookup_t { L_Found, L_NotFound, L_Error };
+
+private:
+  OwnerCache(const OwnerCache&);
+  OwnerCache &operator=(const OwnerCache&);
+
+  struct entry_t {
+    std::string name;
+    Time expires;
+  };
+  typedef std::map<uint32_t, entry_t> names_t;
+
+  /// Look up in the given map, calling the lookup function on a miss
+  std::string lookup(names_t &, uint32_t id,
+                     lookup_t (*fn)(uint32_t, std::string&), Time *expires);
+
+  Mutex m_lock;
+  DiffTime m_ttl;
+  names_t m_users;
+  names_t m_groups;
+  uint64_t m_hits;
+  uint64_t m_misses;
+
+  /// When the last prefill expires
+  Time m_prefill_expires;
+};
+
+#endif
+
+#endif
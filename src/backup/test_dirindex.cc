@@ -0,0 +1,94 @@
+//
+//! \file backup/test_dirindex.cc
+//! Regression test of indexed (version 1) directory objects
+//
+
+#include "common/error.hh"
+#include "common/trace.hh"
+#include "backup/upload.hh"
+#include "objparser/objparser.hh"
+
+#include <iostream>
+
+namespace {
+  void put32(std::vector<uint8_t> &d, uint32_t v)
+  {
+    for (int s = 24; s >= 0; s -= 8)
+      d.push_back(uint8_t(v >> s));
+  }
+
+  void put64(std::vector<uint8_t> &d, uint64_t v)
+  {
+    put32(d, uint32_t(v >> 32));
+    put32(d, uint32_t(v));
+  }
+
+  void putString(std::vector<uint8_t> &d, const std::string &s)
+  {
+    put32(d, uint32_t(s.size()));
+    d.insert(d.end(), s.begin(), s.end());
+  }
+
+  //! A UNIX file or directory entry as the upload encodes them
+  dirobj_t entry(bool dir, const std::string &name, uint64_t size)
+  {
+    std::vector<uint8_t> meta;
+    meta.push_back(dir ? 0x02 : 0x01);
+    putString(meta, name);
+    putString(meta, "user");
+    putString(meta, "group");
+    put32(meta, 0644);
+    put64(meta, 1000); // mtime
+    put64(meta, 1000); // ctime
+    if (!dir)
+      put64(meta, size);
+    objseq_t lor(1, sha256::hash(name));
+    return dirobj_t(lor, meta, size);
+  }
+
+  void check(bool ok, const std::string &what)
+  {
+    if (!ok)
+      throw error("Check failed: " + what);
+  }
+}
+
+int main(int, char **) try
+{
+  std::cerr << "Directory index test" << std::endl;
+
+  // A directory "b" was scanned, and replaced by a file "b" before
+  // the files were listed; the file entries come first
+  std::vector<dirobj_t> ents;
+  ents.push_back(entry(false, "c", 3));
+  ents.push_back(entry(false, "b", 2));
+  ents.push_back(entry(false, "a", 1));
+  ents.push_back(entry(true, "b", 42));
+  ents.push_back(entry(true, "ab", 4));
+
+  sortDirObjs(ents);
+  check(ents.size() == 4, "duplicate name dropped");
+
+  std::vector<uint8_t> obj;
+  encodeDirObjs(obj, 0, ents, 0, ents.size(), false, true);
+
+  // The object must parse, in name order, with the newest "b"
+  const DirView view(obj);
+  check(view.indexed(), "object is indexed");
+  check(view.size() == 4, "object holds four entries");
+  const char *names[] = { "a", "ab", "b", "c" };
+  size_t n = 0;
+  for (DirView::const_iterator i = view.begin(); i != view.end(); ++i, ++n)
+    check(i->nameIs(names[n]), std::string("entry ") + names[n]);
+  DirView::const_iterator b = view.find("b");
+  check(b != view.end(), "find b");
+  check(b->type() == FSDir::dirent_t::UNIXFILE, "b is the file");
+  check(b->size() == 2, "b has the file size");
+
+  std::cerr << "PASSED." << std::endl;
+  return 0;
+} catch (error &e) {
+  std::cerr << e.toString() << std::endl
+            << "FAILED." << std::endl;
+  return 1;
+}
@@ -15,8 +15,12 @@
 #include "xml/xmlio.hh"
 
 #include <algorithm>
+#include <deque>
+#include <string.h>
 
 #if defined(__unix__) || defined(__APPLE__)
+# include "dirscan.hh"
+# include "chunkreader.hh"
 # include <sys/types.h>
 # include <sys/stat.h>
 # include <fcntl.h>
@@ -45,6 +49,22 @@ namespace {
 
 namespace {
 
+  /// Atomically add to a counter, returning the new value. Adding
+  /// zero is an atomic read.
+  long atomicAdd(volatile long &v, long d)
+  {
+#if defined(_WIN32)
+    return ::InterlockedExchangeAdd(&v, d) + d;
+#else
+    return __sync_add_and_fetch(&v, d);
+#endif
+  }
+
+  /// The progress of files is checkpointed every this many chunks -
+  /// so files of fewer chunks are simply read again when a backup is
+  /// resumed
+  const size_t g_checkpoint_chunks = 16;
+
   /// For short delays on retry, call this
   void short_delay()
   {
@@ -57,6 +77,18 @@ namespace {
   }
 
 
+#if defined(__unix__) || defined(__APPLE__)
+  /// Is the data from the given offset on all zero
+  bool allZero(const std::vector<uint8_t> &data, size_t ofs)
+  {
+    if (ofs == data.size())
+      return true;
+    // Every byte equals the one before it, and the first is zero
+    return !data[ofs]
+      && !memcmp(&data[ofs], &data[ofs + 1], data.size() - ofs - 1);
+  }
+#endif
+
   void ser(std::vector<uint8_t> &data, const uint8_t &d)
   {
     data.push_back(d);
@@ -119,84 +151,145 @@ namespace {
   {
     ser(data, uint32_t(d.size()));
     for (size_t i = 0; i != d.size(); ++i) {
-      data.insert(data.end(), &d[i].m_raw[0], &d[i].m_raw[0] + 32);
+      data.insert(data.end(), d[i].m_raw, d[i].m_raw + sha256::size);
     }
     MTrace(t_ser, trace::Debug, "Serialised objseq with length 32 * " << d.size());
   }
 
 }
 
-struct dirobj_t {
-  dirobj_t() : treesize(0) { }
-  dirobj_t(const objseq_t &lor, const std::vector<uint8_t> &lom, uint64_t s)
-    : lor_hash(lor), lom_data(lom), treesize(s) { }
-  objseq_t lor_hash;
-  std::vector<uint8_t> lom_data;
-  uint64_t treesize;
-};
-
-size_t encodeDirObjs(std::vector<uint8_t> &object_out, uint64_t &treesize_out,
-                     const std::list<dirobj_t> &dirobj_lorm, bool partial)
+/// Find how many of the entries from the given position on go into
+/// the next directory object, and the tree size of that object
+size_t splitDirObjs(uint64_t &treesize_out,
+                    const std::vector<dirobj_t> &dirobj_lorm, size_t first,
+                    bool indexed)
 {
-  ser(object_out, uint8_t(0x00)); // Version 0 object
-  // 0xdd => Partial directory entry, 0xde => Complete directory entry
-  ser(object_out, uint8_t(partial?0xdd:0xde));
-  
   //
   // Find out how many entries of LoR and LoM we can add until we
   // reach the chunk size.
   //
-  std::list<dirobj_t>::const_iterator i = dirobj_lorm.begin();
-  size_t n = 0;
+  size_t i = first;
   size_t head_size = 1 // version
   + 1  // type
   + 8  // tree-size
   + 4; // length of LoR
   size_t lom_size = 0;
   uint64_t treesize = 0;
-  
-  while (i != dirobj_lorm.end()) {
+
+  while (i != dirobj_lorm.size()) {
     // We can encode up to the current head minus four bytes for LoR
     // length minus four bytes for LoM length (LoR can be longer
     // than LoM because each M entry may reference several objects)
-    const size_t hs_add = 4 + i->lor_hash.size() * 32; // 32 bytes per hash in LoR
-    const size_t ls_add = i->lom_data.size();
+    const size_t hs_add = 4 + dirobj_lorm[i].lor_hash.size() * 32 // 32 bytes per hash in LoR
+      + (indexed ? 8 : 0); // LoR and LoM offsets in the index
+    const size_t ls_add = dirobj_lorm[i].lom_data.size();
     // See if we are at the limit or if we can go on
     if (head_size + hs_add + lom_size + ls_add < ng_chunk_size) {
       head_size += hs_add;
       lom_size += ls_add;
-      treesize += i->treesize;
+      treesize += dirobj_lorm[i].treesize;
       ++i;
-      ++n;
     } else break;
   }
-  
+
   // If we could not add any objects, we have a single directory
   // entry that is too big for an object. We simply do not handle
   // that now. This would happen if a file is greater than 0.54 TiB.
-  if (i == dirobj_lorm.begin())
+  if (i == first)
     throw error("Oversized directory entry - giving up");
-  
+
   // Sum of ourselves plus our children
   // We are head + lom
-  treesize += head_size + lom_size;
+  treesize_out = treesize + head_size + lom_size;
+  return i - first;
+}
+
+void encodeDirObjs(std::vector<uint8_t> &object_out, uint64_t treesize,
+                   const std::vector<dirobj_t> &dirobj_lorm,
+                   size_t first, size_t n, bool partial, bool indexed)
+{
+  // Version 0 object, or version 1 with an index
+  ser(object_out, uint8_t(indexed ? 0x01 : 0x00));
+  // 0xdd => Partial directory entry, 0xde => Complete directory entry
+  ser(object_out, uint8_t(partial?0xdd:0xde));
   ser(object_out, uint64_t(treesize));
-  
+
   MTrace(t_up, trace::Debug, "Object has treesize " << treesize);
-  
+
   // So, add this - first, length of LoR
   ser(object_out, uint32_t(n));
+  // Then the index; the object offsets of the LoR and LoM entry of
+  // every entry
+  if (indexed) {
+    uint32_t lor = uint32_t(object_out.size() + 8 * n);
+    uint32_t lom = lor;
+    for (size_t l = first; l != first + n; ++l)
+      lom += uint32_t(4 + 32 * dirobj_lorm[l].lor_hash.size());
+    for (size_t l = first; l != first + n; ++l) {
+      ser(object_out, lor);
+      ser(object_out, lom);
+      lor += uint32_t(4 + 32 * dirobj_lorm[l].lor_hash.size());
+      lom += uint32_t(dirobj_lorm[l].lom_data.size());
+    }
+  }
   // Then the LoR - note; the LoR is a list of lists...  The n'th
   // LoM entry references the n'th LoR entry.
-  for (std::list<dirobj_t>::const_iterator l = dirobj_lorm.begin(); l != i; ++l) {
-    ser(object_out, l->lor_hash);
-  }
+  for (size_t l = first; l != first + n; ++l)
+    ser(object_out, dirobj_lorm[l].lor_hash);
   // And then the LoM... It is already raw data.
-  for (std::list<dirobj_t>::const_iterator l = dirobj_lorm.begin(); l != i; ++l)
-    object_out.insert(object_out.end(), l->lom_data.begin(), l->lom_data.end());
-  
-  treesize_out = treesize;
-  return n;
+  for (size_t l = first; l != first + n; ++l)
+    object_out.insert(object_out.end(), dirobj_lorm[l].lom_data.begin(),
+                      dirobj_lorm[l].lom_data.end());
+}
+
+namespace {
+  /// Orders entries by the name in their LoM data, bytewise like
+  /// DirView compares names
+  struct dirobj_name_less {
+    dirobj_name_less(const std::vector<dirobj_t> &e) : ents(e) { }
+    const std::vector<dirobj_t> &ents;
+    bool operator()(size_t a, size_t b) const {
+      size_t aofs = 1, bofs = 1;
+      const std::vector<uint8_t> &al = ents[a].lom_data;
+      const std::vector<uint8_t> &bl = ents[b].lom_data;
+      const uint32_t alen = des<uint32_t>(al, aofs);
+      const uint32_t blen = des<uint32_t>(bl, bofs);
+      const int c = memcmp(&al[aofs], &bl[bofs], std::min(alen, blen));
+      return c < 0 || (!c && alen < blen);
+    }
+  };
+}
+
+void sortDirObjs(std::vector<dirobj_t> &dirobj_lorm)
+{
+  std::vector<size_t> order(dirobj_lorm.size());
+  for (size_t i = 0; i != order.size(); ++i)
+    order[i] = i;
+  const dirobj_name_less less(dirobj_lorm);
+  std::stable_sort(order.begin(), order.end(), less);
+
+  // A name can occur twice if a directory we scanned was replaced by
+  // a file before we listed the files. The file entries come first
+  // and are the most recent, so we keep the first of equal names.
+  size_t kept = 0;
+  for (size_t i = 0; i != order.size(); ++i) {
+    if (kept && !less(order[kept - 1], order[i])) {
+      MTrace(t_up, trace::Info, "Dropping older directory entry with "
+             "duplicate name");
+      continue;
+    }
+    order[kept++] = order[i];
+  }
+  order.resize(kept);
+
+  // Move the entries into place without copying their data
+  std::vector<dirobj_t> sorted(order.size());
+  for (size_t i = 0; i != order.size(); ++i) {
+    sorted[i].lor_hash.swap(dirobj_lorm[order[i]].lor_hash);
+    sorted[i].lom_data.swap(dirobj_lorm[order[i]].lom_data);
+    sorted[i].treesize = dirobj_lorm[order[i]].treesize;
+  }
+  dirobj_lorm.swap(sorted);
 }
 
 ServerConnection::Reply Upload::execute(ServerConnection &conn,
@@ -226,7 +319,7 @@ ServerConnection::Reply Upload::execute(ServerConnection &conn,
 
 bool Upload::testObject(ServerConnection &conn, const sha256 &hash)
 {
-  ServerConnection::Request req(ServerConnection::mHEAD, "/object/" + hash.m_hex);
+  ServerConnection::Request req(ServerConnection::mHEAD, "/object/" + hash.hex());
   req.setBasicAuth(conn);
   ServerConnection::Reply rep = execute(conn, req);
   if (rep.getCode() == 204)
@@ -239,7 +332,7 @@ bool Upload::testObject(ServerConnection &conn, const sha256 &hash)
 void Upload::uploadObject(ServerConnection &conn, const std::vector<uint8_t> &obj)
 {
   ServerConnection::Request req(ServerConnection::mPOST,
-                                "/object/" + sha256::hash(obj).m_hex);
+                                "/object/" + sha256::hash(obj).hex());
   req.setBasicAuth(conn);
   req.setBody(obj);
   ServerConnection::Reply rep = execute(conn, req);
@@ -247,16 +340,27 @@ void Upload::uploadObject(ServerConnection &conn, const std::vector<uint8_t> &ob
     throw error("Unable to upload object - server said: " + rep.toString());
 }
 
+void Upload::ensureZeroChunk(ServerConnection &conn)
+{
+  if (atomicAdd(m_zero_chunk_known, 0))
+    return;
+  if (!testObject(conn, ng_zero_chunk_hash())) {
+    MTrace(t_up, trace::Debug, "Uploading zero chunk");
+    uploadObject(conn, ng_zero_chunk());
+  }
+  atomicAdd(m_zero_chunk_known, 1);
+}
+
 /// Download object
 void fetchObject(ServerConnection &conn, const sha256 &hash,
                  std::vector<uint8_t> &obj)
 {
   ServerConnection::Request req(ServerConnection::mGET,
-                                "/object/" + hash.m_hex);
+                                "/object/" + hash.hex());
   req.setBasicAuth(conn);
   ServerConnection::Reply rep = conn.execute(req);
   if (rep.getCode() != 200)
-    throw error("Cannot retrieve object " + hash.m_hex
+    throw error("Cannot retrieve object " + hash.hex()
                 + ": " + rep.toString());
 
   // Steal the data body from the reply
@@ -273,23 +377,41 @@ Upload::Upload(FSCache &cache, ServerConnection &conn, const std::string &d, con
   , m_completion_notify(0)
   , m_completion_notify_done(false)
   , m_snapshot_notify(0)
+  , m_nqueues(0)
+  , m_queued(0)
+  , m_sleepers(0)
+  , m_workqueue_stop(false)
   , m_backup_cancelled(0)
+  , m_zero_chunk_known(0)
   , m_nworkers(2)
+  , m_read_depth(4)
+  , m_dir_index(false)
   , m_device_name(d)
   , m_backup_root(p)
-  , m_wroot(0, std::string())
+  , m_journal(0)
+  , m_checkpoint(0)
+#if defined(__unix__) || defined(__APPLE__)
+  , m_owners(DiffTime::iso("PT10M"))
+  , m_owner_prefill(false)
+  , m_cache_mode(ChunkReader::CacheKeep)
+  , m_measure_cache(false)
+#endif
+  , m_wtree(std::string())
 #if defined(__linux__)
   , m_addWatchDelegate(0)
+  , m_track_ids(false)
 #endif
 {
   if (m_device_name.empty())
     throw error("Empty device name given to Upload engine");
+  for (size_t i = 0; i != c_max_workers; ++i)
+    m_queues[i] = 0;
 }
 
 Upload::~Upload()
 {
   // Make our processor threads exit
-  m_workqueue_sem.increment();
+  stopWorkQueue();
 
   // Wait for every processor to exit before we move on to deleting
   // our notifiers and filters
@@ -297,6 +419,13 @@ Upload::~Upload()
        i != m_workers.end(); ++i)
     i->join_nothrow();
 
+  for (long i = 0; i != m_nqueues; ++i)
+    delete m_queues[i];
+
+  // Closes the journal cleanly
+  delete m_journal;
+  delete m_checkpoint;
+
   delete m_snapshot_notify;
   delete m_completion_notify;
   delete m_progress;
@@ -308,10 +437,38 @@ Upload::~Upload()
 
 Upload &Upload::setWorkers(size_t n)
 {
-  m_nworkers = n;
+  m_nworkers = std::min(n, size_t(c_max_workers));
+  return *this;
+}
+
+Upload &Upload::setReadDepth(size_t n)
+{
+  m_read_depth = n ? n : 1;
+  return *this;
+}
+
+Upload &Upload::setDirIndex(bool indexed)
+{
+  m_dir_index = indexed;
+  return *this;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+Upload &Upload::setOwnerCache(const DiffTime &ttl, bool prefill)
+{
+  m_owners.setTTL(ttl);
+  m_owner_prefill = prefill;
   return *this;
 }
 
+Upload &Upload::setReadCache(ChunkReader::cache_t mode, bool measure)
+{
+  m_cache_mode = mode;
+  m_measure_cache = measure;
+  return *this;
+}
+#endif
+
 Upload &Upload::setFilter(const BindF1Base<bool,const std::string&> &f)
 {
   delete m_filter;
@@ -350,9 +507,10 @@ Upload &Upload::setAddWatchDelegate(const BindF1Base<int,const std::string&> &f)
 #endif
 
 Upload::dirstate_t::dirstate_t(const std::string &n, dirstate_t *p,
-                               Upload::wnode_t &w, const CObject &co)
+                               WatchTree::node_t w, const CObject &co)
   : name(n)
   , parent(p)
+  , depth(p ? p->depth + 1 : 0)
   , watch(w)
   , cobj(co)
 #if defined(__unix__) || defined(__APPLE__)
@@ -363,21 +521,130 @@ Upload::dirstate_t::dirstate_t(const std::string &n, dirstate_t *p,
 #if defined(_WIN32)
   , meta_fattr(0)
 #endif
+  , files_cached(false)
 {
   MTrace(t_cdp, trace::Debug, "Created dirstate " << n
-         << " with wn " << w.name
-         << " having queued=" << w.m_cdp_queued);
+         << " with wn " << w);
 }
 
 Upload::dirstate_t::~dirstate_t()
 {
 }
 
-size_t Upload::dirstate_t::getDepth() const
+void Upload::dirstate_t::snapshot(Processor &proc)
+{
+  if (!files_cached) {
+    upload(proc);
+    return;
+  }
+
+  // Files changed since our first snapshot are picked up when we are
+  // uploaded for real, once our children complete.
+  MTrace(t_up, trace::Debug, "Snapshot of directory " << name
+         << " reusing " << file_entries.size() << " entries");
+  std::vector<dirobj_t> dirobj_lorm(file_entries);
+  addChildEntries(proc, dirobj_lorm);
+  encodeUpload(proc, dirobj_lorm);
+}
+
+void Upload::dirstate_t::encodeUpload(Processor &proc,
+                                      std::vector<dirobj_t> &dirobj_lorm)
 {
-  if (parent)
-    return 1 + parent->getDepth();
-  return 0;
+  const bool partial = !incomplete_children.empty();
+  const bool indexed = proc.refUpload().m_dir_index;
+  if (indexed)
+    sortDirObjs(dirobj_lorm);
+
+  // All objects in directory updated.
+  MTrace(t_up, trace::Debug, "Done with all entries under " << name
+         << " - will encode directory object(s)");
+
+  //
+  // We will build a new multiref and treesize. Store the old
+  // multiref.
+  //
+  cobj.m_treesize = 0;
+  objseq_t old_multiref;
+  old_multiref.swap(cobj.m_hash);
+
+  //
+  // Now create a directory object holding our LoR and LoM.
+  // - split as necessary to stay within ng_chunk_size.
+  //
+  std::vector<split_t> splits;
+  std::vector<split_t>::const_iterator prev = encoded_splits.begin();
+  proc.setStatus(threadstatus_t::OSUploading, name);
+  for (size_t next = 0; next != dirobj_lorm.size(); ) {
+    split_t split;
+    split.first = next;
+    split.count = splitDirObjs(split.treesize, dirobj_lorm, next, indexed);
+    next += split.count;
+
+    //
+    // If our last partial upload encoded the very same entries into
+    // an object, we know its hash already and we know that the server
+    // has it.
+    //
+    while (prev != encoded_splits.end() && prev->first < split.first)
+      ++prev;
+    if (partial && prev != encoded_splits.end()
+        && prev->first == split.first && prev->count == split.count
+        && std::equal(dirobj_lorm.begin() + split.first,
+                      dirobj_lorm.begin() + next,
+                      encoded_entries.begin() + split.first)) {
+      MTrace(t_up, trace::Debug, " entries " << split.first << "-" << next
+             << " unchanged since last snapshot - done.");
+      split.hash = prev->hash;
+    } else {
+      std::vector<uint8_t> object;
+      encodeDirObjs(object, split.treesize, dirobj_lorm,
+                    split.first, split.count, partial, indexed);
+      MTrace(t_up, trace::Debug, "Encoded object of size "
+             << object.size());
+      split.hash = sha256::hash(object);
+
+      //
+      // First, we see if the computed hash is identical to the hash
+      // in the old multiref. If it is, well there is no point in
+      // asking the server then.
+      //
+      if (old_multiref.size() > splits.size()
+          && split.hash == old_multiref[splits.size()]) {
+        MTrace(t_up, trace::Debug, " hash unchanged - done.");
+      } else if (!proc.refUpload().testObject(proc.refConn(), split.hash)) {
+        MTrace(t_up, trace::Debug, " upload necessary");
+        proc.refUpload().uploadObject(proc.refConn(), object);
+      } else {
+        MTrace(t_up, trace::Debug, " object already on servers");
+      }
+    }
+
+    cobj.m_treesize += split.treesize;
+    cobj.m_hash.push_back(split.hash);
+    splits.push_back(split);
+  }
+
+  // Keep what we encoded only as long as more snapshots may follow
+  if (partial) {
+    encoded_entries.swap(dirobj_lorm);
+    encoded_splits.swap(splits);
+  } else {
+    std::vector<dirobj_t>().swap(encoded_entries);
+    std::vector<split_t>().swap(encoded_splits);
+  }
+
+  // Done. sizehash set. Update cache with both our sizehash and the
+  // mtime/ctime that was set during scan.
+  if (parent) {
+    if (cobj.m_dbid == -1) {
+      proc.refUpload().m_cache.insert(cobj);
+    } else {
+      proc.refUpload().m_cache.update(cobj);
+    }
+    // A backup resuming this one need not come here again
+    if (!partial && proc.refUpload().m_checkpoint)
+      proc.refUpload().m_checkpoint->dirDone(cobj);
+  }
 }
 
 void Upload::dirstate_t::process_scan(Upload::Processor &p)
@@ -404,15 +671,14 @@ void Upload::dirstate_t::process_scan(Upload::Processor &p)
     //
     // However, as soon as the first child is added as a work item, our
     // incomplete_children (and other) members may be changed by other
-    // worker threads. To avoid having other threads write to our
-    // incomplete_children while we're traversing, we hold the
-    // dirstate_lock
-    MutexLock l(p.refUpload().m_dirstate_lock);
-    for (std::set<dirstate_t*>::const_iterator i = incomplete_children.begin();
-         i != incomplete_children.end(); ++i)
-      p.refUpload()
-        .addWorkItem((*i)->getDepth(),
-                     papply(*i, &Upload::dirstate_t::process_scan).clone());
+    // worker threads. No child can have been processed before we add
+    // it, so we take a copy of our incomplete_children and need no
+    // lock to traverse that.
+    const std::vector<dirstate_t*> children(incomplete_children.begin(),
+                                            incomplete_children.end());
+    for (std::vector<dirstate_t*>::const_iterator i = children.begin();
+         i != children.end(); ++i)
+      p.refUpload().addWorkItem(p, workitem_t(*i, workitem_t::OpScan));
 
     //
     // We have incomplete children - we can therefore not proceed
@@ -428,9 +694,7 @@ void Upload::dirstate_t::process_scan(Upload::Processor &p)
   }
 
   // Ok we have no incomplete children. We must schedule an upload.
-  p.refUpload()
-    .addWorkItem(getDepth(),
-                 papply(this, &Upload::dirstate_t::process_upload).clone());
+  p.refUpload().addWorkItem(p, workitem_t(this, workitem_t::OpUpload));
 }
 
 void Upload::dirstate_t::process_upload(Processor &p)
@@ -448,102 +712,123 @@ void Upload::dirstate_t::process_upload(Processor &p)
   // (upload it - referencing all its child objects)
   //
   upload(p);
-  watch.m_cdp_queued = false; // no longer queued for upload!
+  p.refUpload().m_wtree.clearQueued(watch); // no longer queued for upload!
 
   //
   // When done with the processing, we want to move this directory
   // from the incomplete_children list to the complete_children of
   // the parent.
   //
-  { MutexLock l(p.refUpload().m_dirstate_lock);
-
-    // Delete all complete_children entries as we no longer will
-    // need them.
-    for (std::vector<dirstate_t*>::iterator cci = complete_children.begin();
-         cci != complete_children.end(); ++cci)
-      delete *cci;
-    complete_children.clear();
-    MAssert(incomplete_children.empty(), "Ended upload of directory "
-            "with incomplete children");
-
-    // Fine, now do parent processing.
-    //
-    // Now when we finish uploading a directory and step up to the
-    // parent, we may not need to process the parent. Consider a
-    // situation where a directory P has two child directories C0
-    // and C1. C0 is being processed in Thread 0 and C1 in Thread
-    // 1.
-    //
-    // Assuming that T0 finishes C0 and wishes to step up, at the
-    // same time as T1 finishes C1 and also wishes to step
-    // up. Obviously EITHER T0 or T1 need to process P, but NOT
-    // BOTH.
+  // Delete all complete_children entries as we no longer will need
+  // them. Our children moved themselves there before we became
+  // ready, so no-one else touches the list any more.
+  for (std::vector<dirstate_t*>::iterator cci = complete_children.begin();
+       cci != complete_children.end(); ++cci)
+    delete *cci;
+  complete_children.clear();
+  MAssert(incomplete_children.empty(), "Ended upload of directory "
+          "with incomplete children");
+
+  // Fine, now do parent processing.
+  //
+  // Now when we finish uploading a directory and step up to the
+  // parent, we may not need to process the parent. Consider a
+  // situation where a directory P has two child directories C0 and
+  // C1. C0 is being processed in Thread 0 and C1 in Thread 1.
+  //
+  // Assuming that T0 finishes C0 and wishes to step up, at the same
+  // time as T1 finishes C1 and also wishes to step up. Obviously
+  // EITHER T0 or T1 need to process P, but NOT BOTH.
+  //
+  // This is handled since the last thread to take the lock of P will
+  // be the one that sees that the parent->incomplete_children is
+  // empty.
+  //
+  // Once we are in the complete_children of our parent and the lock
+  // is released, the parent may be uploaded and delete us at any
+  // time - so we must not touch any of our members after that.
+  //
+  if (parent) {
+    Upload &up = p.refUpload();
+    dirstate_t *const par = parent;
+
+    // Create partial snapshots every 60 seconds. This uploads all our
+    // ancestors, so it locks the whole tree.
+    const bool snapshot
+      = Time::now() > up.m_latestSnapshotInfo.tstamp + DiffTime::iso("PT60S");
+    if (snapshot)
+      up.lockDirstates();
+    else
+      up.dirstateLock(par).ll_lock();
+
+    par->complete_children.push_back(this);
+    const bool found = par->incomplete_children.erase(this);
+    MAssert(found, "Parent " << par->name
+            << " did not have child " << name
+            << " as incomplete child");
+
     //
-    // This is handled since the last thread to enter the
-    // dirstate_lock will be the one that sees that the
-    // parent->incomplete_children is empty.
+    // So, this move *could* have caused the parent to become
+    // eligible for upload, in that it has no incomplete children.
     //
-    if (parent) {
-      parent->complete_children.push_back(this);
-      const bool found = parent->incomplete_children.erase(this);
-      MAssert(found, "Parent " << parent->name
-              << " did not have child " << name
-              << " as incomplete child");
-
-      //
-      // So, this move *could* have caused the parent to become
-      // eligible for upload, in that it has no incomplete children.
-      //
-      if (parent->incomplete_children.empty()) {
-        MTrace(t_worker, trace::Debug, "Parent of " << name
-               << " is eligible for upload. Stepping up");
-        p.refUpload()
-          .addWorkItem(parent->getDepth(),
-                       papply(parent, &Upload::dirstate_t::process_upload).clone());
-        return;
-      }
+    const bool parent_ready = par->incomplete_children.empty();
+    if (parent_ready) {
+      MTrace(t_worker, trace::Debug, "Parent of " << name
+             << " is eligible for upload. Stepping up");
+    } else {
       //
-      // Ok fine, our parent has incomplete children. This item
-      // will be uploaded when the last incomplete_child finishes
+      // Ok fine, our parent has incomplete children. This item will
+      // be uploaded when the last incomplete_child finishes
       // uploading. For now, just pick the next item from the work
       // queue.
       //
       MTrace(t_worker, trace::Debug, "Parent of " << name
              << " still has "
-             << parent->incomplete_children.size()
+             << par->incomplete_children.size()
              << " unprocessed child directories.");
+    }
 
-      // Create partial snapshots every 60 seconds
-      if (Time::now() > p.refUpload().m_latestSnapshotInfo.tstamp + DiffTime::iso("PT60S")) {
-        dirstate_t *parentTmp = parent;
+    if (!snapshot) {
+      up.dirstateLock(par).ll_unlock();
+    } else if (!parent_ready) {
+      try {
+        dirstate_t *parentTmp = par;
         while (parentTmp) {
           MTrace(t_worker, trace::Info, "Creating partial folder " << parentTmp->name);
-          parentTmp->upload(p);
+          parentTmp->snapshot(p);
           if (!parentTmp->parent) {
             {
-              MutexLock l(p.refUpload().m_latestSnapshotInfoLock);
-              p.refUpload().m_latestSnapshotInfo.tstamp = Time::now();
-              p.refUpload().m_latestSnapshotInfo.type = BTPartial;
-              p.refUpload().m_latestSnapshotInfo.hash = parentTmp->cobj.m_hash;
-              p.refUpload().m_latestSnapshotInfo.treesize = parentTmp->cobj.m_treesize;
+              MutexLock l(up.m_latestSnapshotInfoLock);
+              up.m_latestSnapshotInfo.tstamp = Time::now();
+              up.m_latestSnapshotInfo.type = BTPartial;
+              up.m_latestSnapshotInfo.hash = parentTmp->cobj.m_hash;
+              up.m_latestSnapshotInfo.treesize = parentTmp->cobj.m_treesize;
             }
             // Notify about root chunk upload
-            if (p.refUpload().m_snapshot_notify) {
-              (*p.refUpload().m_snapshot_notify)(p.refUpload());
+            if (up.m_snapshot_notify) {
+              (*up.m_snapshot_notify)(up);
             } else {
               // Invoke "Partial upload" completion handler
-              p.refUpload().complete(p.refConn(), parentTmp->cobj.m_hash, BTPartial);
+              up.complete(p.refConn(), parentTmp->cobj.m_hash, BTPartial);
             }
 
             MTrace(t_worker, trace::Debug, "Partial snapshot created:\n"
-                   << parentTmp->cobj.m_hash[0].m_hex);
+                   << parentTmp->cobj.m_hash[0].hex());
           }
           parentTmp = parentTmp->parent;
         }
+      } catch (...) {
+        up.unlockDirstates();
+        throw;
       }
-
-      return;
+      up.unlockDirstates();
+    } else {
+      up.unlockDirstates();
     }
+
+    if (parent_ready)
+      up.addWorkItem(p, workitem_t(par, workitem_t::OpUpload));
+    return;
   }
 
   // If we are here, then we have no parent....
@@ -568,6 +853,12 @@ void Upload::dirstate_t::process_upload(Processor &p)
     p.refUpload().m_latestSnapshotInfo.hash = cobj.m_hash;
     p.refUpload().m_latestSnapshotInfo.treesize = cobj.m_treesize;
   }
+  // Everything touched before we started is now backed up
+  if (p.refUpload().m_journal)
+    p.refUpload().m_journal->backupDone();
+  // ...and there is nothing to resume
+  if (p.refUpload().m_checkpoint)
+    p.refUpload().m_checkpoint->complete();
   // Notify about root chunk upload
   if (p.refUpload().m_snapshot_notify) {
     (*p.refUpload().m_snapshot_notify)(p.refUpload());
@@ -601,15 +892,46 @@ bool Upload::startUpload()
   m_completion_notify_done = false;
   // Clear cancellation status
   m_backup_cancelled = 0;
-  // Move wnode_t touched status to queued status
-  { MutexLock l(m_wroot_lock);
-    m_wroot.queueTouched();
+  // Move watch tree touched status to queued status
+  { MutexLock l(m_wtree_lock);
+#if defined(__linux__)
+    struct stat st;
+    if (m_track_ids && !stat(m_backup_root.c_str(), &st))
+      m_wtree.setId(WatchTree::c_root, st.st_dev, st.st_ino);
+#endif
+    m_wtree.queueTouched();
+    if (m_journal)
+      m_journal->backupStarted();
+    if (m_checkpoint && m_checkpoint->begin(m_backup_root, m_resume_within))
+      MTrace(t_up, trace::Info, "Resuming the backup of " << m_backup_root);
+    const WatchTree::usage_t u(m_wtree.usage());
+    MTrace(t_cdp, trace::Info, "Watch tree for " << m_backup_root << ": "
+           << u.nodes << " directories, " << u.names << " names, "
+           << u.total() / 1024 << " KiB (nodes " << u.node_bytes / 1024
+           << ", index " << u.index_bytes / 1024 << ", names "
+           << u.name_bytes / 1024 << ")");
+  }
+#if defined(__unix__) || defined(__APPLE__)
+  if (m_owner_prefill)
+    m_owners.prefill();
+  { const OwnerCache::stats_t os(m_owners.stats());
+    MTrace(t_up, trace::Info, "Owner cache: " << os.users << " users, "
+           << os.groups << " groups, " << os.hits << " hits, "
+           << os.misses << " misses");
   }
+  m_cachestats.read = 0;
+  m_cachestats.added = 0;
+#endif
   // Set up
-  addWorkItem(0, papply(new dirstate_t(m_backup_root, 0, m_wroot),
-                        &Upload::dirstate_t::process_scan).clone());
-  // Start additional workers if any are needed
+  addWorkItem(workitem_t(new dirstate_t(m_backup_root, 0, WatchTree::c_root),
+                         workitem_t::OpScan));
+  // Start additional workers if any are needed. Their queues must be
+  // in place before thieves can see them.
   for (size_t i = m_workers.size(); i < m_nworkers; ++i) {
+    if (long(i) == m_nqueues) {
+      m_queues[i] = new workqueue_t;
+      atomicAdd(m_nqueues, 1);
+    }
     m_workers.push_back(Processor(*this, i));
     m_workers.back().start();
   }
@@ -625,16 +947,22 @@ void Upload::cancelUpload()
 
 bool Upload::cancelInProgress()
 {
-  MutexLock l(m_workqueue_lock);
   return m_backup_cancelled;
 }
 
 void Upload::checkForCompletion()
 {
   if (!isWorking()) {
-    MutexLock l(m_workqueue_lock);
+    MutexLock l(m_completion_lock);
     if (!m_completion_notify_done) {
       MTrace(t_worker, trace::Info, "Last worker calling completion notify");
+#if defined(__unix__) || defined(__APPLE__)
+      if (m_measure_cache)
+        MTrace(t_up, trace::Info, "Page cache: read "
+               << m_cachestats.read / 1048576 << " MiB, left "
+               << m_cachestats.added / 1048576
+               << " MiB in cache that was not there before");
+#endif
       m_completion_notify_done = true;
       if (m_completion_notify)
         (*m_completion_notify)(*this);
@@ -644,10 +972,8 @@ void Upload::checkForCompletion()
 
 bool Upload::isWorking_nowl()
 {
-  MutexLock l2(m_workqueue_lock);
-
-  // If there are items in the work queue, we're working
-  if (!m_workqueue.empty())
+  // If there are items in the work queues, we're working
+  if (atomicAdd(m_queued, 0))
     return true;
 
   // If any of the threads are not OSIdle, then we're working
@@ -672,6 +998,12 @@ const std::string &Upload::getBackupRoot()
   return m_backup_root;
 }
 
+WatchTree::usage_t Upload::getWatchUsage()
+{
+  MutexLock l(m_wtree_lock);
+  return m_wtree.usage();
+}
+
 Upload::LatestSnapshotInfo Upload::getLatestSnapshotInfo()
 {
   MutexLock l(m_latestSnapshotInfoLock);
@@ -727,9 +1059,14 @@ bool Upload::Processor::isBusy() const
   return m_is_busy;
 }
 
+size_t Upload::Processor::id() const
+{
+  return m_instance_id;
+}
+
 bool Upload::touchPath(const std::string &fullpath)
 {
-  MutexLock l(m_wroot_lock);
+  MutexLock l(m_wtree_lock);
   // See if we are excluded by a filter
   if (m_filter && !(*m_filter)(fullpath)) {
     MTrace(t_up, trace::Debug, "Touched directory filtered - ignoring");
@@ -739,55 +1076,186 @@ bool Upload::touchPath(const std::string &fullpath)
     if (*path.rbegin() == '/' || *path.rbegin() == '\\') {
       path=path.substr(0, path.length()-1);
     }
-    m_wroot.insert(path).markTouched();
+    m_wtree.markTouched(m_wtree.insert(path));
+    if (m_journal)
+      m_journal->touched(path);
     return true;
   }
   return false;
 }
 
-Upload::workitem_t *Upload::getWorkItem()
+void Upload::touchAll()
+{
+  MutexLock l(m_wtree_lock);
+  m_wtree.touchAll();
+  if (m_journal)
+    m_journal->touchedAll();
+}
+
+void Upload::openJournal(const std::string &fname, bool monitorComplete)
+{
+  MutexLock l(m_wtree_lock);
+  delete m_journal;
+  m_journal = 0;
+  m_journal = new ChangeJournal(fname);
+
+  if (monitorComplete && m_journal->clean() && !m_journal->replayedAll()) {
+    // We know everything that changed since the last backup
+    const std::set<std::string> &paths = m_journal->replayed();
+    for (std::set<std::string>::const_iterator i = paths.begin();
+         i != paths.end(); ++i)
+      m_wtree.markTouched(m_wtree.insert(*i));
+    m_wtree.setQueueNew(false);
+    MTrace(t_cdp, trace::Info, "Journal replayed " << paths.size()
+           << " touched directories under " << m_backup_root);
+  } else {
+    // The next backup must scan everything - and the journal must
+    // say so until it has done so
+    m_wtree.touchAll();
+    m_journal->touchedAll();
+    MTrace(t_cdp, trace::Info, "Journal cannot be trusted - next backup of "
+           << m_backup_root << " scans everything");
+  }
+}
+
+void Upload::openCheckpoint(const std::string &fname, const DiffTime &maxage)
+{
+  MutexLock l(m_workers_lock);
+  delete m_checkpoint;
+  m_checkpoint = 0;
+  m_checkpoint = new Checkpoint(fname);
+  m_resume_within = maxage;
+}
+
+bool Upload::getWorkItem(Processor &p, workitem_t &item)
 {
-  // Wait for an entry to appear
-  m_workqueue_sem.decrement();
-  // Fine, de-queue the item
-  workitem_t *item = 0;
-  { MutexLock l(m_workqueue_lock);
-    if (m_workqueue.empty()) {
-      // No more work. We want to return 0 and let the other threads
-      // know too. So re-increment the semaphore!
+  workqueue_t &own = *m_queues[p.id()];
+  while (true) {
+    // Our own work first, then work added from the outside, then
+    // whatever we can steal
+    if (popWork(own, item) || popWork(m_inject, item)
+        || stealWork(p.id(), item)) {
+      atomicAdd(m_queued, -1);
+      MTrace(t_worker, trace::Debug, "Returning work item");
+      return true;
+    }
+
+    if (m_workqueue_stop) {
+      // No more work. We want to return false and let the other
+      // threads know too.
       m_workqueue_sem.increment();
-    } else {
-      // More work. Pick the item with the greatest depth
-      std::multimap<size_t,workitem_t*>::iterator i = m_workqueue.end();
-      --i;
-      item = i->second;
-      m_workqueue.erase(i);
+      MTrace(t_worker, trace::Debug, "Returning STOP item");
+      return false;
     }
+
+    // Register as a sleeper before the final check for work, so that
+    // anyone adding work after the check will wake us
+    atomicAdd(m_sleepers, 1);
+    if (!atomicAdd(m_queued, 0) && !m_workqueue_stop)
+      m_workqueue_sem.decrement();
+    atomicAdd(m_sleepers, -1);
   }
-  if (item) {
-    MTrace(t_worker, trace::Debug, "Returning work item");
-  } else {
-    MTrace(t_worker, trace::Debug, "Returning STOP item");
+}
+
+bool Upload::popWork(workqueue_t &q, workitem_t &item)
+{
+  MutexLock l(q.lock);
+  if (q.items.empty())
+    return false;
+  item = q.items.back();
+  q.items.pop_back();
+  return true;
+}
+
+bool Upload::stealWork(size_t self, workitem_t &item)
+{
+  const size_t nqueues = atomicAdd(m_nqueues, 0);
+  while (atomicAdd(m_queued, 0)) {
+    // Find the queue with the deepest oldest item
+    workqueue_t *victim = 0;
+    size_t best = 0;
+    for (size_t i = 0; i != nqueues; ++i) {
+      if (i == self)
+        continue;
+      MutexLock l(m_queues[i]->lock);
+      if (!m_queues[i]->items.empty()
+          && (!victim || m_queues[i]->items.front().depth > best)) {
+        victim = m_queues[i];
+        best = victim->items.front().depth;
+      }
+    }
+    if (!victim)
+      return false;
+
+    // Someone may have beaten us to it - then look again
+    MutexLock l(victim->lock);
+    if (!victim->items.empty()) {
+      item = victim->items.front();
+      victim->items.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void Upload::queuedWork()
+{
+  atomicAdd(m_queued, 1);
+  if (atomicAdd(m_sleepers, 0))
+    m_workqueue_sem.increment();
+}
+
+void Upload::addWorkItem(Processor &p, const workitem_t &item)
+{
+  { workqueue_t &q = *m_queues[p.id()];
+    MutexLock l(q.lock);
+    q.items.push_back(item);
   }
-  return item;
+  queuedWork();
 }
 
-void Upload::addWorkItem(size_t p, BindF1Base<void,Upload::Processor&> *i)
+void Upload::addWorkItem(const workitem_t &item)
 {
-  { MutexLock l(m_workqueue_lock);
-    m_workqueue.insert(std::make_pair(p,i));
+  { MutexLock l(m_inject.lock);
+    m_inject.items.push_back(item);
   }
-  m_workqueue_sem.increment();
+  queuedWork();
 }
 
 void Upload::stopWorkQueue()
 {
-  { MutexLock l(m_workqueue_lock);
-    MAssert(m_workqueue.empty(), "Zero work item added on non-empty queue");
-  }
+  m_workqueue_stop = true;
   m_workqueue_sem.increment();
 }
 
+void Upload::workitem_t::operator()(Processor &p) const
+{
+  if (op == OpScan)
+    dir->process_scan(p);
+  else
+    dir->process_upload(p);
+}
+
+Mutex &Upload::dirstateLock(const dirstate_t *d)
+{
+  // dirstate_t objects are heap allocated, so the low bits of their
+  // addresses carry little information
+  return m_dirstate_locks[(reinterpret_cast<uintptr_t>(d) >> 6)
+                         % c_dirstate_stripes];
+}
+
+void Upload::lockDirstates()
+{
+  for (size_t i = 0; i != c_dirstate_stripes; ++i)
+    m_dirstate_locks[i].ll_lock();
+}
+
+void Upload::unlockDirstates()
+{
+  for (size_t i = c_dirstate_stripes; i--; )
+    m_dirstate_locks[i].ll_unlock();
+}
+
 void Upload::complete(ServerConnection &conn,
                       const objseq_t &root, BackupType backupType)
 {
@@ -796,10 +1264,10 @@ void Upload::complete(ServerConnection &conn,
   // Fine, upload a new root object.
   //
   MTrace(t_worker, trace::Info, "Uploading new device root "
-         << root[0].m_hex << " under device name "
+         << root[0].hex() << " under device name "
          << m_device_name);
   using namespace xml;
-  std::string rstr(root[0].m_hex);
+  std::string rstr(root[0].hex());
   char type = (backupType == BTPartial)?'p':'c';
   const IDocument &doc = mkDoc
     (Element("backup")
@@ -826,6 +1294,9 @@ Upload::Processor::Processor(Upload &p, size_t i)
   , m_instance_id(i)
   , m_is_busy(false)
   , m_conn(p.m_conn)
+#if defined(__unix__) || defined(__APPLE__)
+  , m_reader(0)
+#endif
 {
 }
 
@@ -834,9 +1305,19 @@ Upload::Processor::Processor(const Processor &o)
   , m_instance_id(o.m_instance_id)
   , m_is_busy(o.m_is_busy)
   , m_conn(o.m_conn)
+#if defined(__unix__) || defined(__APPLE__)
+  , m_reader(0)
+#endif
 {
 }
 
+Upload::Processor::~Processor()
+{
+#if defined(__unix__) || defined(__APPLE__)
+  delete m_reader;
+#endif
+}
+
 void Upload::Processor::setStatus(threadstatus_t::objstat s, const std::string &o,
 				  const Optional<double> &p)
 {
@@ -861,20 +1342,20 @@ void Upload::Processor::run()
     //
     // Wait for item from work queue
     //
-    if (workitem_t *item = m_parent.getWorkItem()) {
+    workitem_t item;
+    if (m_parent.getWorkItem(*this, item)) {
       //
       // Register that we are busy and execute the item
       //
       m_is_busy = true;
       try {
-        (*item)(*this);
+        item(*this);
       } catch (error &e) {
         // We failed processing - we want to notify the parent of
         // this.
         MTrace(t_worker, trace::Warn, "Aborting backup: " << e.toString());
         m_parent.cancelUpload();
       }
-      delete item;
     } else {
       MTrace(t_worker, trace::Info, "Work stack empty, worker exit");
       return;
@@ -883,129 +1364,6 @@ void Upload::Processor::run()
   m_is_busy = false;
 }
 
-Upload::wnode_t::wnode_t(wnode_t *p, const std::string &n)
-  : m_cdp_touched(false)
-  , m_cdp_queued(true) // all new nodes created during backup should
-                       // be visited
-#if defined(__linux__)
-  , m_wd(-1)
-#endif
-  , m_parent(p)
-  , name(n)
-{
-  // All new nodes created during backup should mark their parent(s)
-  // as having children queued for backup so that we are guaranteed to
-  // visit this child
-  for (wnode_t *i = m_parent; i && !i->m_cdp_queued; i = i->m_parent)
-    i->m_cdp_queued = true;
-}
-
-Upload::wnode_t::~wnode_t()
-{
-  for (std::vector<wnode_t*>::iterator i = children.begin();
-       i != children.end(); ++i)
-    delete *i;
-}
-
-void Upload::wnode_t::touchAll()
-{
-  m_cdp_touched = true;
-  for (std::vector<wnode_t*>::const_iterator i = children.begin();
-       i != children.end(); ++i)
-    (*i)->touchAll();
-}
-
-void Upload::wnode_t::markTouched()
-{
-  // If we' already touched, there is nothing more to do
-  if (m_cdp_touched) return;
-
-  // Fine, mark us and mark our parents
-  m_cdp_touched = true;
-  if (m_parent)
-    m_parent->markTouched();
-}
-
-void Upload::wnode_t::queueTouched()
-{
-  // Move and clear
-  if (m_cdp_touched)
-    MTrace(t_cdp, trace::Debug, "Queuing touched entry: " << name);
-  else
-    MTrace(t_cdp, trace::Debug, "Not queuing untouched entry: " << name);
-  m_cdp_queued = m_cdp_touched;
-  m_cdp_touched = false;
-  // Traverse children - if needed
-  if (m_cdp_queued)
-    for (std::vector<wnode_t*>::const_iterator i = children.begin();
-         i != children.end(); ++i)
-      (*i)->queueTouched();
-}
-
-std::string Upload::wnode_t::absName() const
-{
-#if defined(__unix__) || defined(__APPLE__)
-  const char separator = '/';
-#endif
-#if defined(_WIN32)
-  const char separator = '\\';
-#endif
-  if (m_parent)
-    return m_parent->absName() + separator + name;
-  else
-    return name;
-}
-
-Upload::wnode_t &Upload::wnode_t::insert(const std::string &name, size_t nofs)
-{
-  // If we're at the end, we are the target
-  if (nofs == name.npos)
-    return *this;
-
-  // Cut out component name
-#if defined(__unix__) || defined(__APPLE__)
-  const char separator = '/';
-#endif
-#if defined(_WIN32)
-  const char separator = '\\';
-#endif
-  const size_t cend = name.find(separator, nofs + 1);
-  const std::string cname = name.substr(nofs + 1, cend - nofs - 1);
-
-  // See if any child has the name
-  for (std::vector<wnode_t*>::iterator c = children.begin();
-       c != children.end(); ++c)
-    if ((*c)->name == cname)
-      return (*c)->insert(name, cend);
-
-  // No match, insert.
-  children.push_back(new wnode_t(this, cname));
-  return children.back()->insert(name, cend);
-}
-
-Upload::wnode_t &Upload::wnode_t::getChild(const std::string &cn)
-{
-  for (std::vector<wnode_t*>::const_iterator i = children.begin();
-       i != children.end(); ++i)
-    if ((*i)->name == cn) {
-      MTrace(t_cdp, trace::Debug, "wnode_t::getChild(" << cn << ") found match (q="
-             << (*i)->m_cdp_queued << ")");
-      return **i;
-    }
-  // Not found. Create
-  MTrace(t_cdp, trace::Debug, "wnode_t::getChild(" << cn << ") creating new child");
-  children.push_back(new wnode_t(this, cn));
-  return *children.back();
-}
-
-void Upload::wnode_t::tracetree(size_t indent)
-{
-  MTrace(t_up, trace::Info, std::string(indent, '|') << name);
-  for (std::vector<wnode_t*>::iterator c = children.begin();
-       c != children.end(); ++c)
-    (*c)->tracetree(indent + 1);
-}
-
 ///#if defined (__APPLE__) 
 UploadManager::UploadManager(FSCache &cache, ServerConnection &conn, const std::string &deviceID, const std::string &userID)
 
@@ -1080,6 +1438,20 @@ void UploadManager::addUploadRoot(const std::string &p)
 #if defined(__linux__)
   upload->setAddWatchDelegate(papply(&m_dirMonitor, &DirMonitor::addDir));
 #endif
+
+  // One journal per root, next to the cache. Elsewhere than on Linux
+  // the monitors watch each root recursively, so they see every
+  // change without the tree being walked first.
+#if defined(__linux__)
+  const bool monitorComplete = false;
+#else
+  const bool monitorComplete = true;
+#endif
+  const std::string rootid(sha256::hash(path).hex().substr(0, 16));
+  upload->openJournal(m_cache.fileName() + ".journal." + rootid,
+                      monitorComplete);
+  upload->openCheckpoint(m_cache.fileName() + ".checkpoint." + rootid,
+                         DiffTime::iso("PT24H"));
 }
 
 void UploadManager::addPathMonitor(const std::string &p)
@@ -1246,7 +1618,7 @@ void UploadManager::handleSnapshotNotification(Upload &upload)
   MutexLock l(m_snapshotNotificationLock);
 
   objseq_t root_hash;
-  std::list<dirobj_t> dirobj_lorm;
+  std::vector<dirobj_t> dirobj_lorm;
   bool partialSnapshot = false;
 
   for (uploads_t::iterator uploadIt = m_uploads.begin();
@@ -1302,15 +1674,15 @@ void UploadManager::handleSnapshotNotification(Upload &upload)
   // Now create a directory object holding our LoR and LoM.
   // - split as necessary to stay within ng_chunk_size.
   //
-  while (!dirobj_lorm.empty()) {
+  for (size_t next = 0; next != dirobj_lorm.size(); ) {
     std::vector<uint8_t> object;
     uint64_t treesize;
-    size_t n = encodeDirObjs(object, treesize, dirobj_lorm, partialSnapshot);
+    const size_t n = splitDirObjs(treesize, dirobj_lorm, next, false);
+    encodeDirObjs(object, treesize, dirobj_lorm, next, n, partialSnapshot,
+                  false);
 
-    // Remove the entries we serialised
-    for (size_t i = 0; i < n; i++) {
-      dirobj_lorm.pop_front();
-    }
+    // Skip the entries we serialised
+    next += n;
 
     MTrace(t_upm, trace::Debug, "Encoded backup root object of size "
            << object.size());
@@ -1340,16 +1712,16 @@ void UploadManager::handleSnapshotNotification(Upload &upload)
       
 #if defined (__APPLE__)
       MTrace(t_upm, trace::Info, "Uploading new device root "
-             << root_hash[0].m_hex << " under device name "
+             << root_hash[0].hex() << " under device name "
              << m_deviceName<<" For user "<< m_userID);
 #else
       MTrace(t_upm, trace::Info, "Uploading new device root "
-             << root_hash[0].m_hex << " under device name "
+             << root_hash[0].hex() << " under device name "
              << m_deviceName);
 #endif
 
     using namespace xml;
-    std::string rstr(root_hash[0].m_hex);
+    std::string rstr(root_hash[0].hex());
     Time tstamp = Time::now();
     char backupType = partialSnapshot?'p':'c'; // partial:complete
     const IDocument &doc = mkDoc
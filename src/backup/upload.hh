@@ -16,8 +16,13 @@
 #include "metatree.hh"
 #include "utils.hh"
 #include "dir_monitor.hh"
+#include "watchtree.hh"
+#include "journal.hh"
+#include "checkpoint.hh"
+#include "ownercache.hh"
 
 #if defined(__unix__) || defined(__APPLE__)
+# include "chunkreader.hh"
 # include <sys/types.h>
 # include <sys/stat.h>
 # include <unistd.h>
@@ -40,10 +45,15 @@
 
 #include <set>
 #include <map>
+#include <deque>
 #include <stack>
 #include <vector>
 #include <list>
 
+#if defined(__unix__) || defined(__APPLE__)
+class ChunkReader;
+#endif
+
 struct sizehash_t {
   sizehash_t() : size(0) { }
   sizehash_t(uint64_t s, const objseq_t &h)
@@ -52,6 +62,32 @@ struct sizehash_t {
   objseq_t hash;
 };
 
+/// The LoR and LoM entries of one child object in a directory
+/// object
+struct dirobj_t {
+  dirobj_t() : treesize(0) { }
+  dirobj_t(const objseq_t &lor, const std::vector<uint8_t> &lom, uint64_t s)
+    : lor_hash(lor), lom_data(lom), treesize(s) { }
+  bool operator==(const dirobj_t &o) const {
+    return treesize == o.treesize && lor_hash == o.lor_hash
+      && lom_data == o.lom_data;
+  }
+  objseq_t lor_hash;
+  std::vector<uint8_t> lom_data;
+  uint64_t treesize;
+};
+
+/// Sort entries by name, as an indexed directory object holds them,
+/// keeping only the most recent of entries with the same name
+void sortDirObjs(std::vector<dirobj_t> &dirobj_lorm);
+
+/// Serialise a directory object of n entries from the given position
+/// on. An indexed (version 1) object expects the entries sorted by
+/// name.
+void encodeDirObjs(std::vector<uint8_t> &object_out, uint64_t treesize,
+                   const std::vector<dirobj_t> &dirobj_lorm,
+                   size_t first, size_t n, bool partial, bool indexed);
+
 /// Download object
 void fetchObject(ServerConnection &conn, const sha256 &hash,
                  std::vector<uint8_t> &obj);
@@ -70,9 +106,32 @@ public:
   /// We must destroy allocated structures
   ~Upload();
 
-  /// Set number of workers to use.
+  /// Set number of workers to use (at most 256).
   Upload &setWorkers(size_t n);
 
+  /// Set the number of file data reads each worker may keep in
+  /// flight. Above one, this uses io_uring where the kernel supports
+  /// it. Default is 4.
+  Upload &setReadDepth(size_t n);
+
+  /// Upload directories as indexed (version 1) objects, whose entries
+  /// are sorted by name so that a name is found by binary search.
+  /// Default is off; older readers only know version 0.
+  Upload &setDirIndex(bool);
+
+#if defined(__unix__) || defined(__APPLE__)
+  /// Set the time owner user and group names are cached for (default
+  /// ten minutes), and whether the user and group databases are
+  /// enumerated into the cache when a backup starts
+  Upload &setOwnerCache(const DiffTime &ttl, bool prefill);
+
+  /// Set how file data reads treat the page cache (default is to
+  /// leave it to the kernel), and whether to measure how much of the
+  /// page cache the backup displaces. The measurement is traced when
+  /// the backup completes.
+  Upload &setReadCache(ChunkReader::cache_t mode, bool measure);
+#endif
+
   /// Include a filter for exclude filtering. This closure is applied
   /// on every file system object we encounter, and if it returns
   /// false the object is skipped.
@@ -131,6 +190,9 @@ public:
   /// Get path of backup root
   const std::string &getBackupRoot();
 
+  /// Size and memory use of our tree of watched directories
+  WatchTree::usage_t getWatchUsage();
+
   enum BackupType { BTUnknown, BTComplete, BTPartial };
 
   struct LatestSnapshotInfo {
@@ -146,10 +208,37 @@ public:
   
   /// Touch the path relative to the root
   bool touchPath(const std::string &path);
+
+  /// Touch everything - when change notifications were lost
+  void touchAll();
+
+  /// Record touched directories in the given journal file, and
+  /// replay what it holds from before. If the journal was closed
+  /// cleanly and the change monitor sees every change in the tree
+  /// without us walking it first (monitorComplete), the next backup
+  /// only visits the directories from the journal. Otherwise it scans
+  /// everything, as it does without a journal.
+  void openJournal(const std::string &fname, bool monitorComplete);
+
+  /// Record the progress of backups in the given checkpoint file, so
+  /// that a backup that does not complete can be resumed by the next
+  /// one if that starts within maxage of it. A resumed backup does
+  /// not traverse the directories completed before, unless they
+  /// changed, and continues large files where it left off.
+  void openCheckpoint(const std::string &fname, const DiffTime &maxage);
 #if defined(__linux__)
   /// Touch the path that leads to watched folder defined by inotify watch descriptor
   bool touchPathWD(int wd);
   Upload &setAddWatchDelegate(const BindF1Base<int,const std::string&> &);
+
+  /// Record device and inode numbers of the directories we scan, so
+  /// that file system wide change events can be resolved by
+  /// touchPathID()
+  Upload &setTrackIds(bool);
+
+  /// Touch the directory with the given device and inode numbers. If
+  /// we do not know it by those, the given absolute path is touched.
+  bool touchPathID(uint64_t dev, uint64_t ino, const std::string &path);
 #endif
 
  private:
@@ -207,6 +296,7 @@ public:
     /// instance id [0-n]
     Processor(Upload &p, size_t);
     Processor(const Processor &);
+    ~Processor();
 
 #if defined(__unix__) || defined(__APPLE__)
     /// Our dirstate_t object can call this member to look up a
@@ -235,6 +325,14 @@ public:
     /// or not
     bool isBusy() const;
 
+    /// Our instance id, which is also the index of our work queue
+    size_t id() const;
+
+#if defined(__unix__) || defined(__APPLE__)
+    /// Our file data reader - created on first use
+    ChunkReader &reader();
+#endif
+
   protected:
     void run();
 
@@ -255,37 +353,41 @@ public:
 
 #if defined(__unix__) || defined(__APPLE__)
     struct l_uid_t {
-      l_uid_t(uid_t u, const std::string &n)
-        : uid(u), name(n) { };
+      l_uid_t(uid_t u, const std::string &n, const Time &e)
+        : uid(u), name(n), expires(e) { };
       l_uid_t() : uid(0) { }
       uid_t uid;
       std::string name;
+      Time expires;
     };
 
-    /// UID cache
+    /// Last UID looked up in the owner cache of our parent
     Optional<l_uid_t> m_last_uid;
     Mutex m_uid_lock;
 
     struct l_gid_t {
-      l_gid_t(gid_t u, const std::string &n)
-        : gid(u), name(n) { };
+      l_gid_t(gid_t u, const std::string &n, const Time &e)
+        : gid(u), name(n), expires(e) { };
       l_gid_t() : gid(0) { }
       gid_t gid;
       std::string name;
+      Time expires;
     };
 
-    /// GID cache
+    /// Last GID looked up in the owner cache of our parent
     Optional<l_gid_t> m_last_gid;
     Mutex m_gid_lock;
+
+    /// File data reader
+    ChunkReader *m_reader;
 #endif
   };
 
   /// A directory state
-  struct wnode_t;
   struct dirstate_t {
     /// Initialise a dirstate for a new directory to process
     dirstate_t(const std::string &name, dirstate_t *parent,
-               Upload::wnode_t &w, const CObject & = CObject());
+               WatchTree::node_t w, const CObject & = CObject());
 
     ~dirstate_t();
 
@@ -299,12 +401,9 @@ public:
     }
 
     /// When an entry is inserted in the work queue, we need to know
-    /// its depth. This method computes the depth of the entry. Cache
-    /// the result from this function if you need it multiple times,
-    /// as it does not cache the result by itself (and therefore runs
-    /// in O(d) time where d is the depth (distance from root) of the
-    /// current node in the tree).
-    size_t getDepth() const;
+    /// its depth (distance from root). This is computed once, when
+    /// the dirstate is created.
+    size_t getDepth() const { return depth; }
 
     /// Our absolute path name
     std::string absPath() const;
@@ -327,8 +426,11 @@ public:
     /// This is our parent directory (or null if we are the root)
     dirstate_t *parent;
 
-    /// This is our associated watch object
-    wnode_t &watch;
+    /// Our depth in the tree
+    const size_t depth;
+
+    /// This is our associated node in the watch tree
+    const WatchTree::node_t watch;
 
     /// This is the list of child directories that have not yet
     /// completed processing
@@ -378,89 +480,167 @@ public:
     /// uploads). The worker has its own server connection - but aside
     /// from that we use the Upload object FS cache.
     void upload(Processor &);
+
+    /// Upload a partial snapshot of the directory while it still has
+    /// incomplete children. The first snapshot is a full upload();
+    /// after that, the entries of the other child objects found then
+    /// are reused so that the directory is not scanned again, and only
+    /// the directory objects whose entries changed are encoded anew.
+    void snapshot(Processor &);
+
+    /// Non-directory entries found by the last partial upload(), for
+    /// later snapshots. Valid if files_cached is set.
+    std::vector<dirobj_t> file_entries;
+    bool files_cached;
+
+    /// What a directory object that we encoded and uploaded held
+    struct split_t {
+      size_t first;
+      size_t count;
+      uint64_t treesize;
+      sha256 hash;
+    };
+
+    /// The entries of our last partial upload and the objects they
+    /// were split into
+    std::vector<dirobj_t> encoded_entries;
+    std::vector<split_t> encoded_splits;
+
+    /// Add the entries of our child directories, in fixed order
+    void addChildEntries(Processor &, std::vector<dirobj_t> &);
+
+    /// Encode our directory object(s) from the given entries, upload
+    /// what the server does not have and update our cobj
+    void encodeUpload(Processor &, std::vector<dirobj_t> &);
+
+#if defined(__unix__) || defined(__APPLE__)
+    /// A changed file whose data has been queued on the processor
+    /// reader during upload()
+    struct pendingfile_t;
+
+    /// Read, hash and upload the data of the first file queued on
+    /// the processor reader and update the cache and our directory
+    /// entry for it
+    void uploadPending(Processor &, pendingfile_t &);
+#endif
   };
 
 #if defined(__linux__)
   /// On Linux we need to map from inotify watch descriptor into
-  /// wnode_t.
-  typedef std::map<int, wnode_t*> inotify2wnode_t;
+  /// watch tree node.
+  typedef std::map<int, WatchTree::node_t> inotify2wnode_t;
   inotify2wnode_t m_inotify2wnode;
 #endif
 
-  /// This is our completely generalised priority queue for work
-  /// during upload processing.
-  //
-  /// Work items on this queue is executed in order, with the highest
-  /// keys executing first.
-  //
-  /// During normal upload processing, we add the processing of a
-  /// dirstate_t to the queue with the key set to the absolute depth
-  /// of the dirstate_t object. This will give us a depth-first-like
-  /// upload behaviour.
-  //
-  /// When performing a partial upload, we add the necessary upload
-  /// jobs to the queue with a much higher priority - we simply add an
-  /// integer constant higher than any directory depth can be to
-  /// facilitate this.
+  /// A unit of work for a Processor: the scan or the upload of a
+  /// directory. Work items are plain values held directly in the
+  /// work queues, so queuing work allocates nothing.
+  struct workitem_t {
+    enum op_t { OpScan, OpUpload };
+    workitem_t() : dir(0), op(OpScan), depth(0) { }
+    workitem_t(dirstate_t *d, op_t o)
+      : dir(d), op(o), depth(d->getDepth()) { }
+    /// Execute the item
+    void operator()(Processor &) const;
+    dirstate_t *dir;
+    op_t op;
+    size_t depth;
+  };
+
+  /// A work queue and its lock
+  struct workqueue_t {
+    Mutex lock;
+    std::deque<workitem_t> items;
+  };
+
+  /// Every Processor has its own work queue, indexed by its instance
+  /// id. Work produced by a processor goes on its own queue, from
+  /// which it takes the most recently added (and therefore usually
+  /// deepest) item first; this gives us a depth-first-like upload
+  /// behaviour like the single priority queue we used to have.
   //
-  /// After execution, the de-queued item is deleted by the
-  /// Processor::run method that executes the item.
+  /// A processor whose queue is empty steals the oldest item of
+  /// another queue, choosing the queue whose oldest item is
+  /// deepest. Oldest items are the shallowest of their queue and
+  /// therefore carry the most work, but among those we prefer the
+  /// deepest to keep the number of live dirstates down.
   //
-  Mutex m_workqueue_lock;
-  std::multimap<size_t,BindF1Base<void,Processor&>*> m_workqueue;
-
-  /// We use a semaphore for waiting on work queue items
+  /// Queues are created as workers are started and are never
+  /// removed, so thieves can walk them without a global lock.
+  enum { c_max_workers = 256 };
+  workqueue_t *m_queues[c_max_workers];
+  /// Number of queues in m_queues
+  volatile long m_nqueues;
+
+  /// Work added from outside the processors (the root item) goes
+  /// here
+  workqueue_t m_inject;
+
+  /// Number of queued items over all queues
+  volatile long m_queued;
+  /// Number of processors waiting for work
+  volatile long m_sleepers;
+  /// Set when the processors should exit
+  volatile bool m_workqueue_stop;
+
+  /// Idle processors wait on this semaphore. It is only incremented
+  /// when work is added while a processor may be waiting.
   Semaphore m_workqueue_sem;
 
+  /// Protects the completion notification status
+  Mutex m_completion_lock;
+
   /// Set to false when a backup is initiated - set true when a worker
   /// thread exits due to a cancelled backup. The variable is not
   /// protected by locks
   bool m_backup_cancelled;
 
-  /// When we start scanning a directory, we remove it from the todo
-  /// stack. We then add all its child directories to the todo
-  /// stack. Finally, we check the directory for upload-readiness.
-  //
-  /// A directory is ready for upload if it has no
-  /// incomplete_children.
-  //
-  /// If a directory is upload-ready, we process all its files and we
-  /// already have the complete_children list for child directory
-  /// names and multirefs. When the directory is uploaded, we must
-  /// follow its parent pointer and move the directory from the
-  /// incomplete_children list in the parent to the complete_children
-  /// list in the parent. After that, the upload-readiness check must
-  /// be performed on the parent as well.
+  /// When we start scanning a directory, we add all its child
+  /// directories as work items. A directory is ready for upload when
+  /// it has no incomplete_children; when it has been uploaded, it
+  /// moves itself from the incomplete_children of its parent to the
+  /// parent's complete_children, and the thread that empties the
+  /// parent's incomplete_children schedules the parent for upload.
   //
-  /// When a directory is uploaded, we want to delete its
-  /// complete_children dirstates - but since we also need to
-  /// recursively check for parent upload readiness, the cleanup gets
-  /// slightly messy.  Strictly speaking, we could call
-  /// parent->checkUploadReady() as the last statement in
-  /// checkUploadReady() and therefore still function even though the
-  /// parent will delete us.
-  //
-  /// We need a mutex to protect the m_dir_todo stack.
-  //
-  /// We also need a mutex to proctect the *_children lists in the
-  /// dirstate_t objects. However, we cannot use a mutex in every
-  /// object (mutexes cost), so we could simply use the same mutex as
-  /// we use for the todo stack.
-  Mutex m_dirstate_lock;
+  /// The *_children lists of a dirstate_t are protected by one of a
+  /// set of striped locks chosen by the address of the dirstate_t
+  /// (a mutex in every object would cost too much, a single lock is
+  /// contended with many workers). Taking all stripes (in order)
+  /// locks the whole tree, which we do for partial snapshots.
+  enum { c_dirstate_stripes = 64 };
+  Mutex m_dirstate_locks[c_dirstate_stripes];
+
+  /// The lock for the given dirstate_t
+  Mutex &dirstateLock(const dirstate_t *);
+  /// Lock and unlock every dirstate_t
+  void lockDirstates();
+  void unlockDirstates();
 
-  /// Our work queue works with closures taking one Processor&
-  /// argument. This typedef simply helps our code...
-  typedef BindF1Base<void,Processor&> workitem_t;
+#if defined(__linux__)
+  /// Protects m_inotify2wnode
+  Mutex m_inotify_lock;
+#endif
 
-  /// Called by the processor to request a work item. Returns 0 if no
-  /// more work is to be had and the processor should exit.
-  workitem_t *getWorkItem();
+  /// Called by the processor to request a work item. Waits for work
+  /// and returns false if no more work is to be had and the
+  /// processor should exit.
+  bool getWorkItem(Processor &, workitem_t &);
 
   /// Called by the processor to add a directory as a work item.
-  void addWorkItem(size_t, workitem_t*);
+  void addWorkItem(Processor &, const workitem_t &);
 
-  /// Called by the processor when the root directory has been
-  /// uploaded. This will cause getWorkItem() to start returning 0.
+  /// Add a work item from outside the processors
+  void addWorkItem(const workitem_t &);
+
+  /// Take the newest item of the given queue
+  bool popWork(workqueue_t &, workitem_t &);
+  /// Steal the oldest item of another queue than the given one
+  bool stealWork(size_t, workitem_t &);
+  /// Account for a newly queued item and wake a processor if needed
+  void queuedWork();
+
+  /// This will cause getWorkItem() to start returning 0 once there
+  /// is no more work.
   void stopWorkQueue();
 
   /// For completion of a backup set, the completing Processor object
@@ -485,7 +665,14 @@ public:
   /// *should* use testObject() to test for existence before calling
   /// this method.
   void uploadObject(ServerConnection &, const std::vector<uint8_t> &);
+
+  /// Called by upload processor for chunks of zeros. Makes sure the
+  /// server has the well known zero chunk - we only ask it once.
+  void ensureZeroChunk(ServerConnection &);
 private:
+  /// Whether the server is known to have the zero chunk
+  volatile long m_zero_chunk_known;
+
   /// Our set of workers. This is resized on startUpload().
   Mutex m_workers_lock;
   std::list<Processor> m_workers;
@@ -493,79 +680,11 @@ private:
   /// Number of workers to spawn
   size_t m_nworkers;
 
-  /// When directories are added to a watch list, we must memorise
-  /// them so that we can efficiently run a backup traversing only the
-  /// on-disk directories under which things have changed.
-  struct wnode_t {
-    /// Construct with parent (or 0 if root) and name
-    wnode_t(wnode_t *, const std::string &);
-    ~wnode_t();
-
-    /// If our notification fails and we don't know what has been
-    /// touched, we call this method on the root wnode (m_wroot) to
-    /// mark the full tree as touched.
-    void touchAll();
-
-    /// The CDP monitor will call this method to have the wnode_t
-    /// structure traversed and mark the specified object as touched,
-    /// and all its parents as having a child object that is touched.
-    void markTouched();
-
-    /// This method will move the 'touched' status into the 'queued'
-    /// status and reset the 'touched' status. It is called before
-    /// initiating a backup so that the backup routines can focus on
-    /// backing up anything that was 'queued' for backup, while the
-    /// CDP change monitor can still mark objects as 'touched'
-    /// regardless of the progress of the current backup.
-    void queueTouched();
-
-    /// For change notification (CDP), we track whether this object
-    /// was touched or whether it has children that were touched.
-    //
-    /// When setting this (using markTouched()) we maintain the
-    /// invariant that all ascendents of an object that has
-    /// m_cdp_touched set, will also have m_cdp_touched set.
-    bool m_cdp_touched;
-
-    /// Before starting a backup job, we transfer the touched state
-    /// into the queued state variable - then, if changes occur while
-    /// we are processing, the _touched variable can safely be updated
-    /// without affecting the _queued variablee. The _queued variable
-    /// are reset as we process the backup.
-    bool m_cdp_queued;
-
-#if defined(__linux__)
-    /// On linux we remember our watch descriptor
-    int m_wd;
-#endif
-
-    /// We have a parent or 0
-    wnode_t *m_parent;
-
-    /// The watched object has a name
-    std::string name;
-
-    /// The watched object has children
-    std::vector<wnode_t*> children;
+  /// Reads in flight per worker
+  size_t m_read_depth;
 
-    /// Absolute path name
-    std::string absName() const;
-
-    /// Insert path under wnode_t. The nofs is our offset into the
-    /// name string. This method returns a reference to the wnode_t
-    /// inserted.
-    wnode_t &insert(const std::string &name, size_t nofs = 0);
-
-    /// Locate (and optionally create) child object for given child
-    /// name.
-    wnode_t &getChild(const std::string &name);
-
-    /// Diagnostic - trace the tree
-    void tracetree(size_t indent);
-  private:
-    wnode_t(const wnode_t&);
-    wnode_t &operator=(const wnode_t&);
-  };
+  /// Whether we upload indexed directory objects
+  bool m_dir_index;
 
   /// This is our device name on the back end - we need it when
   /// uploading a new backup root
@@ -578,14 +697,39 @@ private:
   LatestSnapshotInfo m_latestSnapshotInfo;
   Mutex m_latestSnapshotInfoLock;
 
-  /// This is the root of the watched directory tree
-  Mutex m_wroot_lock;
-  wnode_t m_wroot;
+  /// Our journal of touched directories, if any
+  ChangeJournal *m_journal;
+
+  /// Our progress checkpoints, if any, and how old a backup we may
+  /// resume
+  Checkpoint *m_checkpoint;
+  DiffTime m_resume_within;
+
+#if defined(__unix__) || defined(__APPLE__)
+  /// Owner user and group names, shared by our workers
+  OwnerCache m_owners;
+  bool m_owner_prefill;
+
+  /// Page cache treatment of file data reads, and its measurement
+  ChunkReader::cache_t m_cache_mode;
+  bool m_measure_cache;
+  ChunkReader::cachestats_t m_cachestats;
+#endif
+
+  /// When directories are added to a watch list, we must memorise
+  /// them so that we can efficiently run a backup traversing only the
+  /// on-disk directories under which things have changed. The lock
+  /// protects the tree as described in watchtree.hh.
+  Mutex m_wtree_lock;
+  WatchTree m_wtree;
 
 #if defined(__linux__)
   /// In order to monitor directories changes in linux we have to scan recursively
   /// and add every one of them to inotify instance.
   const BindF1Base<int,const std::string&> *m_addWatchDelegate;
+
+  /// Whether we record directory ids in the watch tree
+  bool m_track_ids;
 #endif
 };
 
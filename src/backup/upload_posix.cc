@@ -11,28 +11,174 @@
 bool Upload::touchPathWD(int wd)
 {
   // Treat event - we want to locate the directory that was change
-  inotify2wnode_t::iterator di = m_inotify2wnode.find(wd);
-  // We may have gotten a watch event for something that doesn't
-  // exist any more - just ignore that.
-  if (di == m_inotify2wnode.end()) {
-    MTrace(t_up, trace::Info,
-           "Got watch event on non-existing directory - ignoring");
-  } else {
-    MTrace(t_up, trace::Debug, "directory "
-           << di->second->name << " was touched");
-    // See if we are excluded by a filter
-    if (m_filter && !(*m_filter)(di->second->absName())) {
-      MTrace(t_up, trace::Debug, "Touched directory filtered - ignoring");
-    } else {
-      // Fine, mark dirstate as touched then
-      di->second->markTouched();
+  WatchTree::node_t node;
+  { MutexLock l(m_inotify_lock);
+    inotify2wnode_t::iterator di = m_inotify2wnode.find(wd);
+    // We may have gotten a watch event for something that doesn't
+    // exist any more - just ignore that.
+    if (di == m_inotify2wnode.end()) {
+      MTrace(t_up, trace::Info,
+             "Got watch event on non-existing directory - ignoring");
+      return false;
+    }
+    node = di->second;
+  }
+
+  MutexLock l(m_wtree_lock);
+  MTrace(t_up, trace::Debug, "directory "
+         << m_wtree.name(node) << " was touched");
+  // See if we are excluded by a filter
+  if (m_filter && !(*m_filter)(m_wtree.absName(node))) {
+    MTrace(t_up, trace::Debug, "Touched directory filtered - ignoring");
+    return false;
+  }
+  // Fine, mark dirstate as touched then
+  m_wtree.markTouched(node);
+  if (m_journal)
+    m_journal->touched(m_wtree.absName(node));
+  return true;
+}
+
+Upload &Upload::setTrackIds(bool t)
+{
+  m_track_ids = t;
+  return *this;
+}
+
+bool Upload::touchPathID(uint64_t dev, uint64_t ino, const std::string &path)
+{
+  { MutexLock l(m_wtree_lock);
+    WatchTree::node_t node;
+    if (m_wtree.findId(dev, ino, node)) {
+      MTrace(t_up, trace::Debug, "directory "
+             << m_wtree.name(node) << " was touched");
+      if (m_filter && !(*m_filter)(m_wtree.absName(node))) {
+        MTrace(t_up, trace::Debug, "Touched directory filtered - ignoring");
+        return false;
+      }
+      m_wtree.markTouched(node);
+      if (m_journal)
+        m_journal->touched(m_wtree.absName(node));
       return true;
     }
   }
-  return false;
+
+  // A directory we have not scanned yet; go by its path if it is
+  // under our root - and not merely a sibling sharing its prefix
+  if (path.compare(0, m_backup_root.size(), m_backup_root))
+    return false;
+  if (path.size() != m_backup_root.size()
+      && *m_backup_root.rbegin() != '/'
+      && path[m_backup_root.size()] != '/')
+    return false;
+  return touchPath(path);
 }
 #endif
 
+struct Upload::dirstate_t::pendingfile_t {
+  pendingfile_t() : size(0), resumed_size(0), checkpointed(false) { }
+  /// Our directory entry, waiting for the hashes
+  std::list<dirobj_t>::iterator lorm;
+  CObject cobj;
+  std::string name;
+  uint64_t size;
+  /// The chunks uploaded by the backup we resume, if any; reading
+  /// starts after them
+  objseq_t resumed;
+  uint64_t resumed_size;
+  /// Whether we have checkpointed our progress
+  bool checkpointed;
+};
+
+void Upload::dirstate_t::uploadPending(Processor &proc, pendingfile_t &pf)
+{
+  proc.setStatus(threadstatus_t::OSUploading, pf.name,
+                 pf.size > ng_chunk_size
+                 ? Optional<double>(0) : Optional<double>());
+
+  // We construct a new hash sequence for the new chunks. We should
+  // only upload hashes that we cannot find in our local cache -
+  // however, this is an optimisation for later... Since we do not
+  // write this to the database until the upload of the full file
+  // data is complete, we are guaranteed that whatever we have in our
+  // db also exists on the back end.
+  objseq_t newhash;
+  uint64_t treesize = 0;
+  newhash.swap(pf.resumed);
+  treesize = pf.resumed_size;
+  Checkpoint *checkpoint = proc.refUpload().m_checkpoint;
+  pf.checkpointed = pf.checkpointed || !newhash.empty();
+
+  // Now read a chunk at a time
+  while (true) {
+    std::vector<uint8_t> chunk;
+    chunk.reserve(ng_chunk_size);
+    ser(chunk, uint8_t(0x00)); // Version 0 object
+    ser(chunk, uint8_t(0xfd)); // object type = file data
+    bool hole;
+    if (!proc.reader().next(chunk, hole))
+      break;
+
+    //
+    // A full chunk of zeros - typically a hole that we did not even
+    // read - is the well known zero chunk, which we need not hash and
+    // need only check for on the server once.
+    //
+    if (hole || (chunk.size() == ng_chunk_size && allZero(chunk, 2))) {
+      MTrace(t_up, trace::Debug, "   Chunk of zeros"
+             << (hole ? " (hole)" : ""));
+      newhash.push_back(ng_zero_chunk_hash());
+      treesize += ng_chunk_size;
+      proc.refUpload().ensureZeroChunk(proc.refConn());
+    } else {
+      MTrace(t_up, trace::Debug, "   Read " << chunk.size() - 2
+             << " bytes of chunk data");
+
+      // Fine, we have a chunk.
+      newhash.push_back(sha256::hash(chunk));
+      treesize += chunk.size();
+
+      // Verify with server that it is there
+      if (proc.refUpload().testObject(proc.refConn(), newhash.back())) {
+        MTrace(t_up, trace::Debug, "    Chunk " << newhash.back().hex()
+               << " already exists on server");
+      } else {
+        MTrace(t_up, trace::Debug, "    Chunk " << newhash.back().hex()
+               << " needs upload!");
+        proc.refUpload().uploadObject(proc.refConn(), chunk);
+      }
+    }
+
+    // Update status for large uploads
+    if (pf.size > ng_chunk_size)
+      proc.setStatus(threadstatus_t::OSUploading, pf.name,
+                     std::min(1., 1. * treesize / pf.size));
+
+    // Every chunk so far is on the server; a resumed backup can
+    // continue after them. Only full chunks are followed by more.
+    if (checkpoint && treesize == newhash.size() * ng_chunk_size
+        && !(newhash.size() % g_checkpoint_chunks)) {
+      checkpoint->fileProgress(pf.cobj.m_id, newhash, treesize);
+      pf.checkpointed = true;
+    }
+  }
+  if (checkpoint && pf.checkpointed)
+    checkpoint->fileDone(pf.cobj.m_id);
+
+  // We have now read all chunks. Our newhash contains the new list
+  // of hashes for the metadata entry in our containing directory.
+  pf.cobj.m_hash = newhash;
+  pf.cobj.m_treesize = treesize;
+  if (pf.cobj.m_dbid != -1)
+    proc.refUpload().m_cache.update(pf.cobj);
+  else
+    proc.refUpload().m_cache.insert(pf.cobj);
+  MTrace(t_up, trace::Debug, "Object treesize is: " << pf.cobj.m_treesize);
+
+  pf.lorm->lor_hash = pf.cobj.m_hash;
+  pf.lorm->treesize = pf.cobj.m_treesize;
+}
+
 bool Upload::dirstate_t::scan(Processor &proc)
 {
   // Generate absolute path
@@ -44,64 +190,69 @@ bool Upload::dirstate_t::scan(Processor &proc)
   //
   // Watch, if we're not being watched already
   //
-  if (watch.m_wd == -1 && proc.refUpload().m_addWatchDelegate) {
-    watch.m_wd = (*proc.refUpload().m_addWatchDelegate)(path);
+  WatchTree &wtree = proc.refUpload().m_wtree;
+  if (wtree.wd(watch) == -1 && proc.refUpload().m_addWatchDelegate) {
+    const int wd = (*proc.refUpload().m_addWatchDelegate)(path);
     // If we got -1 back, it means the entry disappeared under us and
     // we just skip it
-    if (watch.m_wd == -1)
+    if (wd == -1)
       return false;
-    // Set up mapping - with proper locking
-    MutexLock l(proc.refUpload().m_dirstate_lock);
-    proc.refUpload().m_inotify2wnode[watch.m_wd] = &watch;
+    wtree.setWd(watch, wd);
+    // Set up mapping - with proper locking. Directories covered by a
+    // file system wide watch have no descriptor of their own.
+    if (wd > 0) {
+      MutexLock l(proc.refUpload().m_inotify_lock);
+      proc.refUpload().m_inotify2wnode[wd] = watch;
+    }
   }
 #endif
 
-  // Get file system info
-  objinfo_t objinfo;
-  { int statrc;
-    while ((statrc = statfs(path.c_str(), &objinfo.fs)) && errno == EINTR);
-    if (statrc) {
-      // If we fail for any reason, skip
-      MTrace(t_up, trace::Info, "Skipping (due to statfs error: "
-             << strerror(errno) << ") " << path);
-      return false;
-    }
+  // Open the directory once - all entries are examined relative to
+  // it so that we do not have the kernel walk the full path for each
+  DirScanner dir;
+  if (!dir.open(path)) {
+    // If we fail for any reason, skip
+    MTrace(t_up, trace::Info, "Skipping (due to opendir error: "
+           << strerror(errno) << ") " << path);
+    return false;
   }
 
-  // Traverse directory...
-  DIR *dir = opendir(path.c_str());
-  if (!dir) {
+  // Get file system info
+  objinfo_t objinfo;
+  if (!dir.statfs(objinfo.fs)) {
     // If we fail for any reason, skip
-    MTrace(t_up, trace::Info, "Skipping (due to opendir error: "
+    MTrace(t_up, trace::Info, "Skipping (due to statfs error: "
            << strerror(errno) << ") " << path);
     return false;
   }
-  ON_BLOCK_EXIT(closedir, dir);
 
-  struct dirent *de;
-  while ((de = readdir(dir))) {
-    // Skip dummy entries
-    { const std::string entry(de->d_name);
-      if (entry == "." || entry == "..")
-        continue;
-    }
+  // Absolute paths are only built for the filter and for tracing
+  const std::string prefix(*path.rbegin() == '/' ? path : (path + "/"));
 
-    // We pass this struct on to the filter later on
-    objinfo.abspath = (*path.rbegin() == '/' ? path : (path + "/")) + de->d_name;
+  DirScanner::entry_t de;
+  while (dir.next(de)) {
+    // If this is not a directory then we do not care about it for
+    // now. Most file systems tell us the type so we need not stat.
+    if (de.type != DT_UNKNOWN && de.type != DT_DIR) {
+      MTrace(t_up, trace::Debug, "Scan skipping non-directory "
+             << de.name);
+      continue;
+    }
 
     // Stat this to see what it is
-    if (-1 == lstat(objinfo.abspath.c_str(), &objinfo.st)) {
+    if (!dir.statAt(de.name, objinfo.st, DirScanner::F_Mode
+                    | DirScanner::F_Owner | DirScanner::F_Ino
+                    | DirScanner::F_Times)) {
       // If lstat fails on this object for any reason, we log it and
       // skip it
       MTrace(t_up, trace::Info, "Scan skipping (due to lstat error: "
-             << strerror(errno) << ") " << objinfo.abspath);
+             << strerror(errno) << ") " << prefix << de.name);
       continue;
     }
 
-    // If this is not a directory then we do not care about it for now
     if (!S_ISDIR(objinfo.st.st_mode)) {
       MTrace(t_up, trace::Debug, "Scan skipping non-directory "
-             << de->d_name);
+             << de.name);
       continue;
     }
 
@@ -109,6 +260,8 @@ bool Upload::dirstate_t::scan(Processor &proc)
     // Check with filter...
     //
     if (proc.refUpload().m_filter) {
+      // We pass this struct on to the filter
+      objinfo.abspath = prefix + de.name;
       if (!(*proc.refUpload().m_filter)(objinfo.abspath)) {
         MTrace(t_up, trace::Debug, "Filter skipping " << objinfo.abspath);
         continue;
@@ -122,17 +275,24 @@ bool Upload::dirstate_t::scan(Processor &proc)
       = proc.refUpload().m_cache.readObj(fsobjid_t(objinfo.st), child_cobj);
 
     //
-    // If watch.getChild() does not find the child it will create a
-    // new node for it. If it does so, the constructor of wnode_t will
-    // ensure that all parents are marked as m_cdp_children_queued and
-    // that the newly created node is marked as m_cdp_queued.
+    // If getChild() does not find the child it will create a new
+    // node for it. If it does so, it will ensure that all parents are
+    // marked as queued and that the newly created node is marked as
+    // queued.
     //
-    // getChild can change the m_wroot tree and must be called holding
-    // the wroot_lock
+    // getChild can change the watch tree and must be called holding
+    // the wtree lock
     //
     dirstate_t *nc;
-    { MutexLock l(proc.refUpload().m_wroot_lock);
-      nc = new dirstate_t(de->d_name, this, watch.getChild(de->d_name), child_cobj);
+    { MutexLock l(proc.refUpload().m_wtree_lock);
+      nc = new dirstate_t(de.name, this,
+                          proc.refUpload().m_wtree.getChild(watch, de.name),
+                          child_cobj);
+#if defined(__linux__)
+      if (proc.refUpload().m_track_ids)
+        proc.refUpload().m_wtree.setId(nc->watch, objinfo.st.st_dev,
+                                       objinfo.st.st_ino);
+#endif
     }
     nc->meta_uid = objinfo.st.st_uid;
     nc->meta_gid = objinfo.st.st_gid;
@@ -140,15 +300,23 @@ bool Upload::dirstate_t::scan(Processor &proc)
 
     // If we are allowed to skip this directory AND we know its
     // hash/treesize, well, take the shortcut...
-    if (!nc->watch.m_cdp_queued && child_unchanged) {
+    if (!proc.refUpload().m_wtree.isQueued(nc->watch) && child_unchanged) {
       MTrace(t_cdp, trace::Debug, " Optimised out traversal of "
-             << objinfo.abspath);
+             << prefix << de.name);
 
       // Insert directly as a complete child.
       complete_children.push_back(nc);
+    } else if (proc.refUpload().m_checkpoint
+               && proc.refUpload().m_checkpoint->findDir(fsobjid_t(objinfo.st),
+                                                         nc->cobj)) {
+      // The backup we resume completed this directory, and it has
+      // not changed since. It stays queued, so that the next backup
+      // looks for what changed in it since then.
+      MTrace(t_cdp, trace::Debug, " Resumed past " << prefix << de.name);
+      complete_children.push_back(nc);
     } else {
       MTrace(t_cdp, trace::Debug, " Need to CDP traverse "
-             << objinfo.abspath);
+             << prefix << de.name);
       // We need to have this child processed before we can know
       // its hash.
       //
@@ -164,6 +332,9 @@ bool Upload::dirstate_t::scan(Processor &proc)
     }
 
   }
+  if (errno)
+    MTrace(t_up, trace::Info, "Error reading directory (" << strerror(errno)
+           << ") " << path);
 
   //
   // If we have no incomplete children and therefore will never be
@@ -196,23 +367,9 @@ void Upload::dirstate_t::upload(Processor &proc)
   // encode our object(s) (plural if split due to size restrictions).
   std::list<dirobj_t> dirobj_lorm;
 
-  // We pass this struct on to the filter later on
-  objinfo_t objinfo;
-
-  // Get file system info
-  { int statrc;
-    while ((statrc = statfs(path.c_str(), &objinfo.fs)) && errno == EINTR);
-    if (statrc) {
-      // If we fail for any reason, skip
-      MTrace(t_up, trace::Info, "Skipping (due to statfs error: "
-             << strerror(errno) << ") " << path);
-      return;
-    }
-  }
-
   // Traverse directory...
-  DIR *dir = opendir(path.c_str());
-  if (!dir) {
+  DirScanner dir;
+  if (!dir.open(path)) {
     // If directory disappeared, handle gracefully
     if (errno == EACCES || errno == ENOENT) {
       MTrace(t_up, trace::Info, "Skipping (due to opendir) " << path);
@@ -220,32 +377,53 @@ void Upload::dirstate_t::upload(Processor &proc)
     }
     throw syserror("opendir", "upload opening directory " + path);
   }
-  ON_BLOCK_EXIT(closedir, dir);
 
-  struct dirent *de;
-  while ((de = readdir(dir))) {
+  // We pass this struct on to the filter later on
+  objinfo_t objinfo;
+
+  // Changed files queued on our reader and not yet uploaded. Whatever
+  // happens, we leave no files queued on the reader.
+  std::deque<pendingfile_t> pending;
+  const size_t window = proc.reader().depth() > 1
+    ? 2 * proc.reader().depth() : 1;
+  ON_BLOCK_EXIT(&ChunkReader::reset, &proc.reader());
+
+  // Get file system info
+  if (!dir.statfs(objinfo.fs)) {
+    // If we fail for any reason, skip
+    MTrace(t_up, trace::Info, "Skipping (due to statfs error: "
+           << strerror(errno) << ") " << path);
+    return;
+  }
+
+  // Absolute paths are only built for the filter and for tracing
+  const std::string prefix(*path.rbegin() == '/' ? path : (path + "/"));
+
+  DirScanner::entry_t de;
+  while (dir.next(de)) {
     // We're scanning...
     proc.setStatus(threadstatus_t::OSScanning, name);
 
-    // Skip dummy entries
-    { const std::string entry(de->d_name);
-      if (entry == "." || entry == "..")
-        continue;
+    // If this is a directory, then we already should have it in our
+    // complete_children container. Anything else that the file
+    // system tells us is not a regular file, we do not back up.
+    if (de.type == DT_DIR)
+      continue;
+    if (de.type != DT_UNKNOWN && de.type != DT_REG) {
+      MTrace(t_up, trace::Debug, "  Skipping unknown object type "
+             << de.name);
+      continue;
     }
 
-    objinfo.abspath = (*path.rbegin() == '/' ? path : (path + "/")) + de->d_name;
-
     // Stat this to see what it is
-    if (-1 == lstat(objinfo.abspath.c_str(), &objinfo.st)) {
+    if (!dir.statAt(de.name, objinfo.st)) {
       // If lstat fails on this object for any reason, we log it and
       // skip it
       MTrace(t_up, trace::Info, "Skipping (due to lstat error: "
-             << strerror(errno) << ") " << objinfo.abspath);
+             << strerror(errno) << ") " << prefix << de.name);
       continue;
     }
 
-    // If this is a directory, then we already should have it in our
-    // complete_children container.
     if (S_ISDIR(objinfo.st.st_mode))
       continue;
 
@@ -267,6 +445,7 @@ void Upload::dirstate_t::upload(Processor &proc)
     // we must update the cache with it
     //
     if (proc.refUpload().m_filter) {
+      objinfo.abspath = prefix + de.name;
       if (!(*proc.refUpload().m_filter)(objinfo.abspath)) {
         MTrace(t_up, trace::Debug, "Filter skipping " << objinfo.abspath);
         continue;
@@ -290,7 +469,7 @@ void Upload::dirstate_t::upload(Processor &proc)
       //
       ser(curr_meta, uint8_t(0x01)); // 0x01 => regular file
       // name
-      ser(curr_meta, std::string(de->d_name));
+      ser(curr_meta, std::string(de.name));
       // owner user and group
       ser(curr_meta, proc.username(objinfo.st.st_uid)); // owner user
       ser(curr_meta, proc.groupname(objinfo.st.st_gid)); // owner group
@@ -305,7 +484,7 @@ void Upload::dirstate_t::upload(Processor &proc)
       //
       // Upload new regular file - set 0% status if file is multi-chunk.
       //
-      proc.setStatus(threadstatus_t::OSUploading, de->d_name,
+      proc.setStatus(threadstatus_t::OSUploading, de.name,
                      (size_t)objinfo.st.st_size > ng_chunk_size
                      ? Optional<double>(0) : Optional<double>());
   
@@ -321,82 +500,51 @@ void Upload::dirstate_t::upload(Processor &proc)
         // The cobj is the actual file data. The hash list is the
         // list of all chunk hashes.
         //
-        // Simply open the file, read chunks one at a time.
-        int fd;
-        while (-1 == (fd = open(objinfo.abspath.c_str(), O_RDONLY, 0))
-               && errno == EINTR);
+        // Open the file and queue it on our reader, which reads
+        // ahead across the queued files. We complete the files in
+        // order as the window of queued files fills up; until then
+        // the directory entry holds a placeholder for the hashes.
+        //
+        // A large file may have been partly uploaded by the backup we
+        // resume; if so we read on from there.
+        objseq_t resumed;
+        uint64_t resumed_size = 0;
+        Checkpoint *checkpoint = proc.refUpload().m_checkpoint;
+        if (checkpoint && uint64_t(objinfo.st.st_size)
+            >= g_checkpoint_chunks * ng_chunk_size
+            && checkpoint->findFile(fsobjid_t(objinfo.st), resumed,
+                                    resumed_size))
+          MTrace(t_up, trace::Debug, "   Resuming after "
+                 << resumed.size() << " chunks");
+
+        const int fd = dir.openFile(de.name);
         if (fd == -1) {
-          MTrace(t_up, trace::Warn, "Unable to open file \"" << objinfo.abspath
-                 << "\" (" << strerror(errno) << ") - skipping");
+          MTrace(t_up, trace::Warn, "Unable to open file \"" << prefix
+                 << de.name << "\" (" << strerror(errno) << ") - skipping");
           continue;
         }
-        ON_BLOCK_EXIT(close, fd);
-
-        // We construct a new hash sequence for the new chunks. We
-        // should only upload hashes that we cannot find in our
-        // local cache - however, this is an optimisation for
-        // later... Since we do not write this to the database until
-        // the upload of the full file data is complete, we are
-        // guaranteed that whatever we have in our db also exists on
-        // the back end.
-        objseq_t newhash;
-        uint64_t treesize = 0;
-
-        // Now read a chunk at a time
-        while (true) {
-          std::vector<uint8_t> chunk;
-          ser(chunk, uint8_t(0x00)); // Version 0 object
-          ser(chunk, uint8_t(0xfd)); // object type = file data
-          chunk.resize(ng_chunk_size);
-          int rrc;
-          size_t ofs = 2;
-          do {
-            rrc = read(fd, &chunk[ofs], chunk.size() - ofs);
-            if (rrc == -1 && errno == EINTR)
-              continue;
-            if (rrc == -1)
-              throw syserror("read", "reading file data from "
-                             + objinfo.abspath + " for backup");
-            ofs += rrc;
-          } while (rrc && ofs < chunk.size());
-
-          MTrace(t_up, trace::Debug, "   Read " << ofs - 2 << " bytes of chunk data");
-          if (!(ofs - 2))
-            break;
-
-          // Fine, we have a chunk.
-          chunk.resize(ofs);
-          newhash.push_back(sha256::hash(chunk));
-          treesize += chunk.size();
-
-          // Verify with server that it is there
-          if (proc.refUpload().testObject(proc.refConn(), newhash.back())) {
-            MTrace(t_up, trace::Debug, "    Chunk " << newhash.back().m_hex
-                   << " already exists on server");
-          } else {
-            MTrace(t_up, trace::Debug, "    Chunk " << newhash.back().m_hex
-                   << " needs upload!");
-            proc.refUpload().uploadObject(proc.refConn(), chunk);
-          }
-
-          // Update status for large uploads
-          if (objinfo.st.st_size > off_t(ng_chunk_size))
-            proc.setStatus(threadstatus_t::OSUploading, de->d_name,
-                           std::min(1., 1. * treesize / objinfo.st.st_size));
-
-          // If this chunk was smaller than max, then we are done. We
-          // do not want to continue reading small blocks from a log
-          // file for example
-          if (chunk.size() < ng_chunk_size)
-            break;
+        // A file using less space than its size has holes
+        proc.reader().add(fd, objinfo.st.st_size, prefix + de.name,
+                          uint64_t(objinfo.st.st_blocks) * 512
+                          < uint64_t(objinfo.st.st_size),
+                          resumed.size() * (ng_chunk_size - 2));
+
+        pending.push_back(pendingfile_t());
+        pendingfile_t &pf = pending.back();
+        pf.resumed.swap(resumed);
+        pf.resumed_size = resumed_size;
+
+        pf.lorm = dirobj_lorm.insert(dirobj_lorm.end(),
+                                     dirobj_t(objseq_t(), curr_meta, 0));
+        pf.cobj = child_cobj;
+        pf.name = de.name;
+        pf.size = objinfo.st.st_size;
+
+        while (pending.size() >= window) {
+          uploadPending(proc, pending.front());
+          pending.pop_front();
         }
-
-        // We have now read all chunks. Our newhash contains the new
-        // list of hashes for the metadata entry in our containing
-        // directory.
-        child_cobj.m_hash = newhash;
-        child_cobj.m_treesize = treesize;
-        meta_changed = true;
+        continue;
       }
 
     } else {
@@ -426,9 +574,29 @@ void Upload::dirstate_t::upload(Processor &proc)
     continue;
   }
 
+  // Complete the files still queued
+  for (; !pending.empty(); pending.pop_front())
+    uploadPending(proc, pending.front());
+
   MTrace(t_up, trace::Debug, " Directory scan processing done. "
          << "Now process complete children.");
 
+  // Snapshots of us may follow as long as we have incomplete
+  // children; they will reuse what we found here.
+  files_cached = !incomplete_children.empty();
+  if (files_cached)
+    file_entries.assign(dirobj_lorm.begin(), dirobj_lorm.end());
+  else
+    std::vector<dirobj_t>().swap(file_entries);
+
+  std::vector<dirobj_t> entries(dirobj_lorm.begin(), dirobj_lorm.end());
+  addChildEntries(proc, entries);
+  encodeUpload(proc, entries);
+}
+
+void Upload::dirstate_t::addChildEntries(Processor &proc,
+                                         std::vector<dirobj_t> &dirobj_lorm)
+{
   //
   // Our child directories should already be processed and available
   // under complete_children. We do not need to hold any lock to
@@ -470,90 +638,18 @@ void Upload::dirstate_t::upload(Processor &proc)
     dirobj_lorm.push_back(dirobj_t((*ci)->cobj.m_hash, meta,
                                    (*ci)->cobj.m_treesize));
   }
-
-  // All objects in directory updated.
-  MTrace(t_up, trace::Debug, "Done with all entries under " << path
-         << " - will encode directory object(s)");
-
-  //
-  // We will build a new multiref and treesize.
-  //
-  cobj.m_treesize = 0;
-  objseq_t existing_hash;
-  existing_hash.swap(cobj.m_hash);
-
-  //
-  // Now create a directory object holding our LoR and LoM.
-  // - split as necessary to stay within ng_chunk_size.
-  //
-  proc.setStatus(threadstatus_t::OSUploading, name);
-  while (!dirobj_lorm.empty()) {
-
-    std::vector<uint8_t> object;
-    uint64_t treesize;
-    size_t n = encodeDirObjs(object, treesize, dirobj_lorm, !incomplete_children.empty());
-
-    // Remove the entries we serialised
-    for (size_t i = 0; i < n; i++) {
-      dirobj_lorm.pop_front();
-    }
-
-    MTrace(t_up, trace::Debug, "Encoded object of size "
-           << object.size());
-
-    //
-    // Compute child object hash and add it to the cobj hash list
-    //
-    const sha256 object_hash(sha256::hash(object));
-    cobj.m_treesize += treesize;
-    cobj.m_hash.push_back(object_hash);
-
-    //
-    // Before we ask the server if we need to upload the object, let's
-    // see if our cache already had a match on the dev/ino. If it did,
-    // then maybe the hash is unchanged and we don't need to ask the
-    // server...
-    //
-    if (cobj.m_dbid != -1) {
-      const size_t current_hash_index = cobj.m_hash.size() - 1;
-      if (existing_hash.size() >= cobj.m_hash.size()
-          && existing_hash[current_hash_index] == cobj.m_hash[current_hash_index]) {
-        MTrace(t_up, trace::Debug, " object previously uploaded.");
-        continue;
-      } else {
-        MTrace(t_up, trace::Debug, " object changed from cached version.");
-      }
-    } else {
-      MTrace(t_up, trace::Debug, " object not previously cached.");
-    }
-
-
-    //
-    // Fine, we now have an object to upload.
-    //
-    if (!proc.refUpload().testObject(proc.refConn(), object_hash)) {
-      MTrace(t_up, trace::Debug, " upload necessary");
-      proc.refUpload().uploadObject(proc.refConn(), object);
-    } else {
-      MTrace(t_up, trace::Debug, " object already on servers");
-    }
-    // Continue until nothing left
-  }
-
-  // Done. sizehash set. Update cache with both our sizehash and the
-  // mtime/ctime that was set during scan.
-  if (parent) {
-    if (cobj.m_dbid == -1) {
-      proc.refUpload().m_cache.insert(cobj);
-    } else {
-      proc.refUpload().m_cache.update(cobj);
-    }
-  }
 }
 
-namespace {
-  Mutex g_pwuid_lock;
-  Mutex g_grgid_lock;
+ChunkReader &Upload::Processor::reader()
+{
+  // Reads hold a full chunk, less the object header
+  if (!m_reader)
+    m_reader = ChunkReader::create(ng_chunk_size - 2,
+                                   m_parent.m_read_depth,
+                                   m_parent.m_cache_mode,
+                                   m_parent.m_measure_cache
+                                   ? &m_parent.m_cachestats : 0);
+  return *m_reader;
 }
 
 std::string Upload::Processor::username(uid_t uid)
@@ -562,22 +658,15 @@ std::string Upload::Processor::username(uid_t uid)
 
   // Most of the time, files are owned by the same user. Let's
   // optimise out the common case here.
-  if (m_last_uid.isSet() && m_last_uid.get().uid == uid)
+  if (m_last_uid.isSet() && m_last_uid.get().uid == uid
+      && Time::now() < m_last_uid.get().expires)
     return m_last_uid.get().name;
 
   // Fine, we must do lookup then.
-  MutexLock l2(g_pwuid_lock);
-  struct passwd *pw = getpwuid(uid);
-  if (pw) {
-    m_last_uid = l_uid_t(uid, pw->pw_name);
-    return pw->pw_name;
-  }
-
-  // Return failed lookup
-  std::ostringstream numeric;
-  numeric << uid;
-  m_last_uid = l_uid_t(uid, numeric.str());
-  return numeric.str();
+  Time expires;
+  const std::string name(m_parent.m_owners.username(uid, &expires));
+  m_last_uid = l_uid_t(uid, name, expires);
+  return name;
 }
 
 /// Find textual name for group id
@@ -587,22 +676,15 @@ std::string Upload::Processor::groupname(gid_t gid)
 
   // Most of the time, files are owned by the same user. Let's
   // optimise out the common case here.
-  if (m_last_gid.isSet() && m_last_gid.get().gid == gid)
+  if (m_last_gid.isSet() && m_last_gid.get().gid == gid
+      && Time::now() < m_last_gid.get().expires)
     return m_last_gid.get().name;
 
   // Fine, we must do lookup then.
-  MutexLock l2(g_grgid_lock);
-  struct group *gr = getgrgid(gid);
-  if (gr) {
-    m_last_gid = l_gid_t(gid, gr->gr_name);
-    return gr->gr_name;
-  }
-
-  // Return failed lookup
-  std::ostringstream numeric;
-  numeric << gid;
-  m_last_gid = l_gid_t(gid, numeric.str());
-  return numeric.str();
+  Time expires;
+  const std::string name(m_parent.m_owners.groupname(gid, &expires));
+  m_last_gid = l_gid_t(gid, name, expires);
+  return name;
 }
 
 
@@ -111,27 +111,37 @@ bool Upload::dirstate_t::scan(Processor &proc)
       = proc.refUpload().m_cache.readObj(fsobjid_t(objinfo.fi), child_cobj);
 
     //
-    // If watch.getChild() does not find the child it will create a
-    // new node for it. If it does so, the constructor of wnode_t will
-    // ensure that all parents are marked as m_cdp_children_queued and
-    // that the newly created node is marked as m_cdp_queued.
+    // If getChild() does not find the child it will create a new
+    // node for it. If it does so, it will ensure that all parents are
+    // marked as queued and that the newly created node is marked as
+    // queued.
     //
-    // Since getChild may modify the wroot tree, we must perform this
-    // while holding the wroot lock
+    // Since getChild may modify the watch tree, we must perform this
+    // while holding the wtree lock
     //
     dirstate_t *nc;
-    { MutexLock l(proc.refUpload().m_wroot_lock);
-      nc = new dirstate_t(name, this, watch.getChild(name), child_cobj);
+    { MutexLock l(proc.refUpload().m_wtree_lock);
+      nc = new dirstate_t(name, this,
+                          proc.refUpload().m_wtree.getChild(watch, name),
+                          child_cobj);
     }
 
     // If we are allowed to skip this directory AND we know its
     // hash/treesize, well, take the shortcut...
-    if (!nc->watch.m_cdp_queued && child_unchanged) {
+    if (!proc.refUpload().m_wtree.isQueued(nc->watch) && child_unchanged) {
       MTrace(t_cdp, trace::Debug, " Optimised out traversal of "
              << objinfo.abspath);
 
       // Insert directly as a complete child.
       complete_children.push_back(nc);
+    } else if (proc.refUpload().m_checkpoint
+               && proc.refUpload().m_checkpoint->findDir(fsobjid_t(objinfo.fi),
+                                                         nc->cobj)) {
+      // The backup we resume completed this directory, and it has
+      // not changed since. It stays queued, so that the next backup
+      // looks for what changed in it since then.
+      MTrace(t_cdp, trace::Debug, " Resumed past " << objinfo.abspath);
+      complete_children.push_back(nc);
     } else {
       MTrace(t_cdp, trace::Debug, " Need to CDP traverse "
              << objinfo.abspath);
@@ -337,6 +347,25 @@ void Upload::dirstate_t::upload(Processor &proc)
         objseq_t newhash;
         uint64_t treesize = 0;
 
+        // A large file may have been partly uploaded by the backup
+        // we resume; if so we read on from there
+        Checkpoint *checkpoint = proc.refUpload().m_checkpoint;
+        bool checkpointed = false;
+        if (checkpoint
+            && current_file_size >= g_checkpoint_chunks * ng_chunk_size
+            && checkpoint->findFile(fsobjid_t(objinfo.fi), newhash, treesize)) {
+          LARGE_INTEGER pos;
+          pos.QuadPart = newhash.size() * (ng_chunk_size - 2);
+          checkpointed = SetFilePointerEx(fh, pos, 0, FILE_BEGIN);
+          if (checkpointed) {
+            MTrace(t_up, trace::Debug, "   Resuming after "
+                   << newhash.size() << " chunks");
+          } else {
+            newhash.clear();
+            treesize = 0;
+          }
+        }
+
         // Now read a chunk at a time
         while (true) {
           std::vector<uint8_t> chunk;
@@ -364,10 +393,10 @@ void Upload::dirstate_t::upload(Processor &proc)
 
           // Verify with server that it is there
           if (proc.refUpload().testObject(proc.refConn(), newhash.back())) {
-            MTrace(t_up, trace::Debug, "    Chunk " << newhash.back().m_hex
+            MTrace(t_up, trace::Debug, "    Chunk " << newhash.back().hex()
                    << " already exists on server");
           } else {
-            MTrace(t_up, trace::Debug, "    Chunk " << newhash.back().m_hex
+            MTrace(t_up, trace::Debug, "    Chunk " << newhash.back().hex()
                    << " needs upload!");
             proc.refUpload().uploadObject(proc.refConn(), chunk);
           }
@@ -377,6 +406,14 @@ void Upload::dirstate_t::upload(Processor &proc)
             proc.setStatus(threadstatus_t::OSUploading, oname,
                            std::min(1., 1. * treesize / current_file_size));
 
+          // Every chunk so far is on the server; a resumed backup can
+          // continue after them
+          if (checkpoint && treesize == newhash.size() * ng_chunk_size
+              && !(newhash.size() % g_checkpoint_chunks)) {
+            checkpoint->fileProgress(fsobjid_t(objinfo.fi), newhash, treesize);
+            checkpointed = true;
+          }
+
 
           // If this chunk was smaller than max, then we are done. We
           // do not want to continue reading small blocks from a log
@@ -385,6 +422,9 @@ void Upload::dirstate_t::upload(Processor &proc)
             break;
         }
 
+        if (checkpointed)
+          checkpoint->fileDone(fsobjid_t(objinfo.fi));
+
         // We have now read all chunks. Our newhash contains the new
         // list of hashes for the metadata entry in our containing
         // directory.
@@ -424,6 +464,22 @@ void Upload::dirstate_t::upload(Processor &proc)
   MTrace(t_up, trace::Debug, " Directory scan processing done. "
          << "Now process complete children.");
 
+  // Snapshots of us may follow as long as we have incomplete
+  // children; they will reuse what we found here.
+  files_cached = !incomplete_children.empty();
+  if (files_cached)
+    file_entries.assign(dirobj_lorm.begin(), dirobj_lorm.end());
+  else
+    std::vector<dirobj_t>().swap(file_entries);
+
+  std::vector<dirobj_t> entries(dirobj_lorm.begin(), dirobj_lorm.end());
+  addChildEntries(proc, entries);
+  encodeUpload(proc, entries);
+}
+
+void Upload::dirstate_t::addChildEntries(Processor &proc,
+                                         std::vector<dirobj_t> &dirobj_lorm)
+{
   //
   // Our child directories should already be processed and available
   // under complete_children. We do not need to hold any lock to
@@ -466,68 +522,4 @@ void Upload::dirstate_t::upload(Processor &proc)
     dirobj_lorm.push_back(dirobj_t((*ci)->cobj.m_hash, meta,
                                    (*ci)->cobj.m_treesize));
   }
-
-  // All objects in directory updated.
-  MTrace(t_up, trace::Debug, "Done with all entries under " << path
-         << " - will encode directory object(s)");
-
-  //
-  // We will build a new multiref and treesize. Store the old
-  // multiref.
-  //
-  cobj.m_treesize = 0;
-  objseq_t old_multiref;
-  old_multiref.swap(cobj.m_hash);
-
-  //
-  // Now create a directory object holding our LoR and LoM.
-  // - split as necessary to stay within ng_chunk_size.
-  //
-  proc.setStatus(threadstatus_t::OSUploading, name);
-  while (!dirobj_lorm.empty()) {
-    std::vector<uint8_t> object;
-    uint64_t treesize;
-    size_t n = encodeDirObjs(object, treesize, dirobj_lorm, !incomplete_children.empty());
-    
-    // Remove the entries we serialised
-    for (size_t i = 0; i < n; i++) {
-      dirobj_lorm.pop_front();
-    }
-
-    MTrace(t_up, trace::Debug, "Encoded object of size "
-           << object.size());
-
-    //
-    // Fine, we now have an object to upload.
-    //
-    cobj.m_treesize += treesize;
-    cobj.m_hash.push_back(sha256::hash(object));
-    //
-    // First, we see if the computed hash is identical to the hash in
-    // the old multiref. If it is, well there is no point in asking
-    // the server then.
-    //
-    if (old_multiref.size() >= cobj.m_hash.size()
-        && cobj.m_hash.back() == old_multiref[cobj.m_hash.size() - 1]) {
-      MTrace(t_up, trace::Debug, " hash unchanged - done.");
-    } else {
-      if (!proc.refUpload().testObject(proc.refConn(), cobj.m_hash.back())) {
-        MTrace(t_up, trace::Debug, " upload necessary");
-        proc.refUpload().uploadObject(proc.refConn(), object);
-      } else {
-        MTrace(t_up, trace::Debug, " object already on servers");
-      }
-    }
-    // Continue until nothing left
-  }
-
-  // Done. sizehash set. Update cache with both our sizehash and the
-  // mtime/ctime that was set during scan.
-  if (parent) {
-    if (cobj.m_dbid == -1) {
-      proc.refUpload().m_cache.insert(cobj);
-    } else {
-      proc.refUpload().m_cache.update(cobj);
-    }
-  }
 }
@@ -0,0 +1,409 @@
+//
+// Implementation of the compact watch tree
+//
+
+#include "watchtree.hh"
+#include "common/error.hh"
+#include "common/trace.hh"
+
+#include <string.h>
+
+#if defined(_WIN32)
+# include <windows.h>
+#endif
+
+namespace {
+  trace::Path t_wt("/upload/cdp/tree");
+
+#if defined(_WIN32)
+  const char separator = '\\';
+#else
+  const char separator = '/';
+#endif
+
+  /// FNV-1a
+  uint32_t hashName(const char *s, size_t len)
+  {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i != len; ++i)
+      h = (h ^ uint8_t(s[i])) * 16777619u;
+    return h;
+  }
+
+  uint32_t hashChild(uint32_t parent, uint32_t name)
+  {
+    uint64_t k = (uint64_t(parent) << 32 | name) * 0x9e3779b97f4a7c15ull;
+    return uint32_t(k >> 32);
+  }
+
+  /// Workers clear queued bits of different nodes concurrently, so
+  /// updates of the bitset words must be atomic
+  void atomicOr(volatile uint32_t *w, uint32_t m)
+  {
+#if defined(_WIN32)
+    InterlockedOr(reinterpret_cast<volatile LONG*>(w), LONG(m));
+#else
+    __sync_fetch_and_or(w, m);
+#endif
+  }
+
+  void atomicAnd(volatile uint32_t *w, uint32_t m)
+  {
+#if defined(_WIN32)
+    InterlockedAnd(reinterpret_cast<volatile LONG*>(w), LONG(m));
+#else
+    __sync_fetch_and_and(w, m);
+#endif
+  }
+
+  size_t log2(uint32_t v)
+  {
+#if defined(__GNUC__)
+    return 31 - __builtin_clz(v);
+#else
+    size_t r = 0;
+    while (v >>= 1)
+      ++r;
+    return r;
+#endif
+  }
+}
+
+WatchTree::usage_t::usage_t()
+  : nodes(0)
+  , names(0)
+  , node_bytes(0)
+  , index_bytes(0)
+  , name_bytes(0)
+{
+}
+
+WatchTree::WatchTree(const std::string &rootname)
+  : m_nnodes(0)
+  , m_queue_new(true)
+  , m_children(64, node_t(c_none))
+  , m_nids(0)
+  , m_blockused(0)
+  , m_names(64, uint32_t(c_none))
+  , m_nnames(0)
+{
+  memset(m_segs, 0, sizeof m_segs);
+  newNode(c_root, intern(rootname));
+}
+
+WatchTree::~WatchTree()
+{
+  for (size_t s = 0; s != c_max_segs; ++s) {
+    delete[] m_segs[s].nodes;
+    delete[] m_segs[s].touched;
+    delete[] m_segs[s].queued;
+  }
+  for (size_t b = 0; b != m_blocks.size(); ++b)
+    delete[] m_blocks[b];
+}
+
+size_t WatchTree::seg(node_t n)
+{
+  return log2((n >> c_seg0_bits) + 1);
+}
+
+size_t WatchTree::off(node_t n)
+{
+  return n - (size_t(c_seg0) << seg(n)) + c_seg0;
+}
+
+void WatchTree::setTouched(node_t n)
+{
+  segment_t &s = m_segs[seg(n)];
+  const size_t o = off(n);
+  s.touched[o >> 5] |= uint32_t(1) << (o & 31);
+}
+
+void WatchTree::setQueued(node_t n, bool q)
+{
+  segment_t &s = m_segs[seg(n)];
+  const size_t o = off(n);
+  if (q)
+    atomicOr(&s.queued[o >> 5], uint32_t(1) << (o & 31));
+  else
+    atomicAnd(&s.queued[o >> 5], ~(uint32_t(1) << (o & 31)));
+}
+
+void WatchTree::clearQueued(node_t n)
+{
+  setQueued(n, false);
+}
+
+WatchTree::node_t WatchTree::newNode(node_t parent, uint32_t name)
+{
+  if (m_nnodes == size_t(c_none))
+    throw error("Watch tree is full");
+
+  const node_t n = node_t(m_nnodes);
+  segment_t &s = m_segs[seg(n)];
+  if (!s.nodes) {
+    const size_t size = segSize(seg(n));
+    s.nodes = new noderec_t[size];
+    s.touched = new uint32_t[size / 32]();
+    s.queued = new uint32_t[size / 32]();
+  }
+
+  noderec_t &r = s.nodes[off(n)];
+  r.parent = parent;
+  r.name = name;
+#if defined(__linux__)
+  r.wd = -1;
+#endif
+  ++m_nnodes;
+  return n;
+}
+
+std::string WatchTree::name(node_t n) const
+{
+  return nameOf(rec(n).name);
+}
+
+std::string WatchTree::absName(node_t n) const
+{
+  // Collect the names from the node up, then assemble
+  std::vector<const char*> parts;
+  size_t len = 0;
+  for (; n != c_root; n = rec(n).parent) {
+    parts.push_back(nameOf(rec(n).name));
+    len += strlen(parts.back()) + 1;
+  }
+  std::string res(nameOf(rec(c_root).name));
+  res.reserve(res.size() + len);
+  for (size_t i = parts.size(); i--; )
+    res.append(1, separator).append(parts[i]);
+  return res;
+}
+
+uint32_t WatchTree::intern(const std::string &name)
+{
+  const size_t slot = nameSlot(name.data(), name.size());
+  if (m_names[slot] != uint32_t(c_none))
+    return m_names[slot];
+
+  // Store the name
+  const size_t need = name.size() + 1;
+  if (need > size_t(c_block))
+    throw error("Name too long for watch tree: " + name);
+  if (m_blocks.empty() || m_blockused + need > size_t(c_block)) {
+    if (m_blocks.size() == size_t(c_block) - 1)
+      throw error("Watch tree name storage is full");
+    m_blocks.push_back(new char[c_block]);
+    m_blockused = 0;
+  }
+  const uint32_t id = uint32_t((m_blocks.size() - 1) << c_block_bits
+                               | m_blockused);
+  memcpy(m_blocks.back() + m_blockused, name.c_str(), need);
+  m_blockused += need;
+
+  m_names[slot] = id;
+  if (++m_nnames * 4 > m_names.size() * 3)
+    growNames();
+  return id;
+}
+
+size_t WatchTree::nameSlot(const char *name, size_t len) const
+{
+  const size_t mask = m_names.size() - 1;
+  for (size_t slot = hashName(name, len) & mask; ;
+       slot = (slot + 1) & mask) {
+    const uint32_t id = m_names[slot];
+    if (id == uint32_t(c_none))
+      return slot;
+    const char *n = nameOf(id);
+    if (!memcmp(n, name, len) && !n[len])
+      return slot;
+  }
+}
+
+void WatchTree::growNames()
+{
+  std::vector<uint32_t> old(m_names.size() * 2, uint32_t(c_none));
+  old.swap(m_names);
+  for (size_t i = 0; i != old.size(); ++i)
+    if (old[i] != uint32_t(c_none)) {
+      const char *n = nameOf(old[i]);
+      m_names[nameSlot(n, strlen(n))] = old[i];
+    }
+}
+
+size_t WatchTree::childSlot(node_t parent, uint32_t name) const
+{
+  const size_t mask = m_children.size() - 1;
+  for (size_t slot = hashChild(parent, name) & mask; ;
+       slot = (slot + 1) & mask) {
+    const node_t c = m_children[slot];
+    if (c == node_t(c_none))
+      return slot;
+    const noderec_t &r = rec(c);
+    if (r.parent == parent && r.name == name)
+      return slot;
+  }
+}
+
+void WatchTree::growChildren()
+{
+  std::vector<node_t> old(m_children.size() * 2, node_t(c_none));
+  old.swap(m_children);
+  for (size_t i = 0; i != old.size(); ++i)
+    if (old[i] != node_t(c_none)) {
+      const noderec_t &r = rec(old[i]);
+      m_children[childSlot(r.parent, r.name)] = old[i];
+    }
+}
+
+WatchTree::node_t WatchTree::getChild(node_t parent, const std::string &cn)
+{
+  const uint32_t name = intern(cn);
+  const size_t slot = childSlot(parent, name);
+  if (m_children[slot] != node_t(c_none)) {
+    MTrace(t_wt, trace::Debug, "getChild(" << cn << ") found match (q="
+           << isQueued(m_children[slot]) << ")");
+    return m_children[slot];
+  }
+
+  // Not found. Create
+  MTrace(t_wt, trace::Debug, "getChild(" << cn << ") creating new child");
+  const node_t c = newNode(parent, name);
+  m_children[slot] = c;
+  if ((m_nnodes - 1) * 4 > m_children.size() * 3)
+    growChildren();
+
+  // All new nodes created during backup should be visited, so we
+  // mark their parent(s) as having children queued for backup too
+  if (!m_queue_new)
+    return c;
+  setQueued(c, true);
+  for (node_t i = parent; !isQueued(i); i = rec(i).parent) {
+    setQueued(i, true);
+    if (i == c_root)
+      break;
+  }
+  return c;
+}
+
+WatchTree::node_t WatchTree::insert(const std::string &path)
+{
+  node_t n = c_root;
+  for (size_t nofs = path.empty() ? path.npos : 0; nofs != path.npos; ) {
+    const size_t cend = path.find(separator, nofs + 1);
+    if (cend != nofs + 1 && nofs + 1 != path.size())
+      n = getChild(n, path.substr(nofs + 1, cend - nofs - 1));
+    nofs = cend;
+  }
+  return n;
+}
+
+size_t WatchTree::idSlot(uint64_t dev, uint64_t ino) const
+{
+  const size_t mask = m_ids.size() - 1;
+  for (size_t slot = hashChild(uint32_t(dev ^ (dev >> 32)),
+                               uint32_t(ino ^ (ino >> 32))) & mask; ;
+       slot = (slot + 1) & mask) {
+    const idrec_t &r = m_ids[slot];
+    if (r.node == node_t(c_none) || (r.dev == dev && r.ino == ino))
+      return slot;
+  }
+}
+
+void WatchTree::setId(node_t n, uint64_t dev, uint64_t ino)
+{
+  if (m_ids.empty()) {
+    idrec_t empty = { 0, 0, node_t(c_none) };
+    m_ids.resize(64, empty);
+  }
+  idrec_t &r = m_ids[idSlot(dev, ino)];
+  if (r.node != node_t(c_none)) {
+    r.node = n;
+    return;
+  }
+  r.dev = dev;
+  r.ino = ino;
+  r.node = n;
+  if (++m_nids * 4 > m_ids.size() * 3) {
+    idrec_t empty = { 0, 0, node_t(c_none) };
+    std::vector<idrec_t> old(m_ids.size() * 2, empty);
+    old.swap(m_ids);
+    for (size_t i = 0; i != old.size(); ++i)
+      if (old[i].node != node_t(c_none))
+        m_ids[idSlot(old[i].dev, old[i].ino)] = old[i];
+  }
+}
+
+bool WatchTree::findId(uint64_t dev, uint64_t ino, node_t &n) const
+{
+  if (m_ids.empty())
+    return false;
+  const idrec_t &r = m_ids[idSlot(dev, ino)];
+  if (r.node == node_t(c_none))
+    return false;
+  n = r.node;
+  return true;
+}
+
+void WatchTree::touchAll()
+{
+  // Directories we have not seen yet may have changed too
+  m_queue_new = true;
+  for (size_t s = 0; s != c_max_segs && m_segs[s].touched; ++s)
+    for (size_t w = 0; w != segSize(s) / 32; ++w)
+      m_segs[s].touched[w] = ~uint32_t(0);
+}
+
+void WatchTree::markTouched(node_t n)
+{
+  // Mark us and our parents until we meet one already touched
+  while (!isTouched(n)) {
+    setTouched(n);
+    if (n == c_root)
+      break;
+    n = rec(n).parent;
+  }
+}
+
+void WatchTree::queueTouched()
+{
+  // Parents always precede their children, so one pass in index
+  // order sees every parent's touched flag before it is cleared
+  size_t queued = 0;
+  for (node_t n = 0; n != m_nnodes; ++n)
+    if (n == c_root || isTouched(rec(n).parent)) {
+      const bool t = isTouched(n);
+      setQueued(n, t);
+      queued += t;
+    }
+  for (size_t s = 0; s != c_max_segs && m_segs[s].touched; ++s)
+    for (size_t w = 0; w != segSize(s) / 32; ++w)
+      m_segs[s].touched[w] = 0;
+  MTrace(t_wt, trace::Debug, "Queued " << queued << " of " << m_nnodes
+         << " watched directories");
+}
+
+WatchTree::usage_t WatchTree::usage() const
+{
+  usage_t u;
+  u.nodes = m_nnodes;
+  u.names = m_nnames;
+  for (size_t s = 0; s != c_max_segs && m_segs[s].nodes; ++s)
+    u.node_bytes += segSize(s) * sizeof(noderec_t) + segSize(s) / 4;
+  u.index_bytes = m_children.capacity() * sizeof(node_t)
+    + m_names.capacity() * sizeof(uint32_t)
+    + m_ids.capacity() * sizeof(idrec_t);
+  u.name_bytes = m_blocks.size() * size_t(c_block)
+    + m_blocks.capacity() * sizeof(char*);
+  return u;
+}
+
+void WatchTree::trace() const
+{
+  std::vector<uint32_t> depth(m_nnodes);
+  for (node_t n = 0; n != m_nnodes; ++n) {
+    if (n != c_root)
+      depth[n] = depth[rec(n).parent] + 1;
+    MTrace(t_wt, trace::Info, std::string(depth[n], '|') << name(n));
+  }
+}
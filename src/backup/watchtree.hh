@@ -0,0 +1,219 @@
+//
+// Compact tree of watched directories for change notification (CDP)
+//
+// Large servers may have millions of directories under watch, so the
+// tree is kept as flat arrays rather than as a node object per
+// directory: nodes are addressed by 32-bit indices and live in
+// segments that are never moved once allocated, names are interned in
+// an arena (a name shared by many directories is stored once), a
+// single hash table keyed by (parent, name) finds children, and the
+// touched/queued flags are kept in bitsets.
+//
+
+#ifndef BACKUP_WATCHTREE_HH
+#define BACKUP_WATCHTREE_HH
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Locking: the tree does no locking of its own. Anything that may
+// create nodes or look at names or the touched flags must be done
+// under a lock held by the user of the tree. The queued flag and the
+// watch descriptor of an existing node, and its parent, may be read
+// and changed without that lock - worker threads do so for the
+// directories they process.
+//
+class WatchTree {
+public:
+  /// A node is identified by its index
+  typedef uint32_t node_t;
+
+  /// The root is always node zero
+  enum { c_root = 0 };
+
+  /// Create the tree with its root node
+  WatchTree(const std::string &rootname);
+  ~WatchTree();
+
+  /// Locate (and create if needed) the child of the given node with
+  /// the given name. A new node is marked as queued, and so are its
+  /// parents, so that a backup in progress is guaranteed to visit it
+  /// - unless new nodes are not to be queued (see below).
+  node_t getChild(node_t parent, const std::string &name);
+
+  /// Normally we know nothing about a directory we have not seen
+  /// before, so a new node is queued for backup. When the tree has
+  /// been restored from a trusted change journal, we do know that
+  /// whatever was not marked as touched is unchanged, and new nodes
+  /// need not be queued.
+  void setQueueNew(bool q) { m_queue_new = q; }
+
+  /// Insert the path under the root. The path consists of components
+  /// each preceded by a separator (empty components are
+  /// skipped). Returns the node of the last component.
+  node_t insert(const std::string &path);
+
+  /// The parent of a node (the root is its own parent)
+  node_t parent(node_t n) const { return rec(n).parent; }
+
+  /// The name of a node
+  std::string name(node_t n) const;
+
+  /// The path from the root to the node
+  std::string absName(node_t n) const;
+
+  /// If our notification fails and we don't know what has been
+  /// touched, this marks the full tree as touched. New nodes will be
+  /// queued from now on.
+  void touchAll();
+
+  /// Mark the node as touched, and all its parents as having a child
+  /// object that is touched. We maintain the invariant that all
+  /// ascendents of a touched node are touched too.
+  void markTouched(node_t n);
+
+  /// Move the 'touched' status into the 'queued' status and reset the
+  /// 'touched' status. This is called before initiating a backup so
+  /// that the backup can focus on what was queued, while the change
+  /// monitor can still mark objects as touched regardless of the
+  /// progress of the current backup.
+  //
+  /// As before, a node whose parent was not touched keeps its queued
+  /// status.
+  void queueTouched();
+
+  /// Is the node queued for backup
+  bool isQueued(node_t n) const { return testBit(m_segs[seg(n)].queued, off(n)); }
+
+  /// The node has been backed up and is no longer queued
+  void clearQueued(node_t n);
+
+#if defined(__linux__)
+  /// Our inotify watch descriptor, or -1
+  int wd(node_t n) const { return rec(n).wd; }
+  void setWd(node_t n, int wd) { rec(n).wd = wd; }
+#endif
+
+  /// Record the device and inode numbers of the directory at a
+  /// node, so that change events naming the directory by those can
+  /// be resolved. Nodes are only indexed if this is called for them.
+  void setId(node_t n, uint64_t dev, uint64_t ino);
+
+  /// Locate the node last recorded with the given device and inode
+  /// numbers. Returns false if there is none.
+  bool findId(uint64_t dev, uint64_t ino, node_t &n) const;
+
+  /// Number of nodes in the tree
+  size_t size() const { return m_nnodes; }
+
+  /// What the tree holds and how much memory it uses
+  struct usage_t {
+    usage_t();
+    /// Nodes (directories) in the tree
+    size_t nodes;
+    /// Distinct names
+    size_t names;
+    /// Bytes allocated for nodes and flags
+    size_t node_bytes;
+    /// Bytes allocated for the child, name and id hash tables
+    size_t index_bytes;
+    /// Bytes allocated for name storage
+    size_t name_bytes;
+    /// Total bytes
+    size_t total() const { return node_bytes + index_bytes + name_bytes; }
+  };
+  usage_t usage() const;
+
+  /// Diagnostic - trace the tree
+  void trace() const;
+
+private:
+  WatchTree(const WatchTree&);
+  WatchTree &operator=(const WatchTree&);
+
+  /// A node as stored
+  struct noderec_t {
+    node_t parent;
+    /// Interned name
+    uint32_t name;
+#if defined(__linux__)
+    int wd;
+#endif
+  };
+
+  /// Nodes are stored in segments; the first holds c_seg0 nodes and
+  /// every following segment twice as many as the one before, so a
+  /// small fixed table of segments covers the full index space and no
+  /// node ever moves.
+  enum { c_seg0_bits = 10, c_seg0 = 1 << c_seg0_bits,
+         c_max_segs = 32 - c_seg0_bits + 1 };
+
+  struct segment_t {
+    noderec_t *nodes;
+    /// Flag bitsets, one bit per node
+    volatile uint32_t *touched;
+    volatile uint32_t *queued;
+  };
+  segment_t m_segs[c_max_segs];
+
+  /// Nodes in use
+  size_t m_nnodes;
+
+  /// Whether new nodes are queued
+  bool m_queue_new;
+
+  /// Segment and offset of a node
+  static size_t seg(node_t n);
+  static size_t off(node_t n);
+  static size_t segSize(size_t s) { return size_t(c_seg0) << s; }
+
+  noderec_t &rec(node_t n) const { return m_segs[seg(n)].nodes[off(n)]; }
+
+  static bool testBit(const volatile uint32_t *w, size_t b)
+  { return (w[b >> 5] >> (b & 31)) & 1; }
+
+  bool isTouched(node_t n) const { return testBit(m_segs[seg(n)].touched, off(n)); }
+  void setTouched(node_t n);
+  void setQueued(node_t n, bool);
+
+  /// Append a node
+  node_t newNode(node_t parent, uint32_t name);
+
+  /// Children, as an open addressing hash table of node indices keyed
+  /// by (parent, name). Unused slots hold c_none.
+  enum { c_none = 0xffffffff };
+  std::vector<node_t> m_children;
+  size_t childSlot(node_t parent, uint32_t name) const;
+  void growChildren();
+
+  /// The (dev, ino) index, as an open addressing hash table. It
+  /// stays empty unless ids are recorded.
+  struct idrec_t {
+    uint64_t dev;
+    uint64_t ino;
+    node_t node;
+  };
+  std::vector<idrec_t> m_ids;
+  size_t m_nids;
+  size_t idSlot(uint64_t dev, uint64_t ino) const;
+
+  /// Name storage. Names are stored zero terminated in blocks of
+  /// c_block bytes; a name is identified by its block and offset.
+  enum { c_block_bits = 16, c_block = 1 << c_block_bits };
+  std::vector<char*> m_blocks;
+  size_t m_blockused;
+  const char *nameOf(uint32_t id) const
+  { return m_blocks[id >> c_block_bits] + (id & (c_block - 1)); }
+
+  /// Name ids as an open addressing hash table keyed by the name
+  std::vector<uint32_t> m_names;
+  size_t m_nnames;
+  uint32_t intern(const std::string &);
+  size_t nameSlot(const char *name, size_t len) const;
+  void growNames();
+};
+
+#endif
@@ -4,101 +4,164 @@
 
 #include "hash.hh"
 #include "error.hh"
+#include "sha256engine.hh"
+
+#include <string.h>
+
+namespace {
+  const char g_hexdigits[] = "0123456789abcdef";
+
+  /// Maps a character to its nibble value, or -1 for non-hex
+  /// characters
+  const int8_t g_hexdecoder[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+  };
+}
 
-#if defined(__unix__) || defined(_WIN32)
-# include <openssl/sha.h>
-#endif
-
-#if defined(__APPLE__)
-# define COMMON_DIGEST_FOR_OPENSSL
-# include <CommonCrypto/CommonDigest.h>
-#endif
-
-#include <sstream>
-#include <iomanip>
+const size_t sha256::size;
 
 sha256::sha256()
 {
+  memset(m_raw, 0, sizeof m_raw);
 }
 
 sha256 sha256::hash(const std::vector<uint8_t> &data)
 {
-  std::vector<uint8_t> raw(SHA256_DIGEST_LENGTH);
+  sha256 hash;
 
   // Compute raw hash
   uint8_t dummy;
-  SHA256_CTX sha;
-  SHA256_Init(&sha);
-  SHA256_Update(&sha, data.empty() ? &dummy : &data[0], data.size());
-  SHA256_Final(&raw[0], &sha);
+  SHA256Context::digest(data.empty() ? &dummy : &data[0], data.size(),
+                        hash.m_raw);
 
-  return parse(raw);
+  return hash;
 }
 
 sha256 sha256::hash(const std::string &data)
 {
-  return hash(std::vector<uint8_t>(data.begin(), data.end()));
+  sha256 hash;
+
+  uint8_t dummy;
+  SHA256Context::digest(data.empty() ? &dummy
+                        : reinterpret_cast<const uint8_t*>(data.data()),
+                        data.size(), hash.m_raw);
+
+  return hash;
+}
+
+std::vector<sha256> sha256::hash(const std::vector<std::vector<uint8_t> > &data)
+{
+  // We hash straight into the vector of results, so it must be a
+  // plain array of digests
+  typedef char plain_digests[sizeof(sha256) == size ? 1 : -1];
+  (void)sizeof(plain_digests);
+
+  std::vector<const uint8_t*> ptrs(data.size());
+  std::vector<size_t> lens(data.size());
+  for (size_t i = 0; i != data.size(); ++i) {
+    ptrs[i] = data[i].empty() ? 0 : &data[i][0];
+    lens[i] = data[i].size();
+  }
+
+  std::vector<sha256> res(data.size());
+  if (!data.empty())
+    SHA256Context::batch(data.size(), &ptrs[0], &lens[0],
+                         &res[0].m_raw);
+  return res;
 }
 
 sha256 sha256::parse(const std::vector<uint8_t> &dat)
 {
-  if (dat.size() != SHA256_DIGEST_LENGTH)
+  if (dat.size() != size)
     throw error("Raw sha256 digest has bad length");
 
-  sha256 hash;
-  hash.m_raw = dat;
-
-  // Hex encode
-  std::ostringstream myhash;
-  for (size_t i = 0; i != dat.size(); ++i)
-    myhash << std::hex << std::setw(2) << std::setfill('0') << uint32_t(dat[i]);
+  return parseRaw(&dat[0]);
+}
 
-  hash.m_hex = myhash.str();
+sha256 sha256::parseRaw(const uint8_t *raw)
+{
+  sha256 hash;
+  memcpy(hash.m_raw, raw, size);
   return hash;
 }
 
 sha256 sha256::parse(const std::string &str)
 {
-  sha256 hash;
-  hash.m_hex = str;
-
   // Validate size
-  if (str.size() != 64)
+  if (str.size() != 2 * size)
     throw error("Hex string has bad length for sha256");
 
   // Parse hex
-  for (size_t i = 0; i != 64; i += 2) {
-    std::istringstream s(str.substr(i, 2));
-    uint32_t val;
-    s >> std::hex >> val;
-    MAssert(!(val >> 8), "Hex value decoding error - byte too big");
-    if (s.fail())
+  sha256 hash;
+  for (size_t i = 0; i != size; ++i) {
+    const int8_t hi = g_hexdecoder[uint8_t(str[2 * i])];
+    const int8_t lo = g_hexdecoder[uint8_t(str[2 * i + 1])];
+    if (hi < 0 || lo < 0)
       throw error("Hex value parse error - cannot parse byte");
-    if (!s.eof())
-      throw error("Trailing bytes after hex byte");
-    hash.m_raw.push_back(uint8_t(val));
+    hash.m_raw[i] = uint8_t((hi << 4) | lo);
   }
 
   return hash;
 }
 
+std::string sha256::hex() const
+{
+  if (empty())
+    return std::string();
+  char res[2 * size];
+  for (size_t i = 0; i != size; ++i) {
+    res[2 * i] = g_hexdigits[m_raw[i] >> 4];
+    res[2 * i + 1] = g_hexdigits[m_raw[i] & 0xf];
+  }
+  return std::string(res, sizeof res);
+}
+
 bool sha256::empty() const
 {
-  return m_hex.empty();
+  for (size_t i = 0; i != size; ++i)
+    if (m_raw[i])
+      return false;
+  return true;
 }
 
 void sha256::clear()
 {
-  m_hex.clear();
-  m_raw.clear();
+  memset(m_raw, 0, sizeof m_raw);
 }
 
 bool sha256::operator==(const sha256 &o) const
 {
-  return m_raw == o.m_raw;
+  return !memcmp(m_raw, o.m_raw, size);
+}
+
+bool sha256::operator!=(const sha256 &o) const
+{
+  return memcmp(m_raw, o.m_raw, size);
 }
 
 bool sha256::operator<(const sha256 &o) const
 {
-  return m_raw < o.m_raw;
+  return memcmp(m_raw, o.m_raw, size) < 0;
+}
+
+size_t sha256::hasher::operator()(const sha256 &h) const
+{
+  size_t res;
+  memcpy(&res, h.m_raw, sizeof res);
+  return res;
 }
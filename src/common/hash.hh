@@ -6,10 +6,16 @@
 #define COMMON_HASH_HH
 
 #include <stdint.h>
+#include <stddef.h>
 #include <vector>
 #include <string>
 
+/// A SHA-256 object id. This is a plain 32-byte value; the hex form
+/// is produced on demand. The all-zero value is the "empty" hash.
 struct sha256 {
+  /// Length of the raw digest
+  static const size_t size = 32;
+
   /// Constructs an "empty" hash
   sha256();
 
@@ -19,15 +25,27 @@ struct sha256 {
   /// Named constructor. Computes the hash of a block of data
   static sha256 hash(const std::string &data);
 
+  /// Named constructor. Computes the hashes of many blocks of data at
+  /// once; the engine may hash several blocks in parallel
+  static std::vector<sha256> hash(const std::vector<std::vector<uint8_t> > &data);
+
   /// Named constructor. Parses the hash from a 32-byte raw string
   static sha256 parse(const std::vector<uint8_t> &str);
 
+  /// Named constructor. Parses the hash from 32 raw bytes in memory
+  static sha256 parseRaw(const uint8_t *raw);
+
   /// Named constructor. Parses the hash from a 64-character
   /// lower-case hex string
   static sha256 parse(const std::string &str);
 
+  /// A 64-character lower-case hex encoded version of the hash, or
+  /// an empty string if the hash is "empty"
+  std::string hex() const;
+
   /// Simply compare the raw content of two hashes
   bool operator==(const sha256&) const;
+  bool operator!=(const sha256&) const;
 
   /// Allow use as key in a set or map
   bool operator<(const sha256&) const;
@@ -36,10 +54,16 @@ struct sha256 {
   bool empty() const;
   /// Clears the hash (makes it "empty")
   void clear();
-  /// A 64-character lower-case hex encoded version of the hash
-  std::string m_hex;
+
+  /// Hash functor for hashed containers (std::tr1::unordered_set and
+  /// friends). The digest is uniformly distributed already so we
+  /// simply use its leading bytes.
+  struct hasher {
+    size_t operator()(const sha256 &h) const;
+  };
+
   /// The 32 raw bytes that make up the hash
-  std::vector<uint8_t> m_raw;
+  uint8_t m_raw[size];
 };
 
 
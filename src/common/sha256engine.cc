@@ -0,0 +1,676 @@
+//
+// Implementation of the SHA-256 engine
+//
+
+#include "sha256engine.hh"
+#include "error.hh"
+#include "time.hh"
+
+#if defined(__unix__) || defined(_WIN32)
+# include <openssl/evp.h>
+#endif
+
+#if defined(__APPLE__)
+# include <CommonCrypto/CommonDigest.h>
+#endif
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <string.h>
+
+//
+// The accelerated engines need per-function target attributes and
+// cpuid; both are GCC (4.9+) and clang features on x86
+//
+#if (defined(__x86_64__) || defined(__i386__))                          \
+  && (defined(__clang__)                                                \
+      || (defined(__GNUC__)                                             \
+          && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+# define SHA256_X86_DISPATCH
+# include <cpuid.h>
+# include <immintrin.h>
+# include <pthread.h>
+#endif
+
+namespace {
+
+  const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+
+  const uint32_t IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  inline uint32_t be32(const uint8_t *p)
+  {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16)
+      | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+  }
+
+  inline void put32(uint8_t *p, uint32_t v)
+  {
+    p[0] = uint8_t(v >> 24);
+    p[1] = uint8_t(v >> 16);
+    p[2] = uint8_t(v >> 8);
+    p[3] = uint8_t(v);
+  }
+
+  inline uint32_t rotr(uint32_t x, unsigned n)
+  {
+    return (x >> n) | (x << (32 - n));
+  }
+
+  /// A block function compresses nblocks 64-byte blocks into the state
+  typedef void (*compress_t)(uint32_t state[8], const uint8_t *data,
+                             size_t nblocks);
+
+  /// Portable block function
+  void compressGeneric(uint32_t state[8], const uint8_t *data,
+                       size_t nblocks)
+  {
+    uint32_t w[64];
+    for (; nblocks; --nblocks, data += 64) {
+      for (unsigned t = 0; t != 16; ++t)
+        w[t] = be32(data + 4 * t);
+      for (unsigned t = 16; t != 64; ++t) {
+        const uint32_t s0 = rotr(w[t-15], 7) ^ rotr(w[t-15], 18)
+          ^ (w[t-15] >> 3);
+        const uint32_t s1 = rotr(w[t-2], 17) ^ rotr(w[t-2], 19)
+          ^ (w[t-2] >> 10);
+        w[t] = w[t-16] + s0 + w[t-7] + s1;
+      }
+
+      uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+      uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+      for (unsigned t = 0; t != 64; ++t) {
+        const uint32_t S1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        const uint32_t ch = (e & f) ^ (~e & g);
+        const uint32_t t1 = h + S1 + ch + K[t] + w[t];
+        const uint32_t S0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        const uint32_t t2 = S0 + maj;
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+      }
+      state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+      state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+  }
+
+#if defined(SHA256_X86_DISPATCH)
+
+  /// SHA-NI block function. Four rounds per group using the
+  /// sha256rnds2 instruction; the message schedule is extended with
+  /// sha256msg1/sha256msg2.
+  __attribute__((target("sha,sse4.1,ssse3")))
+  void compressSHANI(uint32_t state[8], const uint8_t *data, size_t nblocks)
+  {
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                        0x0405060700010203ULL);
+
+    // Re-arrange state into the ABEF/CDGH layout the instructions use
+    __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+    __m128i state1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);             // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B);       // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);    // CDGH
+
+    // Unrolled so the schedule words stay in registers
+#define SHANI_LOAD(g)                                                   \
+    w[g] = _mm_shuffle_epi8                                             \
+      (_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * g)), MASK)
+#define SHANI_SCHED(g)                                                  \
+    w[g & 3] = _mm_sha256msg2_epu32                                     \
+      (_mm_add_epi32(_mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]),   \
+                     _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4)), \
+       w[(g + 3) & 3])
+#define SHANI_ROUNDS(g)                                                 \
+    msg = _mm_add_epi32                                                 \
+      (w[g & 3], _mm_loadu_si128(reinterpret_cast<const __m128i*>(&K[4 * g]))); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                \
+    msg = _mm_shuffle_epi32(msg, 0x0E);                                 \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg)
+
+    __m128i w[4];
+    __m128i msg;
+    for (; nblocks; --nblocks, data += 64) {
+      const __m128i abef_save = state0;
+      const __m128i cdgh_save = state1;
+
+      SHANI_LOAD(0); SHANI_ROUNDS(0);
+      SHANI_LOAD(1); SHANI_ROUNDS(1);
+      SHANI_LOAD(2); SHANI_ROUNDS(2);
+      SHANI_LOAD(3); SHANI_ROUNDS(3);
+      SHANI_SCHED(4); SHANI_ROUNDS(4);
+      SHANI_SCHED(5); SHANI_ROUNDS(5);
+      SHANI_SCHED(6); SHANI_ROUNDS(6);
+      SHANI_SCHED(7); SHANI_ROUNDS(7);
+      SHANI_SCHED(8); SHANI_ROUNDS(8);
+      SHANI_SCHED(9); SHANI_ROUNDS(9);
+      SHANI_SCHED(10); SHANI_ROUNDS(10);
+      SHANI_SCHED(11); SHANI_ROUNDS(11);
+      SHANI_SCHED(12); SHANI_ROUNDS(12);
+      SHANI_SCHED(13); SHANI_ROUNDS(13);
+      SHANI_SCHED(14); SHANI_ROUNDS(14);
+      SHANI_SCHED(15); SHANI_ROUNDS(15);
+
+      state0 = _mm_add_epi32(state0, abef_save);
+      state1 = _mm_add_epi32(state1, cdgh_save);
+    }
+#undef SHANI_LOAD
+#undef SHANI_SCHED
+#undef SHANI_ROUNDS
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);          // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);       // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);    // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);       // ABEF
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+  }
+
+  /// Eight-lane state; word i of lane l is at [i][l]
+  typedef uint32_t lanestate_t[8][8];
+
+  __attribute__((target("avx2")))
+  inline __m256i vrotr(__m256i x, int n)
+  {
+    return _mm256_or_si256(_mm256_srli_epi32(x, n),
+                           _mm256_slli_epi32(x, 32 - n));
+  }
+
+  /// AVX2 multi-buffer block function: compresses one block in each
+  /// of eight independent lanes
+  __attribute__((target("avx2")))
+  void compressAVX2x8(lanestate_t st, const uint8_t *const blocks[8])
+  {
+    __m256i w[64];
+    for (unsigned t = 0; t != 16; ++t)
+      w[t] = _mm256_set_epi32(be32(blocks[7] + 4 * t), be32(blocks[6] + 4 * t),
+                              be32(blocks[5] + 4 * t), be32(blocks[4] + 4 * t),
+                              be32(blocks[3] + 4 * t), be32(blocks[2] + 4 * t),
+                              be32(blocks[1] + 4 * t), be32(blocks[0] + 4 * t));
+    for (unsigned t = 16; t != 64; ++t) {
+      const __m256i s0 = _mm256_xor_si256
+        (_mm256_xor_si256(vrotr(w[t-15], 7), vrotr(w[t-15], 18)),
+         _mm256_srli_epi32(w[t-15], 3));
+      const __m256i s1 = _mm256_xor_si256
+        (_mm256_xor_si256(vrotr(w[t-2], 17), vrotr(w[t-2], 19)),
+         _mm256_srli_epi32(w[t-2], 10));
+      w[t] = _mm256_add_epi32(_mm256_add_epi32(w[t-16], s0),
+                              _mm256_add_epi32(w[t-7], s1));
+    }
+
+    __m256i v[8];
+    for (unsigned i = 0; i != 8; ++i)
+      v[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(st[i]));
+    __m256i a = v[0], b = v[1], c = v[2], d = v[3];
+    __m256i e = v[4], f = v[5], g = v[6], h = v[7];
+
+    for (unsigned t = 0; t != 64; ++t) {
+      const __m256i S1 = _mm256_xor_si256
+        (_mm256_xor_si256(vrotr(e, 6), vrotr(e, 11)), vrotr(e, 25));
+      const __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+                                          _mm256_andnot_si256(e, g));
+      const __m256i t1 = _mm256_add_epi32
+        (_mm256_add_epi32(_mm256_add_epi32(h, S1), ch),
+         _mm256_add_epi32(_mm256_set1_epi32(int(K[t])), w[t]));
+      const __m256i S0 = _mm256_xor_si256
+        (_mm256_xor_si256(vrotr(a, 2), vrotr(a, 13)), vrotr(a, 22));
+      const __m256i maj = _mm256_xor_si256
+        (_mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)),
+         _mm256_and_si256(b, c));
+      const __m256i t2 = _mm256_add_epi32(S0, maj);
+      h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+      d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+    }
+
+    v[0] = _mm256_add_epi32(v[0], a); v[1] = _mm256_add_epi32(v[1], b);
+    v[2] = _mm256_add_epi32(v[2], c); v[3] = _mm256_add_epi32(v[3], d);
+    v[4] = _mm256_add_epi32(v[4], e); v[5] = _mm256_add_epi32(v[5], f);
+    v[6] = _mm256_add_epi32(v[6], g); v[7] = _mm256_add_epi32(v[7], h);
+    for (unsigned i = 0; i != 8; ++i)
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(st[i]), v[i]);
+  }
+
+  bool cpuHasSHANI()
+  {
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+      return false;
+    // SSSE3 and SSE4.1 for the shuffles and blends
+    if (!(c & (1u << 9)) || !(c & (1u << 19)))
+      return false;
+    if (__get_cpuid_max(0, 0) < 7)
+      return false;
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & (1u << 29);
+  }
+
+  bool cpuHasAVX2()
+  {
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+      return false;
+    // The OS must save the YMM registers (OSXSAVE + XCR0 bits 1,2)
+    if (!(c & (1u << 27)) || !(c & (1u << 28)))
+      return false;
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6)
+      return false;
+    if (__get_cpuid_max(0, 0) < 7)
+      return false;
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & (1u << 5);
+  }
+
+#else
+
+  bool cpuHasSHANI() { return false; }
+  bool cpuHasAVX2() { return false; }
+
+#endif
+
+  /// CPU capabilities, probed once at load time
+  const bool g_has_shani = cpuHasSHANI();
+  const bool g_has_avx2 = cpuHasAVX2();
+
+  SHA256Context::engine_t detectStream()
+  {
+    return g_has_shani ? SHA256Context::E_SHANI : SHA256Context::E_Library;
+  }
+
+#if defined(SHA256_X86_DISPATCH)
+  /// Whether eight AVX2 lanes outrun the library on this machine
+  bool avx2Faster();
+
+  /// Measured once, when a batch first needs it, so that programs
+  /// that never hash batches do not pay for it at startup
+  bool g_avx2_faster = false;
+  pthread_once_t g_avx2_once = PTHREAD_ONCE_INIT;
+
+  void measureAVX2()
+  {
+    g_avx2_faster = avx2Faster();
+  }
+#endif
+
+  SHA256Context::engine_t detectBatch()
+  {
+    // A single SHA-NI stream outruns eight AVX2 lanes
+    if (g_has_shani)
+      return SHA256Context::E_SHANI;
+#if defined(SHA256_X86_DISPATCH)
+    // The library's own assembly often beats the lanes, so we only
+    // take them where they measure faster
+    if (g_has_avx2) {
+      pthread_once(&g_avx2_once, measureAVX2);
+      if (g_avx2_faster)
+        return SHA256Context::E_AVX2;
+    }
+#endif
+    return SHA256Context::E_Library;
+  }
+
+  SHA256Context::engine_t g_stream_engine = detectStream();
+
+  /// The batch engine is chosen on first use, unless forced
+  SHA256Context::engine_t g_batch_engine = SHA256Context::E_Library;
+  volatile bool g_batch_chosen = false;
+
+  SHA256Context::engine_t batchEngineNow()
+  {
+    if (!g_batch_chosen) {
+      // Racing threads choose the same engine
+      g_batch_engine = detectBatch();
+      __sync_synchronize();
+      g_batch_chosen = true;
+    }
+    return g_batch_engine;
+  }
+
+  /// The block function used for streaming contexts. The library does
+  /// not expose its block function so we use our generic one unless
+  /// SHA-NI is selected.
+  compress_t streamCompress()
+  {
+#if defined(SHA256_X86_DISPATCH)
+    if (g_stream_engine == SHA256Context::E_SHANI)
+      return compressSHANI;
+#endif
+    return compressGeneric;
+  }
+
+  void libraryDigest(const void *data, size_t len, uint8_t *digest)
+  {
+    uint8_t dummy;
+#if defined(__unix__) || defined(_WIN32)
+    if (!EVP_Digest(len ? data : &dummy, len, digest, 0, EVP_sha256(), 0))
+      throw error("EVP_Digest failed");
+#endif
+#if defined(__APPLE__)
+    CC_SHA256(len ? data : &dummy, CC_LONG(len), digest);
+#endif
+  }
+
+  void putDigest(uint8_t *digest, const uint32_t state[8])
+  {
+    for (unsigned i = 0; i != 8; ++i)
+      put32(digest + 4 * i, state[i]);
+  }
+
+#if defined(SHA256_X86_DISPATCH)
+
+  /// Multi-buffer batch hashing. Each lane walks the padded block
+  /// sequence of one message; when a lane finishes it picks up the
+  /// next pending message.
+  void batchAVX2(size_t n, const uint8_t *const *data, const size_t *len,
+                 uint8_t (*digests)[SHA256Context::DigestLength])
+  {
+    // Block fed to idle lanes
+    static const uint8_t idle[64] = { 0 };
+
+    lanestate_t st;
+    // Message index per lane, or n when idle
+    size_t msg[8];
+    // Next block and total number of padded blocks per lane
+    uint64_t blk[8], nblk[8];
+    // Assembled tail blocks (a message has at most two)
+    uint8_t tail[8][64];
+    const uint8_t *bptr[8];
+
+    size_t next = 0;
+    size_t active = 0;
+    for (unsigned l = 0; l != 8; ++l)
+      msg[l] = n;
+
+    while (true) {
+      // Refill idle lanes
+      for (unsigned l = 0; l != 8 && next != n; ++l) {
+        if (msg[l] != n)
+          continue;
+        msg[l] = next++;
+        blk[l] = 0;
+        nblk[l] = (uint64_t(len[msg[l]]) + 8) / 64 + 1;
+        for (unsigned i = 0; i != 8; ++i)
+          st[i][l] = IV[i];
+        ++active;
+      }
+      if (!active)
+        break;
+
+      // With a single lane left and nothing pending, finish it with
+      // the scalar block function instead of wasting seven lanes
+      if (active == 1 && next == n) {
+        for (unsigned l = 0; l != 8; ++l) {
+          if (msg[l] == n)
+            continue;
+          uint32_t s[8];
+          for (unsigned i = 0; i != 8; ++i)
+            s[i] = st[i][l];
+          const uint64_t full = len[msg[l]] / 64;
+          if (blk[l] < full) {
+            compressGeneric(s, data[msg[l]] + 64 * blk[l], full - blk[l]);
+            blk[l] = full;
+          }
+          for (; blk[l] != nblk[l]; ++blk[l]) {
+            const uint64_t ofs = 64 * blk[l];
+            const size_t l_len = len[msg[l]];
+            memset(tail[l], 0, 64);
+            if (ofs < l_len)
+              memcpy(tail[l], data[msg[l]] + ofs, l_len - ofs);
+            if (ofs <= l_len && l_len < ofs + 64)
+              tail[l][l_len - ofs] = 0x80;
+            if (blk[l] + 1 == nblk[l]) {
+              const uint64_t bits = uint64_t(l_len) * 8;
+              put32(tail[l] + 56, uint32_t(bits >> 32));
+              put32(tail[l] + 60, uint32_t(bits));
+            }
+            compressGeneric(s, tail[l], 1);
+          }
+          putDigest(digests[msg[l]], s);
+          msg[l] = n;
+        }
+        break;
+      }
+
+      // Find the next block of every lane
+      for (unsigned l = 0; l != 8; ++l) {
+        if (msg[l] == n) {
+          bptr[l] = idle;
+          continue;
+        }
+        const size_t l_len = len[msg[l]];
+        const uint64_t ofs = 64 * blk[l];
+        if (ofs + 64 <= l_len) {
+          bptr[l] = data[msg[l]] + ofs;
+          continue;
+        }
+        memset(tail[l], 0, 64);
+        if (ofs < l_len)
+          memcpy(tail[l], data[msg[l]] + ofs, l_len - ofs);
+        if (ofs <= l_len && l_len < ofs + 64)
+          tail[l][l_len - ofs] = 0x80;
+        if (blk[l] + 1 == nblk[l]) {
+          const uint64_t bits = uint64_t(l_len) * 8;
+          put32(tail[l] + 56, uint32_t(bits >> 32));
+          put32(tail[l] + 60, uint32_t(bits));
+        }
+        bptr[l] = tail[l];
+      }
+
+      compressAVX2x8(st, bptr);
+
+      // Retire finished lanes
+      for (unsigned l = 0; l != 8; ++l) {
+        if (msg[l] == n)
+          continue;
+        if (++blk[l] != nblk[l])
+          continue;
+        uint32_t s[8];
+        for (unsigned i = 0; i != 8; ++i)
+          s[i] = st[i][l];
+        putDigest(digests[msg[l]], s);
+        msg[l] = n;
+        --active;
+      }
+    }
+  }
+
+  bool avx2Faster()
+  {
+    // Directory object sized messages; best of three runs each
+    const size_t n = 16;
+    const size_t size = 16384;
+    std::vector<uint8_t> buf(n * size, 0x5a);
+    const uint8_t *data[n];
+    size_t len[n];
+    uint8_t digests[n][SHA256Context::DigestLength];
+    for (size_t i = 0; i != n; ++i) {
+      data[i] = &buf[i * size];
+      len[i] = size;
+    }
+    double avx2 = 0, lib = 0;
+    for (int r = 0; r != 3; ++r) {
+      const Time start(Time::now());
+      batchAVX2(n, data, len, digests);
+      const Time mid(Time::now());
+      for (size_t i = 0; i != n; ++i)
+        libraryDigest(data[i], len[i], digests[i]);
+      const double a = (mid - start).to_double();
+      const double l = (Time::now() - mid).to_double();
+      avx2 = r ? std::min(avx2, a) : a;
+      lib = r ? std::min(lib, l) : l;
+    }
+    return avx2 < lib;
+  }
+
+#endif
+
+}
+
+SHA256Context::SHA256Context()
+{
+  reset();
+}
+
+void SHA256Context::reset()
+{
+  memcpy(m_state, IV, sizeof m_state);
+  m_blocklen = 0;
+  m_total = 0;
+}
+
+SHA256Context &SHA256Context::update(const void *data, size_t len)
+{
+  const compress_t compress = streamCompress();
+  const uint8_t *p = static_cast<const uint8_t*>(data);
+  m_total += len;
+
+  // Complete a partial block first
+  if (m_blocklen) {
+    const size_t fill = std::min(len, sizeof m_block - m_blocklen);
+    memcpy(m_block + m_blocklen, p, fill);
+    m_blocklen += fill;
+    p += fill;
+    len -= fill;
+    if (m_blocklen != sizeof m_block)
+      return *this;
+    compress(m_state, m_block, 1);
+    m_blocklen = 0;
+  }
+
+  // Whole blocks straight from the caller's buffer
+  if (len >= 64) {
+    compress(m_state, p, len / 64);
+    p += len & ~size_t(63);
+    len &= 63;
+  }
+
+  memcpy(m_block, p, len);
+  m_blocklen = len;
+  return *this;
+}
+
+void SHA256Context::final(uint8_t digest[DigestLength])
+{
+  const compress_t compress = streamCompress();
+  const uint64_t bits = m_total * 8;
+
+  m_block[m_blocklen++] = 0x80;
+  if (m_blocklen > 56) {
+    memset(m_block + m_blocklen, 0, sizeof m_block - m_blocklen);
+    compress(m_state, m_block, 1);
+    m_blocklen = 0;
+  }
+  memset(m_block + m_blocklen, 0, 56 - m_blocklen);
+  put32(m_block + 56, uint32_t(bits >> 32));
+  put32(m_block + 60, uint32_t(bits));
+  compress(m_state, m_block, 1);
+
+  putDigest(digest, m_state);
+}
+
+void SHA256Context::digest(const void *data, size_t len,
+                           uint8_t digest[DigestLength])
+{
+  if (g_stream_engine == E_Library) {
+    libraryDigest(data, len, digest);
+    return;
+  }
+  SHA256Context ctx;
+  ctx.update(data, len).final(digest);
+}
+
+void SHA256Context::batch(size_t n, const uint8_t *const *data,
+                          const size_t *len, uint8_t (*digests)[DigestLength])
+{
+  const engine_t engine = batchEngineNow();
+#if defined(SHA256_X86_DISPATCH)
+  // Below three messages the lanes would mostly idle
+  if (engine == E_AVX2 && n >= 3) {
+    batchAVX2(n, data, len, digests);
+    return;
+  }
+#endif
+  for (size_t i = 0; i != n; ++i) {
+    if (engine == E_Library) {
+      libraryDigest(data[i], len[i], digests[i]);
+    } else {
+      SHA256Context ctx;
+      ctx.update(data[i], len[i]).final(digests[i]);
+    }
+  }
+}
+
+bool SHA256Context::available(engine_t e)
+{
+  switch (e) {
+  case E_Generic:
+  case E_Library:
+    return true;
+  case E_SHANI:
+    return g_has_shani;
+  case E_AVX2:
+    return g_has_avx2;
+  }
+  return false;
+}
+
+SHA256Context::engine_t SHA256Context::streamEngine()
+{
+  return g_stream_engine;
+}
+
+SHA256Context::engine_t SHA256Context::batchEngine()
+{
+  return batchEngineNow();
+}
+
+void SHA256Context::force(engine_t e)
+{
+  if (!available(e))
+    throw error("SHA-256 engine " + std::string(name(e))
+                + " not available on this CPU");
+  // AVX2 only makes sense for batches; streams then use the library
+  g_stream_engine = e == E_AVX2 ? E_Library : e;
+  g_batch_engine = e;
+  g_batch_chosen = true;
+}
+
+void SHA256Context::autoSelect()
+{
+  g_stream_engine = detectStream();
+  g_batch_chosen = false;
+}
+
+const char *SHA256Context::name(engine_t e)
+{
+  switch (e) {
+  case E_Generic: return "generic";
+  case E_Library: return "library";
+  case E_SHANI: return "sha-ni";
+  case E_AVX2: return "avx2-x8";
+  }
+  return "unknown";
+}
@@ -0,0 +1,88 @@
+//
+//! \file common/sha256engine.hh
+//! SHA-256 engine with runtime CPU dispatch
+//
+// The object store names every object by its SHA-256 so hashing is
+// on the hot path both in the clients and in the storage daemon. This
+// engine picks the fastest implementation the CPU supports at
+// runtime:
+//
+//  SHA-NI   - the x86 SHA extensions, used for single streams
+//  AVX2     - 8-lane multi-buffer hashing, used for batches of many
+//             small objects (directory objects) when SHA-NI is absent
+//             and the lanes measure faster than the library (measured
+//             on the first batch)
+//  Library  - the platform crypto library (OpenSSL/CommonCrypto)
+//  Generic  - portable C++ block function
+//
+
+#ifndef COMMON_SHA256ENGINE_HH
+#define COMMON_SHA256ENGINE_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+class SHA256Context {
+public:
+  /// Block implementations we can dispatch to
+  enum engine_t { E_Generic, E_Library, E_SHANI, E_AVX2 };
+
+  /// Size of a raw digest
+  static const size_t DigestLength = 32;
+
+  /// Set up a fresh context
+  SHA256Context();
+
+  /// Start over; discards all data hashed so far
+  void reset();
+
+  /// Append data to the hashed stream
+  SHA256Context &update(const void *data, size_t len);
+
+  /// Finish the stream and write the raw digest. The context must be
+  /// reset() before re-use.
+  void final(uint8_t digest[DigestLength]);
+
+  /// One-shot hash of a single buffer through the fastest engine
+  /// (which may be the platform library)
+  static void digest(const void *data, size_t len,
+                     uint8_t digest[DigestLength]);
+
+  /// Hash n independent buffers. With AVX2 and without SHA-NI, up to
+  /// eight buffers are hashed in parallel. The digests are written in
+  /// the order of the input buffers.
+  static void batch(size_t n, const uint8_t *const *data,
+                    const size_t *len, uint8_t (*digests)[DigestLength]);
+
+  /// Whether the given engine can be used on this CPU
+  static bool available(engine_t);
+
+  /// The engine used for single streams
+  static engine_t streamEngine();
+
+  /// The engine used for batches
+  static engine_t batchEngine();
+
+  /// Restrict dispatch to the given engine (for benchmarking and
+  /// testing). Throws if the engine is unavailable. Not thread safe;
+  /// call before hashing starts.
+  static void force(engine_t);
+
+  /// Undo force() and use the auto-detected engines again
+  static void autoSelect();
+
+  /// Name of an engine for diagnostics
+  static const char *name(engine_t);
+
+private:
+  /// The chaining state
+  uint32_t m_state[8];
+  /// Partial block not yet compressed
+  uint8_t m_block[64];
+  /// Number of bytes in m_block
+  size_t m_blocklen;
+  /// Total number of bytes hashed
+  uint64_t m_total;
+};
+
+#endif
@@ -404,8 +404,7 @@ void handleListdev(ServerConnection &conn, Config &conf)
                  (&gotDevice, conf, devname) ]));
 
   std::cout << "List of devices attached to account:" << std::endl;
-  std::istringstream s(std::string(rep.refBody().begin(), rep.refBody().end()));
-  XMLexer lexer(s);
+  XMLexer lexer(rep.refBody());
   ddoc.process(lexer);
 
 }
@@ -510,7 +509,7 @@ namespace {
       throw error("Object ended before objseq_t");
     objseq_t res(len);
     for (size_t i = 0; i != len; ++i) {
-      res[i] = sha256::parse(std::vector<uint8_t>(&b[ofs], &b[ofs + 32]));
+      res[i] = sha256::parseRaw(&b[ofs]);
       ofs += 32;
     }
     return res;
@@ -567,8 +566,7 @@ void handleHistory(ServerConnection &conn, Config &conf)
              [ papply<bool,const job_t&>(&gotBackup, job) ]));
 
   std::cout << "List of backups on this device:" << std::endl;
-  std::istringstream s(std::string(rep.refBody().begin(), rep.refBody().end()));
-  XMLexer lexer(s);
+  XMLexer lexer(rep.refBody());
   ddoc.process(lexer);
 }
 
@@ -647,7 +645,7 @@ void handleCDP(ServerConnection &conn, Config &conf)
 
     // Print hash of root
     MTrace(t_hi, trace::Info, "Upload complete: "
-           << root.getHash().m_hex);
+           << root.getHash().hex());
 
     // Now watch for FS changes.
     //
@@ -9,6 +9,9 @@
 #include "common/error.hh"
 #include "common/trace.hh"
 
+#include <streambuf>
+#include <ostream>
+
 #if defined(__unix__) || defined(__APPLE__)
 # include <openssl/err.h>
 # include "httpd_posix.cc"
@@ -20,6 +23,58 @@ namespace {
 
   //! Trace path for request logging
   trace::Path t_req("/HTTPd/request");
+
+  //! How long a streamed reply waits for the peer to take what was
+  //! posted before it posts more
+  const useconds_t g_drain_wait = 10000;
+
+  //! A stream buffer that posts what is written to it as replies to a
+  //! request; the first one with our headers, and then continuations,
+  //! each time the buffer fills up. A continuation is not posted until
+  //! the one before it was written out, so that a slow peer holds up
+  //! the writer rather than making us queue the document in memory.
+  class ReplyBuf : public std::streambuf {
+  public:
+    ReplyBuf(HTTPd &httpd, uint64_t id, const HTTPHeaders &headers,
+             size_t size)
+      : m_httpd(httpd), m_id(id), m_headers(headers), m_buf(size ? size : 1)
+      , m_started(false) {
+      setp(&m_buf[0], &m_buf[0] + m_buf.size());
+    }
+
+    //! Post what is left as the final reply
+    void finish() { post(true); }
+
+    //! Whether a reply was posted already
+    bool started() const { return m_started; }
+
+  protected:
+    int_type overflow(int_type c) {
+      post(false);
+      if (!traits_type::eq_int_type(c, traits_type::eof()))
+        return sputc(traits_type::to_char_type(c));
+      return traits_type::not_eof(c);
+    }
+
+  private:
+    HTTPd &m_httpd;
+    const uint64_t m_id;
+    const HTTPHeaders m_headers;
+    std::vector<char> m_buf;
+    bool m_started;
+
+    void post(bool final) {
+      const std::string body(pbase(), pptr());
+      while (m_started && m_httpd.outqueued(m_id))
+        usleep(g_drain_wait);
+      if (m_started)
+        m_httpd.postReply(HTTPReply(m_id, final, body));
+      else
+        m_httpd.postReply(HTTPReply(m_id, final, 200, m_headers, body));
+      m_started = true;
+      setp(&m_buf[0], &m_buf[0] + m_buf.size());
+    }
+  };
 }
 
 HTTPd::HTTPd()
@@ -119,6 +174,33 @@ void HTTPd::postReply(uint64_t req_id, const xml::IDocument &doc)
                       out.str()));
 }
 
+void HTTPd::streamReply(uint64_t req_id, const xml::IDocument &doc,
+                        size_t chunk)
+{
+  using namespace xml;
+
+  ReplyBuf buf(*this, req_id,
+               HTTPHeaders().add("content-type", "application/xml")
+               .add("cache-control", "no-cache"), chunk);
+  try {
+    std::ostream out(&buf);
+    XMLWriter writer(out);
+    doc.output(writer);
+  } catch (...) {
+    if (!buf.started())
+      throw;
+    // The status went out already; all we can do is cut the reply
+    // short so that the peer does not take it for complete
+    MTrace(t_http, trace::Info, "Failed generating streamed reply "
+           << req_id << " - closing connection");
+    HTTPReply abort(req_id, true, std::string());
+    abort.setAborted();
+    postReply(abort);
+    throw;
+  }
+  buf.finish();
+}
+
 size_t HTTPd::getQueueLength()
 {
   MutexLock lock(m_requests_mutex);
@@ -145,7 +227,7 @@ bool HTTPd::HandlerThread::outqueued(uint64_t id)
   if (proc == m_id_procs.end())
     return false;
   // Ask processor if anything is queued
-  return proc->second->outqueued();
+  return proc->second->outqueued(id);
 }
 
 void HTTPd::HandlerThread::setNonpersistent(uint64_t id)
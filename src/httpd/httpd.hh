@@ -68,6 +68,16 @@ public:
   //! in the form of an XML document
   void postReply(uint64_t id, const xml::IDocument &doc);
 
+  //! Like postReply, but the document is posted as it is generated,
+  //! in chunked replies of about the given size, so that a large
+  //! document is never held in memory; we wait for each chunk to be
+  //! written before posting the next. A document smaller than that
+  //! goes out as one reply. If generating the document fails after
+  //! the first chunk went out, the connection is closed without
+  //! ending the reply, and the error is re-thrown.
+  void streamReply(uint64_t id, const xml::IDocument &doc,
+                   size_t chunk = 64 * 1024);
+
   //! For diagnostics: Return the number of requests in queue
   size_t getQueueLength(); // Not const because we take a mutex
 
@@ -203,8 +213,9 @@ private:
       bool shouldWrite() const;
 
       //! Returns true if anything is on the outqueue (not yet written
-      //! to at least the OS network layer buffer)
-      bool outqueued() const;
+      //! to at least the OS network layer buffer), or if replies to
+      //! the given request wait to be serialised behind others
+      bool outqueued(uint64_t id) const;
 
 #if defined(__unix__) || defined(__APPLE__)
       //! Called by the handler when a read is possible on the given
@@ -349,6 +360,10 @@ private:
       //! terminating request here
       uint64_t m_close_after_id;
 
+      //! Set once a response was aborted; nothing more is sent on
+      //! this connection and later replies are dropped
+      bool m_aborted;
+
     };
 
     //! Used internally to post a HTTP requests to our request queue
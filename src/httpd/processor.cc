@@ -35,6 +35,7 @@ HTTPd::HandlerThread::Processor::Processor(HandlerThread &handler)
   , m_ssl_needs_read(false)
   , m_ssl_in_shutdown(false)
   , m_close_after_id(-1)
+  , m_aborted(false)
 {
 }
 
@@ -49,6 +50,7 @@ HTTPd::HandlerThread::Processor::Processor(const Processor &o)
   , m_ssl_needs_read(false)
   , m_ssl_in_shutdown(false)
   , m_close_after_id(-1)
+  , m_aborted(false)
 {
   if (o.m_ssl)
     throw error("Cannot copy construct a processor with SSL state");
@@ -130,10 +132,16 @@ bool HTTPd::HandlerThread::Processor::shouldWrite() const
     || (m_ssl && m_ssl_in_shutdown && !m_ssl_needs_read && !m_ssl_needs_write);
 }
 
-bool HTTPd::HandlerThread::Processor::outqueued() const
+bool HTTPd::HandlerThread::Processor::outqueued(uint64_t id) const
 {
   MutexLock lock(m_outbound_mutex);
-  return !m_outbound.empty();
+  if (!m_outbound.empty())
+    return true;
+  for (std::list<HTTPReply>::const_iterator i = m_outqueue.begin();
+       i != m_outqueue.end(); ++i)
+    if (i->getId() == id)
+      return true;
+  return false;
 }
 
 void HTTPd::HandlerThread::Processor::requestActivated(uint64_t id)
@@ -151,6 +159,14 @@ void HTTPd::HandlerThread::Processor::postReply(const HTTPReply &response)
   { // Note; we are called from a worker thread.
     MutexLock lock(m_outbound_mutex);
 
+    // Once a response was aborted the connection is going down and
+    // nothing more may follow the truncated body
+    if (m_aborted) {
+      MTrace(t_proc, trace::Debug, "Processor dropping reply to id "
+             << response.getId() << " after aborted response");
+      return;
+    }
+
     // If this response is a 5xx series error, we close the connection.
     if (response.getStatus() >= 500) {
       MTrace(t_proc, trace::Info, "Processor will close connection after "
@@ -182,6 +198,18 @@ void HTTPd::HandlerThread::Processor::postReply(const HTTPReply &response)
     while (!m_outqueue.empty()
            && !m_req_wo_final.empty()
            && m_outqueue.front().getId() == m_req_wo_final.front()) {
+      // An aborted response ends the connection, after whatever of
+      // it was serialised already
+      if (m_outqueue.front().isAborted()) {
+        MTrace(t_proc, trace::Info, "Processor closing connection after "
+               "aborted response to id " << m_outqueue.front().getId());
+        m_aborted = true;
+        setClose();
+        m_outqueue.clear();
+        m_req_wo_final.clear();
+        break;
+      }
+
       // Serialise request
       m_outqueue.front().serialize(m_outbound);
 
@@ -23,6 +23,7 @@ namespace {
 HTTPReply::HTTPReply()
   : m_id(0)
   , m_is_final(true)
+  , m_is_aborted(false)
   , m_status(0)
 {
 }
@@ -34,6 +35,7 @@ HTTPReply::HTTPReply(uint64_t id,
                      const std::string &content)
   : m_id(id)
   , m_is_final(is_final)
+  , m_is_aborted(false)
   , m_status(status)
   , m_headers(headers)
   , m_body(content)
@@ -45,6 +47,7 @@ HTTPReply::HTTPReply(uint64_t id,
                      const std::string &content)
   : m_id(id)
   , m_is_final(is_final)
+  , m_is_aborted(false)
   , m_status(0)
   , m_body(content)
 {
@@ -186,6 +189,17 @@ void HTTPReply::setFinal(bool f)
   m_is_final = f;
 }
 
+bool HTTPReply::isAborted() const
+{
+  return m_is_aborted;
+}
+
+void HTTPReply::setAborted()
+{
+  m_is_final = true;
+  m_is_aborted = true;
+}
+
 bool HTTPReply::consumeHeaders(std::vector<uint8_t> &d)
 {
   // We simply attempt parsing the full request-line and header block
@@ -78,6 +78,15 @@ public:
   //! Sets whether reply is final or not
   void setFinal(bool);
 
+  //! Returns whether this reply aborts the response to the request
+  bool isAborted() const;
+
+  //! Marks the reply as aborting a response that is already under
+  //! way. An aborted reply is final but carries nothing; instead of
+  //! ending the response the connection is closed once what went
+  //! before it is sent, so that the peer sees the body cut short.
+  void setAborted();
+
   //! Returns the status code
   uint16_t getStatus() const;
 
@@ -117,6 +126,9 @@ private:
   //! Whether or not we are the final reply to the request id
   bool m_is_final;
 
+  //! Whether we abort the response rather than end it
+  bool m_is_aborted;
+
   //! Status code
   uint16_t m_status;
 
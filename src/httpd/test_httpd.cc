@@ -7,6 +7,7 @@
 #include "common/trace.hh"
 #include "common/thread.hh"
 #include "common/mutex.hh"
+#include "common/partial.hh"
 #include "httpd.hh"
 #include <iostream>
 #include <cctype>
@@ -22,6 +23,14 @@
 
 bool g_failed = false;
 
+namespace {
+  //! Iterate up to the given number of document items
+  bool nextItem(size_t &item, size_t items)
+  {
+    return ++item <= items;
+  }
+}
+
 class MyWorker : public Thread {
 public:
   MyWorker(HTTPd &httpd);
@@ -52,6 +61,10 @@ private:
   //! The same simple test as above, only with a delay
   void test_simple_delay();
 
+  //! Request a document large enough to be streamed in chunks, and
+  //! parse it
+  void test_xml_stream();
+
   //! This method will send a request to the server. It will open the
   //! connection if we have none and it will re-use the existing
   //! connection if we have it.
@@ -61,8 +74,9 @@ private:
   void post_body(const std::string &data, int delay = 0);
 
   //! This method will sort-of parse the HTTP reply and return the
-  //! body data. We are NOT fully HTTP 1.1 compliant here, we just
-  //! need to parse what our own server sends...
+  //! body data (reading either content-length or chunked bodies). We
+  //! are NOT fully HTTP 1.1 compliant here, we just need to parse
+  //! what our own server sends...
   std::string receive_body();
 
   //! This method will perform a read and append data to m_inbound.
@@ -172,6 +186,26 @@ void MyWorker::run() try
       usleep(delay);
     }
 
+    //
+    // 3: If request contains header "X-Items" then the response is an
+    //    XML document with that many items, streamed in small chunks
+    //
+    if (req.hasHeader("X-Items")) {
+      std::istringstream parser(req.getHeader("X-Items"));
+      size_t items;
+      parser >> items;
+      if (parser.fail())
+        throw error("Cannot parse items header");
+      size_t item = 0;
+      using namespace xml;
+      const IDocument &doc
+        = mkDoc(Element("items")
+                (*Element("item")(CharData<size_t>(item))
+                 [ papply<bool,size_t&,size_t>(nextItem, item, items) ]));
+      m_httpd.streamReply(req.m_id, doc, 1024);
+      continue;
+    }
+
     std::string data;
     for (size_t i = 0; i != req.m_body.size(); ++i) {
       char c = req.m_body[i];
@@ -203,13 +237,16 @@ void MyClient::run() try
 {
   // Run a sequence of requests
   for (size_t i = 0; i != 100; ++i) {
-    switch (i % 2) {
+    switch (i % 3) {
     case 0:
       test_simple_nodelay();
       break;
     case 1:
       test_simple_delay();
       break;
+    case 2:
+      test_xml_stream();
+      break;
     }
 
   }
@@ -238,6 +275,30 @@ void MyClient::test_simple_delay()
                 + reply + "\"");
 }
 
+void MyClient::test_xml_stream()
+{
+  const size_t items = 2000;
+  std::ostringstream out;
+  out << "GET / HTTP/1.1\r\n"
+      << "host: foo\r\n"
+      << "x-items: " << items << "\r\n"
+      << "\r\n";
+  send(out.str());
+
+  const std::string reply = receive_body();
+  size_t item;
+  size_t seen = 0;
+  using namespace xml;
+  const IDocument &doc
+    = mkDoc(Element("items")
+            (*Element("item")(CharData<size_t>(item))
+             [ papply<bool,size_t&,size_t>(nextItem, seen, items) ]));
+  XMLexer lexer(reply);
+  doc.process(lexer);
+  if (seen != items || item != items)
+    throw error("Streamed document test got bad reply");
+}
+
 void MyClient::post_body(const std::string &data, int delay)
 {
   std::ostringstream out;
@@ -312,6 +373,7 @@ std::string MyClient::receive_body()
   }
 
   size_t body_size = 0;
+  bool chunked = false;
 
   // Parse all headers
   while (true) {
@@ -337,6 +399,28 @@ std::string MyClient::receive_body()
         throw error("Client cannot parse content length header");
     }
 
+    if (key == "transfer-encoding" && hline == "chunked")
+      chunked = true;
+  }
+
+  if (chunked) {
+    std::string body;
+    while (true) {
+      while (m_inbound.find("\r\n") == m_inbound.npos)
+        readmore();
+      size_t chunk_size;
+      std::istringstream csparse(m_inbound.substr(0, m_inbound.find("\r\n")));
+      csparse >> std::hex >> chunk_size;
+      if (csparse.fail())
+        throw error("Client cannot parse chunk size");
+      m_inbound.erase(0, m_inbound.find("\r\n") + 2);
+      while (m_inbound.size() < chunk_size + 2)
+        readmore();
+      body.append(m_inbound, 0, chunk_size);
+      m_inbound.erase(0, chunk_size + 2);
+      if (!chunk_size)
+        return body;
+    }
   }
 
   // Make sure we have the full body read
@@ -9,6 +9,8 @@
 #include "common/trace.hh"
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
+#include <string.h>
 
 namespace {
   trace::Path t_obj("/objparser");
@@ -126,101 +128,356 @@ FSDir::FSDir(const BindF1Base<std::vector<uint8_t>,const sha256&> &g, const objs
   for (objseq_t::const_iterator hashiter = h.begin();
        hashiter != h.end(); ++hashiter)
     try {
-      parse((*m_get)(*hashiter));
+      parse(DirView(*m_get, *hashiter));
     } catch (error &e) {
-      throw error(hashiter->m_hex + ": " + e.toString());
+      throw error(hashiter->hex() + ": " + e.toString());
     }
 }
 
 FSDir::FSDir(const std::vector<uint8_t> &obj)
   : dirsize(0)
 {
-  parse(obj);
+  parse(DirView(obj));
 }
 
-void FSDir::parse(const std::vector<uint8_t> &obj)
+void FSDir::parse(const DirView &view)
 {
-  // Parse
+  dirsize += view.dirsize();
+  for (DirView::const_iterator i = view.begin(); i != view.end(); ++i)
+    dirents.push_back(i->dirent());
+}
+
+namespace {
+  /// Skip a string, returning the offset after it
+  size_t skipString(const std::vector<uint8_t> &obj, size_t ofs)
+  {
+    const uint32_t len = des<uint32_t>(obj, ofs);
+    if (obj.size() < ofs + len)
+      throw error("Object ended before string");
+    return ofs + len;
+  }
+
+  /// Compare names bytewise like memcmp(), the shorter first if one
+  /// is a prefix of the other
+  int compareBytes(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen)
+  {
+    const size_t common = std::min(alen, blen);
+    const int c = common ? memcmp(a, b, common) : 0;
+    if (c)
+      return c;
+    return alen < blen ? -1 : alen > blen ? 1 : 0;
+  }
+
+  /// Find the end of the LoM entry starting at the given offset
+  size_t lomEnd(const std::vector<uint8_t> &obj, size_t ofs)
+  {
+    const uint8_t mt = des<uint8_t>(obj, ofs);
+    ofs = skipString(obj, skipString(obj, ofs));
+    switch (mt) {
+    case 0x01: // UNIX regular file: group, mode, ctime, mtime, size
+      ofs = skipString(obj, ofs) + 4 + 3 * 8;
+      break;
+    case 0x02: // UNIX directory: group, mode, ctime, mtime
+      ofs = skipString(obj, ofs) + 4 + 2 * 8;
+      break;
+    case 0x11: // Windows regular file: attributes, sddl, mtime, btime, size
+      ofs = skipString(obj, ofs + 4) + 3 * 8;
+      break;
+    case 0x12: // Windows directory: attributes, sddl, mtime, btime
+      ofs = skipString(obj, ofs + 4) + 2 * 8;
+      break;
+    default:
+      throw error("Unknown meta data type entry");
+    }
+    if (obj.size() < ofs)
+      throw error("Object ended before LoM entry");
+    return ofs;
+  }
+}
+
+DirView::DirView(const BindF1Base<std::vector<uint8_t>,const sha256&> &g,
+                 const sha256 &h)
+  : m_obj(new std::vector<uint8_t>)
+{
+  // Take over the fetched object rather than copy it
+  std::vector<uint8_t> obj(g(h));
+  m_obj->swap(obj);
+  parse();
+}
+
+DirView::DirView(const std::vector<uint8_t> &obj)
+  : m_obj(new std::vector<uint8_t>(obj))
+{
+  parse();
+}
+
+void DirView::parse()
+{
+  const std::vector<uint8_t> &obj(*m_obj);
   size_t ofs = 0;
 
-  // First, see that it is a version 0 object
-  if (des<uint8_t>(obj, ofs))
-    throw error("Object is not version 0");
+  // First, see that it is a version 0 or an indexed version 1 object
+  const uint8_t version = des<uint8_t>(obj, ofs);
+  if (version > 1)
+    throw error("Object is not version 0 or 1");
 
   uint8_t objType= des<uint8_t>(obj, ofs);
   if (objType != 0xdd && objType != 0xde)
     throw error("Object is not a directory");
 
   // Cumulative size of this object and all its children
-  dirsize += des<uint64_t>(obj, ofs);
+  m_dirsize = des<uint64_t>(obj, ofs);
 
   // Next, we have a 32-bit integer with the length of our LoR
-  const uint32_t lor_len = des<uint32_t>(obj, ofs);
+  m_count = des<uint32_t>(obj, ofs);
 
-  // Now read LoR
-  std::vector<objseq_t> lor;
-  for (size_t i = 0; i != lor_len; ++i) {
-    lor.push_back(des<objseq_t>(obj, ofs));
+  // Then the index, if any
+  m_index = 0;
+  if (version == 1) {
+    m_index = ofs;
+    if (obj.size() < ofs + uint64_t(m_count) * 8)
+      throw error("Object ended before index");
+    ofs += m_count * 8;
   }
-  // And read the same number of elements in the LoM
-  for (size_t i = 0; i != lor_len; ++i) {
-    // Fill out dirent structure
-    dirent_t de;
-    de.hash = lor[i];
-    // Read data type entry
-    const uint8_t entrytype = des<uint8_t>(obj, ofs);
-    switch (entrytype) {
-    case 0x01: { // 0x01 => regular file
-      lom_unix_regfile uf(obj, ofs);
-      de.type = FSDir::dirent_t::UNIXFILE;
-      de.name = uf.name;
-      de.user = uf.owner;
-      de.group = uf.group;
-      de.mode = uf.permissions;
-      de.mtime = uf.mtime;
-      de.size = uf.filesize;
-      break;
-    }
-    case 0x02: { // 0x02 => directory
-      lom_unix_directory ud(obj, ofs);
-      de.type = FSDir::dirent_t::UNIXDIR;
-      de.name = ud.name;
-      de.user = ud.owner;
-      de.group = ud.group;
-      de.mode = ud.permissions;
-      de.mtime = ud.mtime;
-      de.size = 0;
-      break;
-    }
-    case 0x11: { // 0x11 => windows file
-      lom_windows_regfile wf(obj, ofs);
-      de.type = FSDir::dirent_t::WINFILE;
-      de.name = wf.name;
-      de.user = wf.owner;
-      de.group = std::string();
-      de.mode = 0600;
-      de.mtime = wf.mtime;
-      de.size = wf.filesize;
-      break;
-    }
-    case 0x12: { // 0x12 => windows directory
-      lom_windows_directory wd(obj, ofs);
-      de.type = FSDir::dirent_t::WINDIR;
-      de.name = wd.name;
-      de.user = wd.owner;
-      de.group = std::string();
-      de.mode = 0700;
-      de.mtime = wd.mtime;
-      de.size = 0;
-      break;
-    }
-    default:
-      throw error("Unknown meta data type entry");
+
+  // Skip the LoR to find the LoM, and the LoM to see that it is
+  // complete; entries are not decoded until they are looked at
+  m_lor = ofs;
+  for (size_t i = 0; i != m_count; ++i) {
+    const uint32_t len = des<uint32_t>(obj, ofs);
+    if (obj.size() < ofs + uint64_t(len) * sha256::size)
+      throw error("Object ended before objseq_t");
+    ofs += len * sha256::size;
+  }
+  m_lom = ofs;
+  for (size_t i = 0; i != m_count; ++i)
+    ofs = lomEnd(obj, ofs);
+
+  // The index must point where the entries are, in name order
+  if (m_index) {
+    const_iterator prev(end());
+    for (const_iterator i = begin(); i != end(); ++i) {
+      size_t x = m_index + i.m_idx * 8;
+      if (des<uint32_t>(obj, x) != i->m_lor || des<uint32_t>(obj, x) != i->m_lom)
+        throw error("Directory index does not match entries");
+      if (prev != end() && prev->compareName(*i) >= 0)
+        throw error("Directory entries not sorted");
+      prev = i;
     }
+  }
+}
+
+DirView::const_iterator DirView::begin() const
+{
+  const_iterator i;
+  i.m_idx = 0;
+  i.m_ent.m_obj = m_obj.ptr();
+  i.m_ent.m_lor = m_lor;
+  i.m_ent.m_lom = m_lom;
+  return i;
+}
+
+DirView::const_iterator DirView::end() const
+{
+  const_iterator i;
+  i.m_idx = m_count;
+  i.m_ent.m_obj = m_obj.ptr();
+  i.m_ent.m_lor = 0;
+  i.m_ent.m_lom = 0;
+  return i;
+}
+
+DirView::const_iterator DirView::at(size_t n) const
+{
+  if (n >= m_count)
+    return end();
+  if (!m_index) {
+    const_iterator i(begin());
+    while (n--)
+      ++i;
+    return i;
+  }
+  const_iterator i;
+  i.m_idx = n;
+  i.m_ent.m_obj = m_obj.ptr();
+  size_t x = m_index + n * 8;
+  i.m_ent.m_lor = des<uint32_t>(*m_obj, x);
+  i.m_ent.m_lom = des<uint32_t>(*m_obj, x);
+  return i;
+}
+
+DirView::const_iterator DirView::find(const std::string &name) const
+{
+  if (!m_index) {
+    for (const_iterator i = begin(); i != end(); ++i)
+      if (i->nameIs(name))
+        return i;
+    return end();
+  }
+  size_t lo = 0;
+  size_t hi = m_count;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const_iterator i(at(mid));
+    const int c = i->compareName(name);
+    if (!c)
+      return i;
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return end();
+}
+
+DirView::const_iterator &DirView::const_iterator::operator++()
+{
+  // Step past our entries
+  const std::vector<uint8_t> &obj(*m_ent.m_obj);
+  size_t ofs = m_ent.m_lor;
+  m_ent.m_lor = ofs + des<uint32_t>(obj, ofs) * sha256::size;
+  m_ent.m_lom = lomEnd(obj, m_ent.m_lom);
+  ++m_idx;
+  return *this;
+}
+
+FSDir::dirent_t::t DirView::entry_t::type() const
+{
+  switch ((*m_obj)[m_lom]) {
+  case 0x01: return FSDir::dirent_t::UNIXFILE;
+  case 0x02: return FSDir::dirent_t::UNIXDIR;
+  case 0x11: return FSDir::dirent_t::WINFILE;
+  default: return FSDir::dirent_t::WINDIR;
+  }
+}
+
+std::string DirView::entry_t::name() const
+{
+  size_t ofs = m_lom + 1;
+  return des<std::string>(*m_obj, ofs);
+}
+
+bool DirView::entry_t::nameIs(const std::string &n) const
+{
+  size_t ofs = m_lom + 1;
+  const uint32_t len = des<uint32_t>(*m_obj, ofs);
+  return len == n.size()
+    && std::equal(n.begin(), n.end(), m_obj->begin() + ofs);
+}
+
+int DirView::entry_t::compareName(const std::string &n) const
+{
+  size_t ofs = m_lom + 1;
+  const uint32_t len = des<uint32_t>(*m_obj, ofs);
+  return compareBytes(len ? &(*m_obj)[ofs] : 0, len,
+                      reinterpret_cast<const uint8_t*>(n.data()), n.size());
+}
+
+int DirView::entry_t::compareName(const entry_t &o) const
+{
+  size_t ofs = m_lom + 1;
+  const uint32_t len = des<uint32_t>(*m_obj, ofs);
+  size_t oofs = o.m_lom + 1;
+  const uint32_t olen = des<uint32_t>(*o.m_obj, oofs);
+  return compareBytes(len ? &(*m_obj)[ofs] : 0, len,
+                      olen ? &(*o.m_obj)[oofs] : 0, olen);
+}
+
+size_t DirView::entry_t::hashes() const
+{
+  size_t ofs = m_lor;
+  return des<uint32_t>(*m_obj, ofs);
+}
+
+sha256 DirView::entry_t::hash(size_t i) const
+{
+  return sha256::parseRaw(&(*m_obj)[m_lor + 4 + i * sha256::size]);
+}
+
+objseq_t DirView::entry_t::hashseq() const
+{
+  size_t ofs = m_lor;
+  return des<objseq_t>(*m_obj, ofs);
+}
+
+size_t DirView::entry_t::afterOwner() const
+{
+  return skipString(*m_obj, skipString(*m_obj, m_lom + 1));
+}
+
+std::string DirView::entry_t::user() const
+{
+  size_t ofs = skipString(*m_obj, m_lom + 1);
+  return des<std::string>(*m_obj, ofs);
+}
+
+std::string DirView::entry_t::group() const
+{
+  const FSDir::dirent_t::t t = type();
+  if (t == FSDir::dirent_t::WINFILE || t == FSDir::dirent_t::WINDIR)
+    return std::string();
+  size_t ofs = afterOwner();
+  return des<std::string>(*m_obj, ofs);
+}
+
+uint32_t DirView::entry_t::mode() const
+{
+  switch (type()) {
+  case FSDir::dirent_t::WINFILE: return 0600;
+  case FSDir::dirent_t::WINDIR: return 0700;
+  default: break;
+  }
+  size_t ofs = skipString(*m_obj, afterOwner());
+  return des<uint32_t>(*m_obj, ofs);
+}
 
-    // Add to list of entries
-    dirents.push_back(de);
+time_t DirView::entry_t::mtime() const
+{
+  size_t ofs;
+  switch (type()) {
+  case FSDir::dirent_t::WINFILE:
+  case FSDir::dirent_t::WINDIR:
+    // After attributes and sddl
+    ofs = skipString(*m_obj, afterOwner() + 4);
+    break;
+  default:
+    // After group, mode and ctime
+    ofs = skipString(*m_obj, afterOwner()) + 4 + 8;
+    break;
+  }
+  return time_t(des<uint64_t>(*m_obj, ofs));
+}
+
+uint64_t DirView::entry_t::size() const
+{
+  size_t ofs;
+  switch (type()) {
+  case FSDir::dirent_t::UNIXFILE:
+    // After group, mode, ctime and mtime
+    ofs = skipString(*m_obj, afterOwner()) + 4 + 2 * 8;
+    break;
+  case FSDir::dirent_t::WINFILE:
+    // After attributes, sddl, mtime and btime
+    ofs = skipString(*m_obj, afterOwner() + 4) + 2 * 8;
+    break;
+  default:
+    return 0;
   }
+  return des<uint64_t>(*m_obj, ofs);
+}
+
+FSDir::dirent_t DirView::entry_t::dirent() const
+{
+  FSDir::dirent_t de;
+  de.hash = hashseq();
+  de.type = type();
+  de.name = name();
+  de.user = user();
+  de.group = group();
+  de.mode = mode();
+  de.mtime = mtime();
+  de.size = size();
+  return de;
 }
 
 FSDir::dirent_t::dirent_t()
@@ -93,7 +93,7 @@ inline objseq_t des<objseq_t>(const std::vector<uint8_t> &b, size_t &ofs)
     throw error("Object ended before objseq_t");
   objseq_t res(len);
   for (size_t i = 0; i != len; ++i) {
-    res[i] = sha256::parse(std::vector<uint8_t>(&b[ofs], &b[ofs + 32]));
+    res[i] = sha256::parseRaw(&b[ofs]);
     ofs += 32;
   }
   return res;
@@ -115,6 +115,8 @@ inline std::string des<std::string>(const std::vector<uint8_t> &b, size_t &ofs)
 std::string lom_entry_extract_name(const std::vector<uint8_t> &, size_t &);
 
 
+class DirView;
+
 /// A File System Directory object - both 0x02 (UNIX DIRECTORY) and
 /// 0x12 (WINDOWS DIRECTORY) are supported.
 class FSDir {
@@ -149,12 +151,125 @@ public:
 
 private:
   refcount_ptr<BindF1Base<std::vector<uint8_t>,const sha256&> > m_get;
-  void parse(const std::vector<uint8_t>&);
+  void parse(const DirView&);
+};
+
+/// A directory object read in place. Unlike FSDir, nothing is decoded
+/// up front; entries are decoded as far as they are looked at,
+/// straight from the object, which the view keeps. A directory that
+/// was split in several objects is read as a view per object.
+//
+/// Both versions of directory objects are read. Version 1 objects
+/// hold their entries sorted by name, and between the LoR length and
+/// the LoR an index of 32-bit object offsets of the LoR and LoM entry
+/// of every entry, so that a name is found by binary search. The
+/// objects of a split version 1 directory hold consecutive ranges of
+/// names.
+class DirView {
+public:
+  /// Given an 'object fetch' closure and a hash, load the object
+  DirView(const BindF1Base<std::vector<uint8_t>,const sha256&> &, const sha256 &);
+
+  /// Given a plain object
+  DirView(const std::vector<uint8_t> &);
+
+  /// Cumulative size of this object and all its children
+  uint64_t dirsize() const { return m_dirsize; }
+
+  /// Number of entries
+  size_t size() const { return m_count; }
+
+  /// Are the entries sorted and indexed (a version 1 object)
+  bool indexed() const { return m_index != 0; }
+
+  /// An entry, valid as long as the view it came from
+  class entry_t {
+  public:
+    FSDir::dirent_t::t type() const;
+    std::string name() const;
+    /// Compare our name without copying it
+    bool nameIs(const std::string &) const;
+    /// Compare our name to the given one, bytewise like memcmp()
+    int compareName(const std::string &) const;
+    int compareName(const entry_t &) const;
+    /// The objects holding our data or directory
+    size_t hashes() const;
+    sha256 hash(size_t) const;
+    objseq_t hashseq() const;
+    std::string user() const;
+    std::string group() const;
+    uint32_t mode() const;
+    time_t mtime() const;
+    uint64_t size() const;
+    /// Decode everything
+    FSDir::dirent_t dirent() const;
+  private:
+    friend class DirView;
+    const std::vector<uint8_t> *m_obj;
+    /// Our entries in the LoR and the LoM
+    size_t m_lor;
+    size_t m_lom;
+    /// Offset of the field after the name and owner
+    size_t afterOwner() const;
+  };
+
+  class const_iterator {
+  public:
+    const entry_t &operator*() const { return m_ent; }
+    const entry_t *operator->() const { return &m_ent; }
+    const_iterator &operator++();
+    bool operator==(const const_iterator &o) const { return m_idx == o.m_idx; }
+    bool operator!=(const const_iterator &o) const { return m_idx != o.m_idx; }
+  private:
+    friend class DirView;
+    size_t m_idx;
+    entry_t m_ent;
+  };
+
+  const_iterator begin() const;
+  const_iterator end() const;
+
+  /// The entry at the given position; immediate if we are indexed
+  const_iterator at(size_t) const;
+
+  /// Find the entry with the given name, or return end(). A binary
+  /// search if we are indexed.
+  const_iterator find(const std::string &) const;
+
+private:
+  refcount_ptr<std::vector<uint8_t> > m_obj;
+  uint64_t m_dirsize;
+  size_t m_count;
+  /// Start of the index (zero if none), of the LoR and of the LoM
+  size_t m_index;
+  size_t m_lor;
+  size_t m_lom;
+
+  /// Check the header and find the lists
+  void parse();
 };
 
 //! Our max chunk size
 const size_t ng_chunk_size = 8 * 1024 * 1024;
 
+//! A file data object holding a full chunk of zeros. Runs of zeros
+//! in files - holes in sparse files in particular - are stored as
+//! this object, so it is well known and need never be read, hashed
+//! or written again.
+inline std::vector<uint8_t> ng_zero_chunk()
+{
+  std::vector<uint8_t> chunk(ng_chunk_size, 0);
+  chunk[1] = 0xfd; // version 0 file data object
+  return chunk;
+}
+
+//! The hash of the all-zero file data object
+inline const sha256 &ng_zero_chunk_hash()
+{
+  static const sha256 hash(sha256::hash(ng_zero_chunk()));
+  return hash;
+}
+
 
 
 #endif
@@ -560,7 +560,7 @@ void MyWorker::handleGET(const HTTPRequest &req)
 
 std::vector<uint8_t> MyWorker::localObjectFetch(const sha256 &obj) const
 {
-  const std::string name = m_cfg.root + splitName(obj.m_hex);
+  const std::string name = m_cfg.root + splitName(obj.hex());
 
 #if defined(__unix__) || defined(__APPLE__)
   int orc;
@@ -598,7 +598,7 @@ std::vector<uint8_t> MyWorker::localObjectFetch(const sha256 &obj) const
 
 uint64_t MyWorker::localObjectSize(const sha256 &obj) const
 {
-  const std::string name = m_cfg.root + splitName(obj.m_hex);
+  const std::string name = m_cfg.root + splitName(obj.hex());
 
 #if defined(__unix__) || defined(__APPLE__)
   struct stat buf;
@@ -619,7 +619,7 @@ void MyWorker::handlePOST(const HTTPRequest &req)
   const std::string hash = getHash(req);
 
   // If hashes deviate, request is not valid
-  if (sha256::hash(req.m_body).m_hex != hash) {
+  if (sha256::hash(req.m_body).hex() != hash) {
     m_httpd.postReply(HTTPReply(req.m_id, true, 400,
 				HTTPHeaders().add("content-type", "text/plain"),
 				"Hash and content data do not match\n"));
@@ -651,16 +651,20 @@ void MyWorker::handlePOST(const HTTPRequest &req)
   //
   if (must_replicate) {
     size_t ofs = 0;
-    // version - must be zero
-    if (0 != des<uint8_t>(req.m_body, ofs)) {
-      MTrace(t_stord, trace::Info, "Rejecting version not-0 object");
+    // version - must be zero, or one for (indexed) directory objects
+    const uint8_t objVersion = des<uint8_t>(req.m_body, ofs);
+    // Only perform validation on directory entries
+    uint8_t objType= des<uint8_t>(req.m_body, ofs);
+    if (0 != objVersion
+        && !(1 == objVersion && (0xdd == objType || 0xde == objType))) {
+      MTrace(t_stord, trace::Info, "Rejecting version " << uint32_t(objVersion)
+             << " object");
       m_httpd.postReply(HTTPReply(req.m_id, true, 400,
                                   HTTPHeaders().add("content-type", "text/plain"),
-                                  "Object version must be zero.\n"));
+                                  "Object version must be zero, or one for "
+                                  "directory objects.\n"));
       return;
     }
-    // Only perform validation on directory entries
-    uint8_t objType= des<uint8_t>(req.m_body, ofs);
     if (0xdd == objType || 0xde == objType) {
       MTrace(t_stord, trace::Debug, "Will validate uploaded directory entry "
              << hash);
@@ -668,7 +672,7 @@ void MyWorker::handlePOST(const HTTPRequest &req)
       uint64_t tsize = req.m_body.size();
 
       // Fine, parse this object to see what it references
-      FSDir thisobj(std::vector<uint8_t>(req.m_body.begin(), req.m_body.end()));
+      DirView thisobj(std::vector<uint8_t>(req.m_body.begin(), req.m_body.end()));
 
       //
       // If full checking is enabled, perform that
@@ -683,26 +687,25 @@ void MyWorker::handlePOST(const HTTPRequest &req)
         // We now perform two checks; we see that all referenced objects
         // actually exist, and, we validate the tree size.
         //
-        for (FSDir::dirents_t::const_iterator i = thisobj.dirents.begin();
-             i != thisobj.dirents.end(); ++i) {
-          switch (i->type) {
+        for (DirView::const_iterator i = thisobj.begin();
+             i != thisobj.end(); ++i) {
+          switch (i->type()) {
           case FSDir::dirent_t::UNIXFILE:
           case FSDir::dirent_t::WINFILE:
             // For a regular file we just need the sizes of the
             // referenced objects
-            for (objseq_t::const_iterator c = i->hash.begin();
-                 c != i->hash.end(); ++c) {
+            for (size_t c = 0; c != i->hashes(); ++c) {
               try {
-                const uint64_t s(localObjectSize(*c));
+                const uint64_t s(localObjectSize(i->hash(c)));
                 tsize += s;
-                tab << "File " << i->name << ": +" << s << " bytes" << std::endl;
+                tab << "File " << i->name() << ": +" << s << " bytes" << std::endl;
               } catch (error &e) {
-                MTrace(t_stord, trace::Info, "Child file " << i->name
+                MTrace(t_stord, trace::Info, "Child file " << i->name()
                        << " size fetch error: " << e.toString());
                 m_httpd.postReply(HTTPReply
                                   (req.m_id, true, 400,
                                    HTTPHeaders().add("content-type", "text/plain"),
-                                   "Cannot fetch size of child file (" + i->name
+                                   "Cannot fetch size of child file (" + i->name()
                                    + ").\n"));
                 return;
               }
@@ -710,20 +713,23 @@ void MyWorker::handlePOST(const HTTPRequest &req)
             break;
           case FSDir::dirent_t::UNIXDIR:
           case FSDir::dirent_t::WINDIR: {
-            // For directories, we fetch the directory, parse it, and
-            // read out its tree size
+            // For directories, we fetch the directory and read out
+            // its tree size; there is no need to decode its entries
             try {
-              FSDir child(papply(this,&MyWorker::localObjectFetch), i->hash);
-              tsize += child.dirsize;
-              tab << "Dir  " << i->name << ": +" << child.dirsize
+              uint64_t childsize = 0;
+              for (size_t c = 0; c != i->hashes(); ++c)
+                childsize += DirView(papply(this,&MyWorker::localObjectFetch),
+                                     i->hash(c)).dirsize();
+              tsize += childsize;
+              tab << "Dir  " << i->name() << ": +" << childsize
                   << " bytes" << std::endl;
             } catch (error &e) {
-              MTrace(t_stord, trace::Info, "Child directory " << i->name
+              MTrace(t_stord, trace::Info, "Child directory " << i->name()
                      << " parse error: " << e.toString());
               m_httpd.postReply(HTTPReply
                                 (req.m_id, true, 400,
                                  HTTPHeaders().add("content-type", "text/plain"),
-                                 "Child directory (" + i->name + ") error: "
+                                 "Child directory (" + i->name() + ") error: "
                                  + e.toString() + "\n"));
               return;
             }
@@ -731,8 +737,8 @@ void MyWorker::handlePOST(const HTTPRequest &req)
           }
           default:
             MTrace(t_stord, trace::Info, "Unknown object type "
-                   << i->type << " encountered in directory entry validation of "
-                   "entry named " << i->name);
+                   << i->type() << " encountered in directory entry validation of "
+                   "entry named " << i->name());
             m_httpd.postReply(HTTPReply(req.m_id, true, 400,
                                         HTTPHeaders().add("content-type", "text/plain"),
                                         "Unknown child entry type.\n"));
@@ -746,9 +752,9 @@ void MyWorker::handlePOST(const HTTPRequest &req)
         //
         // Do the tree sizes add up?
         //
-        if (tsize != thisobj.dirsize) {
+        if (tsize != thisobj.dirsize()) {
           MTrace(t_stord, trace::Info, "Rejecting directory entry with treesize "
-                 << thisobj.dirsize << ", but referenced objects add up to "
+                 << thisobj.dirsize() << ", but referenced objects add up to "
                  << tsize << " bytes");
           m_httpd.postReply(HTTPReply(req.m_id, true, 400,
                                       HTTPHeaders().add("content-type", "text/plain"),
@@ -763,9 +769,9 @@ void MyWorker::handlePOST(const HTTPRequest &req)
       // treesize is at least as big as the object itself
       //
       if (m_cfg.dirCheck == "simple") {
-        if (thisobj.dirsize < tsize) {
+        if (thisobj.dirsize() < tsize) {
           MTrace(t_stord, trace::Info, "Rejecting directory of size "
-                 << tsize << " with treesize " << thisobj.dirsize);
+                 << tsize << " with treesize " << thisobj.dirsize());
           m_httpd.postReply(HTTPReply(req.m_id, true, 400,
                                       HTTPHeaders().add("content-type", "text/plain"),
                                       "Directory treesize smaller than directory.\n"));
@@ -110,14 +110,14 @@ void mirror::Supervisor::logObjectReplication(const sha256 &oid)
 
   // Log object to current file
   { std::ostringstream s;
-    s << oid.m_hex << "\n";
+    s << oid.hex() << "\n";
     int rc;
     do { rc = write(m_log, s.str().data(), s.str().size()); }
     while (rc == -1 && errno == EINTR);
     if (rc == -1)
       throw syserror("write", "writing object id entry to mirroring log");
     ++m_log_entries;
-    MTrace(t_mirror, trace::Debug, "Logged object " << oid.m_hex);
+    MTrace(t_mirror, trace::Debug, "Logged object " << oid.hex());
   }
 
   // We should *always* have our active log in the logs list
@@ -271,7 +271,7 @@ void mirror::Supervisor::run()
             .push_back(wq_item_t(m_serial++,
                                  sha256::parse(std::string(entry, entry + 64))));
           m_workitems.increment();
-          MTrace(t_mirror, trace::Debug, "queued " << m_workqueue.back().objectid.m_hex
+          MTrace(t_mirror, trace::Debug, "queued " << m_workqueue.back().objectid.hex()
                  << " from " << fullname
                  << " with sequence " << m_workqueue.back().serial);
         } else if (rc == -1) {
@@ -390,7 +390,7 @@ void mirror::Supervisor::Worker::run()
     if (!m_parent.getWorkItem(item))
       break;
 
-    MTrace(t_mirror, trace::Debug, "Will mirror " << item.objectid.m_hex
+    MTrace(t_mirror, trace::Debug, "Will mirror " << item.objectid.hex()
            << " with seq# " << item.serial);
 
     // Good, mirror item
@@ -399,14 +399,14 @@ void mirror::Supervisor::Worker::run()
         // Construct the mirror POST request
         HTTPRequest req;
         req.m_method = HTTPRequest::mPOST;
-        req.m_uri = "/object/" + item.objectid.m_hex;
+        req.m_uri = "/object/" + item.objectid.hex();
         req.m_headers
           .add("host", m_parent.m_host)
           .add("redundancy", "replica"); // prevent back-replication
 
         std::vector<char> buffer(ng_chunk_size);
         // Read data from local disk
-        { int fd = open((m_parent.m_objdir + splitName(item.objectid.m_hex)).c_str(),
+        { int fd = open((m_parent.m_objdir + splitName(item.objectid.hex())).c_str(),
                         O_RDONLY);
           if (fd == -1) {
             // In case the file simply doesn't exist, then we probably
@@ -415,11 +415,11 @@ void mirror::Supervisor::Worker::run()
             // disk. We skip such objects.
             if (errno == ENOENT) {
               MTrace(t_mirror, trace::Info, "Skipping replication of "
-                     << item.objectid.m_hex << " - missing locally");
+                     << item.objectid.hex() << " - missing locally");
               m_parent.workItemComplete(item.serial);
               break;
             }
-            throw syserror("open", "opening " + item.objectid.m_hex
+            throw syserror("open", "opening " + item.objectid.hex()
                            + " for replication");
           }
           ON_BLOCK_EXIT(close, fd);
@@ -429,7 +429,7 @@ void mirror::Supervisor::Worker::run()
                  && errno == EINTR);
           if (rc == -1)
             throw syserror("read", "reading source object "
-                           + item.objectid.m_hex + " for replication");
+                           + item.objectid.hex() + " for replication");
           // Insert data in body
           req.m_body.assign(&buffer[0], &buffer[0] + rc);
         }
@@ -439,7 +439,7 @@ void mirror::Supervisor::Worker::run()
         if (rep.getStatus() == 201) {
           // Success!
           MTrace(t_mirror, trace::Info, "Replicated "
-                 << item.objectid.m_hex << " seq# " << item.serial);
+                 << item.objectid.hex() << " seq# " << item.serial);
           m_parent.workItemComplete(item.serial);
           break;
         }
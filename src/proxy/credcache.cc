@@ -5,46 +5,212 @@
 //
 
 #include "credcache.hh"
+#include "common/string.hh"
 
-CredCache::CredCache(const DiffTime &timeout)
+#include <algorithm>
+
+namespace {
+  //! How long we remember rejected credentials
+  const DiffTime g_failed_ttl(DiffTime::iso("PT10S"));
+
+  //! How often expired entries are dropped
+  const DiffTime g_expire_interval(DiffTime::iso("PT30S"));
+
+  //! The block size of SHA-256, for HMAC
+  const size_t g_blocksize = 64;
+}
+
+CredCache::stats_t::stats_t()
+  : entries(0)
+  , hits(0)
+  , misses(0)
+  , rejects(0)
+  , evicted(0)
+  , expired(0)
+{
+}
+
+CredCache::CredCache(const DiffTime &timeout, size_t maxentries)
   : m_ttl(timeout)
+  , m_secret(randStr(g_blocksize))
+  , m_shardmax(std::max(maxentries / m_nshards, size_t(1)))
+  , m_expirer(*this)
 {
+  m_expirer.start();
 }
 
-bool CredCache::isValid(const std::string &authstr,
-                        uint64_t &account, uint64_t &access, access_type_t &tt)
+CredCache::~CredCache()
 {
-  MutexLock lock(m_cachelock);
-  cache_t::iterator i = m_cache.find(authstr);
-  if (i == m_cache.end())
-    return false;
+  m_expirer.stop.increment();
+  m_expirer.join_nothrow();
+}
+
+sha256 CredCache::digest(const std::string &authstr) const
+{
+  // HMAC-SHA256 with our secret as the key
+  std::string ipad(m_secret), opad(m_secret);
+  ipad.resize(g_blocksize, 0);
+  opad.resize(g_blocksize, 0);
+  for (size_t i = 0; i != g_blocksize; ++i) {
+    ipad[i] ^= 0x36;
+    opad[i] ^= 0x5c;
+  }
+  const sha256 inner(sha256::hash(ipad + authstr));
+  return sha256::hash(opad + std::string(inner.m_raw,
+                                         inner.m_raw + sha256::size));
+}
+
+CredCache::shard_t &CredCache::shard(const sha256 &key)
+{
+  // The digest is uniformly distributed already
+  return m_shards[key.m_raw[0] % m_nshards];
+}
+
+CredCache::c_t *CredCache::find(shard_t &s, const sha256 &key)
+{
+  shard_t::cache_t::iterator i = s.cache.find(key);
+  if (i == s.cache.end())
+    return 0;
 
   // See if entry has expired
-  if (i->second.eol < Time::now()) {
-    m_cache.erase(i);
+  if (i->second.first.eol < Time::now()) {
+    s.lru.erase(i->second.second);
+    s.cache.erase(i);
+    ++s.stats.expired;
+    return 0;
+  }
+
+  // Mark it most recently used
+  s.lru.splice(s.lru.begin(), s.lru, i->second.second);
+  return &i->second.first;
+}
+
+void CredCache::insert(shard_t &s, const sha256 &key, const c_t &entry)
+{
+  shard_t::cache_t::iterator i = s.cache.find(key);
+  if (i != s.cache.end()) {
+    i->second.first = entry;
+    s.lru.splice(s.lru.begin(), s.lru, i->second.second);
+    return;
+  }
+
+  // Make room by dropping the least recently used
+  while (s.cache.size() >= m_shardmax) {
+    s.cache.erase(s.lru.back());
+    s.lru.pop_back();
+    ++s.stats.evicted;
+  }
+
+  s.lru.push_front(key);
+  s.cache.insert(std::make_pair(key, std::make_pair(entry, s.lru.begin())));
+}
+
+bool CredCache::isValid(const std::string &authstr,
+                        uint64_t &account, uint64_t &access, access_type_t &tt)
+{
+  const sha256 key(digest(authstr));
+  shard_t &s = shard(key);
+  MutexLock lock(s.lock);
+  const c_t *e = find(s, key);
+  if (!e || e->account_id == uint64_t(-1)) {
+    ++s.stats.misses;
     return false;
   }
 
   // Success then!
-  account = i->second.account_id;
-  access = i->second.access_id;
-  tt = i->second.token_type;
+  ++s.stats.hits;
+  account = e->account_id;
+  access = e->access_id;
+  tt = e->token_type;
   return true;
 }
 
 void CredCache::cacheOk(const std::string &authstr,
                         uint64_t account, uint64_t access, access_type_t tt)
 {
-  MutexLock lock(m_cachelock);
+  const sha256 key(digest(authstr));
+  shard_t &s = shard(key);
+  MutexLock lock(s.lock);
   // Insert or replace this string
-  m_cache[authstr] = c_t(Time::now() + m_ttl,
-                         account, access, tt);
+  insert(s, key, c_t(Time::now() + m_ttl, account, access, tt));
+}
+
+bool CredCache::isFailed(const std::string &authstr)
+{
+  const sha256 key(digest(authstr));
+  shard_t &s = shard(key);
+  MutexLock lock(s.lock);
+  const c_t *e = find(s, key);
+  if (!e || e->account_id != uint64_t(-1))
+    return false;
+  ++s.stats.rejects;
+  return true;
+}
+
+void CredCache::cacheFailed(const std::string &authstr)
+{
+  const sha256 key(digest(authstr));
+  shard_t &s = shard(key);
+  MutexLock lock(s.lock);
+  insert(s, key, c_t(Time::now() + std::min(m_ttl, g_failed_ttl),
+                     -1, -1, AT_None));
 }
 
 void CredCache::invalidate(const std::string &authstring)
 {
+  const sha256 key(digest(authstring));
+  shard_t &s = shard(key);
+  MutexLock lock(s.lock);
+  shard_t::cache_t::iterator i = s.cache.find(key);
+  if (i == s.cache.end())
+    return;
+  s.lru.erase(i->second.second);
+  s.cache.erase(i);
+}
+
+CredCache::stats_t CredCache::stats()
+{
+  stats_t res;
+  for (size_t n = 0; n != m_nshards; ++n) {
+    MutexLock lock(m_shards[n].lock);
+    const stats_t &s = m_shards[n].stats;
+    res.entries += m_shards[n].cache.size();
+    res.hits += s.hits;
+    res.misses += s.misses;
+    res.rejects += s.rejects;
+    res.evicted += s.evicted;
+    res.expired += s.expired;
+  }
+  return res;
+}
+
+void CredCache::expire()
+{
+  for (size_t n = 0; n != m_nshards; ++n) {
+    shard_t &s = m_shards[n];
+    MutexLock lock(s.lock);
+    const Time now(Time::now());
+    for (shard_t::cache_t::iterator i = s.cache.begin();
+         i != s.cache.end(); ) {
+      if (i->second.first.eol < now) {
+        s.lru.erase(i->second.second);
+        s.cache.erase(i++);
+        ++s.stats.expired;
+      } else {
+        ++i;
+      }
+    }
+  }
+}
+
 
-  MutexLock lock(m_cachelock);
-  m_cache.erase(authstring);
+CredCache::Expirer::Expirer(CredCache &c)
+  : m_cache(c)
+{
 }
 
+void CredCache::Expirer::run()
+{
+  while (!stop.decrement(Time::now() + g_expire_interval))
+    m_cache.expire();
+}
@@ -10,13 +10,21 @@
 
 #include "common/time.hh"
 #include "common/mutex.hh"
+#include "common/semaphore.hh"
+#include "common/thread.hh"
+#include "common/hash.hh"
 
 #include <map>
+#include <list>
 #include <string>
 
 class CredCache {
 public:
-  CredCache(const DiffTime &timeout);
+  //! Entries live for the given time. At most the given number of
+  //! entries is kept; beyond that, the least recently used go first.
+  CredCache(const DiffTime &timeout, size_t maxentries);
+
+  ~CredCache();
 
   //! Access tokens can have various types that may limit their access
   //! to API calls. The actual restrictions are implemented in the
@@ -38,18 +46,45 @@ public:
   void cacheOk(const std::string &authstring,
                uint64_t account, uint64_t access, access_type_t tt);
 
-  /// Remove this authstring from the cache - used when renaming or
-  /// deleting tokens. Does nothing if authstring was not in cache.
+  /// See if this username:password was rejected a moment ago
+  bool isFailed(const std::string &authstring);
+
+  /// Remember for a few seconds that this username:password was
+  /// rejected, so that repeated attempts need not go to the database
+  void cacheFailed(const std::string &authstring);
+
+  /// Remove this authstring from the cache - used when creating,
+  /// renaming or deleting tokens. Does nothing if authstring was not
+  /// in cache.
   void invalidate(const std::string &authstring);
 
+  /// Cache utilisation
+  struct stats_t {
+    stats_t();
+    size_t entries;
+    /// Lookups of valid credentials that were cached and that were
+    /// not, and lookups of recently rejected credentials
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t rejects;
+    /// Entries dropped to make room, and entries expired
+    uint64_t evicted;
+    uint64_t expired;
+  };
+  stats_t stats();
+
 private:
+  CredCache(const CredCache &);
+  CredCache &operator=(const CredCache &);
 
   /// Our cache entry Time-To-Live (after which they will expire and
   /// have to be re-inserted)
   const DiffTime m_ttl;
 
-  /// Cache mutual exclusion
-  Mutex m_cachelock;
+  /// Entries are keyed by a digest of the authstring, keyed with this
+  /// secret, so that we do not keep the credentials themselves
+  const std::string m_secret;
+  sha256 digest(const std::string &authstring) const;
 
   /// Cache entry
   struct c_t {
@@ -57,15 +92,51 @@ private:
     c_t(const Time &t, uint64_t accnt, uint64_t accs, access_type_t tt)
       : eol(t), account_id(accnt), access_id(accs), token_type(tt) { }
     Time eol; /// End-of-Life of entry
-    uint64_t account_id; /// Account it
+    uint64_t account_id; /// Account it (-1 if rejected)
     uint64_t access_id;  /// Access token id
     access_type_t token_type; /// Access token type
   };
 
-  /// Mapping from authstring into cache entry expiry
-  typedef std::map<std::string,c_t> cache_t;
-  cache_t m_cache;
-
+  /// The cache is split in shards by digest, each with its own lock,
+  /// so that workers rarely wait for each other
+  struct shard_t {
+    /// Shard mutual exclusion
+    Mutex lock;
+    /// Our digests, most recently used first
+    typedef std::list<sha256> lru_t;
+    lru_t lru;
+    /// Mapping from digest into cache entry and its place in the LRU
+    typedef std::map<sha256,std::pair<c_t,lru_t::iterator> > cache_t;
+    cache_t cache;
+    stats_t stats;
+  };
+  static const size_t m_nshards = 16;
+  shard_t m_shards[m_nshards];
+  const size_t m_shardmax;
+
+  shard_t &shard(const sha256 &);
+
+  /// Look up an entry that has not expired, and mark it used. Must
+  /// hold the shard lock.
+  c_t *find(shard_t &, const sha256 &);
+
+  /// Insert or replace an entry. Must hold the shard lock.
+  void insert(shard_t &, const sha256 &, const c_t &);
+
+  /// Drop expired entries from every shard
+  void expire();
+
+  /// Runs expire() now and then until we are destroyed
+  class Expirer : public Thread {
+  public:
+    Expirer(CredCache &);
+    /// Posted to stop us
+    Semaphore stop;
+  protected:
+    void run();
+  private:
+    CredCache &m_cache;
+  } m_expirer;
 };
 
 
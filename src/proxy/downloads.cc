@@ -18,6 +18,10 @@ void MyWorker::generateFileDownloadReply(const HTTPRequest &req,
   if (data_constant_uri && cacheBypassRequest(req))
     return;
 
+  // The transfer needs nothing from the database; let other workers
+  // have our connection meanwhile
+  m_db.release();
+
   // We simply start a chunked transfer - first we send the header
   // with the content disposition for the file name, and then the
   // transfer starts.
@@ -100,8 +104,8 @@ std::vector<uint8_t> MyWorker::fetchObject(const sha256 &hash)
 
     HTTPRequest fwd;
     fwd.m_method = HTTPRequest::mGET;
-    fwd.m_uri = "/object/" + hash.m_hex;
-    MTrace(t_api, trace::Info, "Fetching chunk " << hash.m_hex);
+    fwd.m_uri = "/object/" + hash.hex();
+    MTrace(t_api, trace::Info, "Fetching chunk " << hash.hex());
 
     HTTPReply rep = m_osapi.execute(fwd);
 
@@ -124,6 +128,6 @@ std::vector<uint8_t> MyWorker::fetchObject(const sha256 &hash)
 
   // No more retries
   throw error("No more retries - giving up on fetch of "
-              + hash.m_hex);
+              + hash.hex());
 }
 
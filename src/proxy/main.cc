@@ -73,11 +73,15 @@ int main(int argc, char **argv) try
   httpd.addListener(conf.bindPort);
 
   // Instantiate credentials cache
-  CredCache credcache(conf.cacheTTL);
+  CredCache credcache(conf.cacheTTL, conf.cacheSize);
+
+  // Set up the database connections the workers share
+  sql::Pool dbpool(conf.connString, conf.dbConnections
+                   ? conf.dbConnections : conf.workerThreads);
 
   // Start worker threads
   std::vector<MyWorker> workers(conf.workerThreads,
-                                MyWorker(httpd, conf, credcache));
+                                MyWorker(httpd, conf, credcache, dbpool));
   for (size_t i = 0; i != workers.size(); ++i)
     workers[i].start();
 
@@ -99,6 +103,15 @@ int main(int argc, char **argv) try
       //
       MTrace(t_api, trace::Info, "Workqueue length: "
              << httpd.getQueueLength() << " jobs");
+      const sql::Pool::stats_t db(dbpool.stats());
+      MTrace(t_api, trace::Info, "Database pool: " << db.leased << "/"
+             << db.open << "/" << db.size << " leased/open/max, "
+             << db.waiting << " waiting; " << db.waits << " of "
+             << db.leases << " leases waited, avg "
+             << (db.waits ? db.waited.to_double() / db.waits : 0)
+             << "s max " << db.maxwait.to_double() << "s; "
+             << db.reconnects << " connects, "
+             << db.failures << " failed");
     }
   }
 #endif
@@ -127,6 +140,8 @@ int main(int argc, char **argv) try
 SvcConfig::SvcConfig(const char *fname)
   : bindPort(0)
   , workerThreads(0)
+  , dbConnections(0)
+  , cacheSize(100000)
 {
   // Define configuration document schema
   using namespace xml;
@@ -141,10 +156,12 @@ SvcConfig::SvcConfig(const char *fname)
              & Element("documentRoot")(CharData<std::string>(docRoot))
              & Element("documentIndex")(CharData<std::string>(docIndex))
              & Element("connString")(CharData<std::string>(connString))
+             & !Element("dbConnections")(CharData<size_t>(dbConnections))
              & Element("authRealm")(CharData<std::string>(authRealm))
              & !Element("sslCert")(CharData<Optional<std::string> >(ssl_certfile))
              & !Element("sslKey")(CharData<Optional<std::string> >(ssl_keyfile))
              & Element("cacheTTL")(CharData<DiffTime>(cacheTTL))
+             & !Element("cacheSize")(CharData<size_t>(cacheSize))
              & *Element("mime")
              (Element("ext")(CharData<std::string>(hMime.tmp_ext))
               & Element("type")(CharData<std::string>(hMime.tmp_mime)))
@@ -179,12 +196,13 @@ bool SvcConfig::cMime::add()
 ///////////////////////////////////////////////////////////////
 
 
-MyWorker::MyWorker(HTTPd &httpd, const SvcConfig &conf, CredCache &cc)
+MyWorker::MyWorker(HTTPd &httpd, const SvcConfig &conf, CredCache &cc,
+                   sql::Pool &pool)
   : m_httpd(httpd)
   , m_cfg(conf)
   , m_cc(cc)
   , m_osapi(conf)
-  , m_db(conf.connString)
+  , m_db(pool)
   , m_account_id(-1)
   , m_access_id(-1)
   , m_access_type(CredCache::AT_None)
@@ -220,7 +238,7 @@ MyWorker::MyWorker(const MyWorker &o)
   , m_cfg(o.m_cfg)
   , m_cc(o.m_cc)
   , m_osapi(o.m_osapi)
-  , m_db(o.m_cfg.connString)
+  , m_db(o.m_db)
   , m_account_id(-1)
   , m_access_id(-1)
   , m_access_type(CredCache::AT_None)
@@ -304,6 +322,10 @@ void MyWorker::run() try
                                     + e.toString() + "\n"));
       }
     }
+
+    // Give our database connection back before we wait for the next
+    // request
+    m_db.release();
   }
 } catch (error &e) {
   std::cerr << "Worker caught: " << e.toString() << std::endl;
@@ -413,21 +435,40 @@ bool MyWorker::authenticate(const HTTPRequest &req, size_t tt, reqmode_t authmod
       return requireAccessType(req, tt);
     }
 
-    // In case we lost our database connection, set it up again.
-    m_db.reconnect();
+    // Credentials we just rejected are not tried again for a while
+    if (m_cc.isFailed(authstr))
+      throw std::string("Credentials not valid");
 
     //
     // Now see if we have such an access token that grants access
-    // to an account.
+    // to an account. Along with it, we look up whether the account
+    // it grants access to is enabled and whether it is a system user
+    // (which can allow impersonation), and the account to
+    // impersonate if any - all in one round trip.
     //
-    sql::query q(m_db,
+    sql::query q(db(),
                  "SELECT a.target, a.id, a.ttype, a.atype FROM access a"
                  " WHERE a.aname = $1::text"
                  "   AND a.apass = $2::text");
     q.add(uname).add(upass);
+    sql::query aq(db(),
+                  "SELECT ac.enabled, ac.sysusr FROM account ac, access a"
+                  " WHERE ac.id = a.target"
+                  "   AND a.aname = $1::text"
+                  "   AND a.apass = $2::text");
+    aq.add(uname).add(upass);
+    sql::query iq(db(), "SELECT id FROM account WHERE guid = $1::TEXT");
+    { sql::batch b(db());
+      b.add(q).add(aq);
+      if (req.hasHeader("impersonate"))
+        b.add(iq.add(req.getHeader("impersonate")));
+      b.execute();
+    }
 
-    if (!q.fetch())
+    if (!q.fetch()) {
+      m_cc.cacheFailed(authstr);
       throw std::string("Credentials not valid");
+    }
 
     char ttype;
     char atype;
@@ -458,84 +499,82 @@ bool MyWorker::authenticate(const HTTPRequest &req, size_t tt, reqmode_t authmod
       return false;
     }
 
-  } catch (std::string &s) {
-    // To counter brute-force attacks, we delay the 401 response half
-    // a second
-    usleep(500000);
-    // Report error to user
-    m_httpd.postReply(HTTPReply(req.m_id, true, authFailCode(req),
-                                HTTPHeaders()
-                                .add("WWW-Authenticate",
-                                     "Basic realm=\"" + m_cfg.authRealm + "\"")
-                                .add("content-type", "text/plain"),
-                                "User authentication error:\n "
-                                + s + "\n"));
-    return false;
-  }
-
-  // Fine, peer is authentic
-  MTrace(t_api, trace::Debug, "Request authenticated: account id is "
-         << m_account_id << " access token id is " << m_access_id);
-
-  // We need to see if the account is enabled or disabled, and we need
-  // to see if it is a system user (which can allow impersonation)
-  { sql::query q(m_db, "SELECT enabled, sysusr FROM account WHERE id = $1::BIGINT");
-    q.add(m_account_id);
-    if (!q.fetch()) throw error("Cannot extract account data");
-    bool enabled;
-    bool sysusr;
-    q.get(enabled).get(sysusr);
-    if (!enabled) {
-      m_httpd.postReply(HTTPReply(req.m_id, true, 403,
-                                  HTTPHeaders()
-                                  .add("content-type", "text/plain"),
-                                  "Account disabled.\n"));
-      return false;
-    }
-    //
-    // If we are required to authenticate a system user, make sure we
-    // did
-    //
-    if (authmode == REQSYS && !sysusr) {
-      m_httpd.postReply(HTTPReply(req.m_id, true, 403,
-                                  HTTPHeaders()
-                                  .add("content-type", "text/plain"),
-                                  "Special account required for endpoint.\n"));
-      return false;
-    }
-
-    //
-    // If this is a system user, see that the peer IP is from our
-    // trusted network
-    //
-    // XXXX later
+    // Fine, peer is authentic
+    MTrace(t_api, trace::Debug, "Request authenticated: account id is "
+           << m_account_id << " access token id is " << m_access_id);
 
-    //
-    // If we have an impersonate header, require a system account.
-    //
-    if (req.hasHeader("impersonate")) {
-      if (!sysusr) {
-        MTrace(t_api, trace::Info, "Impersonation attempt denied");
+    // We need to see if the account is enabled or disabled, and we need
+    // to see if it is a system user (which can allow impersonation)
+    { if (!aq.fetch()) throw error("Cannot extract account data");
+      bool enabled;
+      bool sysusr;
+      aq.get(enabled).get(sysusr);
+      if (!enabled) {
         m_httpd.postReply(HTTPReply(req.m_id, true, 403,
                                     HTTPHeaders()
                                     .add("content-type", "text/plain"),
-                                    "Impersonation not allowed.\n"));
+                                    "Account disabled.\n"));
         return false;
       }
-      // Fine, we have a system account. Fetch impersonation account
-      // and impersonate
-      sql::query q2(m_db, "SELECT id FROM account WHERE guid = $1::TEXT");
-      q2.add(req.getHeader("impersonate"));
-      if (!q2.fetch()) {
+      //
+      // If we are required to authenticate a system user, make sure we
+      // did
+      //
+      if (authmode == REQSYS && !sysusr) {
         m_httpd.postReply(HTTPReply(req.m_id, true, 403,
                                     HTTPHeaders()
                                     .add("content-type", "text/plain"),
-                                    "Impersonation account does not exist.\n"));
+                                    "Special account required for"
+                                    " endpoint.\n"));
         return false;
       }
-      q2.get(m_account_id);
-      MTrace(t_api, trace::Info, "Impersonation attempt succeeded");
+
+      //
+      // If this is a system user, see that the peer IP is from our
+      // trusted network
+      //
+      // XXXX later
+
+      //
+      // If we have an impersonate header, require a system account.
+      //
+      if (req.hasHeader("impersonate")) {
+        if (!sysusr) {
+          MTrace(t_api, trace::Info, "Impersonation attempt denied");
+          m_httpd.postReply(HTTPReply(req.m_id, true, 403,
+                                      HTTPHeaders()
+                                      .add("content-type", "text/plain"),
+                                      "Impersonation not allowed.\n"));
+          return false;
+        }
+        // Fine, we have a system account. Impersonate the account we
+        // fetched
+        if (!iq.fetch()) {
+          m_httpd.postReply(HTTPReply(req.m_id, true, 403,
+                                      HTTPHeaders()
+                                      .add("content-type", "text/plain"),
+                                      "Impersonation account does not"
+                                      " exist.\n"));
+          return false;
+        }
+        iq.get(m_account_id);
+        MTrace(t_api, trace::Info, "Impersonation attempt succeeded");
+      }
     }
+  } catch (std::string &s) {
+    // To counter brute-force attacks, we delay the 401 response half
+    // a second - without holding a database connection meanwhile
+    m_db.release();
+    usleep(500000);
+    // Report error to user
+    m_httpd.postReply(HTTPReply(req.m_id, true, authFailCode(req),
+                                HTTPHeaders()
+                                .add("WWW-Authenticate",
+                                     "Basic realm=\"" + m_cfg.authRealm + "\"")
+                                .add("content-type", "text/plain"),
+                                "User authentication error:\n "
+                                + s + "\n"));
+    return false;
   }
 
   // Fine, request is authentic and account is not disabled
@@ -760,7 +799,7 @@ bool MyWorker::isAncestorOf(uint64_t ancestor, uint64_t descendant)
   uint64_t match = descendant;
   do {
     // Locate the parent of 'match'
-    sql::query q(m_db,
+    sql::query q(db(),
                  "SELECT parent FROM account"
                  " WHERE id = $1::BIGINT AND parent IS NOT NULL");
     q.add(match);
@@ -780,7 +819,7 @@ bool MyWorker::isAncestorOf(uint64_t ancestor, uint64_t descendant)
 bool MyWorker::getUserPathId(uint64_t req_id, uint64_t &ownerid)
 {
   // First, look up the guid and get the user id
-  { sql::query q(m_db,
+  { sql::query q(db(),
                  "SELECT id FROM account"
                  " WHERE guid = $1::TEXT");
     q.add(m_userid);
@@ -818,6 +857,10 @@ void MyWorker::cObject::handle(const HTTPRequest &req) const
   if (!m_parent.authenticate(req, CredCache::AT_User | CredCache::AT_Device))
     return;
 
+  // The rest is up to the object store; return our database
+  // connection while we wait for it
+  m_parent.m_db.release();
+
   // Deal with entity-tag preconditions
   if (m_parent.cacheBypassRequest(req))
     return;
@@ -862,7 +905,7 @@ void MyWorker::cTokens::handle(const HTTPRequest &req) const
     Optional<Time> etime;
 
     // Setup fetch of tokens
-    sql::query q(m_parent.m_db, "SELECT descr, aname, created, expires FROM access "
+    sql::query q(m_parent.db(), "SELECT descr, aname, created, expires FROM access "
                  "WHERE ttype = 'a' AND target = $1::BIGINT");
     q.add(m_parent.m_account_id)
       .receiver(descr)
@@ -906,8 +949,7 @@ void MyWorker::cTokens::handle(const HTTPRequest &req) const
                & Element("type")(CharData<std::string>(type))
                & Element("aname")(CharData<std::string>(aname))
                & Element("apass")(CharData<std::string>(apass))));
-    { std::istringstream body(req.m_body);
-      XMLexer lexer(body);
+    { XMLexer lexer(req.m_body);
       tokendoc.process(lexer);
     }
 
@@ -929,7 +971,7 @@ void MyWorker::cTokens::handle(const HTTPRequest &req) const
     }
 
     MTrace(t_api, trace::Info, "Will create access token ");
-    sql::exec s(m_parent.m_db,
+    sql::exec s(m_parent.db(),
                 "INSERT INTO access (descr,aname,apass,created_by,ttype,target,atype) "
                 "VALUES ($1::text, $2::text, $3::text, $4::BIGINT, 'a', "
                 "$5::BIGINT, $6::CHAR)");
@@ -947,6 +989,9 @@ void MyWorker::cTokens::handle(const HTTPRequest &req) const
       return;
     }
 
+    // These credentials may have been rejected a moment ago
+    m_parent.m_cc.invalidate(aname + ":" + apass);
+
     // Send back 201 Created with location header
     m_parent.m_httpd
       .postReply(HTTPReply(req.m_id, true, 201,
@@ -1006,14 +1051,14 @@ void MyWorker::cToken::handle(const HTTPRequest &req) const
 
   // All checks and optionally updates must occur in a single
   // transaction
-  sql::transaction trans(m_parent.m_db);
+  sql::transaction trans(m_parent.db());
 
   // Now retrieve the token id that we are going to manipulate. Only
   // retrieve the token if it grants access to the authenticated user
   // account
   uint64_t token_id;
   std::string old_apass;
-  if (!sql::query(m_parent.m_db,
+  if (!sql::query(m_parent.db(),
                   "SELECT id, apass FROM access "
                   "WHERE ttype = 'a' AND target = $1::BIGINT AND aname = $2::TEXT")
       .add(m_parent.m_account_id)
@@ -1043,8 +1088,7 @@ void MyWorker::cToken::handle(const HTTPRequest &req) const
       = mkDoc(Element("token_update")
               (!Element("aname")(CharData<Optional<std::string> >(aname))
                & !Element("apass")(CharData<Optional<std::string> >(apass))));
-    { std::istringstream body(req.m_body);
-      XMLexer lexer(body);
+    { XMLexer lexer(req.m_body);
       ddoc.process(lexer);
     }
 
@@ -1053,7 +1097,7 @@ void MyWorker::cToken::handle(const HTTPRequest &req) const
     // If rename was requested, perform
     if (aname.isSet()) {
       try {
-        sql::exec(m_parent.m_db, "UPDATE access SET aname = $1::TEXT "
+        sql::exec(m_parent.db(), "UPDATE access SET aname = $1::TEXT "
                   "WHERE id = $2::BIGINT")
           .add(aname.get())
           .add(token_id)
@@ -1071,7 +1115,7 @@ void MyWorker::cToken::handle(const HTTPRequest &req) const
 
     // If new password given, update
     if (apass.isSet()) {
-      sql::exec(m_parent.m_db, "UPDATE access SET apass = $1::TEXT "
+      sql::exec(m_parent.db(), "UPDATE access SET apass = $1::TEXT "
                 "WHERE id = $2::BIGINT")
         .add(apass.get())
         .add(token_id)
@@ -1081,14 +1125,12 @@ void MyWorker::cToken::handle(const HTTPRequest &req) const
     // Commit and report success
     trans.commit();
 
-    // Invalidate credentials cache for this token
-    { std::string authline(m_parent.m_token_aname + ":" + old_apass);
-      std::string authstr;
-      base64::encode(authstr, std::vector<uint8_t>(authline.begin(), authline.end()));
-      MTrace(t_api, trace::Debug, "Invalidating auth: " << authstr
-             << " based on auth string " << authline);
-      m_parent.m_cc.invalidate(authstr);
-    }
+    // Invalidate credentials cache for this token - the cache holds
+    // the decoded credentials, and may hold the new ones as rejected
+    m_parent.m_cc.invalidate(m_parent.m_token_aname + ":" + old_apass);
+    m_parent.m_cc.invalidate((aname.isSet() ? aname.get()
+                              : m_parent.m_token_aname)
+                             + ":" + (apass.isSet() ? apass.get() : old_apass));
 
     m_parent.m_httpd
       .postReply(HTTPReply(req.m_id, true, 200,
@@ -1135,13 +1177,13 @@ void MyWorker::cDevices::handle(const HTTPRequest &req) const
   switch (req.getMethod()) {
   case HTTPRequest::mGET: {
     // Set up query to retrieve all PC devices for the given account
-    sql::query pcq(m_parent.m_db,
+    sql::query pcq(m_parent.db(),
                    "SELECT guid, descr FROM device "
                    "WHERE account = $1::BIGINT AND kind = 'p'");
     pcq.add(owner_id);
 
     // Set up query to retrieve all cloud devices for the given account
-    sql::query cq(m_parent.m_db,
+    sql::query cq(m_parent.db(),
                   "SELECT guid, descr, ctype, uri, login, password FROM device "
                   "WHERE account = $1::BIGINT AND kind = 'c'");
     cq.add(owner_id);
@@ -1157,6 +1199,9 @@ void MyWorker::cDevices::handle(const HTTPRequest &req) const
     MTrace(t_api, trace::Debug, "Fetching device list for account "
            << owner_id);
 
+    // Both lists in one round trip
+    sql::batch(m_parent.db()).add(pcq).add(cq).execute();
+
     // Generate output document by fetching until nothing more to
     // fetch
     using namespace xml;
@@ -1175,18 +1220,18 @@ void MyWorker::cDevices::handle(const HTTPRequest &req) const
                 & Element("password")(CharData<std::string>(cpassword)))
                [ papply(&cq, &sql::query::fetch) ]));
 
-    m_parent.m_httpd.postReply(req.m_id, ddoc);
+    m_parent.m_httpd.streamReply(req.m_id, ddoc);
     return;
   }
   case HTTPRequest::mPOST: {
     // Fetch a GUID to use for insertion
     std::string device_id;
-    sql::query(m_parent.m_db, "SELECT guidstr()")
+    sql::query(m_parent.db(), "SELECT guidstr()")
       .fetchone().get(device_id);
 
     // Set up SQL statement for PC device insertion
     std::string devname;
-    sql::exec pce(m_parent.m_db,
+    sql::exec pce(m_parent.db(),
                   "INSERT INTO device (guid, account, kind, descr) "
                   "VALUES ($1::TEXT, $2::BIGINT, 'p', $3::TEXT)");
     pce.sender(device_id).sender(owner_id).sender(devname);
@@ -1194,7 +1239,7 @@ void MyWorker::cDevices::handle(const HTTPRequest &req) const
     // Set up SQL statement for cloud device insertion
     std::string ctype;
     Optional<std::string> curi, clogin, cpass;
-    sql::exec ce(m_parent.m_db,
+    sql::exec ce(m_parent.db(),
                  "INSERT INTO device "
                  "(guid,account, kind, descr, ctype, uri, login, password) "
                  "VALUES "
@@ -1217,8 +1262,7 @@ void MyWorker::cDevices::handle(const HTTPRequest &req) const
                & !Element("password")(CharData<Optional<std::string> >(cpass)))
               [papply(&ce, &sql::exec::execute)]);
     try {
-      std::istringstream body(req.m_body);
-      XMLexer lexer(body);
+      XMLexer lexer(req.m_body);
       ddoc.process(lexer);
     } catch (error &e) {
       // If we got an insertion error, then we must report 409. If we
@@ -1287,7 +1331,7 @@ void MyWorker::cDevice::handle(const HTTPRequest &req) const
     // 2: Parse update document (overriding properties)
     // 3: Update database with new properties
     //
-    sql::transaction trans(m_parent.m_db);
+    sql::transaction trans(m_parent.db());
 
     uint64_t d_id;
     char d_kind;
@@ -1298,7 +1342,7 @@ void MyWorker::cDevice::handle(const HTTPRequest &req) const
     Optional<std::string> d_password;
 
     // 1: Load properties
-    sql::query(m_parent.m_db,
+    sql::query(m_parent.db(),
                "SELECT id, kind, descr, ctype, uri, login, password "
                "FROM device "
                "WHERE account = $1::BIGINT AND guid = $2::TEXT")
@@ -1327,13 +1371,12 @@ void MyWorker::cDevice::handle(const HTTPRequest &req) const
                & !Element("login")(CharData<Optional<std::string> >(d_login))
                & !Element("password")(CharData<Optional<std::string> >(d_password)))
               [ papply<bool,char&,char>( assign<char>, d_kind, 'c' ) ]);
-    { std::istringstream body(req.m_body);
-      XMLexer lexer(body);
+    { XMLexer lexer(req.m_body);
       ddoc.process(lexer);
     }
 
     // 3: Update database
-    sql::exec(m_parent.m_db,
+    sql::exec(m_parent.db(),
               "UPDATE device SET kind = $1::CHAR, "
               "descr = $2::TEXT, "
               "ctype = $3::TEXT, "
@@ -1373,7 +1416,7 @@ void MyWorker::cDevice::handle(const HTTPRequest &req) const
   }
   case HTTPRequest::mDELETE: {
     // Attempt deleting device.
-    sql::exec e(m_parent.m_db,
+    sql::exec e(m_parent.db(),
                 "DELETE FROM device WHERE account = $1::BIGINT "
                 "AND guid = $2::TEXT");
     e.add(owner_id)
@@ -1429,7 +1472,7 @@ void MyWorker::cHistory::handle(const HTTPRequest &req) const
     return;
 
   // Verify device name first!
-  sql::query q(m_parent.m_db, "SELECT id FROM device"
+  sql::query q(m_parent.db(), "SELECT id FROM device"
                " WHERE account = $1::BIGINT"
                " AND guid = $2::TEXT");
   q.add(owner_id).add(m_parent.m_device_id);
@@ -1447,7 +1490,7 @@ void MyWorker::cHistory::handle(const HTTPRequest &req) const
   switch (req.getMethod()) {
   case HTTPRequest::mGET: {
     // Report backup history for device
-    sql::query q(m_parent.m_db,
+    sql::query q(m_parent.db(),
                  "SELECT root, tstamp, kind FROM backup "
                  "WHERE device = $1::BIGINT "
                  "ORDER BY tstamp DESC");
@@ -1467,7 +1510,7 @@ void MyWorker::cHistory::handle(const HTTPRequest &req) const
                 & Element("type")(CharData<char>(kind)))
                [ papply(&q, &sql::query::fetch) ]));
 
-    m_parent.m_httpd.postReply(req.m_id, ddoc);
+    m_parent.m_httpd.streamReply(req.m_id, ddoc);
 
     break;
   }
@@ -1482,8 +1525,7 @@ void MyWorker::cHistory::handle(const HTTPRequest &req) const
               (Element("tstamp")(CharData<Time>(tstamp))
                & Element("root")(CharData<std::string>(root))
                & !Element("type")(CharData<Optional<std::string> >(type))));
-    { std::istringstream body(req.m_body);
-      XMLexer lexer(body);
+    { XMLexer lexer(req.m_body);
       ddoc.process(lexer);
     }
 
@@ -1502,7 +1544,7 @@ void MyWorker::cHistory::handle(const HTTPRequest &req) const
 
     // Create device and respond accordingly
     try {
-      sql::exec s(m_parent.m_db, "INSERT INTO backup (device,root,tstamp,kind) "
+      sql::exec s(m_parent.db(), "INSERT INTO backup (device,root,tstamp,kind) "
                   "VALUES ($1::BIGINT, $2::text, $3::TIMESTAMP, $4::CHAR)");
       s.add(devid).add(root).add(tstamp).add(kind);
       s.execute();
@@ -1563,7 +1605,7 @@ void MyWorker::cDevStatus::handle(const HTTPRequest &req) const
     return;
 
   // Verify device name first!
-  sql::query q(m_parent.m_db, "SELECT id FROM device"
+  sql::query q(m_parent.db(), "SELECT id FROM device"
                " WHERE account = $1::BIGINT"
                " AND guid = $2::TEXT");
   q.add(owner_id).add(m_parent.m_device_id);
@@ -1581,7 +1623,7 @@ void MyWorker::cDevStatus::handle(const HTTPRequest &req) const
   switch (req.getMethod()) {
   case HTTPRequest::mGET: {
     // Report status history from device
-    sql::query q(m_parent.m_db,
+    sql::query q(m_parent.db(),
                  "SELECT tstamp,status FROM devstatus "
                  "WHERE device = $1::BIGINT "
                  "ORDER BY tstamp DESC");
@@ -1609,13 +1651,12 @@ void MyWorker::cDevStatus::handle(const HTTPRequest &req) const
     std::string status;
     const IDocument &ddoc
       = mkDoc(Element("status")(CharData<std::string>(status)));
-    { std::istringstream body(req.m_body);
-      XMLexer lexer(body);
+    { XMLexer lexer(req.m_body);
       ddoc.process(lexer);
     }
 
     // Create device and respond accordingly
-    sql::exec s(m_parent.m_db, "INSERT INTO devstatus (device,status) "
+    sql::exec s(m_parent.db(), "INSERT INTO devstatus (device,status) "
                 "VALUES ($1::BIGINT, $2::text)");
     s.add(devid).add(status);
     s.execute();
@@ -1662,7 +1703,7 @@ void MyWorker::cDevAttr::handle(const HTTPRequest &req) const
   switch (req.getMethod()) {
     case HTTPRequest::mPUT: {
       // Attempt updating device attributes
-      sql::exec(m_parent.m_db,
+      sql::exec(m_parent.db(),
                 "UPDATE device SET attributes = attributes || "
                 "HSTORE($1::TEXT,$2::TEXT) "
                 "WHERE account = $3::BIGINT AND guid = $4::TEXT")
@@ -1681,7 +1722,7 @@ void MyWorker::cDevAttr::handle(const HTTPRequest &req) const
       return;
     }
     case HTTPRequest::mGET: {
-      sql::query q(m_parent.m_db,
+      sql::query q(m_parent.db(),
                 "SELECT attributes->$1::TEXT "
                 "FROM device "
                 "WHERE account = $2::BIGINT AND guid = $3::TEXT");
@@ -1711,7 +1752,7 @@ void MyWorker::cDevAttr::handle(const HTTPRequest &req) const
     }
     case HTTPRequest::mDELETE: {
       // Attempt deleting the attribute
-      sql::exec(m_parent.m_db,
+      sql::exec(m_parent.db(),
                 "UPDATE device SET attributes = DELETE(attributes, $1::TEXT) "
                 "WHERE account = $2::BIGINT AND guid = $3::TEXT")
         .add(m_parent.m_attributename)
@@ -1769,8 +1810,7 @@ void MyWorker::cDevAuthCode::handle(const HTTPRequest &req) const
               (Element("type")(CharData<std::string>(p_type))
                & Element("code")(CharData<std::string>(p_code))
                & Element("redirect_uri")(CharData<std::string>(p_redirect_uri))));
-      { std::istringstream body(req.m_body);
-        XMLexer lexer(body);
+      { XMLexer lexer(req.m_body);
         ddoc.process(lexer);
       }
 
@@ -1831,9 +1871,9 @@ void MyWorker::cDevAuthCode::handle(const HTTPRequest &req) const
 
           // Store tokens in device attributes KV
           {
-            sql::transaction trans(m_parent.m_db);
+            sql::transaction trans(m_parent.db());
 
-            sql::exec(m_parent.m_db,
+            sql::exec(m_parent.db(),
                       "UPDATE device SET attributes = attributes || "
                       "HSTORE('google_access_token',$1::TEXT) "
                       "WHERE account = $2::BIGINT AND guid = $3::TEXT")
@@ -1842,7 +1882,7 @@ void MyWorker::cDevAuthCode::handle(const HTTPRequest &req) const
               .add(m_parent.m_device_id)
               .execute();
 
-            sql::exec(m_parent.m_db,
+            sql::exec(m_parent.db(),
                       "UPDATE device SET attributes = attributes || "
                       "HSTORE('google_refresh_token',$1::TEXT) "
                       "WHERE account = $2::BIGINT AND guid = $3::TEXT")
@@ -1906,7 +1946,7 @@ void MyWorker::cUsers::handle(const HTTPRequest &req) const
 
     // Extract the account guid
     std::string p_id;
-    { sql::query uq(m_parent.m_db,
+    { sql::query uq(m_parent.db(),
                     "SELECT guid FROM account WHERE id = $1::BIGINT");
       uq.add(m_parent.m_account_id);
       if (!uq.fetch())
@@ -1962,7 +2002,7 @@ void MyWorker::cUser::handle(const HTTPRequest &req) const
   //
   uint64_t account_id;
   uint64_t parent_id;
-  { sql::query q(m_parent.m_db,
+  { sql::query q(m_parent.db(),
                  "SELECT id, parent FROM account"
                  " WHERE guid = $1::TEXT");
     q.add(m_parent.m_userid);
@@ -2010,15 +2050,14 @@ void MyWorker::cUser::handle(const HTTPRequest &req) const
     const IDocument &ddoc
       = mkDoc(Element("user_update")
               (Element("enabled")(CharData<bool>(p_enabled))));
-    { std::istringstream body(req.m_body);
-      XMLexer lexer(body);
+    { XMLexer lexer(req.m_body);
       ddoc.process(lexer);
     }
 
     // Should we enable/disable account?
     MTrace(t_api, trace::Info, "Will set account-enabled = "
            << p_enabled << " for account " << account_id);
-    sql::exec(m_parent.m_db,
+    sql::exec(m_parent.db(),
               "UPDATE account SET enabled = $1::BOOLEAN"
               " WHERE id = $2::BIGINT")
       .add(p_enabled).add(account_id).execute();
@@ -2059,14 +2098,14 @@ void MyWorker::cUser::handle(const HTTPRequest &req) const
            << account_id << " on request from account id "
            << m_parent.m_account_id);
 
-    { sql::transaction trans(m_parent.m_db);
-      sql::exec(m_parent.m_db,
+    { sql::transaction trans(m_parent.db());
+      sql::exec(m_parent.db(),
                 "DELETE FROM account WHERE id = $1::BIGINT")
         .add(account_id)
         .execute();
       // Access tokens do not directly reference the account table and
       // must be deleted separately
-      sql::exec(m_parent.m_db,
+      sql::exec(m_parent.db(),
                 "DELETE FROM access WHERE ttype = 'a' AND target = $1::BIGINT")
         .add(account_id)
         .execute();
@@ -2191,7 +2230,7 @@ void MyWorker::cContacts::handle(const HTTPRequest &req) const
       return;
     // Retrieve all contacts for the given user
     std::string type;
-    sql::query tq(m_parent.m_db,
+    sql::query tq(m_parent.db(),
                   "SELECT ctype FROM contact "
                   "WHERE account = $1::BIGINT");
     tq.add(query_root).receiver(type);
@@ -2233,8 +2272,7 @@ void MyWorker::cContacts::handle(const HTTPRequest &req) const
                & !Element("zipcode")(CharData<Optional<std::string> >(p_zipcode))
                & !Element("country")(CharData<Optional<std::string> >(p_country))));
 
-    { std::istringstream body(req.m_body);
-      XMLexer lexer(body);
+    { XMLexer lexer(req.m_body);
       ddoc.process(lexer);
     }
 
@@ -2252,7 +2290,7 @@ void MyWorker::cContacts::handle(const HTTPRequest &req) const
 
     // Now create new contact
     try {
-      sql::exec(m_parent.m_db,
+      sql::exec(m_parent.db(),
                 "INSERT INTO contact (email, companyname, fullname"
                 ", phone, street1, street2, city, state, zipcode"
                 ", country, account"
@@ -2354,7 +2392,7 @@ void MyWorker::cContact::handle(const HTTPRequest &req) const
     Optional<std::string> p_email, p_companyname, p_fullname,
       p_phone, p_street1, p_street2, p_city, p_state, p_zipcode, p_country;
 
-    sql::query cq(m_parent.m_db,
+    sql::query cq(m_parent.db(),
                   "SELECT ctype, email, companyname, fullname,"
                   " phone, street1, street2, city, state, zipcode, country "
                   " FROM contact WHERE account = $1::BIGINT AND ctype = $2::TEXT");
@@ -2413,13 +2451,12 @@ void MyWorker::cContact::handle(const HTTPRequest &req) const
                & !Element("zipcode")(CharData<Optional<std::string> >(p_zipcode))
                & !Element("country")(CharData<Optional<std::string> >(p_country))));
 
-    { std::istringstream body(req.m_body);
-      XMLexer lexer(body);
+    { XMLexer lexer(req.m_body);
       ddoc.process(lexer);
     }
 
     // Now update the given contact
-    sql::exec ex(m_parent.m_db,
+    sql::exec ex(m_parent.db(),
                  "UPDATE contact SET email = $1::TEXT, companyname = $2::TEXT, "
                  "fullname = $3::TEXT, phone = $4::TEXT, street1 = $5::TEXT, "
                  "street2 = $6::TEXT, city = $7::TEXT, state = $8::TEXT, "
@@ -2492,7 +2529,7 @@ void MyWorker::cSubUsers::handle(const HTTPRequest &req) const
     // Now retrieve list of users and report it
     //
     std::string guid;
-    sql::query gq(m_parent.m_db,
+    sql::query gq(m_parent.db(),
                   "SELECT guid FROM account WHERE parent = $1::BIGINT");
     gq.add(query_root)
       .receiver(guid);
@@ -2506,7 +2543,7 @@ void MyWorker::cSubUsers::handle(const HTTPRequest &req) const
               (*Element("id")(CharData<std::string>(guid))
                [papply(&gq, &sql::query::fetch)]));
 
-    m_parent.m_httpd.postReply(req.m_id, ddoc);
+    m_parent.m_httpd.streamReply(req.m_id, ddoc);
     return;
   }
   case HTTPRequest::mPOST: {
@@ -2545,20 +2582,19 @@ void MyWorker::cSubUsers::handle(const HTTPRequest &req) const
               (Element("login")(CharData<std::string>(p_login))
                & Element("password")(CharData<std::string>(p_password))
                & !Element("external_id")(CharData<std::string>(p_extid))));
-    { std::istringstream body(req.m_body);
-      XMLexer lexer(body);
+    { XMLexer lexer(req.m_body);
       ddoc.process(lexer);
     }
 
     // Create user account
-    { sql::transaction trans(m_parent.m_db);
+    { sql::transaction trans(m_parent.db());
       // First the account
-      sql::query q(m_parent.m_db, "SELECT nextval('account_id_seq')");
+      sql::query q(m_parent.db(), "SELECT nextval('account_id_seq')");
       if (!q.fetch()) throw error("Cannot get account id");
       uint64_t new_account_id;
       q.get(new_account_id);
       // Fine, insert
-      sql::exec(m_parent.m_db,
+      sql::exec(m_parent.db(),
                 "INSERT INTO account (id,parent)"
                 " VALUES ($1::BIGINT,$2::BIGINT)")
         .add(new_account_id).add(query_root)
@@ -2572,7 +2608,7 @@ void MyWorker::cSubUsers::handle(const HTTPRequest &req) const
         // Also create a set of credentials for this user account. We
         // use the supplied e-mail address as the login.
         //
-        sql::exec(m_parent.m_db,
+        sql::exec(m_parent.db(),
                   "INSERT INTO access (descr, aname, apass, created_by, "
                   "ttype, target, atype) "
                   "VALUES ($1::TEXT, $2::TEXT, $3::TEXT, $4::BIGINT, "
@@ -2592,6 +2628,8 @@ void MyWorker::cSubUsers::handle(const HTTPRequest &req) const
                                "An account with this login name already exists.\n"));
         return;
       }
+      // These credentials may have been rejected a moment ago
+      m_parent.m_cc.invalidate(p_login + ":" + p_password);
 
       //
       // If an external id is given, attach it to this account
@@ -2602,7 +2640,7 @@ void MyWorker::cSubUsers::handle(const HTTPRequest &req) const
       // external id must be unique.
       //
       if (!p_extid.empty()) {
-        sql::exec(m_parent.m_db,
+        sql::exec(m_parent.db(),
                   "INSERT INTO account_extern_id (account,parent,extern)"
                   " VALUES ($1::BIGINT, $2::BIGINT, $3::TEXT)")
           .add(new_account_id).add(m_parent.m_account_id).add(p_extid)
@@ -2613,7 +2651,7 @@ void MyWorker::cSubUsers::handle(const HTTPRequest &req) const
       // Extract the user guid for our reply...
       //
       std::string user_guid;
-      { sql::query q(m_parent.m_db, "SELECT guid FROM account WHERE id = $1::BIGINT");
+      { sql::query q(m_parent.db(), "SELECT guid FROM account WHERE id = $1::BIGINT");
         q.add(new_account_id);
         if (!q.fetch()) throw error("Unable to retrieve account we just created");
         q.get(user_guid);
@@ -2684,38 +2722,12 @@ void MyWorker::cDownFile::handle(const HTTPRequest &req) const
       }
       if (rep.getStatus() != 200)
         throw error("Cannot get directory object: " + rep.toString());
-      // Fine, we have the directory object. Now search the LoM for
-      // the given file-name
-      const std::vector<uint8_t> object(rep.refBody().begin(),
-                                        rep.refBody().end());
-      size_t ofs = 0;
-      //
-      // Offset 0:  1 byte, version 0
-      if (0 != des<uint8_t>(object, ofs))
-        throw error("Unexpected object version");
-      // Offset 1: 1 byte object type - expect 0xdd or 0xde for directory entry
-      uint8_t objType= des<uint8_t>(object, ofs);
-      if (0xdd != objType && 0xde != objType)
-        throw error("Object not directory entry");
-      // Offset 2: 8 byte tree-size
-      ofs += 8;
-      // Offset 10: LoR
-      std::vector<objseq_t> lor;
-      const size_t lor_len = des<uint32_t>(object, ofs);
-      for (size_t i = 0; i != lor_len; ++i)
-        lor.push_back(des<objseq_t>(object, ofs));
-      // LoM - same number of entries as LoR
-      bool found = false;
-      for (size_t i = 0; i != lor_len; ++i) {
-        const std::string name = lom_entry_extract_name(object, ofs);
-        if (name == m_parent.m_downfile) {
-          MTrace(t_api, trace::Debug, " Located downfile=" << name);
-          filedata = lor[i];
-          found = true;
-          break;
-        }
-      }
-      if (!found) {
+      // Fine, we have the directory object. Now search it for the
+      // given file-name - by binary search if it is indexed
+      const DirView dir(std::vector<uint8_t>(rep.refBody().begin(),
+                                             rep.refBody().end()));
+      const DirView::const_iterator i = dir.find(m_parent.m_downfile);
+      if (i == dir.end()) {
         MTrace(t_api, trace::Debug, " No file named " << m_parent.m_downfile);
         m_parent.m_httpd.postReply(HTTPReply(req.m_id, true, 404,
                                              HTTPHeaders()
@@ -2723,6 +2735,8 @@ void MyWorker::cDownFile::handle(const HTTPRequest &req) const
                                              "File object does not exist\n"));
         return;
       }
+      MTrace(t_api, trace::Debug, " Located downfile=" << m_parent.m_downfile);
+      filedata = i->hashseq();
     }
     //
     // So, since the directory object references the file data
@@ -2764,8 +2778,8 @@ void MyWorker::cQueue::handle(const HTTPRequest &req) const
     // 'temporarily unavailable'. If an event is returned it is also
     // de-queued and re-scheduled in case it is a recurring event.
     {
-      sql::transaction trans(m_parent.m_db);
-      sql::query q(m_parent.m_db,
+      sql::transaction trans(m_parent.db());
+      sql::query q(m_parent.db(),
                    "SELECT s.id, s.identifier,"
                    "       COALESCE(s.period, '0 seconds'::INTERVAL),"
                    "       a.guid"
@@ -2792,13 +2806,13 @@ void MyWorker::cQueue::handle(const HTTPRequest &req) const
 
       if (period > DiffTime(0, 0)) {
         // If this is a recurring event, re-schedule it.
-        sql::exec(m_parent.m_db,
+        sql::exec(m_parent.db(),
                   "UPDATE schedule SET expire = now() + period"
                   " WHERE id = $1::BIGINT")
           .add(id).execute();
       } else {
         // Fine, non-recurring so delete it.
-        sql::exec(m_parent.m_db,
+        sql::exec(m_parent.db(),
                   "DELETE FROM schedule WHERE id = $1::BIGINT")
           .add(id).execute();
       }
@@ -2839,13 +2853,12 @@ void MyWorker::cQueue::handle(const HTTPRequest &req) const
               (Element("identifier")(CharData<std::string>(identifier))
                & !Element("expire")(CharData<Time>(expire))
                & !Element("period")(CharData<DiffTime>(period))));
-    { std::istringstream body(req.m_body);
-      XMLexer lexer(body);
+    { XMLexer lexer(req.m_body);
       ddoc.process(lexer);
     }
 
     // Fine, add event then
-    sql::exec(m_parent.m_db,
+    sql::exec(m_parent.db(),
               "INSERT INTO schedule (account, queue, expire, period, identifier)"
               " VALUES ($1::BIGINT, $2::TEXT, $3::TIMESTAMP, $4::INTERVAL, $5::TEXT)")
       .add(m_parent.m_account_id)
@@ -2891,7 +2904,7 @@ void MyWorker::cQueueEvent::handle(const HTTPRequest &req) const
   case HTTPRequest::mDELETE: {
 
     // Fine, delete event if we can find it
-    sql::exec cmd(m_parent.m_db,
+    sql::exec cmd(m_parent.db(),
                   "DELETE FROM schedule"
                   " WHERE account = $1::BIGINT"
                   "   AND queue = $2::TEXT"
@@ -2938,6 +2951,7 @@ void MyWorker::cStatus::handle(const HTTPRequest &req) const
     std::string version(g_getVersion());
     Time p_time(Time::now());
     size_t p_queue(m_parent.m_httpd.getQueueLength());
+    CredCache::stats_t p_cc(m_parent.m_cc.stats());
 
     cm hm(*this);
 
@@ -2947,6 +2961,11 @@ void MyWorker::cStatus::handle(const HTTPRequest &req) const
               (Element("version")(CharData<std::string>(version))
                & Element("time")(CharData<Time>(p_time))
                & Element("request-queue")(CharData<size_t>(p_queue))
+               & Element("credcache")
+               (Element("entries")(CharData<size_t>(p_cc.entries))
+                & Element("hits")(CharData<uint64_t>(p_cc.hits))
+                & Element("misses")(CharData<uint64_t>(p_cc.misses))
+                & Element("rejects")(CharData<uint64_t>(p_cc.rejects)))
                & *Element("mirror")
                (Element("host")(CharData<std::string>(hm.host))
                 & Element("port")(CharData<uint16_t>(hm.port))
@@ -2994,8 +3013,7 @@ bool MyWorker::cStatus::cm::getNext()
     if (rep.getStatus() == 200) {
       using namespace xml;
       const IDocument &ddoc = mkDoc(SubDocument(m_status));
-      std::istringstream istr(rep.refBody());
-      XMLexer lexer(istr);
+      XMLexer lexer(rep.refBody());
       ddoc.process(lexer);
     } else {
       m_status = "<!-- Non-200 status -->";
@@ -3032,8 +3050,7 @@ void MyWorker::cFavourites::handle(const HTTPRequest &req) const
     const IDocument &ddoc
       = mkDoc(Element("favourite")
               (Element("path")(CharData<std::string>(path))));
-    { std::istringstream body(req.m_body);
-      XMLexer lexer(body);
+    { XMLexer lexer(req.m_body);
       ddoc.process(lexer);
     }
 
@@ -3050,11 +3067,11 @@ void MyWorker::cFavourites::handle(const HTTPRequest &req) const
     }
 
     // Start transaction for our two-stage insert
-    sql::transaction trans(m_parent.m_db);
+    sql::transaction trans(m_parent.db());
 
     // Locate device id
     uint64_t devid;
-    sql::query q(m_parent.m_db,
+    sql::query q(m_parent.db(),
                  "SELECT id FROM device "
                  "WHERE account = $1::BIGINT "
                  "AND descr = $2::TEXT");
@@ -3069,7 +3086,7 @@ void MyWorker::cFavourites::handle(const HTTPRequest &req) const
     q.get(devid);
 
     // Insert.
-    sql::exec(m_parent.m_db,
+    sql::exec(m_parent.db(),
               "INSERT INTO favourites (account, label, device, path)"
               " VALUES ($1::BIGINT, $2::TEXT, $3::BIGINT, $4::TEXT)")
       .add(m_parent.m_account_id)
@@ -3091,7 +3108,7 @@ void MyWorker::cFavourites::handle(const HTTPRequest &req) const
     std::string label;
     std::string path;
 
-    sql::query q(m_parent.m_db,
+    sql::query q(m_parent.db(),
                  "SELECT f.label, '/' || d.descr || f.path "
                  "FROM favourites f, device d "
                  "WHERE f.account = $1::BIGINT "
@@ -3156,7 +3173,7 @@ void MyWorker::cFavourite::handle(const HTTPRequest &req) const
   switch (req.getMethod()) {
   case HTTPRequest::mDELETE: {
 
-    sql::exec(m_parent.m_db,
+    sql::exec(m_parent.db(),
               "DELETE FROM favourites "
               "WHERE account = $1::BIGINT "
               "AND label = $2::TEXT")
@@ -3209,14 +3226,13 @@ void MyWorker::cShares::handle(const HTTPRequest &req) const
               (Element("device")(CharData<std::string>(device))
                & Element("path")(CharData<std::string>(path))
                & !Element("expires")(CharData<Time>(expires))));
-    { std::istringstream body(req.m_body);
-      XMLexer lexer(body);
+    { XMLexer lexer(req.m_body);
       ddoc.process(lexer);
     }
 
     // Match device
     uint64_t dev_id;
-    { sql::query dq(m_parent.m_db,
+    { sql::query dq(m_parent.db(),
                     "SELECT id FROM device "
                     "WHERE account = $1::BIGINT"
                     "  AND descr = $2::TEXT");
@@ -3243,7 +3259,7 @@ void MyWorker::cShares::handle(const HTTPRequest &req) const
 
     // Generate guid string
     std::string guidstr;
-    if (!sql::query(m_parent.m_db, "SELECT guidstr()")
+    if (!sql::query(m_parent.db(), "SELECT guidstr()")
         .receiver(guidstr).fetch()) {
       m_parent.m_httpd
         .postReply(HTTPReply(req.m_id, true, 500,
@@ -3253,7 +3269,7 @@ void MyWorker::cShares::handle(const HTTPRequest &req) const
     }
 
     // Insert.
-    sql::exec(m_parent.m_db,
+    sql::exec(m_parent.db(),
               "INSERT INTO share (account, access, guid, device, path, expires) "
               "VALUES ($1::BIGINT, $2::BIGINT, $3::TEXT, $4::BIGINT, $5::TEXT, "
               "$6::TIMESTAMP)")
@@ -3288,7 +3304,7 @@ void MyWorker::cShares::handle(const HTTPRequest &req) const
     std::string path;
     Time expires;
     std::string device;
-    sql::query fq(m_parent.m_db,
+    sql::query fq(m_parent.db(),
                   "SELECT s.guid, s.path, s.expires, d.descr "
                   "FROM share s, device d "
                   "WHERE s.device = d.id "
@@ -3330,13 +3346,13 @@ void MyWorker::cShare::handle(const HTTPRequest &req) const
   switch (req.getMethod()) {
   case HTTPRequest::mGET: {
     // Verify that share exists and hasn't expired.
-    if (!sql::query(m_parent.m_db,
+    if (!sql::query(m_parent.db(),
                     "SELECT id FROM share WHERE guid = $1::TEXT "
                     "AND expires > now()")
         .add(m_parent.m_share).fetch()) {
       // No, no such share.
       // Remove it, if it simply expired
-      sql::exec(m_parent.m_db,
+      sql::exec(m_parent.db(),
                 "DELETE FROM share WHERE guid = $1::TEXT "
                 "AND expires < now()").add(m_parent.m_share).execute();
       // Respond accordingly
@@ -3386,8 +3402,8 @@ void MyWorker::cShare::handle(const HTTPRequest &req) const
     // So let's see if the authenticated user is the owner of the
     // share
     uint64_t share_owner_id;
-    sql::transaction trans(m_parent.m_db);
-    if (!sql::query(m_parent.m_db,
+    sql::transaction trans(m_parent.db());
+    if (!sql::query(m_parent.db(),
                     "SELECT account FROM share WHERE guid = $1::TEXT")
         .add(m_parent.m_share)
         .receiver(share_owner_id)
@@ -3409,7 +3425,7 @@ void MyWorker::cShare::handle(const HTTPRequest &req) const
     }
 
     // So we own the share - delete it
-    sql::exec(m_parent.m_db,
+    sql::exec(m_parent.db(),
               "DELETE FROM share WHERE guid = $1::TEXT "
               "AND account = $2::BIGINT")
       .add(m_parent.m_share)
@@ -3452,12 +3468,12 @@ void MyWorker::cSPath::handle(const HTTPRequest &req) const
     //
     uint64_t dev_id;
     std::string rootpath;
-    if (!sql::query(m_parent.m_db,
+    if (!sql::query(m_parent.db(),
                     "SELECT device, path FROM share WHERE guid = $1::TEXT "
                     "AND expires > now()")
         .add(m_parent.m_share).receiver(dev_id).receiver(rootpath).fetch()) {
       // Remove it, if it simply expired
-      sql::exec(m_parent.m_db,
+      sql::exec(m_parent.db(),
                 "DELETE FROM share WHERE guid = $1::TEXT "
                 "AND expires < now()").add(m_parent.m_share).execute();
       // Respond accordingly
@@ -3478,7 +3494,7 @@ void MyWorker::cSPath::handle(const HTTPRequest &req) const
     // the shared device
     //
     std::string rootobj;
-    if (!sql::query(m_parent.m_db,
+    if (!sql::query(m_parent.db(),
                     "SELECT root FROM backup WHERE device = $1::BIGINT "
                     "ORDER BY tstamp DESC LIMIT 1")
         .add(dev_id).receiver(rootobj).fetch()) {
@@ -3493,6 +3509,10 @@ void MyWorker::cSPath::handle(const HTTPRequest &req) const
     MTrace(t_api, trace::Info, "Allowing access to root path "
            << rootpath << " on device id " << dev_id);
 
+    // Traversing the path is up to the object store; return our
+    // database connection while we do it
+    m_parent.m_db.release();
+
     //
     // We simply prepend the root path to the access path
     //
@@ -3511,18 +3531,44 @@ void MyWorker::cSPath::handle(const HTTPRequest &req) const
       // Fetch next component
       const std::string next(spath.substr(0, spath.find("/")));
       spath.erase(0, next.size());
-      // Load the current directory
-      FSDir curr(papply(&m_parent, &MyWorker::fetchObject), curobj);
-      // Locate the entry to traverse into
-      for (FSDir::dirents_t::const_iterator i = curr.dirents.begin();
-           i != curr.dirents.end(); ++i) {
-        if (i->name == next) {
-          curobj = i->hash;
-          if (i->type == FSDir::dirent_t::UNIXFILE
-              || i->type == FSDir::dirent_t::WINFILE)
-            filename = i->name;
+      // Locate the entry to traverse into, reading the current
+      // directory one object at a time and decoding only the entry
+      // we want. The objects of an indexed directory hold consecutive
+      // ranges of names, so we bisect those and fetch only the one
+      // holding the name; older objects are read one after the other.
+      const objseq_t parts(curobj);
+      size_t lo = 0, hi = parts.size();
+      size_t searched = parts.size();
+      while (lo < hi) {
+        const bool linear = searched != parts.size();
+        const size_t p = linear ? lo : lo + (hi - lo) / 2;
+        if (p == searched) {
+          ++lo;
+          continue;
+        }
+        const DirView curr(papply(&m_parent, &MyWorker::fetchObject), parts[p]);
+        const DirView::const_iterator i = curr.find(next);
+        if (i != curr.end()) {
+          curobj = i->hashseq();
+          if (i->type() == FSDir::dirent_t::UNIXFILE
+              || i->type() == FSDir::dirent_t::WINFILE)
+            filename = next;
           goto next_component;
         }
+        if (linear) {
+          ++lo;
+        } else if (!curr.indexed() || !curr.size()) {
+          // Search the others one after the other
+          searched = p;
+          lo = 0;
+        } else if (curr.at(0)->compareName(next) > 0) {
+          hi = p;
+        } else if (curr.at(curr.size() - 1)->compareName(next) < 0) {
+          lo = p + 1;
+        } else {
+          // It would have been in this object
+          break;
+        }
       }
       // Unable to find path component
       m_parent.m_httpd
@@ -3566,7 +3612,7 @@ void MyWorker::cSPath::handle(const HTTPRequest &req) const
                  FSDir::dirents_t::iterator&, FSDir::dirents_t&>
                  (this, &cSPath::sendDir, f, d_i, dir.dirents) ]));
 
-    m_parent.m_httpd.postReply(req.m_id, ddoc);
+    m_parent.m_httpd.streamReply(req.m_id, ddoc);
     return;
   }
   default:
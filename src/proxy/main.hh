@@ -16,6 +16,7 @@
 #include "httpd/httpd.hh"
 #include "httpd/httpclient.hh"
 #include "sql/sql.hh"
+#include "sql/pool.hh"
 #include "objparser/objparser.hh"
 
 //! Trace path for main server operations
@@ -49,6 +50,10 @@ public:
   //! Property: database connection string
   std::string connString;
 
+  //! Property: most database connections shared by the workers
+  //! (defaults to the number of workers)
+  size_t dbConnections;
+
   //! Property: HTTP authentication realm
   std::string authRealm;
 
@@ -67,6 +72,9 @@ public:
   //! Credentials cache entry TTL
   DiffTime cacheTTL;
 
+  //! Most entries in the credentials cache
+  size_t cacheSize;
+
   //! Handler for mime types
   struct cMime {
     /// For parsing - load temporary extension and mimetype into here
@@ -90,7 +98,8 @@ public:
 
 class MyWorker : public Thread {
 public:
-  MyWorker(HTTPd &httpd, const SvcConfig &cfg, CredCache &cc);
+  MyWorker(HTTPd &httpd, const SvcConfig &cfg, CredCache &cc,
+           sql::Pool &pool);
   MyWorker(const MyWorker &);
   ~MyWorker();
 protected:
@@ -113,8 +122,14 @@ private:
   //! Our OS/API connection handler
   OSMirror m_osapi;
 
-  //! Our database connection
-  sql::Connection m_db;
+  //! The database connection we lease for a request. It is taken
+  //! from the pool when the request first needs it, and returned when
+  //! the request is done - or earlier, before a long transfer from
+  //! the object store.
+  sql::Pool::Lease m_db;
+
+  //! Our database connection, leased if we do not hold one yet
+  sql::Connection &db() { return m_db.get(); }
 
   //! Actually process a request
   void processRequest(HTTPRequest &req);
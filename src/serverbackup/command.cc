@@ -459,8 +459,7 @@ void Command::Processor::cmdLogin(std::vector<std::string> &tokens)
                     try {
 
 
-                        std::istringstream body(std::string(rep.refBody().begin(), rep.refBody().end()));
-                        XMLexer lexer(body);
+                        XMLexer lexer(rep.refBody());
                         ddoc.process(lexer);
                         
                         m_parent.m_cfg.m_user_id = id;
@@ -9,64 +9,38 @@
 #include "common/trace.hh"
 #include "common/partial.hh"
 #include "common/string.hh"
-#include "common/scopeguard.hh"
 
 #include "objparser/objparser.hh"
 
 #include "xml/xmlio.hh"
 
 #include "commandproc.hh"
+#include "restore.hh"
 
 #include <cctype>
-#include <iomanip>
 
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <fcntl.h>
-#include <unistd.h>
 #include <errno.h>
-#include <pwd.h>
-#include <grp.h>
 
 namespace {
   trace::Path t_cmd("/commandproc");
 }
 
-CommProc::CommProc(ServerConnection &conn)
+CommProc::CommProc(ServerConnection &conn, size_t restorestreams)
   : m_conn(conn)
+  , m_restorestreams(restorestreams)
 {
 }
 
 std::vector<uint8_t> CommProc::getObject(const sha256 &hash)
 {
-  while (true) {
-    ServerConnection::Reply rep;
-    try {
-      ServerConnection::Request req(ServerConnection::mGET,
-                                    "/object/" + hash.m_hex);
-      req.setBasicAuth(m_conn);
-      rep = m_conn.execute(req);
-    } catch (error &e) {
-      MTrace(t_cmd, trace::Warn, e.toString());
-      sleep(5);
-      continue;
-    }
-    if (rep.getCode() == 200) {
-      return rep.refBody();
-    }
-    // 500 errors are retry-able
-    if (rep.getCode() >= 500) {
-      MTrace(t_cmd, trace::Warn, "Server gave " << rep.getCode()
-             << " error: " << rep.toString());
-      sleep(5);
-      continue;
-    }
-    // If we get a 404 there is no point in retrying
-    if (rep.getCode() == 404)
-      throw error("Object not found on server");
-    // Other errors should not be retried either
-    throw error("Non-retry-able error: " + rep.toString());
-  }
+  return RestoreEngine::getObject(m_conn, hash);
+}
+
+void CommProc::setObjectStore(const std::string &dir)
+{
+  m_objstore = dir;
 }
 
 void CommProc::run()
@@ -159,6 +133,8 @@ void CommProc::run()
         cmd_cd(tokens);
       else if (tokens[0] == "get")
         cmd_get(tokens);
+      else if (tokens[0] == "update")
+        cmd_update(tokens);
       else if (tokens[0] == "rawget")
         cmd_rawget(tokens);
       else if (tokens[0] == "quit")
@@ -180,6 +156,8 @@ void CommProc::cmd_help(const std::vector<std::string> &t)
               << "                    directory" << std::endl
               << "cd   {destination}: enter host, snapshot or directory" << std::endl
               << "get  {directory}  : restore named directory" << std::endl
+              << "update {directory}: restore named directory over" << std::endl
+              << "                    an existing local copy" << std::endl
               << "rawget {hash}     : restore hierarchy under given hash" << std::endl
               << std::endl;
     return;
@@ -222,6 +200,18 @@ void CommProc::cmd_help(const std::vector<std::string> &t)
     return;
   }
 
+  if (t[1] == "update") {
+    std::cerr << "update {directory}" << std::endl
+              << "The \"update\" command restores the named directory" << std::endl
+              << "like \"get\" does, but into an existing local copy" << std::endl
+              << "in the current working directory. Files that are" << std::endl
+              << "unchanged are left alone, and data that is found in" << std::endl
+              << "existing files is copied rather than downloaded." << std::endl
+              << "Local files that are not in the backup are kept." << std::endl
+              << std::endl;
+    return;
+  }
+
   if (t[1] == "rawget") {
     std::cerr << "rawget {hash}" << std::endl
               << "This command is used in very special situations only," << std::endl
@@ -312,12 +302,8 @@ void CommProc::cmd_cd(const std::vector<std::string> &t)
     throw error("No such element");
 }
 
-void CommProc::cmd_get(const std::vector<std::string>& t)
+objseq_t CommProc::findDirectory(const std::string &name)
 {
-  // Check that precisely one argument was given
-  if (t.size() != 2)
-    throw error("get takes precisely one argument");
-
   // Check that we have a current directory
   if (m_path.empty())
     throw error("Cannot get until we enter a directory");
@@ -328,7 +314,7 @@ void CommProc::cmd_get(const std::vector<std::string>& t)
   FSDir cdir(papply(this, &CommProc::getObject), m_path.back().hash);
   for (FSDir::dirents_t::const_iterator i = cdir.dirents.begin();
        i != cdir.dirents.end(); ++i) {
-    if (i->name == t[1]) {
+    if (i->name == name) {
       if (i->type == FSDir::dirent_t::UNIXDIR
           || i->type == FSDir::dirent_t::WINDIR) {
         restore_hash = i->hash;
@@ -340,13 +326,39 @@ void CommProc::cmd_get(const std::vector<std::string>& t)
   }
   if (!found)
     throw error("No such child object (file or directory) found");
+  return restore_hash;
+}
+
+void CommProc::cmd_get(const std::vector<std::string>& t)
+{
+  // Check that precisely one argument was given
+  if (t.size() != 2)
+    throw error("get takes precisely one argument");
+
+  const objseq_t restore_hash(findDirectory(t[1]));
   // Create restore directory
   if (mkdir(t[1].c_str(), 0700))
     throw syserror("mkdir", "creating restore destination");
   else
     MTrace(t_cmd, trace::Info, "Restoring to ./" << t[1] << "/");
   // Restore then!
-  restoreDirectory(restore_hash, t[1]);
+  restoreDirectory(restore_hash, t[1], false);
+}
+
+void CommProc::cmd_update(const std::vector<std::string>& t)
+{
+  // Check that precisely one argument was given
+  if (t.size() != 2)
+    throw error("update takes precisely one argument");
+
+  const objseq_t restore_hash(findDirectory(t[1]));
+  // Create restore directory unless it is there
+  if (mkdir(t[1].c_str(), 0700) && errno != EEXIST)
+    throw syserror("mkdir", "creating restore destination");
+  else
+    MTrace(t_cmd, trace::Info, "Updating ./" << t[1] << "/");
+  // Restore then!
+  restoreDirectory(restore_hash, t[1], true);
 }
 
 void CommProc::cmd_rawget(const std::vector<std::string>& t)
@@ -366,7 +378,7 @@ void CommProc::cmd_rawget(const std::vector<std::string>& t)
   else
     MTrace(t_cmd, trace::Info, "Restoring to ./" << t[1] << "/");
   // Restore then!
-  restoreDirectory(restore_hash, t[1]);
+  restoreDirectory(restore_hash, t[1], false);
 }
 
 
@@ -409,8 +421,7 @@ void CommProc::cmd_ls_devices()
                [ papply<bool,CommProc,const std::string&>
                  (this, &CommProc::printLine, devname) ]));
 
-  std::istringstream s(std::string(rep.refBody().begin(), rep.refBody().end()));
-  XMLexer lexer(s);
+  XMLexer lexer(rep.refBody());
   ddoc.process(lexer);
 }
 
@@ -438,8 +449,7 @@ void CommProc::cmd_ls_snapshots()
              [ papply<bool,CommProc,const std::string&>
                (this, &CommProc::printLine, tstamp) ]));
 
-  std::istringstream s(std::string(rep.refBody().begin(), rep.refBody().end()));
-  XMLexer lexer(s);
+  XMLexer lexer(rep.refBody());
   ddoc.process(lexer);
 }
 
@@ -482,87 +492,21 @@ void CommProc::init_root_path()
              [ papply<bool,CommProc,const Time&,const std::string&>
                (this, &CommProc::filterSnapHash, tstamp, hash) ]));
 
-  std::istringstream s(std::string(rep.refBody().begin(), rep.refBody().end()));
-  XMLexer lexer(s);
+  XMLexer lexer(rep.refBody());
   ddoc.process(lexer);
 
   if (m_path.empty())
     throw error("No such snapshot found");
 }
 
-void CommProc::restoreDirectory(const objseq_t &obj, const std::string &ldir)
+void CommProc::restoreDirectory(const objseq_t &obj, const std::string &ldir,
+                                bool reuse)
 {
-  // Load the directory
-  FSDir dir(papply(this, &CommProc::getObject), obj);
-
-  // Restore every entry
-  for (FSDir::dirents_t::const_iterator i = dir.dirents.begin();
-       i != dir.dirents.end(); ++i) {
-
-    const std::string fname = ldir + "/" + i->name;
-
-    if (i->type == FSDir::dirent_t::UNIXFILE
-        || i->type == FSDir::dirent_t::WINFILE) {
-      // Create file with proper mode
-      int fd = open(fname.c_str(),
-                    O_WRONLY | O_CREAT | O_EXCL,
-                    i->mode);
-      if (fd == -1)
-        throw syserror("open", "creating file for restore");
-      ON_BLOCK_EXIT(close, fd);
-      // Set file ownership
-      if (fchown(fd, str2user(i->user), str2group(i->group)))
-        MTrace(t_cmd, trace::Warn, "Failed setting owner on " << fname);
-      //
-      // Restore data
-      std::cerr << "Preparing " << fname << "..." << std::flush;
-      for (objseq_t::const_iterator c = i->hash.begin(); c != i->hash.end(); ++c) {
-        // Load chunk
-        std::vector<uint8_t> chunk(getObject(*c));
-        size_t ofs = 0;
-        // Verify object version
-        if (des<uint8_t>(chunk, ofs))
-          throw error("File data object is not version 0");
-        // Verify that it is file data
-        if (des<uint8_t>(chunk, ofs) != 0xfd)
-          throw error("Not a file data object");
-        // Fine, write data then
-        while (ofs != chunk.size()) {
-          int wrc = write(fd, &chunk[ofs], chunk.size() - ofs);
-          if (wrc == -1 && errno == EINTR)
-            continue;
-          if (wrc == -1)
-            throw syserror("write", "writing chunk data");
-          if (wrc == 0)
-            throw error("Writing chunk data wrote no data");
-          MAssert(wrc > 0, "Non -1 negative write response");
-          ofs += wrc;
-        }
-        size_t oldprec(std::cerr.precision());
-        std::cerr << "\rRestoring " << fname << ": "
-                  << std::setprecision(3)
-                  << (c - i->hash.begin() + 1) * 100.0 / i->hash.size()
-                  << std::setprecision(oldprec)
-                  << "%" << std::flush;
-      }
-      std::cerr << " -> done" << std::endl;
-      continue;
-    }
-    if (i->type == FSDir::dirent_t::UNIXDIR
-        || i->type == FSDir::dirent_t::WINDIR) {
-      // Create directory with proper mode
-      if (mkdir(fname.c_str(), i->mode))
-        throw syserror("mkdir", "creating directory " + fname + " for restore");
-
-      // Set ownership...
-      if (lchown(fname.c_str(), str2user(i->user), str2group(i->group)))
-        MTrace(t_cmd, trace::Warn, "Failed setting owner on " << fname);
-
-      // Descend
-      restoreDirectory(i->hash, fname);
-      continue;
-    }
-  }
+  RestoreEngine engine(m_conn, m_restorestreams);
+  engine.setReuse(reuse);
+  if (!m_objstore.empty())
+    engine.setObjectStore(m_objstore);
+  engine.restore(obj, ldir);
 }
 
 bool CommProc::filterSnapHash(const Time &t, const std::string &h)
@@ -579,33 +523,6 @@ bool CommProc::filterSnapHash(const Time &t, const std::string &h)
 
 
 
-uid_t CommProc::str2user(const std::string &usr)
-{
-  struct passwd *res = getpwnam(usr.c_str());
-  if (res)
-    return res->pw_uid;
-  // Failure... See if usr is a numeric string
-  try { return string2Any<uint32_t>(usr); }
-  catch (...) { }
-  // No, not numeric either.
-  MTrace(t_cmd, trace::Warn, "User \"" << usr << "\" not found. Using uid 0");
-  return 0;
-}
-
-gid_t CommProc::str2group(const std::string &grp)
-{
-  struct group *res = getgrnam(grp.c_str());
-  if (res)
-    return res->gr_gid;
-  // Failure... See if grp is a numeric string
-  try { return string2Any<uint32_t>(grp); }
-  catch (...) { }
-  // No, not numeric either.
-  MTrace(t_cmd, trace::Warn, "Group \"" << grp << "\" not found. Using gid 0");
-  return 0;
-}
-
-
 std::string CommProc::printPath(const path_t &p)
 {
   std::ostringstream out;
@@ -15,17 +15,27 @@
 
 class CommProc {
 public:
-  CommProc(ServerConnection &conn);
+  /// Restores download over the given number of connections
+  CommProc(ServerConnection &conn, size_t restorestreams);
 
   /// Call this method to start the command line processor. This
   /// method returns when the user has quit the command line.
   void run();
 
+  /// Have restores take chunks from this local object store when it
+  /// has them
+  void setObjectStore(const std::string &);
 
 private:
   /// Our server connection
   ServerConnection &m_conn;
 
+  /// Connections to restore with
+  const size_t m_restorestreams;
+
+  /// Local object store, if any
+  std::string m_objstore;
+
   /// Object download. Will retry on retry-able errors.
   std::vector<uint8_t> getObject(const sha256 &);
 
@@ -33,6 +43,7 @@ private:
   void cmd_ls(const std::vector<std::string>&);
   void cmd_cd(const std::vector<std::string>&);
   void cmd_get(const std::vector<std::string>&);
+  void cmd_update(const std::vector<std::string>&);
   void cmd_rawget(const std::vector<std::string>&);
 
   void cmd_ls_devices();
@@ -49,8 +60,12 @@ private:
   /// tstamp from the XML it may init the path.
   bool filterSnapHash(const Time &, const std::string &);
 
-  /// Restore the given directory under the given local directory
-  void restoreDirectory(const objseq_t&, const std::string &);
+  /// Find the named directory in the current directory
+  objseq_t findDirectory(const std::string &);
+
+  /// Restore the given directory under the given local directory,
+  /// optionally reusing what is there already
+  void restoreDirectory(const objseq_t&, const std::string &, bool reuse);
 
   /// Utility routine for printing dir/file permissions
   static std::string printPerm(uint32_t);
@@ -59,11 +74,6 @@ private:
   /// Same, for mtime/ctime
   static std::string printDate(uint64_t);
 
-  /// Convert string user to numeric user
-  static uid_t str2user(const std::string &);
-  /// Convert string group to numeric group
-  static gid_t str2group(const std::string &);
-
   /// The currently selected device, if any (empty if none)
   std::string m_device;
 
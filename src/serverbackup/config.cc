@@ -18,6 +18,10 @@ namespace {
 
 Config::Config(const std::string &fname)
   : m_workers(2)
+  , m_ownerprefill(false)
+  , m_pagecachestats(false)
+  , m_dirindex(false)
+  , m_restorestreams(8)
   , m_file(fname)
 {
   read();
@@ -78,8 +82,18 @@ Config &Config::doch(Config::op_t op)
              & !Element("device")(CharData<Optional<std::string> >(m_device))
 	     & !Element("device_id")(CharData<Optional<std::string> >(m_device_id))
              & Element("cache")(CharData<std::string>(m_cachename))
+             & !Element("cacheengine")(CharData<Optional<std::string> >(m_cacheengine))
              & !Element("cdp")(CharData<Optional<DiffTime> >(m_cdp))
+             & !Element("cdpmonitor")(CharData<Optional<std::string> >(m_cdpmonitor))
              & !Element("workers")(CharData<size_t>(m_workers))
+             & !Element("ownercache")(CharData<Optional<DiffTime> >(m_ownercache))
+             & !Element("ownerprefill")(CharData<bool>(m_ownerprefill))
+             & !Element("resumewithin")(CharData<Optional<DiffTime> >(m_resumewithin))
+             & !Element("pagecache")(CharData<Optional<std::string> >(m_pagecache))
+             & !Element("pagecachestats")(CharData<bool>(m_pagecachestats))
+             & !Element("dirindex")(CharData<bool>(m_dirindex))
+             & !Element("restorestreams")(CharData<size_t>(m_restorestreams))
+             & !Element("restoreobjects")(CharData<Optional<std::string> >(m_restoreobjects))
              & *Element("skiptype")(CharData<std::string>(skiptype))
              [ ptrcall(op == op_r ? &gotType : &getType) ]
              & *Element("skipdir")(CharData<std::string>(skipdir))
@@ -54,12 +54,49 @@ public:
   //! Cache file name
   std::string m_cachename;
 
+  //! Optional - cache engine ("sqlite" or "mmap"), default sqlite
+  Optional<std::string> m_cacheengine;
+
   //! Optional - CDP trigger timeout - or unset if no CDP trigger
   Optional<DiffTime> m_cdp;
 
+  //! Optional - CDP change monitor ("fanotify" or "inotify"), default
+  //! fanotify where available
+  Optional<std::string> m_cdpmonitor;
+
   //! Number of worker threads to use for backup
   size_t m_workers;
 
+  //! Optional - time owner user and group names are cached for,
+  //! default ten minutes
+  Optional<DiffTime> m_ownercache;
+
+  //! Whether to enumerate all users and groups into the owner cache
+  //! when a backup starts
+  bool m_ownerprefill;
+
+  //! Optional - how long after it started a backup that did not
+  //! complete may be resumed, default a day
+  Optional<DiffTime> m_resumewithin;
+
+  //! Optional - how file data reads treat the page cache ("keep",
+  //! "drop" or "direct"), default keep
+  Optional<std::string> m_pagecache;
+
+  //! Whether to measure how much of the page cache a backup displaces
+  bool m_pagecachestats;
+
+  //! Whether to upload indexed (version 1) directory objects, which
+  //! servers older than this one do not take
+  bool m_dirindex;
+
+  //! Number of concurrent connections to restore with
+  size_t m_restorestreams;
+
+  //! Optional - local object store directory that restores take
+  //! chunks from before downloading them
+  Optional<std::string> m_restoreobjects;
+
   //! List of file system types to exclude from the backup. If none
   //! are mentioned in the configuration file we set a default list
   //! of: tmpfs, proc, sysfs, devpts, rpc_pipefs
@@ -141,7 +141,15 @@ void Engine::Backup::run()
     m_parent.m_cfg.m_device_id = "f";
   // Let's connect to the server
   std::string apihost, token, pass, devname, cachename,device_id, id;
+  FSCache::engine_t cacheengine = FSCache::E_SQLite;
+  bool fswide = true;
   size_t nworkers;
+  DiffTime ownercache(DiffTime::iso("PT10M"));
+  bool ownerprefill;
+  ChunkReader::cache_t pagecache = ChunkReader::CacheKeep;
+  bool pagecachestats;
+  bool dirindex;
+  DiffTime resumewithin(DiffTime::iso("PT24H"));
   { // We access config data
     MutexLock cfglock(m_parent.m_cfg.m_lock);
     // We have some absolute excludes that we will not run
@@ -161,16 +169,42 @@ void Engine::Backup::run()
   //  device_id = m_parent.m_cfg.m_device_id.get();
   //  id = m_parent.m_cfg.m_user_id.get();
     cachename = m_parent.m_cfg.m_cachename;
+    if (m_parent.m_cfg.m_cacheengine.isSet())
+      cacheengine = FSCache::parseEngine(m_parent.m_cfg.m_cacheengine.get());
+    if (m_parent.m_cfg.m_cdpmonitor.isSet()) {
+      const std::string &mon = m_parent.m_cfg.m_cdpmonitor.get();
+      if (mon != "fanotify" && mon != "inotify")
+        throw error("Unknown CDP monitor: " + mon);
+      fswide = mon == "fanotify";
+    }
     nworkers = m_parent.m_cfg.m_workers;
+    if (m_parent.m_cfg.m_ownercache.isSet())
+      ownercache = m_parent.m_cfg.m_ownercache.get();
+    ownerprefill = m_parent.m_cfg.m_ownerprefill;
+    if (m_parent.m_cfg.m_pagecache.isSet()) {
+      const std::string &pc = m_parent.m_cfg.m_pagecache.get();
+      if (pc == "keep")
+        pagecache = ChunkReader::CacheKeep;
+      else if (pc == "drop")
+        pagecache = ChunkReader::CacheDrop;
+      else if (pc == "direct")
+        pagecache = ChunkReader::CacheDirect;
+      else
+        throw error("Unknown page cache mode: " + pc);
+    }
+    pagecachestats = m_parent.m_cfg.m_pagecachestats;
+    dirindex = m_parent.m_cfg.m_dirindex;
+    if (m_parent.m_cfg.m_resumewithin.isSet())
+      resumewithin = m_parent.m_cfg.m_resumewithin.get();
     
   }
   ServerConnection conn(apihost, 443, true);
   conn.setDefaultBasicAuth(token, pass);
 
   // Initialise cache
-  FSCache cache(cachename);
+  FSCache cache(cachename, cacheengine);
 
-  DirMonitor dirMonitor;
+  DirMonitor dirMonitor(fswide);
   dirMonitor.setChangeNotification(papply(this, &Engine::Backup::handleChangeNotification));
 
   // Set up upload
@@ -188,12 +222,29 @@ void Engine::Backup::run()
   // Set number of workers
   upload->setWorkers(nworkers);
 
+  // Owner names are looked up for every file
+  upload->setOwnerCache(ownercache, ownerprefill);
+
+  // Keep the backup from flushing the page cache
+  upload->setReadCache(pagecache, pagecachestats);
+
+  // Directory object version
+  upload->setDirIndex(dirindex);
+
   // Set up exclude filtering
   upload->setFilter(papply(this, &Engine::Backup::filter));
 
   upload->setCompletionNotification(papply(this, &Engine::Backup::handleUploadCompletion));
 
   upload->setAddWatchDelegate(papply(&dirMonitor, &DirMonitor::addDir));
+  upload->setTrackIds(dirMonitor.fileSystemWide());
+
+  // Remember touched directories across restarts. Only the file system
+  // wide monitor sees all changes without walking the tree first.
+  upload->openJournal(cachename + ".journal", dirMonitor.fileSystemWide());
+
+  // Let a backup that is stopped be resumed by the next
+  upload->openCheckpoint(cachename + ".checkpoint", resumewithin);
 
   // Wait until we're told to start
   while (true) {
@@ -230,6 +281,14 @@ void Engine::Backup::run()
           MTrace(t_eng, trace::Debug, "Skip: \"" << *i << "\"");
         // Skip the cache too
         m_skip_filesystems.insert(cachename);
+        m_skip_filesystems.insert(cachename + "-wal");
+        m_skip_filesystems.insert(cachename + "-shm");
+        m_skip_filesystems.insert(cachename + ".mmap.idx");
+        m_skip_filesystems.insert(cachename + ".mmap.arena");
+        m_skip_filesystems.insert(cachename + ".journal");
+        m_skip_filesystems.insert(cachename + ".checkpoint");
+        m_skip_filesystems.insert(cachename + ".checkpoint-wal");
+        m_skip_filesystems.insert(cachename + ".checkpoint-shm");
         for (std::set<std::string>::const_iterator i = m_skip_filesystems.begin();
              i != m_skip_filesystems.end(); ++i)
           MTrace(t_eng, trace::Debug, "Skip: \"" << *i << "\"");
@@ -277,8 +336,16 @@ void Engine::Backup::handleChangeNotification(DirMonitor &dirMonitor)
   bool rc = dirMonitor.popFileChangeEvent(event);
 
   while (rc) {
-    MTrace(t_eng, trace::Debug, "ChangedWD:" << event.root + " " + event.fileName);
-    m_pUpload->touchPathWD(event.root);
+    if (event.root != -1) {
+      MTrace(t_eng, trace::Debug, "ChangedWD:" << event.root << " " << event.fileName);
+      m_pUpload->touchPathWD(event.root);
+    } else if (event.dev || event.ino) {
+      MTrace(t_eng, trace::Debug, "Changed:" << event.path << " " << event.fileName);
+      m_pUpload->touchPathID(event.dev, event.ino, event.path);
+    } else {
+      MTrace(t_eng, trace::Info, "Change events lost - rescanning everything");
+      m_pUpload->touchAll();
+    }
     rc = dirMonitor.popFileChangeEvent(event);
   }
 
@@ -0,0 +1,635 @@
+///
+/// Parallel restore engine for the restore utility
+///
+
+#include "restore.hh"
+
+#include "common/error.hh"
+#include "common/trace.hh"
+#include "common/partial.hh"
+#include "common/string.hh"
+#include "common/scopeguard.hh"
+
+#include <iostream>
+#include <iomanip>
+#include <map>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pwd.h>
+#include <grp.h>
+
+namespace {
+  trace::Path t_rst("/restore");
+
+  /// Directory listings wait while this many chunks are queued, so
+  /// that we do not hold the entire tree in memory
+  const size_t g_max_queued_chunks = 4096;
+
+  /// How often we report progress
+  const DiffTime g_progress_interval(DiffTime::iso("PT5S"));
+
+  /// getpwnam() and getgrnam() are not reentrant
+  Mutex g_name_lock;
+
+  /// File data in a chunk, after its two byte header
+  const uint64_t g_chunk_data = ng_chunk_size - 2;
+
+  double mib(uint64_t bytes)
+  {
+    return bytes / (1024. * 1024.);
+  }
+
+  /// Read until we have len bytes or reach the end of the file;
+  /// return the bytes read
+  size_t readAt(int fd, uint64_t ofs, uint8_t *buf, size_t len)
+  {
+    size_t got = 0;
+    while (got != len) {
+      ssize_t rc = pread(fd, buf + got, len - got, off_t(ofs + got));
+      if (rc == -1 && errno == EINTR)
+        continue;
+      if (rc == -1)
+        throw syserror("pread", "reading existing data");
+      if (rc == 0)
+        break;
+      got += rc;
+    }
+    return got;
+  }
+
+  /// Objects are stored like the object store server does it
+  std::string storeName(const std::string &n)
+  {
+    return "/" + n.substr(0, 2) + "/" + n.substr(2, 2)
+      + "/" + n.substr(4, 2) + "/" + n.substr(6);
+  }
+}
+
+RestoreEngine::stats_t::stats_t()
+  : dirs(0)
+  , files(0)
+  , chunks(0)
+  , bytes(0)
+  , reused(0)
+  , stored(0)
+  , sparse(0)
+  , started(Time::now())
+{
+}
+
+RestoreEngine::RestoreEngine(const ServerConnection &conn, size_t streams)
+  : m_proto(conn)
+  , m_streams(streams ? streams : 1)
+  , m_reuse(false)
+  , m_stop(false)
+{
+}
+
+RestoreEngine::~RestoreEngine()
+{
+}
+
+std::vector<uint8_t> RestoreEngine::getObject(ServerConnection &conn,
+                                              const sha256 &hash)
+{
+  while (true) {
+    ServerConnection::Reply rep;
+    try {
+      ServerConnection::Request req(ServerConnection::mGET,
+                                    "/object/" + hash.hex());
+      req.setBasicAuth(conn);
+      rep = conn.execute(req);
+    } catch (error &e) {
+      MTrace(t_rst, trace::Warn, e.toString());
+      sleep(5);
+      continue;
+    }
+    if (rep.getCode() == 200) {
+      return rep.refBody();
+    }
+    // 500 errors are retry-able
+    if (rep.getCode() >= 500) {
+      MTrace(t_rst, trace::Warn, "Server gave " << rep.getCode()
+             << " error: " << rep.toString());
+      sleep(5);
+      continue;
+    }
+    // If we get a 404 there is no point in retrying
+    if (rep.getCode() == 404)
+      throw error("Object not found on server");
+    // Other errors should not be retried either
+    throw error("Non-retry-able error: " + rep.toString());
+  }
+}
+
+void RestoreEngine::restore(const objseq_t &dir, const std::string &ldir)
+{
+  // Compute the zero chunk hash before the workers compare with it
+  ng_zero_chunk_hash();
+
+  // The root gets no owner or mode; it was created by our caller
+  dir_t *root = new dir_t;
+  root->parent = 0;
+  root->path = ldir;
+  root->hash = dir;
+  root->meta = false;
+  root->uid = 0;
+  root->gid = 0;
+  root->mode = 0;
+  root->pending = 1;
+
+  { MutexLock l(m_lock);
+    m_stop = false;
+    m_error.clear();
+    m_dirjobs.clear();
+    m_chunkjobs.clear();
+    m_stats = stats_t();
+    m_last_progress = m_stats.started;
+    m_dirs.insert(root);
+    m_dirjobs.push_back(job_t(root));
+    m_work.increment();
+  }
+
+  std::vector<Worker*> workers;
+  for (size_t i = 0; i != m_streams; ++i) {
+    workers.push_back(new Worker(*this, m_proto));
+    workers.back()->start();
+  }
+  MTrace(t_rst, trace::Info, "Restoring with " << m_streams << " streams");
+
+  // Wait until we are done or failed, then for the workers to notice
+  m_done.decrement();
+  for (size_t i = 0; i != workers.size(); ++i) {
+    workers[i]->join_nothrow();
+    delete workers[i];
+  }
+
+  // Whatever is left was not restored
+  MutexLock l(m_lock);
+  for (std::set<dir_t*>::iterator i = m_dirs.begin(); i != m_dirs.end(); ++i)
+    delete *i;
+  m_dirs.clear();
+  for (std::set<file_t*>::iterator i = m_files.begin(); i != m_files.end(); ++i)
+    delete *i;
+  m_files.clear();
+  m_dirjobs.clear();
+  m_chunkjobs.clear();
+
+  progress(true);
+  if (!m_error.empty())
+    throw error(m_error);
+}
+
+void RestoreEngine::setReuse(bool reuse)
+{
+  m_reuse = reuse;
+}
+
+void RestoreEngine::setObjectStore(const std::string &dir)
+{
+  m_objstore = dir;
+}
+
+RestoreEngine::stats_t RestoreEngine::stats()
+{
+  MutexLock l(m_lock);
+  return m_stats;
+}
+
+bool RestoreEngine::getJob(job_t &job)
+{
+  while (true) {
+    m_work.decrement();
+    MutexLock l(m_lock);
+    if (m_stop) {
+      // Pass the wake-up on to the next worker
+      m_work.increment();
+      return false;
+    }
+    // Prefer listings, so that there is plenty of file data to fetch
+    // - but only as long as the chunks queued do not pile up
+    if (!m_dirjobs.empty() && m_chunkjobs.size() < g_max_queued_chunks) {
+      job = m_dirjobs.front();
+      m_dirjobs.pop_front();
+      return true;
+    }
+    if (!m_chunkjobs.empty()) {
+      job = m_chunkjobs.front();
+      m_chunkjobs.pop_front();
+      return true;
+    }
+    // A wake-up left over from an earlier restore
+  }
+}
+
+void RestoreEngine::listDir(Worker &w, dir_t *d)
+{
+  // Create everything in the directory, and queue what must be
+  // fetched. Files hold no data yet and are writable by us only
+  // until they are done.
+  std::vector<job_t> jobs;
+  std::vector<file_t*> empty;
+  size_t children = 0;
+  uint64_t sparse = 0;
+  uint64_t reused = 0;
+  for (objseq_t::const_iterator p = d->hash.begin(); p != d->hash.end(); ++p) {
+    const DirView view(papply(&w, &Worker::getObject), *p);
+    for (DirView::const_iterator i = view.begin(); i != view.end(); ++i) {
+
+      const std::string fname = d->path + "/" + i->name();
+      const FSDir::dirent_t::t type = i->type();
+
+      if (type == FSDir::dirent_t::UNIXFILE
+          || type == FSDir::dirent_t::WINFILE) {
+        // See what is there already
+        struct stat st;
+        const bool exists = m_reuse && !lstat(fname.c_str(), &st);
+        if (exists && !S_ISREG(st.st_mode))
+          throw error("Cannot restore file " + fname + " over non-file");
+        const objseq_t have(exists ? hashLocal(fname) : objseq_t());
+
+        file_t *f = new file_t;
+        f->parent = d;
+        f->path = fname;
+        f->hash = i->hashseq();
+        f->meta = type == FSDir::dirent_t::UNIXFILE;
+        f->uid = f->meta ? str2user(i->user()) : 0;
+        f->gid = f->meta ? str2group(i->group()) : 0;
+        f->mode = i->mode();
+        f->pending = 0;
+        // Unless the file ends in a zero chunk, its last chunk tells us
+        // its size
+        f->size = f->hash.empty() || f->hash.back() != ng_zero_chunk_hash()
+          ? 0 : f->hash.size() * g_chunk_data;
+        f->local.resize(f->hash.size(), -1);
+        { MutexLock l(m_lock);
+          m_files.insert(f);
+        }
+
+        // An unchanged file just gets its owner and mode
+        if (exists && have == f->hash) {
+          f->size = st.st_size;
+          empty.push_back(f);
+          reused += st.st_size;
+          continue;
+        }
+
+        // Otherwise we write a new file, taking what we can from the
+        // existing one
+        std::map<sha256,uint64_t> offsets;
+        for (size_t c = have.size(); c--; )
+          offsets[have[c]] = c * g_chunk_data;
+        if (exists)
+          f->tmp = fname + ".srestore";
+        int fd = exists
+          ? open(f->tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)
+          : open(fname.c_str(), O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+        if (fd == -1)
+          throw syserror("open", "creating file " + fname + " for restore");
+        close(fd);
+
+        // Chunks of zeros are not fetched but left as holes in the
+        // file; we set its size when done
+        for (size_t c = 0; c != f->hash.size(); ++c) {
+          if (f->hash[c] == ng_zero_chunk_hash()) {
+            sparse += g_chunk_data;
+            continue;
+          }
+          std::map<sha256,uint64_t>::const_iterator o = offsets.find(f->hash[c]);
+          if (o != offsets.end())
+            f->local[c] = o->second;
+          jobs.push_back(job_t(f, c));
+          ++f->pending;
+        }
+        if (f->pending)
+          ++children;
+        else
+          empty.push_back(f);
+        continue;
+      }
+
+      if (type == FSDir::dirent_t::UNIXDIR
+          || type == FSDir::dirent_t::WINDIR) {
+        // We must be able to fill the directory; its mode is set when
+        // it is done
+        if (mkdir(fname.c_str(), S_IRWXU)) {
+          struct stat st;
+          if (errno != EEXIST || !m_reuse
+              || lstat(fname.c_str(), &st) || !S_ISDIR(st.st_mode)
+              || chmod(fname.c_str(), S_IRWXU))
+            throw syserror("mkdir", "creating directory " + fname + " for restore");
+        }
+
+        dir_t *c = new dir_t;
+        c->parent = d;
+        c->path = fname;
+        c->hash = i->hashseq();
+        c->meta = type == FSDir::dirent_t::UNIXDIR;
+        c->uid = c->meta ? str2user(i->user()) : 0;
+        c->gid = c->meta ? str2group(i->group()) : 0;
+        c->mode = i->mode();
+        c->pending = 1;
+        { MutexLock l(m_lock);
+          m_dirs.insert(c);
+        }
+        jobs.push_back(job_t(c));
+        ++children;
+        continue;
+      }
+    }
+  }
+
+  { MutexLock l(m_lock);
+    d->pending += children;
+    m_stats.sparse += sparse;
+    m_stats.reused += reused;
+    for (std::vector<job_t>::const_iterator i = jobs.begin();
+         i != jobs.end(); ++i) {
+      if (i->dir)
+        m_dirjobs.push_back(*i);
+      else
+        m_chunkjobs.push_back(*i);
+      m_work.increment();
+    }
+  }
+
+  // Files with no data to fetch are done already; they were not
+  // counted as pending children
+  for (std::vector<file_t*>::const_iterator i = empty.begin();
+       i != empty.end(); ++i)
+    fileDone(*i);
+
+  // Our listing is done
+  childDone(d);
+}
+
+void RestoreEngine::writeChunk(Worker &w, file_t *f, size_t chunk)
+{
+  // Load chunk - from local data if we have it
+  std::vector<uint8_t> data;
+  enum { NET, LOCAL, STORE } source;
+  if (f->local[chunk] != -1 && readLocal(f, chunk, data)) {
+    source = LOCAL;
+  } else if (!m_objstore.empty() && readStore(f->hash[chunk], data)) {
+    source = STORE;
+  } else {
+    data = w.getObject(f->hash[chunk]);
+    source = NET;
+  }
+  size_t ofs = 0;
+  // Verify object version
+  if (des<uint8_t>(data, ofs))
+    throw error("File data object is not version 0");
+  // Verify that it is file data
+  if (des<uint8_t>(data, ofs) != 0xfd)
+    throw error("Not a file data object");
+  const uint64_t len = data.size() - ofs;
+
+  // Write it where it belongs; other workers write the other chunks
+  const std::string &target = f->tmp.empty() ? f->path : f->tmp;
+  int fd = open(target.c_str(), O_WRONLY);
+  if (fd == -1)
+    throw syserror("open", "opening file " + target + " for restore");
+  ON_BLOCK_EXIT(close, fd);
+  off_t pos = off_t(chunk * g_chunk_data);
+  while (ofs != data.size()) {
+    ssize_t wrc = pwrite(fd, &data[ofs], data.size() - ofs, pos);
+    if (wrc == -1 && errno == EINTR)
+      continue;
+    if (wrc == -1)
+      throw syserror("pwrite", "writing chunk data to " + target);
+    if (wrc == 0)
+      throw error("Writing chunk data wrote no data");
+    MAssert(wrc > 0, "Non -1 negative write response");
+    ofs += wrc;
+    pos += wrc;
+  }
+
+  bool done;
+  { MutexLock l(m_lock);
+    switch (source) {
+    case NET: ++m_stats.chunks; break;
+    case LOCAL: m_stats.reused += len; break;
+    case STORE: m_stats.stored += len; break;
+    }
+    m_stats.bytes += len;
+    // Only the last chunk tells us the size of the file
+    if (chunk + 1 == f->hash.size())
+      f->size = chunk * g_chunk_data + len;
+    done = !--f->pending;
+    progress(false);
+  }
+
+  if (done) {
+    dir_t *parent = f->parent;
+    fileDone(f);
+    childDone(parent);
+  }
+}
+
+bool RestoreEngine::readLocal(file_t *f, size_t chunk, std::vector<uint8_t> &data)
+{
+  int fd = open(f->path.c_str(), O_RDONLY);
+  if (fd == -1)
+    throw syserror("open", "reading existing file " + f->path);
+  ON_BLOCK_EXIT(close, fd);
+  data.resize(ng_chunk_size);
+  data[0] = 0x00;
+  data[1] = 0xfd;
+  data.resize(2 + readAt(fd, f->local[chunk], &data[2], g_chunk_data));
+  // The file may have changed since we hashed it
+  return sha256::hash(data) == f->hash[chunk];
+}
+
+bool RestoreEngine::readStore(const sha256 &hash, std::vector<uint8_t> &data)
+{
+  const std::string name = m_objstore + storeName(hash.hex());
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd == -1) {
+    if (errno != ENOENT)
+      MTrace(t_rst, trace::Warn, "Cannot open " << name << ": "
+             << strerror(errno));
+    return false;
+  }
+  ON_BLOCK_EXIT(close, fd);
+  // Read one byte more than a chunk can hold, to see if it does
+  data.resize(ng_chunk_size + 1);
+  data.resize(readAt(fd, 0, &data[0], data.size()));
+  if (sha256::hash(data) == hash)
+    return true;
+  MTrace(t_rst, trace::Warn, "Object " << name << " is damaged");
+  return false;
+}
+
+objseq_t RestoreEngine::hashLocal(const std::string &fname)
+{
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd == -1)
+    throw syserror("open", "reading existing file " + fname);
+  ON_BLOCK_EXIT(close, fd);
+
+  // Chunk and hash like the backup does
+  objseq_t res;
+  std::vector<uint8_t> data(ng_chunk_size);
+  for (uint64_t ofs = 0; ; ofs += g_chunk_data) {
+    data.resize(ng_chunk_size);
+    data[0] = 0x00;
+    data[1] = 0xfd;
+    const size_t got = readAt(fd, ofs, &data[2], g_chunk_data);
+    if (!got)
+      break;
+    data.resize(2 + got);
+    res.push_back(sha256::hash(data));
+    if (got != g_chunk_data)
+      break;
+  }
+  return res;
+}
+
+void RestoreEngine::fileDone(file_t *f)
+{
+  const std::string &target = f->tmp.empty() ? f->path : f->tmp;
+  // Extend the file over trailing holes
+  if (truncate(target.c_str(), off_t(f->size)))
+    throw syserror("truncate", "setting size of restored file " + target);
+  // Set ownership before mode, as a change of owner clears set-id bits
+  if (f->meta) {
+    if (chown(target.c_str(), f->uid, f->gid))
+      MTrace(t_rst, trace::Warn, "Failed setting owner on " << f->path);
+    if (chmod(target.c_str(), f->mode & 07777))
+      throw syserror("chmod", "setting mode on " + f->path);
+  }
+  // Replace the existing file
+  if (!f->tmp.empty() && rename(f->tmp.c_str(), f->path.c_str()))
+    throw syserror("rename", "replacing " + f->path);
+
+  MutexLock l(m_lock);
+  ++m_stats.files;
+  m_files.erase(f);
+  delete f;
+}
+
+void RestoreEngine::childDone(dir_t *d)
+{
+  while (d) {
+    { MutexLock l(m_lock);
+      if (--d->pending)
+        return;
+    }
+
+    // Everything under the directory is restored
+    if (d->meta) {
+      if (lchown(d->path.c_str(), d->uid, d->gid))
+        MTrace(t_rst, trace::Warn, "Failed setting owner on " << d->path);
+      if (chmod(d->path.c_str(), d->mode & 07777))
+        throw syserror("chmod", "setting mode on " + d->path);
+    }
+
+    dir_t *parent = d->parent;
+    MutexLock l(m_lock);
+    ++m_stats.dirs;
+    m_dirs.erase(d);
+    delete d;
+    d = parent;
+    // When the root is done, so are we
+    if (!d)
+      stop(std::string());
+  }
+}
+
+void RestoreEngine::stop(const std::string &err)
+{
+  if (m_stop)
+    return;
+  m_stop = true;
+  m_error = err;
+  m_work.increment();
+  m_done.increment();
+}
+
+void RestoreEngine::progress(bool force)
+{
+  const Time now(Time::now());
+  if (!force && now - m_last_progress < g_progress_interval)
+    return;
+  m_last_progress = now;
+
+  const double secs = (now - m_stats.started).to_double();
+  const std::streamsize oldprec(std::cerr.precision());
+  std::cerr << (force ? "Restored " : "Restoring: ")
+            << m_stats.dirs << " directories, "
+            << m_stats.files << " files, "
+            << std::fixed << std::setprecision(1)
+            << mib(m_stats.bytes) << " MiB written, "
+            << mib(m_stats.reused + m_stats.stored) << " MiB not downloaded ("
+            << mib(m_stats.reused) << " MiB local, "
+            << mib(m_stats.stored) << " MiB object store), "
+            << mib(m_stats.sparse) << " MiB left as holes, in "
+            << secs << " s ("
+            << (secs > 0 ? mib(m_stats.bytes) / secs : 0.) << " MiB/s)"
+            << std::resetiosflags(std::ios::fixed)
+            << std::setprecision(oldprec) << std::endl;
+}
+
+RestoreEngine::Worker::Worker(RestoreEngine &e, const ServerConnection &c)
+  : m_engine(e)
+  , m_conn(c)
+{
+}
+
+std::vector<uint8_t> RestoreEngine::Worker::getObject(const sha256 &hash)
+{
+  return RestoreEngine::getObject(m_conn, hash);
+}
+
+void RestoreEngine::Worker::run()
+{
+  job_t job;
+  while (m_engine.getJob(job)) {
+    try {
+      if (job.dir)
+        m_engine.listDir(*this, job.dir);
+      else
+        m_engine.writeChunk(*this, job.file, job.chunk);
+    } catch (error &e) {
+      MTrace(t_rst, trace::Warn, "Restore failed: " << e.toString());
+      MutexLock l(m_engine.m_lock);
+      m_engine.stop(e.toString());
+    }
+  }
+}
+
+uid_t RestoreEngine::str2user(const std::string &usr)
+{
+  { MutexLock l(g_name_lock);
+    struct passwd *res = getpwnam(usr.c_str());
+    if (res)
+      return res->pw_uid;
+  }
+  // Failure... See if usr is a numeric string
+  try { return string2Any<uint32_t>(usr); }
+  catch (...) { }
+  // No, not numeric either.
+  MTrace(t_rst, trace::Warn, "User \"" << usr << "\" not found. Using uid 0");
+  return 0;
+}
+
+gid_t RestoreEngine::str2group(const std::string &grp)
+{
+  { MutexLock l(g_name_lock);
+    struct group *res = getgrnam(grp.c_str());
+    if (res)
+      return res->gr_gid;
+  }
+  // Failure... See if grp is a numeric string
+  try { return string2Any<uint32_t>(grp); }
+  catch (...) { }
+  // No, not numeric either.
+  MTrace(t_rst, trace::Warn, "Group \"" << grp << "\" not found. Using gid 0");
+  return 0;
+}
@@ -0,0 +1,201 @@
+///
+/// Parallel restore engine for the restore utility
+///
+/// A restore runs a pool of worker threads, each with its own
+/// connection to the server. Directory objects are fetched breadth
+/// first, ahead of the file data, so that there is always plenty of
+/// file data to download; the chunks of a file are downloaded
+/// concurrently and written where they belong in the file. A
+/// directory gets its mode and owner once everything under it has
+/// been restored, so that a read-only directory can be filled first.
+///
+
+#ifndef SERVERBACKUP_RESTORE_HH
+#define SERVERBACKUP_RESTORE_HH
+
+#include "client/serverconnection.hh"
+#include "objparser/objparser.hh"
+#include "common/thread.hh"
+#include "common/mutex.hh"
+#include "common/semaphore.hh"
+#include "common/time.hh"
+
+#include <deque>
+#include <set>
+#include <vector>
+#include <string>
+#include <sys/types.h>
+
+class RestoreEngine {
+public:
+  /// Our connections are copies of the given one
+  RestoreEngine(const ServerConnection &, size_t streams);
+  ~RestoreEngine();
+
+  /// Restore the contents of the given directory object into the
+  /// given (existing) local directory. Progress is written to
+  /// standard error, and so is a summary at the end.
+  //
+  /// \throws error on the first failure - the restore stops then
+  void restore(const objseq_t &dir, const std::string &ldir);
+
+  /// Restore over what is there already. Existing directories are
+  /// kept, and existing files are chunked and hashed like the backup
+  /// does it; chunks found there are copied instead of downloaded.
+  /// Files that are unchanged are left alone.
+  void setReuse(bool);
+
+  /// Look for chunks in this local object store (laid out like the
+  /// object store server's) before downloading them
+  void setObjectStore(const std::string &);
+
+  /// Download an object. Will retry on retry-able errors.
+  static std::vector<uint8_t> getObject(ServerConnection &, const sha256 &);
+
+  /// What a restore did
+  struct stats_t {
+    stats_t();
+    size_t dirs;
+    size_t files;
+    /// Chunks downloaded, and the bytes of file data written
+    uint64_t chunks;
+    uint64_t bytes;
+    /// Bytes of file data taken from existing local files and from
+    /// the local object store rather than downloaded
+    uint64_t reused;
+    uint64_t stored;
+    /// Bytes of zero chunks that we skipped, leaving holes
+    uint64_t sparse;
+    Time started;
+  };
+  stats_t stats();
+
+  /// Convert string user to numeric user
+  static uid_t str2user(const std::string &);
+  /// Convert string group to numeric group
+  static gid_t str2group(const std::string &);
+
+private:
+  RestoreEngine(const RestoreEngine &);
+  RestoreEngine &operator=(const RestoreEngine &);
+
+  /// A directory being restored
+  struct dir_t {
+    dir_t *parent;
+    std::string path;
+    objseq_t hash;
+    /// Whether we restore owner and mode (not for the root, nor for
+    /// directories backed up from Windows)
+    bool meta;
+    uid_t uid;
+    gid_t gid;
+    uint32_t mode;
+    /// Our own listing (until it is done) and the children not yet
+    /// restored. We are done when this reaches zero.
+    size_t pending;
+  };
+
+  /// A file being restored. It is created when its directory is
+  /// listed, and gets its size, owner and mode when all its chunks
+  /// are written.
+  struct file_t {
+    dir_t *parent;
+    std::string path;
+    objseq_t hash;
+    bool meta;
+    uid_t uid;
+    gid_t gid;
+    uint32_t mode;
+    /// Chunks not yet written
+    size_t pending;
+    /// The size of the file, once we know it
+    uint64_t size;
+    /// If we replace an existing file, we write this file and rename
+    /// it when done
+    std::string tmp;
+    /// For every chunk, its offset in the existing file or -1
+    std::vector<int64_t> local;
+  };
+
+  /// A work item - a directory to list, or a chunk of a file
+  struct job_t {
+    job_t() : dir(0), file(0), chunk(0) { }
+    job_t(dir_t *d) : dir(d), file(0), chunk(0) { }
+    job_t(file_t *f, size_t c) : dir(0), file(f), chunk(c) { }
+    dir_t *dir;
+    file_t *file;
+    size_t chunk;
+  };
+
+  class Worker : public Thread {
+  public:
+    Worker(RestoreEngine &, const ServerConnection &);
+    /// Download an object on our own connection
+    std::vector<uint8_t> getObject(const sha256 &);
+  protected:
+    void run();
+  private:
+    RestoreEngine &m_engine;
+    ServerConnection m_conn;
+  };
+  friend class Worker;
+
+  const ServerConnection m_proto;
+  const size_t m_streams;
+  bool m_reuse;
+  std::string m_objstore;
+
+  /// Protects everything below
+  Mutex m_lock;
+  /// Directory listings and file chunks to do. Listings go first
+  /// unless plenty of chunks are queued already.
+  std::deque<job_t> m_dirjobs;
+  std::deque<job_t> m_chunkjobs;
+  /// Counts the jobs queued, and wakes the workers when we stop
+  Semaphore m_work;
+  /// Set when the restore is done or failed
+  bool m_stop;
+  /// The first failure, if any
+  std::string m_error;
+  /// Posted when we stop
+  Semaphore m_done;
+  /// Everything not yet restored, so that we can clean up after a
+  /// failure
+  std::set<dir_t*> m_dirs;
+  std::set<file_t*> m_files;
+
+  stats_t m_stats;
+  Time m_last_progress;
+
+  /// Fetch the next job; returns false when we stop
+  bool getJob(job_t &);
+
+  /// Do a job; these run without our lock
+  void listDir(Worker &, dir_t *);
+  void writeChunk(Worker &, file_t *, size_t chunk);
+
+  /// Hash the chunks of an existing file
+  objseq_t hashLocal(const std::string &);
+
+  /// Read a chunk from the existing file, or from the object store.
+  /// Return false if it is not there (any more).
+  bool readLocal(file_t *, size_t chunk, std::vector<uint8_t> &);
+  bool readStore(const sha256 &, std::vector<uint8_t> &);
+
+  /// Set size, owner and mode of a file whose chunks are all written,
+  /// and forget it
+  void fileDone(file_t *);
+
+  /// A child of the given directory is done. Completes the directory
+  /// and its parents as far as they are done.
+  void childDone(dir_t *);
+
+  /// Stop the restore, recording the failure if any. Must hold
+  /// m_lock.
+  void stop(const std::string &err);
+
+  /// Print progress, if it is time to. Must hold m_lock.
+  void progress(bool force);
+};
+
+#endif
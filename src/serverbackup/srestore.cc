@@ -46,7 +46,9 @@ int main(int argc, char **argv) try
   conn.setDefaultBasicAuth(conf.m_token.get(), conf.m_password.get());
 
   // Fine, now enter the command line processor.
-  CommProc cp(conn);
+  CommProc cp(conn, conf.m_restorestreams);
+  if (conf.m_restoreobjects.isSet())
+    cp.setObjectStore(conf.m_restoreobjects.get());
   cp.run();
 } catch (error &e) {
   std::cerr << "Error: " << e.toString()
@@ -9,14 +9,169 @@
 #include "common/scopeguard.hh"
 
 #include <algorithm>
+#include <sstream>
 
 #include <libpq-fe.h>
 
+// Batches are pipelined where libpq can (from PostgreSQL 14)
+#if defined(LIBPQ_HAS_PIPELINING) && !defined(_WIN32)
+# define SQL_PIPELINE
+# include <poll.h>
+# include <errno.h>
+#endif
+
 trace::Path sql::t_sql("/sql");
 
+namespace {
+  //! Type oids of the binary parameters we pass (from pg_type.h)
+  const Oid g_int8oid = 20;
+  const Oid g_timestampoid = 1114;
+
+  //! Seconds from the UNIX epoch to the PostgreSQL epoch, 2000-01-01
+  const int64_t g_pgepoch = 946684800;
+
+  //! The most statements we keep prepared on a connection; anything
+  //! beyond this is executed unprepared
+  const size_t g_max_prepared = 1024;
+
+#if defined(SQL_PIPELINE)
+  //! Flush what we sent on a non-blocking connection, reading what
+  //! the server sends meanwhile so that neither of us blocks on a
+  //! full buffer. Returns false if the connection failed.
+  bool flushPipeline(PGconn *pgc)
+  {
+    while (true) {
+      const int res = PQflush(pgc);
+      if (!res)
+        return true;
+      if (res < 0)
+        return false;
+      struct pollfd pfd;
+      pfd.fd = PQsocket(pgc);
+      pfd.events = POLLIN | POLLOUT;
+      pfd.revents = 0;
+      if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        throw syserror("poll", "flushing database batch");
+      if ((pfd.revents & POLLIN) && !PQconsumeInput(pgc))
+        return false;
+    }
+  }
+
+  //! The result of the next command in a pipeline, or null if the
+  //! connection failed
+  PGresult *nextResult(PGconn *pgc)
+  {
+    PGresult *pres = PQgetResult(pgc);
+    if (!pres)
+      return 0;
+    // Every command is terminated by a null result
+    if (PGresult *extra = PQgetResult(pgc)) {
+      PQclear(extra);
+      PQclear(pres);
+      return 0;
+    }
+    return pres;
+  }
+#endif
+}
+
+sql::params::~params()
+{
+  // Free allocated parameter data
+  for (std::vector<char*>::iterator i = values.begin();
+       i != values.end(); ++i)
+    delete[] *i;
+}
+
+void sql::params::null()
+{
+  values.push_back(0);
+  lengths.push_back(0);
+  formats.push_back(0);
+  types.push_back(0);
+}
+
+void sql::params::text(const std::string &v)
+{
+  // Validate that this is UTF-8
+  validateUTF8(v);
+  // Copy the string to a zero-terminated char array
+  char *nstr = new char[v.size() + 1];
+  memcpy(nstr, v.c_str(), v.size() + 1);
+  values.push_back(nstr);
+  lengths.push_back(0);
+  formats.push_back(0);
+  types.push_back(0);
+}
+
+void sql::params::binary(Oid type, const char *data, int len)
+{
+  char *nval = new char[len];
+  memcpy(nval, data, len);
+  values.push_back(nval);
+  lengths.push_back(len);
+  formats.push_back(1);
+  types.push_back(type);
+}
+
+void sql::params::int8(int64_t v)
+{
+  // Network byte order
+  char b[8];
+  for (size_t i = 0; i != sizeof b; ++i)
+    b[i] = char(uint64_t(v) >> (56 - 8 * i));
+  binary(g_int8oid, b, sizeof b);
+}
+
+void sql::params::timestamp(const Time &t)
+{
+  // Microseconds since the PostgreSQL epoch, in network byte order -
+  // but only whole seconds, as when we passed time stamps as text
+  const int64_t us = (int64_t(t.to_timet()) - g_pgepoch) * 1000000;
+  char b[8];
+  for (size_t i = 0; i != sizeof b; ++i)
+    b[i] = char(uint64_t(us) >> (56 - 8 * i));
+  binary(g_timestampoid, b, sizeof b);
+}
+
+void sql::addParam(params &p, short v) { p.int8(v); }
+void sql::addParam(params &p, unsigned short v) { p.int8(v); }
+void sql::addParam(params &p, int v) { p.int8(v); }
+void sql::addParam(params &p, unsigned int v) { p.int8(v); }
+void sql::addParam(params &p, long v) { p.int8(v); }
+void sql::addParam(params &p, long long v) { p.int8(v); }
+
+void sql::addParam(params &p, unsigned long v)
+{
+  // Leave it to the server to reject what does not fit a bigint
+  if (v > 0x7fffffffffffffffull)
+    addParam<unsigned long>(p, v);
+  else
+    p.int8(int64_t(v));
+}
+
+void sql::addParam(params &p, unsigned long long v)
+{
+  if (v > 0x7fffffffffffffffull)
+    addParam<unsigned long long>(p, v);
+  else
+    p.int8(int64_t(v));
+}
+
+void sql::addParam(params &p, const Time &v)
+{
+  // Outside the range of the server, the server may reject it as text
+  const int64_t s = int64_t(v.to_timet());
+  if (s < -210866803200ll || s > 9224318015999ll)
+    addParam<Time>(p, v);
+  else
+    p.timestamp(v);
+}
+
 sql::Connection::Connection(const std::string &cstr)
   : pgc(0)
   , m_connstr(cstr)
+  , m_named(0)
 {
   reconnect();
 }
@@ -30,7 +185,20 @@ sql::Connection::~Connection()
 sql::Connection::Connection(const Connection &o)
   : pgc(0)
   , m_connstr(o.m_connstr)
+  , m_named(0)
+{
+}
+
+void sql::Connection::disconnect()
 {
+  if (pgc)
+    PQfinish(pgc);
+  pgc = 0;
+}
+
+bool sql::Connection::connected() const
+{
+  return pgc && PQstatus(pgc) == CONNECTION_OK;
 }
 
 void sql::Connection::reconnect()
@@ -44,8 +212,13 @@ void sql::Connection::reconnect()
     // Connection not ok. Kill it.
     MTrace(t_sql, trace::Debug, "Connection not ok, finishing it up");
     PQfinish(pgc);
+    pgc = 0;
   }
 
+  // A new connection has none of our prepared statements
+  m_prepared.clear();
+  m_named = 0;
+
   MTrace(t_sql, trace::Debug, "Connecting: " + m_connstr);
 
   // Attempt connection
@@ -61,6 +234,63 @@ void sql::Connection::reconnect()
 }
 
 
+sql::Connection::prepared_t::iterator
+sql::Connection::cached(const std::string &stmt, const params &p, bool &fresh)
+{
+  // Statements are keyed by their text and their parameter types, as
+  // they are prepared with those types
+  std::string key(stmt);
+  key.push_back(0);
+  if (!p.types.empty())
+    key.append(reinterpret_cast<const char*>(&p.types[0]),
+               p.types.size() * sizeof p.types[0]);
+
+  fresh = false;
+  prepared_t::iterator i = m_prepared.find(key);
+  if (i == m_prepared.end() && m_prepared.size() < g_max_prepared) {
+    std::ostringstream name;
+    name << "s" << m_named++;
+    i = m_prepared.insert(std::make_pair(key, name.str())).first;
+    fresh = true;
+  }
+  return i;
+}
+
+PGresult *sql::Connection::execute(const std::string &stmt, const params &p)
+{
+  bool fresh;
+  prepared_t::iterator i = cached(stmt, p, fresh);
+  if (fresh) {
+    MTrace(t_sql, trace::Debug, "Preparing " << i->second
+           << " \"" << stmt << "\"");
+    PGresult *pres = PQprepare(pgc, i->second.c_str(), stmt.c_str(),
+                               p.size(), p.types.empty() ? 0 : &p.types[0]);
+    ON_BLOCK_EXIT(PQclear, pres);
+    if (PQresultStatus(pres) != PGRES_COMMAND_OK) {
+      m_prepared.erase(i);
+      if (!pres)
+        throw error("Out of memory during db prepare");
+      throw error("Prepare: \"" + stmt + "\" failed: "
+                  + PQresultErrorMessage(pres));
+    }
+  }
+
+  if (i == m_prepared.end())
+    return PQexecParams(pgc, stmt.c_str(), p.size(),
+                        p.types.empty() ? 0 : &p.types[0],
+                        p.values.empty() ? 0 : &p.values[0],
+                        p.lengths.empty() ? 0 : &p.lengths[0],
+                        p.formats.empty() ? 0 : &p.formats[0],
+                        0);
+
+  return PQexecPrepared(pgc, i->second.c_str(), p.size(),
+                        p.values.empty() ? 0 : &p.values[0],
+                        p.lengths.empty() ? 0 : &p.lengths[0],
+                        p.formats.empty() ? 0 : &p.formats[0],
+                        0);
+}
+
+
 sql::exec::exec(sql::Connection &conn, const std::string &s)
   : m_conn(conn)
   , m_stmt(s)
@@ -75,11 +305,6 @@ sql::exec::~exec()
     delete m_txers.front();
     m_txers.pop_front();
   }
-
-  // Free allocated parameter strings
-  for (std::vector<char*>::iterator i = m_parms.begin();
-       i != m_parms.end(); ++i)
-    delete[] *i;
 }
 
 
@@ -94,14 +319,7 @@ bool sql::exec::execute()
 
   MTrace(t_sql, trace::Debug, "Executing \"" + m_stmt + "\"");
 
-  PGresult *pres = PQexecParams(m_conn.pgc,
-                                m_stmt.c_str(),
-                                m_parms.size(),
-                                0,
-                                m_parms.empty() ? 0 : &m_parms[0],
-                                0,
-                                0,
-                                0);
+  PGresult *pres = m_conn.execute(m_stmt, m_parms);
   if (!pres)
     throw error("Out of memory during db exec");
 
@@ -143,11 +361,6 @@ sql::query::~query()
     m_rxers.pop_front();
   }
 
-  // Free allocated parameter strings
-  for (std::vector<char*>::iterator i = m_parms.begin();
-       i != m_parms.end(); ++i)
-    delete[] *i;
-
   // Free result structure
   if (m_pgres)
     PQclear(m_pgres);
@@ -161,28 +374,12 @@ bool sql::query::fetch()
   MTrace(t_sql, trace::Debug, "Querying \"" + m_qstr + "\"");
 
   // If the query has not yet been executed, do so
-  if (!m_pgres) {
-    m_pgres = PQexecParams(m_conn.pgc,
-                           m_qstr.c_str(),
-                           m_parms.size(),
-                           0,
-                           m_parms.empty() ? 0 : &m_parms[0],
-                           0,
-                           0,
-                           0);
-
-    if (PQresultStatus(m_pgres) != PGRES_TUPLES_OK)
-      throw error("Query: \"" + m_qstr + "\" failed: "
-                  + PQresultErrorMessage(m_pgres));
-
-    // Good, we have the initial result.
-    m_crow = 0;
-    m_ccol = 0;
-  } else {
-    // Proceed to next row
-    ++m_crow;
-    m_ccol = 0;
-  }
+  if (!m_pgres)
+    result(m_conn.execute(m_qstr, m_parms));
+
+  // Proceed to next row
+  ++m_crow;
+  m_ccol = 0;
 
   const bool res = PQntuples(m_pgres) > m_crow;
 
@@ -195,6 +392,19 @@ bool sql::query::fetch()
   return res;
 }
 
+void sql::query::result(PGresult *pres)
+{
+  m_pgres = pres;
+  if (PQresultStatus(m_pgres) != PGRES_TUPLES_OK)
+    throw error("Query: \"" + m_qstr + "\" failed: "
+                + PQresultErrorMessage(m_pgres));
+
+  // Good, we have the initial result. The first fetch moves to the
+  // first row.
+  m_crow = -1;
+  m_ccol = 0;
+}
+
 sql::query &sql::query::fetchone()
 {
   if (!fetch())
@@ -207,6 +417,124 @@ sql::query &sql::query::fetchone()
 }
 
 
+sql::batch::batch(Connection &conn)
+  : m_conn(conn)
+{
+}
+
+sql::batch &sql::batch::add(query &q)
+{
+  if (&q.m_conn != &m_conn)
+    throw error("Batch query on another connection: " + q.m_qstr);
+  if (q.m_pgres)
+    throw error("Batch query already executed: " + q.m_qstr);
+  m_queries.push_back(&q);
+  return *this;
+}
+
+void sql::batch::execute()
+{
+  // We need a valid pgc pointer
+  m_conn.reconnect();
+
+#if defined(SQL_PIPELINE)
+  if (m_queries.size() > 1) {
+    PGconn *pgc = m_conn.pgc;
+    MTrace(t_sql, trace::Debug, "Pipelining " << m_queries.size()
+           << " queries");
+    // Until the results are read back and the connection is out of
+    // pipeline and non-blocking mode again, it is of no use to
+    // anyone else; whatever way we leave before that, we drop it. A
+    // new one will have none of our prepared statements.
+    ScopeGuard drop = MakeObjGuard(m_conn, &Connection::disconnect);
+    if (!PQenterPipelineMode(pgc) || PQsetnonblocking(pgc, 1))
+      throw error("Cannot pipeline batch: "
+                  + std::string(PQerrorMessage(pgc)));
+
+    // Send every query, preparing it first if it is new. The cache
+    // entries we make are removed again if the preparation fails.
+    std::vector<Connection::prepared_t::iterator>
+      fresh(m_queries.size(), m_conn.m_prepared.end());
+    bool sent = true;
+    for (size_t n = 0; sent && n != m_queries.size(); ++n) {
+      const query &q = *m_queries[n];
+      const params &p = q.m_parms;
+      MTrace(t_sql, trace::Debug, "Querying \"" + q.m_qstr + "\"");
+      bool prepare;
+      Connection::prepared_t::iterator i
+        = m_conn.cached(q.m_qstr, p, prepare);
+      if (prepare) {
+        fresh[n] = i;
+        sent = PQsendPrepare(pgc, i->second.c_str(), q.m_qstr.c_str(),
+                             p.size(), p.types.empty() ? 0 : &p.types[0]);
+      }
+      if (sent && i == m_conn.m_prepared.end())
+        sent = PQsendQueryParams(pgc, q.m_qstr.c_str(), p.size(),
+                                 p.types.empty() ? 0 : &p.types[0],
+                                 p.values.empty() ? 0 : &p.values[0],
+                                 p.lengths.empty() ? 0 : &p.lengths[0],
+                                 p.formats.empty() ? 0 : &p.formats[0],
+                                 0);
+      else if (sent)
+        sent = PQsendQueryPrepared(pgc, i->second.c_str(), p.size(),
+                                   p.values.empty() ? 0 : &p.values[0],
+                                   p.lengths.empty() ? 0 : &p.lengths[0],
+                                   p.formats.empty() ? 0 : &p.formats[0],
+                                   0);
+      sent = sent && flushPipeline(pgc);
+    }
+    sent = sent && PQpipelineSync(pgc) && flushPipeline(pgc);
+
+    // Read back the results, in the order we sent the commands
+    std::vector<std::string> failed(m_queries.size());
+    for (size_t n = 0; sent && n != m_queries.size(); ++n) {
+      query &q = *m_queries[n];
+      if (fresh[n] != m_conn.m_prepared.end()) {
+        PGresult *pres = nextResult(pgc);
+        ON_BLOCK_EXIT(PQclear, pres);
+        if (!pres) {
+          sent = false;
+        } else if (PQresultStatus(pres) != PGRES_COMMAND_OK) {
+          failed[n] = "Prepare: \"" + q.m_qstr + "\" failed: "
+            + PQresultErrorMessage(pres);
+          m_conn.m_prepared.erase(fresh[n]);
+        }
+      }
+      q.m_pgres = sent ? nextResult(pgc) : 0;
+      sent = q.m_pgres != 0;
+    }
+    if (sent) {
+      PGresult *pres = PQgetResult(pgc);
+      sent = PQresultStatus(pres) == PGRES_PIPELINE_SYNC;
+      PQclear(pres);
+    }
+
+    if (!sent)
+      throw error("Batch failed: " + std::string(PQerrorMessage(pgc)));
+    if (PQsetnonblocking(pgc, 0) || !PQexitPipelineMode(pgc))
+      throw error("Cannot leave pipeline mode: "
+                  + std::string(PQerrorMessage(pgc)));
+    drop.Dismiss();
+
+    // Report the first failure
+    for (size_t n = 0; n != m_queries.size(); ++n) {
+      if (!failed[n].empty())
+        throw error(failed[n]);
+      m_queries[n]->result(m_queries[n]->m_pgres);
+    }
+    return;
+  }
+#endif
+
+  // One query after the other
+  for (size_t n = 0; n != m_queries.size(); ++n) {
+    query &q = *m_queries[n];
+    MTrace(t_sql, trace::Debug, "Querying \"" + q.m_qstr + "\"");
+    q.result(m_conn.execute(q.m_qstr, q.m_parms));
+  }
+}
+
+
 sql::transaction::transaction(Connection &c)
   : m_conn(c)
   , m_com(false)
@@ -0,0 +1,180 @@
+///
+/// Implementation of the database connection pool
+///
+
+#include "pool.hh"
+#include "common/error.hh"
+
+#include <algorithm>
+
+namespace {
+  //! A connection idle for longer than this is checked with a round
+  //! trip to the server before it is leased out again
+  const DiffTime g_health_idle(DiffTime::iso("PT30S"));
+
+  //! The first and the longest delay after failing to connect
+  const DiffTime g_backoff_min(DiffTime::iso("PT0.1S"));
+  const DiffTime g_backoff_max(DiffTime::iso("PT30S"));
+}
+
+sql::Pool::stats_t::stats_t()
+  : size(0)
+  , open(0)
+  , leased(0)
+  , waiting(0)
+  , leases(0)
+  , waits(0)
+  , reconnects(0)
+  , failures(0)
+{
+}
+
+sql::Pool::Pool(const std::string &connstr, size_t size)
+  : m_free(size)
+  , m_retry(Time::BEGINNING_OF_TIME)
+{
+  if (!size)
+    throw error("Connection pool must hold at least one connection");
+  m_stats.size = size;
+  m_all.push_back(new Connection(connstr));
+  m_idle.push_back(std::make_pair(m_all.back(), Time::now()));
+  m_stats.open = 1;
+}
+
+sql::Pool::~Pool()
+{
+  for (std::vector<Connection*>::iterator i = m_all.begin();
+       i != m_all.end(); ++i)
+    delete *i;
+}
+
+sql::Pool::stats_t sql::Pool::stats()
+{
+  MutexLock l(m_lock);
+  return m_stats;
+}
+
+sql::Connection *sql::Pool::acquire()
+{
+  const Time start(Time::now());
+  { MutexLock l(m_lock);
+    ++m_stats.waiting;
+  }
+  m_free.decrement();
+  const DiffTime waited(Time::now() - start);
+
+  Connection *conn;
+  Time idle;
+  { MutexLock l(m_lock);
+    --m_stats.waiting;
+    ++m_stats.leased;
+    ++m_stats.leases;
+    if (waited > DiffTime::MSEC) {
+      ++m_stats.waits;
+      m_stats.waited += waited;
+      m_stats.maxwait = std::max(m_stats.maxwait, waited);
+    }
+    if (m_idle.empty()) {
+      // Not yet connected - our connect check does that
+      m_all.push_back(new Connection(*m_all.front()));
+      m_stats.open = m_all.size();
+      conn = m_all.back();
+      idle = Time::now();
+    } else {
+      // Take the most recently used; it is the most likely to be good
+      conn = m_idle.back().first;
+      idle = m_idle.back().second;
+      m_idle.pop_back();
+    }
+  }
+
+  try {
+    check(*conn, idle);
+  } catch (...) {
+    release(conn);
+    throw;
+  }
+  return conn;
+}
+
+void sql::Pool::release(Connection *conn)
+{
+  { MutexLock l(m_lock);
+    m_idle.push_back(std::make_pair(conn, Time::now()));
+    --m_stats.leased;
+  }
+  m_free.increment();
+}
+
+void sql::Pool::check(Connection &conn, const Time &idle)
+{
+  // The server may have dropped a connection that sat idle without us
+  // noticing. If the round trip fails, the connection is no longer
+  // good and we reconnect it below.
+  if (conn.connected() && Time::now() - idle > g_health_idle) {
+    try {
+      query(conn, "SELECT 1").fetch();
+    } catch (error &e) {
+      MTrace(t_sql, trace::Info, "Idle connection failed: " << e.toString());
+    }
+  }
+  if (conn.connected())
+    return;
+
+  { MutexLock l(m_lock);
+    if (Time::now() < m_retry)
+      throw error("Database unavailable - backing off after failed "
+                  "reconnect");
+  }
+
+  try {
+    conn.reconnect();
+  } catch (error &e) {
+    MutexLock l(m_lock);
+    ++m_stats.failures;
+    m_backoff = m_backoff == DiffTime()
+      ? g_backoff_min : std::min(m_backoff * 2, g_backoff_max);
+    m_retry = Time::now() + m_backoff;
+    MTrace(t_sql, trace::Warn, "Reconnect failed, retrying in "
+           << m_backoff.to_double() << "s: " << e.toString());
+    throw;
+  }
+
+  MutexLock l(m_lock);
+  ++m_stats.reconnects;
+  m_backoff = DiffTime();
+  m_retry = Time::BEGINNING_OF_TIME;
+}
+
+
+sql::Pool::Lease::Lease(Pool &pool)
+  : m_pool(pool)
+  , m_conn(0)
+{
+}
+
+sql::Pool::Lease::Lease(const Lease &o)
+  : m_pool(o.m_pool)
+  , m_conn(0)
+{
+}
+
+sql::Pool::Lease::~Lease()
+{
+  release();
+}
+
+sql::Connection &sql::Pool::Lease::get()
+{
+  if (!m_conn)
+    m_conn = m_pool.acquire();
+  return *m_conn;
+}
+
+void sql::Pool::Lease::release()
+{
+  if (!m_conn)
+    return;
+  m_pool.release(m_conn);
+  m_conn = 0;
+}
@@ -0,0 +1,104 @@
+///
+/// A bounded pool of database connections
+///
+/// Threads lease a connection for as long as they need one - a
+/// request or a transaction - instead of each owning one, so that the
+/// number of threads does not dictate the number of database
+/// backends.
+///
+
+#ifndef SQL_POOL_HH
+#define SQL_POOL_HH
+
+#include "sql.hh"
+#include "common/mutex.hh"
+#include "common/semaphore.hh"
+#include "common/time.hh"
+
+#include <vector>
+
+namespace sql {
+
+  class Pool {
+  public:
+    /// Set up a pool of at most the given number of connections. One
+    /// connection is made right away - throws if that fails; the rest
+    /// are made as they are needed.
+    Pool(const std::string &connstr, size_t size);
+
+    /// There must be no leases outstanding
+    ~Pool();
+
+    /// A connection leased from the pool. It is taken from the pool
+    /// on first use and returned on release() or destruction.
+    class Lease {
+    public:
+      Lease(Pool &);
+      Lease(const Lease &);
+      ~Lease();
+
+      /// Our connection. Waits for one if all are leased; throws if
+      /// the database cannot be reached.
+      Connection &get();
+
+      /// Return our connection, if we hold one. No query, exec or
+      /// transaction on it may be in use.
+      void release();
+
+    private:
+      Lease &operator=(const Lease &);
+      Pool &m_pool;
+      Connection *m_conn;
+    };
+
+    /// Pool utilisation
+    struct stats_t {
+      stats_t();
+      size_t size;
+      /// Connections made, leased now and threads waiting for one
+      size_t open;
+      size_t leased;
+      size_t waiting;
+      /// Leases, and how many of them had to wait and for how long
+      uint64_t leases;
+      uint64_t waits;
+      DiffTime waited;
+      DiffTime maxwait;
+      /// Connections (re-)established, and failed attempts
+      uint64_t reconnects;
+      uint64_t failures;
+    };
+    stats_t stats();
+
+  private:
+    Pool(const Pool &);
+    Pool &operator=(const Pool &);
+
+    /// Take an idle connection, checking its health, or make one
+    Connection *acquire();
+    void release(Connection *);
+
+    /// Make sure the connection is good; reconnects it unless we are
+    /// backing off after a failed attempt
+    void check(Connection &, const Time &idle);
+
+    /// Counts the connections not leased
+    Semaphore m_free;
+
+    /// Protects everything below
+    Mutex m_lock;
+    /// Every connection made, and the idle ones with the time they
+    /// were returned
+    std::vector<Connection*> m_all;
+    std::vector<std::pair<Connection*,Time> > m_idle;
+    /// After a failed connection attempt we fail leases rather than
+    /// try again until this time, and double the delay on every
+    /// further failure
+    Time m_retry;
+    DiffTime m_backoff;
+    stats_t m_stats;
+  };
+
+}
+
+#endif
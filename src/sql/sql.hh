@@ -12,11 +12,13 @@
 #include "common/partial.hh"
 #include "common/trace.hh"
 #include "common/optional.hh"
+#include "common/time.hh"
 
 #include <string>
 #include <string.h>
 #include <vector>
 #include <list>
+#include <map>
 
 #include <libpq-fe.h>
 
@@ -27,6 +29,48 @@ namespace sql {
 
   class query;
   class exec;
+  class batch;
+
+  /// Statement parameters, as libpq takes them
+  class params {
+  public:
+    ~params();
+
+    /// Add a null
+    void null();
+
+    /// Add a parameter in text format, of a type the server infers
+    void text(const std::string &);
+
+    /// Add a parameter in binary format, of the given type
+    void binary(Oid type, const char *data, int len);
+
+    /// Add a bigint, or a timestamp (whole seconds), in binary format
+    void int8(int64_t);
+    void timestamp(const Time &);
+
+    size_t size() const { return values.size(); }
+
+    std::vector<char*> values;
+    std::vector<int> lengths;
+    std::vector<int> formats;
+    std::vector<Oid> types;
+  };
+
+  /// Add a parameter. Integers and time stamps are passed in binary;
+  /// anything else that can be written to a stream is passed as
+  /// text.
+  template <typename V>
+  void addParam(params &, const V &);
+  void addParam(params &, short);
+  void addParam(params &, unsigned short);
+  void addParam(params &, int);
+  void addParam(params &, unsigned int);
+  void addParam(params &, long);
+  void addParam(params &, unsigned long);
+  void addParam(params &, long long);
+  void addParam(params &, unsigned long long);
+  void addParam(params &, const Time &);
 
   /// SQL Connection
   class Connection {
@@ -43,6 +87,10 @@ namespace sql {
     /// object (and throws if this cannot be accomplished)
     void reconnect();
 
+    /// Whether we hold a connection that is good as far as we know,
+    /// without asking the server
+    bool connected() const;
+
     /// Copy construction - we copy the connection string but not the
     /// connection.
     Connection(const Connection &);
@@ -51,14 +99,38 @@ namespace sql {
     /// Protect from assignment
     Connection &operator=(const Connection&);
 
+    /// Drop the connection, if we hold one - for when it was left in
+    /// a state we cannot use. The next reconnect() makes a new one.
+    void disconnect();
+
     /// psql connection object - it is accessed directly by the query
     /// and exec classes.
     PGconn *pgc;
     friend class query;
     friend class exec;
+    friend class batch;
 
     /// Our connection string
     const std::string m_connstr;
+
+    /// Statements prepared on this connection; their names by their
+    /// text and parameter types. Forgotten when we reconnect.
+    typedef std::map<std::string,std::string> prepared_t;
+    prepared_t m_prepared;
+
+    /// Statements named so far on this connection
+    size_t m_named;
+
+    /// Our cache entry for a statement, or m_prepared.end() if it is
+    /// not cached and there is no room for it. A new entry is named
+    /// but the caller must prepare the statement - and erase the
+    /// entry if that fails.
+    prepared_t::iterator cached(const std::string &stmt, const params &,
+                                bool &fresh);
+
+    /// Execute a statement, preparing it the first time we see it.
+    /// Returns the result, which the caller must clear.
+    PGresult *execute(const std::string &stmt, const params &);
   };
 
   /// An SQL query
@@ -102,6 +174,8 @@ namespace sql {
     query &receiver(V &);
 
   private:
+    friend class batch;
+
     /// Our connection
     Connection &m_conn;
 
@@ -109,11 +183,14 @@ namespace sql {
     const std::string m_qstr;
 
     /// The parameters
-    std::vector<char*> m_parms;
+    params m_parms;
 
     /// Our result data
     PGresult *m_pgres;
 
+    /// Take the result of our query - throws if it failed
+    void result(PGresult *);
+
     /// Current result row
     int m_crow;
 
@@ -166,7 +243,7 @@ namespace sql {
     const std::string m_stmt;
 
     /// The parameters
-    std::vector<char*> m_parms;
+    params m_parms;
 
     /// If the user set up sender variables, we may have a list of
     /// those.
@@ -177,6 +254,30 @@ namespace sql {
     size_t m_affected_rows;
   };
 
+  /// A batch of queries that do not depend on each other. They are
+  /// sent to the server together and their results read back in one
+  /// round trip, where libpq supports pipelining; otherwise they are
+  /// run one after the other. Rows are fetched from the queries as
+  /// usual once the batch is executed.
+  class batch {
+  public:
+    /// Set up a batch on the connection of its queries
+    batch(Connection &);
+
+    /// Add a query with its parameters set
+    batch &add(query &);
+
+    /// Run the queries. Throws on the first that failed.
+    void execute();
+
+  private:
+    /// Our connection
+    Connection &m_conn;
+
+    /// The queries, in order
+    std::vector<query*> m_queries;
+  };
+
   /// A transaction. Aborts on destruction if not committed.
   class transaction {
   public:
@@ -196,28 +297,27 @@ namespace sql {
     bool m_com;
   };
 
+  template <typename V>
+  void addParam(params &p, const V &v)
+  {
+    std::ostringstream str;
+    str << v;
+    p.text(str.str());
+  }
+
   template <typename V>
   exec &exec::add(const Optional<V>& v)
   {
     if (v.isSet())
       return add(v.get());
-    m_parms.push_back(0);
+    m_parms.null();
     return *this;
   }
 
   template <typename V>
   exec &exec::add(const V& v)
   {
-    std::ostringstream str;
-    str << v;
-    // Validate that this is UTF-8
-    validateUTF8(str.str());
-    // Copy the string to a zero-terminated char array
-    const size_t s = str.str().size();
-    char *nstr = new char[s + 1];
-    memcpy(nstr, str.str().c_str(), s);
-    nstr[s] = 0;
-    m_parms.push_back(nstr);
+    addParam(m_parms, v);
     return *this;
   }
 
@@ -232,16 +332,7 @@ namespace sql {
   template <typename V>
   query &query::add(const V& v)
   {
-    std::ostringstream str;
-    str << v;
-    // Validate that this is UTF-8
-    validateUTF8(str.str());
-    // Copy the string to a zero-terminated char array
-    const size_t s = str.str().size();
-    char *nstr = new char[s + 1];
-    memcpy(nstr, str.str().c_str(), s);
-    nstr[s] = 0;
-    m_parms.push_back(nstr);
+    addParam(m_parms, v);
     return *this;
   }
 
@@ -250,7 +341,7 @@ namespace sql {
   {
     if (v.isSet())
       return add(v.get());
-    m_parms.push_back(0);
+    m_parms.null();
     return *this;
   }
 
@@ -0,0 +1,124 @@
+//
+// Benchmark for the FSCache engines
+//
+// Fills a cache with N synthetic objects (default 10M, or the first
+// argument) and measures inserts per second and random lookups per
+// second for the SQLite and the memory mapped engine, as well as the
+// time it takes to migrate the SQLite cache into the mmap engine.
+//
+// Usage: fscache_bench [count] [directory]
+//
+
+#include "backup/metatree.hh"
+#include "common/error.hh"
+#include "common/time.hh"
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <stdlib.h>
+#include <stdio.h>
+
+namespace {
+
+  /// Random lookups per measurement
+  const uint64_t g_lookups = 1000000;
+
+  CObject mkObj(uint64_t n)
+  {
+    CObject obj;
+    obj.m_id.device = 2049;
+    obj.m_id.fileid = n + 1;
+#if defined(__unix__) || defined(__APPLE__)
+    obj.m_id.ctime_s = 1400000000 + n;
+    obj.m_id.ctime_ns = uint32_t(n % 1000000000);
+    obj.m_id.mtime_s = 1400000000 + n;
+    obj.m_id.mtime_ns = uint32_t(n % 1000000000);
+#endif
+    obj.m_hash.push_back(sha256::hash(std::string(reinterpret_cast<const char*>(&n),
+                                                  sizeof n)));
+    obj.m_treesize = n;
+    return obj;
+  }
+
+  uint64_t rnd(uint64_t max)
+  {
+    return ((uint64_t(rand()) << 31) ^ uint64_t(rand())) % max;
+  }
+
+  void report(const std::string &what, uint64_t n, const Time &start)
+  {
+    const double secs = (Time::now() - start).to_double();
+    std::cout << std::setw(24) << what
+              << std::setw(12) << std::fixed << std::setprecision(2) << secs
+              << " s" << std::setw(14) << std::setprecision(0) << n / secs
+              << " /s" << std::endl;
+  }
+
+  void bench(const std::string &name, FSCache &cache, uint64_t count,
+             bool fill)
+  {
+    if (fill) {
+      const Time start = Time::now();
+      for (uint64_t i = 0; i != count; ++i)
+        cache.insert(mkObj(i));
+      cache.flush();
+      report(name + " insert", count, start);
+    }
+
+    srand(42);
+    uint64_t misses = 0;
+    const Time start = Time::now();
+    for (uint64_t i = 0; i != g_lookups; ++i) {
+      const CObject ref = mkObj(rnd(count));
+      CObject obj;
+      if (!cache.readObj(ref.m_id, obj) || obj.m_treesize != ref.m_treesize)
+        ++misses;
+    }
+    report(name + " lookup", g_lookups, start);
+    if (misses)
+      throw error("Lookups missed objects in " + name + " cache");
+  }
+
+}
+
+int main(int argc, char **argv) try
+{
+  const uint64_t count = argc > 1 ? strtoull(argv[1], 0, 10) : 10000000;
+  const std::string dir = argc > 2 ? argv[2] : ".";
+  const std::string fname = dir + "/fscache_bench.db";
+  if (!count)
+    throw error("Need a positive object count");
+
+  remove(fname.c_str());
+  remove((fname + ".mmap.idx").c_str());
+  remove((fname + ".mmap.arena").c_str());
+
+  std::cout << count << " objects" << std::endl;
+
+  { FSCache cache(fname, FSCache::E_SQLite);
+    bench("sqlite", cache, count, true);
+  }
+
+  { const Time start = Time::now();
+    FSCache cache(fname, FSCache::E_MMap);
+    report("mmap migrate", count, start);
+    bench("mmap (migrated)", cache, count, false);
+  }
+
+  remove((fname + ".mmap.idx").c_str());
+  remove((fname + ".mmap.arena").c_str());
+  { FSCache cache(fname + ".fresh", FSCache::E_MMap);
+    bench("mmap", cache, count, true);
+  }
+
+  remove(fname.c_str());
+  remove((fname + "-wal").c_str());
+  remove((fname + "-shm").c_str());
+  remove((fname + ".fresh.mmap.idx").c_str());
+  remove((fname + ".fresh.mmap.arena").c_str());
+  return 0;
+} catch (error &e) {
+  std::cerr << e.toString() << std::endl;
+  return 1;
+}
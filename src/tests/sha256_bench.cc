@@ -0,0 +1,183 @@
+//
+// Microbenchmark for the SHA-256 engines
+//
+// Compares the platform library one-shot hash (what sha256::hash
+// used to do) against each engine available on this CPU, for single
+// streams and for batches of independent objects, across object
+// sizes. Every engine is verified against the library first.
+//
+
+#include "common/error.hh"
+#include "common/time.hh"
+#include "common/sha256engine.hh"
+
+#if defined(__unix__) || defined(_WIN32)
+# include <openssl/evp.h>
+#endif
+
+#if defined(__APPLE__)
+# include <CommonCrypto/CommonDigest.h>
+#endif
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <iomanip>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+  /// Object sizes: small directory objects up to full data chunks
+  const size_t g_sizes[] = { 64, 256, 1024, 4096, 65536, 1048576, 8388608 };
+
+  /// Bytes to hash per measurement
+  const uint64_t g_volume = 256 * 1048576;
+
+  void libraryDigest(const uint8_t *data, size_t len, uint8_t *digest)
+  {
+    uint8_t dummy;
+#if defined(__unix__) || defined(_WIN32)
+    if (!EVP_Digest(len ? data : &dummy, len, digest, 0, EVP_sha256(), 0))
+      throw error("EVP_Digest failed");
+#endif
+#if defined(__APPLE__)
+    CC_SHA256(len ? data : &dummy, CC_LONG(len), digest);
+#endif
+  }
+
+  /// Verify that the configured engine agrees with the library on a
+  /// range of lengths around the padding boundaries
+  void verify(const std::vector<uint8_t> &buf)
+  {
+    std::vector<const uint8_t*> ptrs;
+    std::vector<size_t> lens;
+    for (size_t len = 0; len != 300; ++len) {
+      ptrs.push_back(&buf[len]);
+      lens.push_back(len);
+    }
+    std::vector<uint8_t> out(ptrs.size() * 32);
+    SHA256Context::batch(ptrs.size(), &ptrs[0], &lens[0],
+                         reinterpret_cast<uint8_t(*)[32]>(&out[0]));
+
+    for (size_t i = 0; i != ptrs.size(); ++i) {
+      uint8_t ref[32], one[32], streamed[32];
+      libraryDigest(ptrs[i], lens[i], ref);
+      SHA256Context::digest(ptrs[i], lens[i], one);
+      // Feed the stream in odd-sized pieces
+      SHA256Context ctx;
+      for (size_t o = 0; o < lens[i]; o += 7)
+        ctx.update(ptrs[i] + o, std::min(size_t(7), lens[i] - o));
+      ctx.final(streamed);
+      if (memcmp(ref, one, 32) || memcmp(ref, streamed, 32)
+          || memcmp(ref, &out[i * 32], 32))
+      {
+        std::ostringstream msg;
+        msg << SHA256Context::name(SHA256Context::streamEngine())
+            << " engine disagrees with library at length " << lens[i];
+        throw error(msg.str());
+      }
+    }
+  }
+
+  double mbps(uint64_t bytes, const Time &start)
+  {
+    return double(bytes) / 1048576 / (Time::now() - start).to_double();
+  }
+
+  double benchLibrary(const std::vector<uint8_t> &buf, size_t size)
+  {
+    uint8_t digest[32];
+    const Time start = Time::now();
+    uint64_t done = 0;
+    for (; done < g_volume; done += size)
+      libraryDigest(&buf[0], size, digest);
+    return mbps(done, start);
+  }
+
+  double benchStream(const std::vector<uint8_t> &buf, size_t size)
+  {
+    uint8_t digest[32];
+    const Time start = Time::now();
+    uint64_t done = 0;
+    for (; done < g_volume; done += size) {
+      SHA256Context ctx;
+      ctx.update(&buf[0], size).final(digest);
+    }
+    return mbps(done, start);
+  }
+
+  double benchBatch(const std::vector<uint8_t> &buf, size_t size)
+  {
+    // Batches of 64 objects, like the LoM parts of a directory
+    const size_t n = std::min(size_t(64), buf.size() / size);
+    std::vector<const uint8_t*> ptrs(n);
+    std::vector<size_t> lens(n, size);
+    for (size_t i = 0; i != n; ++i)
+      ptrs[i] = &buf[i * size];
+    std::vector<uint8_t> out(n * 32);
+
+    const Time start = Time::now();
+    uint64_t done = 0;
+    for (; done < g_volume; done += n * size)
+      SHA256Context::batch(n, &ptrs[0], &lens[0],
+                           reinterpret_cast<uint8_t(*)[32]>(&out[0]));
+    return mbps(done, start);
+  }
+
+}
+
+int main(int, char **) try
+{
+  // Enough for a batch of 64 of the largest objects we batch
+  std::vector<uint8_t> buf(64 * 1048576);
+  srand(42);
+  for (size_t i = 0; i != buf.size(); ++i)
+    buf[i] = uint8_t(rand());
+
+  std::cout << "Auto-selected: stream "
+            << SHA256Context::name(SHA256Context::streamEngine())
+            << ", batch "
+            << SHA256Context::name(SHA256Context::batchEngine())
+            << std::endl;
+
+  const SHA256Context::engine_t engines[] = {
+    SHA256Context::E_Generic, SHA256Context::E_SHANI, SHA256Context::E_AVX2
+  };
+
+  std::cout << std::setw(10) << "size"
+            << std::setw(12) << "library";
+  for (size_t e = 0; e != sizeof engines / sizeof engines[0]; ++e)
+    if (SHA256Context::available(engines[e]))
+      std::cout << std::setw(10) << SHA256Context::name(engines[e])
+                << std::setw(8) << "batch";
+  std::cout << "   (MiB/s)" << std::endl;
+
+  for (size_t e = 0; e != sizeof engines / sizeof engines[0]; ++e)
+    if (SHA256Context::available(engines[e])) {
+      SHA256Context::force(engines[e]);
+      verify(buf);
+    }
+
+  for (size_t s = 0; s != sizeof g_sizes / sizeof g_sizes[0]; ++s) {
+    const size_t size = g_sizes[s];
+    std::cout << std::setw(10) << size
+              << std::setw(12) << std::fixed << std::setprecision(0)
+              << benchLibrary(buf, size);
+    for (size_t e = 0; e != sizeof engines / sizeof engines[0]; ++e) {
+      if (!SHA256Context::available(engines[e]))
+        continue;
+      SHA256Context::force(engines[e]);
+      std::cout << std::setw(10) << benchStream(buf, size)
+                << std::setw(8) << benchBatch(buf, size);
+    }
+    std::cout << std::endl;
+  }
+  SHA256Context::autoSelect();
+
+  return 0;
+} catch (error &e) {
+  std::cerr << e.toString() << std::endl;
+  return 1;
+}
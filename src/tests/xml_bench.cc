@@ -0,0 +1,154 @@
+//
+// Microbenchmark for the XML parser
+//
+// Parses synthetic /devices/{id}/history and /devices documents, as
+// the proxy sends them, with the lexer reading the document in place
+// and through a stream, and reports documents and megabytes per
+// second.
+//
+// Usage: xml_bench [entries] [rounds]
+//
+
+#include "xml/xmlio.hh"
+#include "common/error.hh"
+#include "common/partial.hh"
+#include "common/time.hh"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <stdlib.h>
+
+namespace {
+
+  std::string mkHistory(size_t n)
+  {
+    std::ostringstream doc;
+    doc << "<history>";
+    for (size_t i = 0; i != n; ++i) {
+      doc << "<backup><tstamp>2014-03-" << std::setw(2) << std::setfill('0')
+          << 1 + i % 28 << "T12:" << std::setw(2) << i % 60
+          << ":00Z</tstamp><root>";
+      for (size_t h = 0; h != 8; ++h)
+        doc << std::hex << std::setw(8) << uint32_t(i * 2654435761u + h)
+            << std::dec;
+      doc << "</root><type>" << (i % 10 ? 'p' : 'c') << "</type></backup>";
+    }
+    doc << "</history>";
+    return doc.str();
+  }
+
+  std::string mkDevices(size_t n)
+  {
+    std::ostringstream doc;
+    doc << "<devices>";
+    for (size_t i = 0; i != n; ++i)
+      doc << "<pc><guid>" << std::hex << std::setw(16) << std::setfill('0')
+          << i * 11400714819323198485ull << std::dec
+          << "</guid><name>Workstation " << i
+          << " &amp; laptop</name></pc>";
+    for (size_t i = 0; i != n / 10; ++i)
+      doc << "<cloud><guid>" << std::hex << std::setw(16) << std::setfill('0')
+          << i * 11400714819323198485ull << std::dec
+          << "</guid><name>Mail " << i << "</name><type>imap</type>"
+          << "<uri>imaps://mail.example.com:993/</uri>"
+          << "<login>user" << i << "@example.com</login>"
+          << "<password>s3cr&lt;t</password></cloud>";
+    doc << "</devices>";
+    return doc.str();
+  }
+
+  void report(const std::string &what, size_t rounds, size_t bytes,
+              const Time &start)
+  {
+    const double secs = (Time::now() - start).to_double();
+    std::cout << std::setw(24) << what
+              << std::setw(12) << std::fixed << std::setprecision(0)
+              << rounds / secs << " docs/s"
+              << std::setw(10) << std::setprecision(1)
+              << rounds * double(bytes) / secs / 1048576 << " MB/s"
+              << std::endl;
+  }
+
+  size_t g_count;
+
+  bool counted()
+  {
+    ++g_count;
+    return true;
+  }
+
+  void bench(const std::string &name, const xml::IDocument &doc,
+             const std::string &data, size_t entries, size_t rounds)
+  {
+    g_count = 0;
+    Time start = Time::now();
+    for (size_t r = 0; r != rounds; ++r) {
+      xml::XMLexer lexer(data);
+      doc.process(lexer);
+    }
+    report(name + " in place", rounds, data.size(), start);
+
+    start = Time::now();
+    for (size_t r = 0; r != rounds; ++r) {
+      std::istringstream s(data);
+      xml::XMLexer lexer(s);
+      doc.process(lexer);
+    }
+    report(name + " stream", rounds, data.size(), start);
+
+    if (g_count != 2 * rounds * entries)
+      throw error("Parsed the wrong number of " + name + " entries");
+  }
+
+}
+
+int main(int argc, char **argv) try
+{
+  const size_t entries = argc > 1 ? strtoul(argv[1], 0, 10) : 1000;
+  const size_t rounds = argc > 2 ? strtoul(argv[2], 0, 10) : 200;
+  if (!entries || !rounds)
+    throw error("Need positive entry and round counts");
+
+  std::string tstamp, root, type, guid, name, uri, login, password;
+  using namespace xml;
+
+  const std::string history(mkHistory(entries));
+  const IDocument &hdoc
+    = mkDoc(Element("history")
+            (*Element("backup")
+             (Element("tstamp")(CharData<std::string>(tstamp))
+              & Element("type")(CharData<std::string>(type))
+              & Element("root")(CharData<std::string>(root)))
+             [ papply(&counted) ]));
+  std::cout << entries << " history entries, " << history.size()
+            << " bytes" << std::endl;
+  bench("history", hdoc, history, entries, rounds);
+
+  const std::string devices(mkDevices(entries));
+  const IDocument &ddoc
+    = mkDoc(Element("devices")
+            (*Element("pc")
+             (Element("guid")(CharData<std::string>(guid))
+              & Element("name")(CharData<std::string>(name)))
+             [ papply(&counted) ]
+             & *Element("cloud")
+             (Element("guid")(CharData<std::string>(guid))
+              & Element("name")(CharData<std::string>(name))
+              & Element("type")(CharData<std::string>(type))
+              & Element("uri")(CharData<std::string>(uri))
+              & Element("login")(CharData<std::string>(login))
+              & Element("password")(CharData<std::string>(password)))
+             [ papply(&counted) ]));
+  std::cout << entries << " + " << entries / 10 << " devices, "
+            << devices.size() << " bytes" << std::endl;
+  bench("devices", ddoc, devices, entries + entries / 10, rounds);
+
+  if (entries >= 10 && password != "s3cr<t")
+    throw error("Parsed wrong device data");
+  return 0;
+} catch (error &e) {
+  std::cerr << e.toString() << std::endl;
+  return 1;
+}
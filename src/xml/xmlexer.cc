@@ -8,145 +8,171 @@
 #include "common/error.hh"
 #include <cstdio>
 #include <sstream>
+#include <iterator>
+#include <algorithm>
+#include <string.h>
 
-xml::XMLexer::XMLexer(std::istream& input_)
-  : input(input_), deepest_backup(0)
+xml::XMLexer::XMLexer(std::istream& input)
+  : begin(0), end(0), pos(0), npending(0)
 {
   if (!input.good())
     throw error("No input data for XML lexer");
+  own.assign(std::istreambuf_iterator<char>(input),
+             std::istreambuf_iterator<char>());
+  begin = pos = own.data();
+  end = begin + own.size();
+}
+
+xml::XMLexer::XMLexer(const std::string& input)
+  : begin(input.data()), end(input.data() + input.size())
+  , pos(begin), npending(0)
+{
+}
+
+xml::XMLexer::XMLexer(const std::vector<uint8_t>& input)
+  : begin(0), end(0), pos(0), npending(0)
+{
+  if (!input.empty()) {
+    begin = pos = reinterpret_cast<const char*>(&input[0]);
+    end = begin + input.size();
+  }
 }
 
 
 std::string xml::XMLexer::getCurrentContext() const
 {
   std::string con;
-  // Now read some characters... If we read too much, an error will be
-  // thrown from getRaw - we catch that and ignore it.
-  try {
-    while (con.size() < 256)
-      con += getRaw();
-  } catch (error&) {
-    // Nothing.
-  }
+  for (unsigned i = npending; i; --i)
+    con.push_back(pending[i - 1]);
+  con.append(pos, std::min(end, pos + 256));
   return con;
 }
 
 char xml::XMLexer::getRaw() const
 {
-  // Read character
-  char c;
-  input.get(c);
-  // Make sure stream is still ok
-  if (!input.good())
+  if (npending)
+    return pending[--npending];
+  if (pos == end)
     throw error("Unexpected end of XML input");
-  if (deepest_backup)
-    deepest_backup->addData(c);
-  return c;
+  return *pos++;
 }
 
 char xml::XMLexer::get() const
 {
   char c = getRaw();
-  if (c ==  '&') {
-    // We need to un-escape this. It can either be a direct character
-    // reference on the form &#38; or it can be an entity on the form
-    // &amp;
-    std::string ent;
-    for (char nc = getRaw(); nc != ';'; nc = getRaw())
-      ent.push_back(nc);
-    // Good, we now have everything up until the ';' in ent, and we
-    // have consumed the ';' and thrown it away.
-    if (ent.size() > 1 && ent[0] == '#') {
-      // Good, this is a character reference!
-      unsigned codepoint;
-      if (ent[1] == 'x') {
-        // Hexadecimal
-        std::istringstream rd(ent.substr(2));
-        rd >> std::hex >> codepoint;
-        if (rd.fail())
-          throw error("Cannot parse hex codepoint: \"" + ent + "\"");
-      } else if (ent[1] >= '0' && ent[1] <= '9') {
-        // Decimal
-        std::istringstream rd(ent.substr(1));
-        rd >> codepoint;
-        if (rd.fail())
-          throw error("Cannot parse decimal codepoint: \"" + ent + "\"");
-      } else {
-        // Nothing!
-        throw error("Unable to parse character reference: \"" + ent + "\"");
-      }
-      // Now we need to take this potentially multi-byte character and
-      // push everything except from the first byte back onto the
-      // input stream. That way subsequent get calls will read the
-      // remaining bytes.
-      if (codepoint < 0x80) {
-        // One byte
-        return codepoint;
-      } else if (codepoint < 0x800) {
-        // Two byte
-        // First byte (to return) holds: 110yyyxx
-        // Second byte (to push) holds:  10xxxxxx
-        const uint8_t second = 0x80 | (codepoint & 0x3F);
-        const uint8_t first = 0xC0 | (codepoint >> 6);
-        input.putback(second);
-        return first;
-      } else if (codepoint < 0x10000) {
-        // Three byte
-        // First byte (to return) holds: 1110yyyy
-        // Second byte (to push) holds:  10yyyyxx
-        // Third byte (to push) holds:   10xxxxxx
-        const uint8_t third = 0x80 | (codepoint & 0x3F);
-        const uint8_t second = 0x80 | ((codepoint >> 6) & 0x3F);
-        const uint8_t first = 0xE0 | (codepoint >> 12);
-        input.putback(third);
-        input.putback(second);
-        return first;
-      } else if (codepoint < 0x110000) {
-        // Four byte
-        // First byte (to return) holds: 11110zzz
-        // Second byte (to push) holds:  10zzyyyy
-        // Third byte (to push) holds:   10yyyyxx
-        // Fourth byte (to push) holds:  10xxxxxx
-        const uint8_t fourth = 0x80 | (codepoint & 0x3F);
-        const uint8_t third = 0x80 | ((codepoint >> 6) & 0x3F);
-        const uint8_t second = 0x80 | ((codepoint >> 12) & 0x3F);
-        const uint8_t first = 0xE0 | (codepoint >> 18);
-        input.putback(fourth);
-        input.putback(third);
-        input.putback(second);
-        return first;
-      } else {
-        // Not a valid unicode codepoint
-        throw error("Code point out of range");
-      }
+  if (c ==  '&')
+    return getReference();
+  // Ok, no escape needed then.
+  return c;
+}
 
+char xml::XMLexer::getReference() const
+{
+  // We need to un-escape this. It can either be a direct character
+  // reference on the form &#38; or it can be an entity on the form
+  // &amp;
+  std::string ent;
+  for (char nc = getRaw(); nc != ';'; nc = getRaw())
+    ent.push_back(nc);
+  // Good, we now have everything up until the ';' in ent, and we
+  // have consumed the ';' and thrown it away.
+  if (ent.size() > 1 && ent[0] == '#') {
+    // Good, this is a character reference!
+    unsigned codepoint;
+    if (ent[1] == 'x') {
+      // Hexadecimal
+      std::istringstream rd(ent.substr(2));
+      rd >> std::hex >> codepoint;
+      if (rd.fail())
+        throw error("Cannot parse hex codepoint: \"" + ent + "\"");
+    } else if (ent[1] >= '0' && ent[1] <= '9') {
+      // Decimal
+      std::istringstream rd(ent.substr(1));
+      rd >> codepoint;
+      if (rd.fail())
+        throw error("Cannot parse decimal codepoint: \"" + ent + "\"");
+    } else {
+      // Nothing!
+      throw error("Unable to parse character reference: \"" + ent + "\"");
+    }
+    // Now we need to take this potentially multi-byte character and
+    // keep everything except from the first byte pending. That way
+    // subsequent get calls will read the remaining bytes.
+    if (codepoint < 0x80) {
+      // One byte
+      return codepoint;
+    } else if (codepoint < 0x800) {
+      // Two byte
+      // First byte (to return) holds: 110yyyxx
+      // Second byte (to push) holds:  10xxxxxx
+      const uint8_t second = 0x80 | (codepoint & 0x3F);
+      const uint8_t first = 0xC0 | (codepoint >> 6);
+      pending[0] = second;
+      npending = 1;
+      return first;
+    } else if (codepoint < 0x10000) {
+      // Three byte
+      // First byte (to return) holds: 1110yyyy
+      // Second byte (to push) holds:  10yyyyxx
+      // Third byte (to push) holds:   10xxxxxx
+      const uint8_t third = 0x80 | (codepoint & 0x3F);
+      const uint8_t second = 0x80 | ((codepoint >> 6) & 0x3F);
+      const uint8_t first = 0xE0 | (codepoint >> 12);
+      pending[0] = third;
+      pending[1] = second;
+      npending = 2;
+      return first;
+    } else if (codepoint < 0x110000) {
+      // Four byte
+      // First byte (to return) holds: 11110zzz
+      // Second byte (to push) holds:  10zzyyyy
+      // Third byte (to push) holds:   10yyyyxx
+      // Fourth byte (to push) holds:  10xxxxxx
+      const uint8_t fourth = 0x80 | (codepoint & 0x3F);
+      const uint8_t third = 0x80 | ((codepoint >> 6) & 0x3F);
+      const uint8_t second = 0x80 | ((codepoint >> 12) & 0x3F);
+      const uint8_t first = 0xF0 | (codepoint >> 18);
+      pending[0] = fourth;
+      pending[1] = third;
+      pending[2] = second;
+      npending = 3;
+      return first;
+    } else {
+      // Not a valid unicode codepoint
+      throw error("Code point out of range");
     }
-    // See if we can match a known reference
-    if (ent == "amp")
-      return '&';
-    if (ent == "lt")
-      return '<';
-    if (ent == "gt")
-      return '>';
-    if (ent == "apos")
-      return '\'';
-    if (ent == "quot")
-      return '"';
-    throw error("Unknown character reference (" + ent + ")");
   }
-  // Ok, no escape needed then.
-  return c;
+  // See if we can match a known reference
+  if (ent == "amp")
+    return '&';
+  if (ent == "lt")
+    return '<';
+  if (ent == "gt")
+    return '>';
+  if (ent == "apos")
+    return '\'';
+  if (ent == "quot")
+    return '"';
+  throw error("Unknown character reference (" + ent + ")");
 }
 
 
 bool xml::XMLexer::endOfStream() const
 {
-  return input.eof();
+  return pos == end && !npending;
 }
 
 
 bool xml::XMLexer::matchRaw(const std::string& m) const
 {
+  if (!npending) {
+    // Compare in place
+    if (size_t(end - pos) < m.size()
+        || memcmp(pos, m.data(), m.size()))
+      return false;
+    pos += m.size();
+    return true;
+  }
   Backup myback(*this);
   // Read and compare, terminate on first character mismatch
   for (std::string::const_iterator i = m.begin();
@@ -182,44 +208,52 @@ bool xml::XMLexer::match(const std::string& m) const
 }
 
 
-xml::XMLexer::Backup::Backup(const xml::XMLexer& in)
-  : lexer(in)
+void xml::XMLexer::getCharData(std::string& dest) const
 {
-  // Our backup member must be set to the currently deepest backup
-  // member of the lexer, as that will be our parent
-  prev_backup = in.deepest_backup;
-  // Now set the lexer deepest_backup to point to us, as we are now
-  // the deepest.
-  in.deepest_backup = this;
+  while (npending)
+    dest.push_back(pending[--npending]);
+  while (pos != end) {
+    // Take the run up to the next markup or reference
+    const char *run = pos;
+    while (pos != end && *pos != '<' && *pos != '&')
+      ++pos;
+    dest.append(run, pos);
+    if (pos == end || *pos == '<')
+      return;
+    ++pos;
+    dest.push_back(getReference());
+    while (npending)
+      dest.push_back(pending[--npending]);
+  }
 }
 
-xml::XMLexer::Backup::~Backup()
+
+bool xml::XMLexer::skipSpace() const
 {
-  // Set the deepest backup member on the lexer to our parent, as our
-  // parent will be the deepest when we are gone
-  lexer.deepest_backup = prev_backup;
+  if (npending)
+    return false;
+  const char *start = pos;
+  while (pos != end
+         && (*pos == 0x20 || *pos == 0x09 || *pos == 0x0A || *pos == 0x0D))
+    ++pos;
+  return pos != start;
 }
 
-void xml::XMLexer::Backup::restore()
+
+xml::XMLexer::Backup::Backup(const xml::XMLexer& in)
+  : lexer(in), pos(in.pos), npending(in.npending)
 {
-  // Add all data that was consumed while we existed back into the
-  // lexer
-  while (!data.empty()) {
-    lexer.input.putback(*data.rbegin());
-    dropData();
-  }
+  memcpy(pending, in.pending, sizeof pending);
 }
 
-void xml::XMLexer::Backup::dropData()
+void xml::XMLexer::Backup::restore()
 {
-  data.erase(data.size() - 1);
-  if (prev_backup)
-    prev_backup->dropData();
+  lexer.pos = pos;
+  lexer.npending = npending;
+  memcpy(lexer.pending, pending, sizeof pending);
 }
 
-void xml::XMLexer::Backup::addData(char c)
+std::string xml::XMLexer::Backup::getData() const
 {
-  data.push_back(c);
-  if (prev_backup)
-    prev_backup->addData(c);
+  return std::string(pos, lexer.pos);
 }
@@ -10,33 +10,8 @@
 
 bool xml::SymSpace::process(XMLexer& in) const
 {
-  bool ok = false;
-  while (true) {
-    try {
-      XMLexer::Backup back(in);
-      const uint8_t c = in.getRaw();
-      switch (c) {
-      case 0x09:
-      case 0x0D:
-      case 0x0A:
-      case 0x20:
-        ok = true; // we've matched at least once
-        continue;
-      default:
-        // Ok this didn't match! Restore state and stop reading.
-        back.restore();
-        break;
-      }
-      break;
-    } catch (error&) {
-      // End of stream. Just stop.
-      break;
-    }
-  }
-
-  // If we're here, there's no more spaces to read. Just return
-  // whether or not we matched any
-  return ok;
+  // Return whether or not we matched any spaces
+  return in.skipSpace();
 }
 
 
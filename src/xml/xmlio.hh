@@ -9,13 +9,23 @@
 
 #include <istream>
 #include <list>
+#include <vector>
+#include <stdint.h>
 
 namespace xml {
 
+  //! The lexer reads from a contiguous buffer; either a view of the
+  //! caller's data, or a copy of what an input stream holds. Backing
+  //! up and restoring its state is saving and restoring an offset.
   class XMLexer {
   public:
+    //! Read the rest of the stream into our own buffer
     XMLexer(std::istream&);
 
+    //! Read the given data in place. The data must outlive the lexer.
+    XMLexer(const std::string&);
+    XMLexer(const std::vector<uint8_t>&);
+
     //! Returns the next few handfulls of bytes from the input; meant
     //! to be used when formatting error messages
     std::string getCurrentContext() const;
@@ -44,7 +54,13 @@ namespace xml {
     //! stream; this ensures that state can be properly backed up
     char get() const;
 
+    //! Append formatted data up until the next '<' or the end of
+    //! input to the given string. Runs without references are
+    //! appended in one go.
+    void getCharData(std::string&) const;
 
+    //! Skip white space; returns true if there was any
+    bool skipSpace() const;
 
 
     //! Note; [Sec 2.11] newline handling
@@ -57,42 +73,42 @@ namespace xml {
     public:
       //! Instantiate a backup on a lexer
       Backup(const XMLexer& in);
-      //! Destroy a backup on a lexer
-      ~Backup();
       //! Call this to restore the lexer state to where we were
       //! instantiated
       void restore();
-      //! Called by XMLexer to add data to the backup set
-      void addData(char c);
       //! For diagnostics it is useful to be able to inspect the data
-      //! buffer
-      const std::string& getData() const { return data; }
+      //! consumed since we were instantiated
+      std::string getData() const;
     private:
-      //! If we're not the top-most backup on the backup stack and the
-      //! top-most backup is restoring, we need to drop characters
-      //! from our restore buffer as well.
-      void dropData();
-      //! There can be a stack of backup objects. This pointer points
-      //! to the previous most-recent (deepest stack) backup, or it is
-      //! a null pointer if this is the root backup object.
-      Backup* prev_backup;
       //! A reference to our lexer
       const XMLexer& lexer;
-      //! This is all characters that were consumed from the lexer
-      //! while we existed
-      std::string data;
+      //! The lexer state when we were instantiated
+      const char *pos;
+      unsigned npending;
+      char pending[3];
     };
 
   private:
-
-    //! Our input stream
-    std::istream& input;
-
-    //! Either this is a null pointer or it is a pointer to the
-    //! deepest Backup object we have. We want to append all
-    //! modifications that are made to the deepest backup object at
-    //! any time.
-    mutable Backup* deepest_backup;
+    XMLexer(const XMLexer&);
+    XMLexer &operator=(const XMLexer&);
+
+    //! Our buffer, if we read from a stream
+    std::string own;
+
+    //! The input, and how far we got
+    const char *begin;
+    const char *end;
+    mutable const char *pos;
+
+    //! The remaining bytes of a multi-byte character that get()
+    //! decoded from a character reference, last byte first. They are
+    //! read before the input.
+    mutable unsigned npending;
+    mutable char pending[3];
+
+    //! Decode the character reference at pos, which is just after the
+    //! '&'
+    char getReference() const;
   };
 
   //! This is our XML writer class. It helps with printing of data to
@@ -34,23 +34,29 @@ void xml::XMLWriter::writeCharData(const std::string& chardata)
   // Section 2.4 states that '&' and '<' MUST be escaped. The '>' can
   // be left in its literal form unless it participates in the
   // sequence ']]>' in which case it must be escaped - so we always
-  // just escape it. We further escape ''' and '"'.
-  for (std::string::const_iterator i = chardata.begin();
-       i != chardata.end(); ++i) {
-    switch (*i) {
-    case '<': output << "&lt;";
+  // just escape it. We further escape ''' and '"'. Everything else
+  // is written in runs.
+  std::string::size_type run = 0;
+  for (std::string::size_type i = 0; i != chardata.size(); ++i) {
+    const char *esc;
+    switch (chardata[i]) {
+    case '<': esc = "&lt;";
       break;
-    case '&': output << "&amp;";
+    case '&': esc = "&amp;";
       break;
-    case '>': output << "&gt;";
+    case '>': esc = "&gt;";
       break;
-    case '\'': output << "&apos;";
+    case '\'': esc = "&apos;";
       break;
-    case '"': output << "&quot;";
+    case '"': esc = "&quot;";
       break;
-    default: output << *i;
-  }
+    default: continue;
+    }
+    output.write(chardata.data() + run, i - run);
+    output << esc;
+    run = i + 1;
   }
+  output.write(chardata.data() + run, chardata.size() - run);
 }
 
 